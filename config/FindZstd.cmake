@@ -0,0 +1,32 @@
+# - Find Zstd
+# Find the native zstd includes and library.
+#
+#  HINT: ZSTD_ROOT_DIR
+#
+# Once done this will define
+#
+#  ZSTD_INCLUDE_DIR    - where to find zstd.h
+#  ZSTD_LIBRARY        - the zstd library
+#  ZSTD_FOUND          - True if zstd was found.
+#
+
+find_library(ZSTD_LIBRARY NAMES zstd libzstd zstd_static
+	HINTS
+	${ZSTD_ROOT_DIR}/lib
+	$ENV{ZSTD_ROOT_DIR}/lib
+	${CMAKE_FIND_ROOT_PATH}/sys-root/mingw/lib
+)
+
+find_path(ZSTD_INCLUDE_DIR NAMES zstd.h
+	HINTS
+	${ZSTD_ROOT_DIR}/include
+	$ENV{ZSTD_ROOT_DIR}/include
+	${CMAKE_FIND_ROOT_PATH}/sys-root/mingw/include
+)
+
+# handle the QUIETLY and REQUIRED arguments and set ZSTD_FOUND to TRUE if
+# all listed variables are TRUE
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(Zstd REQUIRED_VARS ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+MARK_AS_ADVANCED(ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
@@ -10,6 +10,7 @@ ECM_URL=https://download.kde.org/stable/frameworks/5.64/extra-cmake-modules-5.64
 KARCHIVE_URL=https://download.kde.org/stable/frameworks/5.64/karchive-5.64.0.tar.xz
 KDNSSD_URL=https://download.kde.org/stable/frameworks/5.64/kdnssd-5.64.0.tar.xz
 KEYCHAIN_URL=https://github.com/frankosterfeld/qtkeychain/archive/v0.10.0.zip
+ZSTD_URL=https://github.com/facebook/zstd/releases/download/v1.4.5/zstd-1.4.5.tar.gz
 
 ### Build flags
 export CFLAGS=-mmacosx-version-min=10.10
@@ -65,6 +66,11 @@ function build_justmakeinstall() {
 	INSTALLPREFIX="$QTPATH" make install
 }
 
+function build_zstd() {
+	make
+	make "PREFIX=$QTPATH" install
+}
+
 function build_cmake() {
 	mkdir build
 	cd build
@@ -108,6 +114,7 @@ download_package "$ECM_URL" extra-cmake-modules.tar.xz
 download_package "$KARCHIVE_URL" karchive.tar.xz
 download_package "$KDNSSD_URL" kdnssd.tar.xz
 download_package "$KEYCHAIN_URL" qtkeychain.zip
+download_package "$ZSTD_URL" zstd.tar.gz
 
 # Make sure we have the right versions (and they haven't been tampered with)
 shasum -a 256 -c ../deps.sha256
@@ -120,4 +127,5 @@ install_package extra-cmake-modules cmake
 install_package karchive cmake
 install_package kdnssd cmake
 install_package qtkeychain cmake
+install_package zstd zstd
 
@@ -230,12 +230,15 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	m_viewStatusBar->addWidget(sessionHistorySize);
 
 #ifndef NDEBUG
-	// Debugging tool: show amount of memory consumed by tiles
+	// Debugging tool: show amount of memory consumed by tiles and how long the last undo took
 	{
 		QLabel *tilemem = new QLabel(this);
 		QTimer *tilememtimer = new QTimer(this);
-		connect(tilememtimer, &QTimer::timeout, [tilemem]() {
-			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+		connect(tilememtimer, &QTimer::timeout, [this, tilemem]() {
+			QString text = QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2);
+			if(m_doc->canvas())
+				text += QStringLiteral(" Replay: %1 ms").arg(m_doc->canvas()->stateTracker()->lastReplayDuration());
+			tilemem->setText(text);
 		});
 		tilememtimer->setInterval(1000);
 		tilememtimer->start(1000);
@@ -22,6 +22,7 @@
 #include "core/layer.h"
 
 #include <QCache>
+#include <QMutex>
 #include <QtMath>
 
 namespace brushes {
@@ -33,6 +34,7 @@ template<typename T> T square(T x) { return x*x; }
 typedef QVector<float> LUT;
 static const int LUT_RADIUS = 128;
 static QCache<int, LUT> LUT_CACHE;
+static QMutex LUT_CACHE_MUTEX; // dabs may be drawn in the paint thread and the GUI thread at the same time
 
 // Generate a lookup table for Gimp style exponential brush shape
 // The value at r² (where r is distance from brush center, scaled to LUT_RADIUS) is
@@ -56,6 +58,7 @@ static LUT cachedGimpStyleBrushLUT(float hardness)
 {
 	const int h = hardness * 100;
 	Q_ASSERT(h>=0 && h<=100);
+	QMutexLocker lock(&LUT_CACHE_MUTEX);
 	if(!LUT_CACHE.contains(h))
 		LUT_CACHE.insert(h, new LUT(makeGimpStyleBrushLUT(h / 100.0)));
 
@@ -257,6 +260,68 @@ paintcore::BrushStamp makeGimpStyleBrushStamp(const QPointF &point, qreal radius
 	return s;
 }
 
+namespace {
+
+// Cache of finished dab masks. Dab positions are in quarter pixels, so the mask
+// is fully determined by the dab parameters and the subpixel offset.
+// Consecutive dabs in a stroke very often share the same parameters.
+static const int MASK_CACHE_SIZE = 8 * 1024 * 1024; // max total size of cached masks in bytes
+static QCache<quint64, paintcore::BrushStamp> MASK_CACHE(MASK_CACHE_SIZE);
+static QMutex MASK_CACHE_MUTEX;
+static MaskCacheStats MASK_CACHE_STATS;
+
+paintcore::BrushStamp cachedGimpStyleBrushStamp(int x, int y, const protocol::ClassicBrushDab &d)
+{
+	const int xfrac = x & 3;
+	const int yfrac = y & 3;
+	const int xpos = (x - xfrac) / 4;
+	const int ypos = (y - yfrac) / 4;
+
+	const quint64 key =
+		quint64(d.size) << 20 |
+		quint64(d.hardness) << 12 |
+		quint64(d.opacity) << 4 |
+		xfrac << 2 |
+		yfrac;
+
+	paintcore::BrushStamp bs;
+	bool found = false;
+	{
+		QMutexLocker lock(&MASK_CACHE_MUTEX);
+		const paintcore::BrushStamp *cached = MASK_CACHE.object(key);
+		if(cached) {
+			++MASK_CACHE_STATS.hits;
+			bs = *cached;
+			found = true;
+		}
+	}
+
+	if(!found) {
+		bs = makeGimpStyleBrushStamp(
+			QPointF(xfrac/4.0, yfrac/4.0),
+			d.size/256.0,
+			d.hardness/255.0,
+			d.opacity/255.0
+		);
+
+		QMutexLocker lock(&MASK_CACHE_MUTEX);
+		++MASK_CACHE_STATS.misses;
+		MASK_CACHE.insert(key, new paintcore::BrushStamp(bs), square(bs.mask.diameter()));
+	}
+
+	bs.left += xpos;
+	bs.top += ypos;
+	return bs;
+}
+
+}
+
+MaskCacheStats classicBrushMaskCacheStats()
+{
+	QMutexLocker lock(&MASK_CACHE_MUTEX);
+	return MASK_CACHE_STATS;
+}
+
 void drawClassicBrushDabs(const protocol::DrawDabsClassic &dabs, paintcore::EditableLayer layer, int sublayer)
 {
 	if(dabs.dabs().isEmpty()) {
@@ -276,21 +341,20 @@ void drawClassicBrushDabs(const protocol::DrawDabsClassic &dabs, paintcore::Edit
 		blendmode = paintcore::BlendMode::MODE_NORMAL;
 	}
 
+	QVector<paintcore::BrushStamp> stamps;
+	stamps.reserve(dabs.dabs().size());
+
 	int lastX = dabs.originX();
 	int lastY = dabs.originY();
 	for(const protocol::ClassicBrushDab &d : dabs.dabs()) {
 		const int nextX = lastX + d.x;
 		const int nextY = lastY + d.y;
-		const paintcore::BrushStamp bs = makeGimpStyleBrushStamp(
-			QPointF(nextX/4.0, nextY/4.0),
-			d.size/256.0,
-			d.hardness/255.0,
-			d.opacity/255.0
-		);
-		layer.putBrushStamp(bs, color, blendmode);
+		stamps << cachedGimpStyleBrushStamp(nextX, nextY, d);
 		lastX = nextX;
 		lastY = nextY;
 	}
+
+	layer.putBrushStamps(stamps, color, blendmode);
 }
 
 }
@@ -41,6 +41,14 @@ void drawClassicBrushDabs(const protocol::DrawDabsClassic &dabs, paintcore::Edit
 
 paintcore::BrushStamp makeGimpStyleBrushStamp(const QPointF &point, qreal radius, qreal hardness, qreal opacity);
 
+struct MaskCacheStats {
+	qint64 hits = 0;
+	qint64 misses = 0;
+};
+
+//! Get the hit/miss counters of the brush mask cache used by drawClassicBrushDabs
+MaskCacheStats classicBrushMaskCacheStats();
+
 }
 
 #endif
@@ -162,13 +162,13 @@ void ClassicBrushState::addDab(const paintcore::Point &point, quint32 color)
 		m_lastDabY = y;
 	}
 
-	m_lastDab->dabs() << protocol::ClassicBrushDab {
+	m_lastDab->appendDab(protocol::ClassicBrushDab {
 		static_cast<decltype(protocol::ClassicBrushDab::x)>(x - m_lastDabX),
 		static_cast<decltype(protocol::ClassicBrushDab::y)>(y - m_lastDabY),
 		static_cast<decltype(protocol::ClassicBrushDab::size)>(m_brush.size(point.pressure()) * 256),
 		static_cast<decltype(protocol::ClassicBrushDab::hardness)>(m_brush.hardness(point.pressure()) * 255),
 		static_cast<decltype(protocol::ClassicBrushDab::opacity)>(opacity)
-	};
+	});
 
 	m_lastDabX = x;
 	m_lastDabY = y;
@@ -73,6 +73,9 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 	paintcore::BrushMask mask;
 	int lastSize = -1, lastOpacity = 0;
 
+	QVector<paintcore::BrushStamp> stamps;
+	stamps.reserve(dabs.dabs().size());
+
 	int lastX = dabs.originX();
 	int lastY = dabs.originY();
 	for(const protocol::PixelBrushDab &d : dabs.dabs()) {
@@ -87,15 +90,13 @@ void drawPixelBrushDabs(const protocol::DrawDabsPixel &dabs, paintcore::Editable
 		}
 
 		const int offset = d.size/2;
-		layer.putBrushStamp(
-			paintcore::BrushStamp { nextX-offset, nextY-offset, mask },
-			color,
-			blendmode
-		);
+		stamps << paintcore::BrushStamp { nextX-offset, nextY-offset, mask };
 
 		lastX = nextX;
 		lastY = nextY;
 	}
+
+	layer.putBrushStamps(stamps, color, blendmode);
 }
 
 }
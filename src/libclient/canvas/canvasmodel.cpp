@@ -40,11 +40,12 @@
 #include <QSettings>
 #include <QDebug>
 #include <QPainter>
+#include <QThread>
 
 namespace canvas {
 
-CanvasModel::CanvasModel(uint8_t localUserId, QObject *parent)
-	: QObject(parent), m_selection(nullptr), m_mode(Mode::Offline)
+CanvasModel::CanvasModel(uint8_t localUserId, QObject *parent, bool paintThread)
+	: QObject(parent), m_paintThread(nullptr), m_selection(nullptr), m_mode(Mode::Offline)
 {
 	m_layerlist = new LayerListModel(this);
 	m_userlist = new UserListModel(this);
@@ -56,7 +57,20 @@ CanvasModel::CanvasModel(uint8_t localUserId, QObject *parent)
 	connect(m_aclfilter, &AclFilter::userLocksChanged, m_userlist, &UserListModel::updateLocks);
 
 	m_layerstack = new paintcore::LayerStack(this);
-	m_statetracker = new StateTracker(m_layerstack, m_layerlist, localUserId, this);
+
+	if(paintThread) {
+		// The state tracker does all the drawing in the paint thread.
+		// Changes to the layer list and annotations are relayed back to this thread.
+		m_statetracker = new StateTracker(m_layerstack, m_layerlist, localUserId);
+		m_statetracker->setFastCatchupEnabled(true);
+		m_paintThread = new QThread(this);
+		m_paintThread->setObjectName("paint thread");
+		m_statetracker->moveToThread(m_paintThread);
+		m_paintThread->start();
+
+	} else {
+		m_statetracker = new StateTracker(m_layerstack, m_layerlist, localUserId, this);
+	}
 	m_usercursors = new UserCursorModel(this);
 	m_lasers = new LaserTrailModel(this);
 
@@ -80,6 +94,19 @@ CanvasModel::CanvasModel(uint8_t localUserId, QObject *parent)
 	updateLayerViewOptions();
 }
 
+CanvasModel::~CanvasModel()
+{
+	if(m_paintThread) {
+		// Skip whatever is left in the queue. The paint thread never
+		// waits for this thread, so this can't deadlock.
+		m_paintThread->requestInterruption();
+		m_paintThread->quit();
+		m_paintThread->wait();
+
+		delete m_statetracker;
+	}
+}
+
 uint8_t CanvasModel::localUserId() const
 {
 	return m_statetracker->localId();
@@ -237,6 +264,7 @@ void CanvasModel::pickColor(int x, int y, int layer, int diameter)
 {
 	QColor color;
 	if(layer>0) {
+		QMutexLocker lock(m_layerstack->mutex());
 		const paintcore::Layer *l = m_layerstack->getLayer(layer);
 		if(layer)
 			color = l->colorAt(x, y, diameter);
@@ -342,11 +370,14 @@ QImage CanvasModel::selectionToImage(int layerId) const
 		return m_selection->transformedPasteImage();
 	}
 
-	const paintcore::Layer *layer = m_layerstack->getLayer(layerId);
-	if(layer)
-		img = layer->toImage();
-	else
-		img = toImage(layerId==0);
+	{
+		QMutexLocker lock(m_layerstack->mutex());
+		const paintcore::Layer *layer = m_layerstack->getLayer(layerId);
+		if(layer)
+			img = layer->toImage();
+		else
+			img = toImage(layerId==0);
+	}
 
 
 	if(m_selection) {
@@ -399,7 +430,6 @@ void CanvasModel::onCanvasResize(int xoffset, int yoffset, const QSize &oldsize)
 void CanvasModel::resetCanvas()
 {
 	setTitle(QString());
-	m_layerstack->editor(0).reset();
 	m_statetracker->reset();
 	m_aclfilter->reset(m_statetracker->localId(), false);
 }
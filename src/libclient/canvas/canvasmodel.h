@@ -32,6 +32,8 @@
 #include <QObject>
 #include <QPointer>
 
+class QThread;
+
 namespace protocol {
 	class UserJoin;
 	class UserLeave;
@@ -63,7 +65,15 @@ class CanvasModel : public QObject
 	Q_OBJECT
 
 public:
-	explicit CanvasModel(uint8_t localUserId, QObject *parent=nullptr);
+	/**
+	 * @brief Construct a canvas model
+	 *
+	 * @param localUserId ID of the local user
+	 * @param parent
+	 * @param paintThread run the paint engine in a thread of its own
+	 */
+	explicit CanvasModel(uint8_t localUserId, QObject *parent=nullptr, bool paintThread=false);
+	~CanvasModel();
 
 	paintcore::LayerStack *layerStack() const { return m_layerstack; }
 	StateTracker *stateTracker() const { return m_statetracker; }
@@ -170,6 +180,7 @@ private:
 
 	paintcore::LayerStack *m_layerstack;
 	StateTracker *m_statetracker;
+	QThread *m_paintThread;
 	UserCursorModel *m_usercursors;
 	LaserTrailModel *m_lasers;
 	Selection *m_selection;
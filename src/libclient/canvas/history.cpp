@@ -20,29 +20,55 @@
 #include "history.h"
 #include "../libshared/net/undo.h"
 
+#include <algorithm>
+
 namespace canvas {
 
 using namespace protocol;
 
 History::History()
-	: m_offset(0), m_bytes(0)
+	: m_offset(0), m_bytes(0), m_contexts(256)
 {
 }
 
 void History::append(MessagePtr msg)
 {
+	const int pos = end();
+	ContextIndex &ctx = m_contexts[msg->contextId()];
+	ctx.messages.append(pos);
+	if(msg->type() == MSG_UNDOPOINT) {
+		ctx.undoPoints.append(pos);
+		m_undoPoints.append(pos);
+	}
+
 	m_messages.append(msg);
 	m_bytes += msg->length();
 }
 
+//! Remove indexes smaller than the limit from the beginning of a sorted vector
+static void trimIndexes(QVector<int> &indexes, int limit)
+{
+	if(!indexes.isEmpty() && indexes.first() < limit)
+		indexes.erase(indexes.begin(), std::lower_bound(indexes.begin(), indexes.end(), limit));
+}
+
 void History::cleanup(int indexlimit)
 {
 	Q_ASSERT(indexlimit <= end());
 
+	if(m_offset >= indexlimit)
+		return;
+
 	while(m_offset < indexlimit) {
 		m_bytes -= m_messages.takeFirst()->length();
 		++m_offset;
 	}
+
+	trimIndexes(m_undoPoints, m_offset);
+	for(ContextIndex &ctx : m_contexts) {
+		trimIndexes(ctx.messages, m_offset);
+		trimIndexes(ctx.undoPoints, m_offset);
+	}
 }
 
 void History::resetTo(int newoffset)
@@ -51,6 +77,17 @@ void History::resetTo(int newoffset)
 	m_offset = newoffset;
 	m_messages.clear();
 	m_bytes = 0;
+
+	m_undoPoints.clear();
+	for(ContextIndex &ctx : m_contexts) {
+		ctx.messages.clear();
+		ctx.undoPoints.clear();
+	}
+}
+
+int History::undoPointsSince(int pos) const
+{
+	return int(m_undoPoints.constEnd() - std::lower_bound(m_undoPoints.constBegin(), m_undoPoints.constEnd(), pos));
 }
 
 }
@@ -21,6 +21,7 @@
 #define CANVAS_HISTORY_H
 
 #include <QList>
+#include <QVector>
 
 #include "../libshared/net/message.h"
 
@@ -98,10 +99,45 @@ public:
 	 */
 	protocol::MessageList toList() const { return m_messages; }
 
+	/**
+	 * @brief Get the indexes of all the undo points in memory
+	 *
+	 * The indexes are in ascending order.
+	 */
+	const QVector<int> &undoPoints() const { return m_undoPoints; }
+
+	/**
+	 * @brief Get the indexes of the undo points made by the given user
+	 *
+	 * The indexes are in ascending order.
+	 */
+	const QVector<int> &undoPoints(uint8_t contextId) const { return m_contexts.at(contextId).undoPoints; }
+
+	/**
+	 * @brief Get the indexes of all messages by the given user
+	 *
+	 * The indexes are in ascending order. With these, a user's own history
+	 * can be inspected without going through everyone else's messages.
+	 */
+	const QVector<int> &messages(uint8_t contextId) const { return m_contexts.at(contextId).messages; }
+
+	/**
+	 * @brief Get the number of undo points at or after the given index
+	 */
+	int undoPointsSince(int pos) const;
+
 private:
+	struct ContextIndex {
+		QVector<int> messages;
+		QVector<int> undoPoints;
+	};
+
 	protocol::MessageList m_messages;
 	int m_offset;
 	uint m_bytes;
+
+	QVector<int> m_undoPoints;
+	QVector<ContextIndex> m_contexts;
 };
 
 }
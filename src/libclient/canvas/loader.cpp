@@ -19,6 +19,7 @@
 
 #include "loader.h"
 #include "net/client.h"
+#include "net/compression.h"
 #include "ora/orareader.h"
 #include "canvas/aclfilter.h"
 
@@ -145,7 +146,7 @@ MessageList ImageCanvasLoader::loadInitCommands()
 				paintcore::BlendMode::MODE_NORMAL
 			));
 
-			tileset.toPutTiles(1, layerId, 0, msgs);
+			tileset.toPutTiles(1, layerId, 0, msgs, -1, net::compression::defaultCodec());
 
 			++layerId;
 
@@ -188,26 +189,36 @@ MessageList QImageCanvasLoader::loadInitCommands()
 		paintcore::BlendMode::MODE_NORMAL
 	));
 
-	tileset.toPutTiles(1, 1, 0, msgs);
+	tileset.toPutTiles(1, 1, 0, msgs, -1, net::compression::defaultCodec());
 
 	return msgs;
 }
 
+static bool isSentSublayer(const paintcore::Layer *sublayer)
+{
+	return sublayer->id() > 0 && sublayer->id() < 256 && !sublayer->isHidden();
+}
+
 MessageList SnapshotLoader::loadInitCommands()
 {
+	// The paint engine may be running in another thread
+	QMutexLocker lock(m_layers->mutex());
+
 	MessageList msgs;
 
 	// Most important bit first: canvas initialization
 	const QSize imgsize = m_layers->size();
 	msgs.append(MessagePtr(new protocol::CanvasResize(m_contextId, 0, imgsize.width(), imgsize.height(), 0)));
 
+	const net::compression::Codec codec = net::compression::codecFor(m_protocolVersion);
+
 	const QColor solidBgColor = m_layers->background().solidColor();
 	if(solidBgColor.isValid())
 		msgs.append(MessagePtr(new protocol::CanvasBackground(m_contextId, solidBgColor.rgba())));
 	else
 		msgs.append(MessagePtr(new protocol::CanvasBackground(
 			m_contextId,
-			qCompress(reinterpret_cast<const uchar*>(m_layers->background().constData()), paintcore::Tile::BYTES)
+			net::compression::compress(reinterpret_cast<const uchar*>(m_layers->background().constData()), paintcore::Tile::BYTES, codec, m_compressionLevel)
 			)));
 
 	// Preset default layer
@@ -219,11 +230,50 @@ MessageList SnapshotLoader::loadInitCommands()
 		msgs.append(protocol::Chat::pin(m_contextId, m_pinnedMessage));
 	}
 
+	// Gather the tiles of all layers and compress them in one go.
+	// Sublayers are only included if they will be sent.
+	// If the protocol version allows it, tiles repeated anywhere in the snapshot
+	// are replaced with references to their first occurrence.
+	QVector<paintcore::LayerTileSet> tilesets;
+	QVector<QVector<paintcore::LayerTileSet>> subtilesets;
+	tilesets.reserve(m_layers->layerCount());
+	subtilesets.reserve(m_layers->layerCount());
+
+	const bool dedup = m_protocolVersion.supportsTileReferences();
+	paintcore::TileDictionary dictionary;
+
+	for(int i=0;i<m_layers->layerCount();++i) {
+		const paintcore::Layer *layer = m_layers->getLayerByIndex(i);
+		tilesets << paintcore::LayerTileSet::fromLayer(*layer);
+		if(dedup)
+			dictionary.deduplicate(tilesets.last(), layer->id(), 0);
+
+		QVector<paintcore::LayerTileSet> subs;
+		for(const paintcore::Layer *sublayer : layer->sublayers()) {
+			if(isSentSublayer(sublayer)) {
+				subs << paintcore::LayerTileSet::fromLayer(*sublayer);
+				if(dedup)
+					dictionary.deduplicate(subs.last(), layer->id(), sublayer->id());
+			}
+		}
+		subtilesets << subs;
+	}
+
+	{
+		QVector<paintcore::LayerTileSet*> all;
+		for(int i=0;i<tilesets.size();++i) {
+			all << &tilesets[i];
+			for(int j=0;j<subtilesets[i].size();++j)
+				all << &subtilesets[i][j];
+		}
+		paintcore::LayerTileSet::compressAll(all, m_compressionLevel, codec);
+	}
+
 	// Create layers
 	for(int i=0;i<m_layers->layerCount();++i) {
 		const paintcore::Layer *layer = m_layers->getLayerByIndex(i);
 
-		const auto tileset = paintcore::LayerTileSet::fromLayer(*layer);
+		const auto &tileset = tilesets.at(i);
 
 		msgs << protocol::MessagePtr(new protocol::LayerCreate(
 			m_contextId,
@@ -244,12 +294,13 @@ MessageList SnapshotLoader::loadInitCommands()
 			layer->blendmode()
 		));
 
-		tileset.toPutTiles(m_contextId, layer->id(), 0, msgs);
+		tileset.toPutTiles(m_contextId, layer->id(), 0, msgs, m_compressionLevel, codec);
 
 		// Put active sublayers (if any)
+		int sub = 0;
 		for(const paintcore::Layer *sublayer : layer->sublayers()) {
-			if(sublayer->id() > 0 && sublayer->id() < 256 && !sublayer->isHidden()) {
-				const auto subtileset = paintcore::LayerTileSet::fromLayer(*sublayer);
+			if(isSentSublayer(sublayer)) {
+				const auto &subtileset = subtilesets.at(i).at(sub++);
 				msgs << protocol::MessagePtr(new protocol::LayerAttributes(
 					m_contextId,
 					layer->id(),
@@ -259,7 +310,7 @@ MessageList SnapshotLoader::loadInitCommands()
 					sublayer->blendmode()
 					));
 
-				subtileset.toPutTiles(m_contextId, layer->id(), sublayer->id(), msgs);
+				subtileset.toPutTiles(m_contextId, layer->id(), sublayer->id(), msgs, m_compressionLevel, codec);
 			}
 		}
 
@@ -25,6 +25,7 @@
 #include <QImage>
 
 #include "../libshared/net/message.h"
+#include "../libshared/net/protover.h"
 
 namespace paintcore {
 	class LayerStack;
@@ -163,7 +164,8 @@ public:
 	 * @param aclfilter Access controls (optional)
 	 */
 	SnapshotLoader(uint8_t contextId, const paintcore::LayerStack *layers, const AclFilter *aclfilter)
-		: m_layers(layers), m_aclfilter(aclfilter), m_defaultLayer(0), m_contextId(contextId) {}
+		: m_layers(layers), m_aclfilter(aclfilter), m_protocolVersion(protocol::ProtocolVersion::current()),
+		  m_defaultLayer(0), m_compressionLevel(-1), m_contextId(contextId) {}
 
 	//! Include a default layer message
 	void setDefaultLayer(int defaultLayer) { m_defaultLayer = defaultLayer; }
@@ -171,6 +173,24 @@ public:
 	//! Include a pinned chat message
 	void setPinnedMessage(const QString &message) { m_pinnedMessage = message; }
 
+	/**
+	 * @brief Set the compression level used for tiles
+	 *
+	 * Lower levels make the snapshot faster to generate but larger
+	 * to send. The default (-1) is the codec's default level.
+	 * The codec is chosen based on the protocol version.
+	 */
+	void setCompressionLevel(int level) { m_compressionLevel = level; }
+
+	/**
+	 * @brief Set the protocol version of the session the snapshot is for
+	 *
+	 * This determines which encoding features (tile references and
+	 * compression codec) can be used.
+	 * The default is the current version.
+	 */
+	void setProtocolVersion(const protocol::ProtocolVersion &version) { m_protocolVersion = version; }
+
 	protocol::MessageList loadInitCommands() override;
 	QString filename() const override { return QString(); }
 	QString errorMessage() const override { return QString(); }
@@ -179,9 +199,11 @@ public:
 private:
 	const paintcore::LayerStack *m_layers;
 	const AclFilter *m_aclfilter;
+	protocol::ProtocolVersion m_protocolVersion;
 
 	QString m_pinnedMessage;
 	int m_defaultLayer;
+	int m_compressionLevel;
 
 	uint8_t m_contextId;
 
@@ -26,6 +26,7 @@
 #include "core/layer.h"
 #include "brushes/brushpainter.h"
 #include "net/commands.h"
+#include "net/compression.h"
 #include "net/internalmsg.h"
 #include "tools/selection.h" // for selection transform utils
 
@@ -41,14 +42,43 @@
 #include <QElapsedTimer>
 #include <QSettings>
 #include <QPainter>
+#include <QThread>
+#include <QPointer>
+#include <QSet>
+
+#include <algorithm>
+#include <limits>
 
 namespace canvas {
 
+static qint64 nextSavepointSerial()
+{
+	static QAtomicInteger<qint64> serial;
+	return serial.fetchAndAddRelaxed(1) + 1;
+}
+
 struct StateSavepoint::Data : public QSharedData {
+	Data() = default;
+
+	// A copy is a different savepoint, so it gets a serial number of its own
+	Data(const Data &other)
+		: QSharedData(),
+		  streampointer(other.streampointer), timestamp(other.timestamp), replayCost(other.replayCost),
+		  canvas(other.canvas), layermodel(other.layermodel)
+	{ }
+
+	const qint64 serial = nextSavepointSerial(); // unique, never reused
 	int streampointer = 0;
 	qint64 timestamp = 0;
+	qint64 replayCost = 0; // the tracker's replay cost counter when this savepoint was made
 	paintcore::Savepoint canvas;
 	QVector<LayerListItem> layermodel;
+
+	// Number of tiles shared with neither neighbour (see exclusiveTileCount)
+	// and the serial numbers of the neighbours it was counted for.
+	mutable int exclusiveTiles = -1;
+	mutable qint64 exclusivePrev = 0;
+	mutable qint64 exclusiveNext = 0;
 };
 
 StateSavepoint::StateSavepoint()
@@ -80,6 +110,11 @@ qint64 StateSavepoint::timestamp() const
 	return d ? d->timestamp : 0;
 }
 
+int StateSavepoint::streamPointer() const
+{
+	return d ? d->streampointer : 0;
+}
+
 paintcore::Savepoint StateSavepoint::canvas() const
 {
 	Q_ASSERT(d);
@@ -113,15 +148,15 @@ protocol::MessageList StateSavepoint::initCommands(uint8_t contextId, const Canv
 	return loader.loadInitCommands();
 }
 
-StateSavepoint StateSavepoint::fromCanvasSavepoint(const paintcore::Savepoint &savepoint)
+// Make the layer list model content matching the savepoint's layers.
+// The layer stack is ordered bottom-first, but the list is topmost-first.
+static QVector<LayerListItem> layerListItems(const paintcore::Savepoint &savepoint)
 {
-	auto *d = new StateSavepoint::Data;
-
-	d->timestamp = QDateTime::currentMSecsSinceEpoch();
-	d->canvas = savepoint;
-
-	for(const paintcore::Layer *l : savepoint.layers) {
-		d->layermodel << LayerListItem {
+	QVector<LayerListItem> items;
+	items.reserve(savepoint.layers.size());
+	for(int i=savepoint.layers.size()-1;i>=0;--i) {
+		const paintcore::Layer *l = savepoint.layers.at(i);
+		items << LayerListItem {
 			uint16_t(l->id()),
 			l->title(),
 			l->opacity() / 255.0f,
@@ -131,6 +166,16 @@ StateSavepoint StateSavepoint::fromCanvasSavepoint(const paintcore::Savepoint &s
 			l->isFixed()
 		};
 	}
+	return items;
+}
+
+StateSavepoint StateSavepoint::fromCanvasSavepoint(const paintcore::Savepoint &savepoint)
+{
+	auto *d = new StateSavepoint::Data;
+
+	d->timestamp = QDateTime::currentMSecsSinceEpoch();
+	d->canvas = savepoint;
+	d->layermodel = layerListItems(savepoint);
 	return StateSavepoint(d);
 }
 
@@ -151,10 +196,25 @@ StateTracker::StateTracker(paintcore::LayerStack *image, LayerListModel *layerli
 		_showallmarkers(false),
 		m_hasParticipated(false),
 		m_localPenDown(false),
-		m_isQueued(false)
+		m_isQueued(false),
+		m_scopedReplay(true),
+		m_fastCatchup(false),
+		m_catchingUp(false),
+		m_replayCost(0),
+		m_savepointMemoryBudget(512 * 1024 * 1024)
 {
+	qRegisterMetaType<StateSavepoint>();
+
 	connect(m_layerlist, &LayerListModel::layerOpacityPreview, this, &StateTracker::previewLayerOpacity);
 
+	// When running in the paint thread, these are used to update
+	// the models that live in the GUI thread
+	QPointer<StateTracker> self(this);
+	connect(this, &StateTracker::guiCallsQueued, m_layerlist, [self]() {
+		if(self)
+			self->runGuiCalls();
+	}, Qt::QueuedConnection);
+
 	// Reset local fork if it falls behind too much
 	m_localfork.setFallbehind(10000);
 
@@ -174,13 +234,23 @@ StateTracker::~StateTracker()
 
 void StateTracker::reset()
 {
+	if(callInOwnThread([this]() { reset(); }))
+		return;
+
+	// The canvas is reset here rather than by the caller, so that it
+	// happens in order with the commands already queued for the paint thread.
+	m_layerstack->editor(0).reset();
+
 	m_savepoints.clear();
 	m_history.resetTo(m_history.end());
-	m_hasParticipated = false;
-	m_localPenDown = false;
+	m_hasParticipated.storeRelease(false);
+	m_localPenDown.storeRelease(false);
 	m_msgqueue.clear();
 	m_localfork.clear();
-	m_layerlist->clear();
+	m_catchingUp = false;
+	m_catchupBuffer.clear();
+	m_replayCost = 0;
+	callInGuiThread([this]() { m_layerlist->clear(); });
 
 	// Make sure there is always a savepoint in the history
 	makeSavepoint(m_history.end()-1);
@@ -188,6 +258,11 @@ void StateTracker::reset()
 
 void StateTracker::localCommand(protocol::MessagePtr msg)
 {
+	if(callInOwnThread([this, msg]() { localCommand(msg); }))
+		return;
+
+	finishCatchup();
+
 	// A fork is created at the end of the mainline history
 	if(m_localfork.isEmpty()) {
 		m_localfork.setOffset(m_history.end()-1);
@@ -224,13 +299,16 @@ void StateTracker::localCommand(protocol::MessagePtr msg)
 
 void StateTracker::receiveQueuedCommand(protocol::MessagePtr msg)
 {
+	// In the paint thread, the whole queue is processed without breaks
+	if(callInOwnThread([this, msg]() { receiveCommand(msg); }))
+		return;
+
 	m_msgqueue.append(msg);
 
 	if(!m_isQueued) {
 		// This introduces a tiny bit of lag, but allows sequential
 		// messages to queue up even when the system is not under very heavy
-		// load. Won't be needed anymore when the paint engine runs in its own
-		// thread.
+		// load. Not used when the paint engine runs in its own thread.
 		m_isQueued = true;
 		m_queuetimer->start(1);
 	}
@@ -254,13 +332,125 @@ void StateTracker::processQueuedCommands()
 	}
 }
 
+/**
+ * @brief Queue a function call to be made in the paint thread
+ *
+ * If the state tracker is in the calling thread, nothing is done.
+ *
+ * @return true if the call was queued
+ */
+bool StateTracker::callInOwnThread(std::function<void()> fn)
+{
+	if(thread() == QThread::currentThread())
+		return false;
+
+	// The paint thread is shutting down: nothing will run anymore
+	if(thread()->isInterruptionRequested())
+		return true;
+
+	QMutexLocker lock(&m_paintQueueLock);
+	m_paintqueue << fn;
+	if(m_paintqueue.size() == 1)
+		QMetaObject::invokeMethod(this, "processPaintThreadQueue", Qt::QueuedConnection);
+
+	return true;
+}
+
+void StateTracker::processPaintThreadQueue()
+{
+	// Canvas change notifications are coalesced over short time slices,
+	// so the GUI receives fewer and larger updates during catchup.
+	QElapsedTimer elapsed;
+	elapsed.start();
+
+	m_layerstack->beginBatch();
+
+	for(;;) {
+		std::function<void()> fn;
+		{
+			QMutexLocker lock(&m_paintQueueLock);
+			if(QThread::currentThread()->isInterruptionRequested()) {
+				// Shutting down: skip whatever is left in the queue
+				m_paintqueue.clear();
+				break;
+			}
+			if(m_paintqueue.isEmpty())
+				break;
+			fn = m_paintqueue.takeFirst();
+		}
+
+		fn();
+
+		if(elapsed.elapsed() > 20) {
+			m_layerstack->endBatch();
+			m_layerstack->beginBatch();
+			elapsed.restart();
+		}
+	}
+
+	m_layerstack->endBatch();
+}
+
+/**
+ * @brief Call a function in the thread of the GUI models
+ *
+ * When not called from the GUI thread, the function is queued. Queued
+ * functions are called in the order they were queued.
+ *
+ * The paint thread never waits for the GUI thread, since the GUI
+ * thread may be waiting for the paint thread.
+ *
+ * @param fn the function to call
+ */
+void StateTracker::callInGuiThread(std::function<void()> fn)
+{
+	if(m_layerlist->thread() == QThread::currentThread()) {
+		fn();
+		return;
+	}
+
+	bool first;
+	{
+		QMutexLocker lock(&m_guiCallLock);
+		m_guicalls << fn;
+		first = m_guicalls.size() == 1;
+	}
+
+	if(first)
+		emit guiCallsQueued(QPrivateSignal());
+}
+
+void StateTracker::runGuiCalls()
+{
+	QList<std::function<void()>> calls;
+	{
+		QMutexLocker lock(&m_guiCallLock);
+		calls.swap(m_guicalls);
+	}
+
+	for(const auto &fn : calls)
+		fn();
+}
+
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
 {
 	if(msg->type() == protocol::MSG_INTERNAL) {
 		// MSG_INTERNAL is a pseudo-message used for internal synchronization
 		const auto &ci = msg.cast<protocol::ClientInternal>();
+
+		// Catchup progress reports arrive mixed in with the history. Anything
+		// else must see the buffered history executed first.
+		if(ci.internalType() != protocol::ClientInternal::Type::Catchup)
+			finishCatchup();
+
 		switch(ci.internalType()) {
 		case protocol::ClientInternal::Type::Catchup:
+			if(ci.value() == 0) {
+				// Fast catchup is possible only when starting from an empty history
+				m_catchingUp = m_fastCatchup && m_localfork.isEmpty() && m_history.offset() == m_history.end();
+			} else if(ci.value() >= 100) {
+				finishCatchup();
+			}
 			emit catchupProgress(ci.value());
 			break;
 		case protocol::ClientInternal::Type::SequencePoint:
@@ -270,12 +460,17 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			handleTruncateHistory();
 			break;
 		case protocol::ClientInternal::Type::SoftResetPoint:
-			emit softResetPoint();
+			emit softResetPoint(createSavepoint(m_history.end()-1));
 			break;
 		}
 		return;
 	}
 
+	if(m_catchingUp) {
+		m_catchupBuffer << msg;
+		return;
+	}
+
 	// Add command to history and execute it
 	m_history.append(msg);
 
@@ -304,13 +499,18 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			const StateSavepoint &sp = m_savepoints.at(savepoint);
 			qDebug("inconsistency at %d (local fork at %d). Rolling back to %d", m_history.end(), m_localfork.offset(), sp->streampointer);
 
+			// These are the messages whose order changes in the rollback
+			protocol::MessageList changed = m_localfork.messages();
+			for(int i=m_localfork.offset()+1;i<m_history.end();++i)
+				changed << m_history.at(i);
+
 			// Avoid rollback churn by clearing the local fork, but not if
 			// local drawing is in progress. If we clear the fork then,
 			// we trigger a self-conflict feedback loop until the stroke finishes.
-			if(!m_localPenDown)
+			if(!m_localPenDown.loadAcquire())
 				m_localfork.clear();
 
-			revertSavepointAndReplay(sp);
+			revertSavepointAndReplay(sp, changed);
 		}
 
 	} else if(lfa==LocalFork::CONCURRENT) {
@@ -322,6 +522,14 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 {
+	// Measure how long commands take to execute, so savepoints can be placed
+	// where replaying would get expensive. Undos are not replayed and undo points
+	// make savepoints themselves, so they are not counted.
+	const bool measured = msg->type() != protocol::MSG_UNDO && msg->type() != protocol::MSG_UNDOPOINT;
+	QElapsedTimer timer;
+	if(measured)
+		timer.start();
+
 	switch(msg->type()) {
 		using namespace protocol;
 		case MSG_CANVAS_RESIZE:
@@ -390,6 +598,87 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 			qWarning() << "Unhandled drawing command" << msg->type() << msg->messageName();
 			return;
 	}
+
+	if(measured)
+		m_replayCost += timer.nsecsElapsed() / 1000;
+}
+
+/**
+ * @brief Execute the messages received during the initial catchup
+ *
+ * Instead of executing the history one message at a time, the undo states
+ * are resolved first, so undone actions are never drawn at all. Savepoints
+ * are made only where undo can still reach, and observers are not notified
+ * of the changes until the whole history has been executed.
+ *
+ * This runs without breaks, which is why it is only used in the paint thread.
+ */
+void StateTracker::finishCatchup()
+{
+	if(!m_catchingUp)
+		return;
+
+	m_catchingUp = false;
+
+	const protocol::MessageList buffer = m_catchupBuffer;
+	m_catchupBuffer.clear();
+
+	if(buffer.isEmpty())
+		return;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	// Pass 1. Add the messages to the history and resolve the undo states
+	const int start = m_history.end();
+	for(protocol::MessagePtr msg : buffer) {
+		m_history.append(msg);
+		const int pos = m_history.end() - 1;
+
+		if(msg->type() == protocol::MSG_UNDOPOINT) {
+			markUnreachableUndos(msg->contextId(), pos);
+			if(msg->contextId() == localId())
+				m_hasParticipated.storeRelease(true);
+
+		} else if(msg->type() == protocol::MSG_UNDO) {
+			protocol::Undo &cmd = msg.cast<protocol::Undo>();
+			cmd.setUndoState(protocol::GONE);
+			const int upos = findUndoStart(cmd);
+			if(upos >= 0)
+				markUndone(cmd.overrideId() ? cmd.overrideId() : cmd.contextId(), upos, cmd.isRedo());
+		}
+	}
+
+	// Undo can't reach past this undo point, so no savepoints are needed before it
+	const QVector<int> &undoPoints = m_history.undoPoints();
+	const bool limitReached = undoPoints.size() >= protocol::UNDO_DEPTH_LIMIT;
+	const int oldestReachable = limitReached ? undoPoints.at(undoPoints.size() - protocol::UNDO_DEPTH_LIMIT) : m_history.offset();
+
+	// Pass 2. Execute the messages that are still in effect
+	m_layerstack->suspendObservers();
+	for(int pos=start;pos<m_history.end();++pos) {
+		protocol::MessagePtr msg = m_history.at(pos);
+
+		if(pos == oldestReachable && m_savepoints.last()->streampointer < pos-1)
+			m_savepoints << createSavepoint(pos-1);
+
+		if(msg->undoState() != protocol::DONE || msg->type() == protocol::MSG_UNDO)
+			continue;
+
+		if(msg->type() == protocol::MSG_UNDOPOINT) {
+			if(pos >= oldestReachable)
+				makeSavepoint(pos);
+		} else {
+			handleCommand(msg, true, pos);
+		}
+	}
+	m_layerstack->resumeObservers();
+
+	if(limitReached)
+		releaseSavepoints(oldestReachable);
+	m_history.cleanup(m_savepoints.first()->streampointer);
+
+	qDebug("Caught up %d messages in %lld ms", buffer.size(), timer.elapsed());
 }
 
 /**
@@ -397,6 +686,11 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
  */
 void StateTracker::endRemoteContexts()
 {
+	if(callInOwnThread([this]() { endRemoteContexts(); }))
+		return;
+
+	finishCatchup();
+
 	// Add local fork to the mainline history
 	auto localfork = m_localfork.messages();
 	m_localfork.clear();
@@ -418,6 +712,9 @@ void StateTracker::endRemoteContexts()
  */
 void StateTracker::endPlayback()
 {
+	if(callInOwnThread([this]() { endPlayback(); }))
+		return;
+
 	auto layers = m_layerstack->editor(0);
 	layers.mergeAllSublayers();
 }
@@ -442,7 +739,7 @@ void StateTracker::handleCanvasBackground(const protocol::CanvasBackground &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()));
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = net::compression::decompress(cmd.image(), paintcore::Tile::BYTES);
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid canvas background: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -474,33 +771,38 @@ void StateTracker::handleLayerCreate(const protocol::LayerCreate &cmd)
 
 	// Note: layers are listed bottom-first in the stack,
 	// but topmost first in the view
-	m_layerlist->createLayer(
-		cmd.layer(),
-		layers->layerCount() - layers->indexOf(layer->id()) - 1,
-		cmd.title()
-	);
-
-	// Auto-select layers we create
-	// During the startup phase, autoselect new layers or if a default one is set,
-	// just the default one. If there is a remembered layer selection, it takes precedence
-	// over others.
-	if(
-			// Autoselect layers created by me
-			(m_hasParticipated && cmd.contextId() == localId()) ||
-			// If this user has not yet drawn anything...
-			(!m_hasParticipated && (
-				// ... and if there is no remembered layer...
-				((m_myLastLayer <= 0) && ( // ...select default layer or if not selected, any new layer
-					layer->id() == m_layerlist->defaultLayer() ||
-					!m_layerlist->defaultLayer()
-				)) ||
-				// ... and if there is a remembered layer, select only that one
-				(m_myLastLayer>0 && layer->id() == m_myLastLayer)
-			))
-	   )
-	{
-		emit layerAutoselectRequest(layer->id());
-	}
+	const int layerId = layer->id();
+	const int index = layers->layerCount() - layers->indexOf(layerId) - 1;
+	const QString title = cmd.title();
+	const bool hasParticipated = m_hasParticipated.loadAcquire();
+	const bool isMine = cmd.contextId() == localId();
+	const int myLastLayer = m_myLastLayer;
+
+	callInGuiThread([=]() {
+		m_layerlist->createLayer(layerId, index, title);
+
+		// Auto-select layers we create
+		// During the startup phase, autoselect new layers or if a default one is set,
+		// just the default one. If there is a remembered layer selection, it takes precedence
+		// over others.
+		if(
+				// Autoselect layers created by me
+				(hasParticipated && isMine) ||
+				// If this user has not yet drawn anything...
+				(!hasParticipated && (
+					// ... and if there is no remembered layer...
+					((myLastLayer <= 0) && ( // ...select default layer or if not selected, any new layer
+						layerId == m_layerlist->defaultLayer() ||
+						!m_layerlist->defaultLayer()
+					)) ||
+					// ... and if there is a remembered layer, select only that one
+					(myLastLayer>0 && layerId == myLastLayer)
+				))
+		   )
+		{
+			emit layerAutoselectRequest(layerId);
+		}
+	});
 }
 
 void StateTracker::handleLayerAttributes(const protocol::LayerAttributes &cmd)
@@ -525,7 +827,13 @@ void StateTracker::handleLayerAttributes(const protocol::LayerAttributes &cmd)
 		layer.setOpacity(cmd.opacity());
 		layer.setCensored(cmd.isCensored());
 		layer.setFixed(cmd.isFixed());
-		m_layerlist->changeLayer(layer->id(), cmd.isCensored(), cmd.isFixed(), cmd.opacity() / 255.0, paintcore::BlendMode::Mode(cmd.blend()));
+		const int id = layer->id();
+		const bool censored = cmd.isCensored();
+		const bool fixed = cmd.isFixed();
+		const float opacity = cmd.opacity() / 255.0;
+		callInGuiThread([this, id, censored, fixed, opacity, bm]() {
+			m_layerlist->changeLayer(id, censored, fixed, opacity, bm);
+		});
 	}
 }
 
@@ -544,7 +852,10 @@ void StateTracker::handleLayerVisibility(const protocol::LayerVisibility &cmd)
 	}
 
 	layer.setHidden(!cmd.visible());
-	m_layerlist->setLayerHidden(layer->id(), !cmd.visible());
+
+	const int id = layer->id();
+	const bool hidden = !cmd.visible();
+	callInGuiThread([this, id, hidden]() { m_layerlist->setLayerHidden(id, hidden); });
 }
 
 void StateTracker::previewLayerOpacity(int id, float opacity)
@@ -570,7 +881,10 @@ void StateTracker::handleLayerTitle(const protocol::LayerRetitle &cmd)
 	}
 
 	layer.setTitle(cmd.title());
-	m_layerlist->retitleLayer(layer->id(), cmd.title());
+
+	const int id = layer->id();
+	const QString title = cmd.title();
+	callInGuiThread([this, id, title]() { m_layerlist->retitleLayer(id, title); });
 }
 
 void StateTracker::handleLayerOrder(const protocol::LayerOrder &cmd)
@@ -591,7 +905,7 @@ void StateTracker::handleLayerOrder(const protocol::LayerOrder &cmd)
 	}
 
 	layers.reorderLayers(newOrder);
-	m_layerlist->reorderLayers(newOrder);
+	callInGuiThread([this, newOrder]() { m_layerlist->reorderLayers(newOrder); });
 }
 
 void StateTracker::handleLayerDelete(const protocol::LayerDelete &cmd)
@@ -601,7 +915,9 @@ void StateTracker::handleLayerDelete(const protocol::LayerDelete &cmd)
 	if(cmd.merge())
 		layers.mergeLayerDown(cmd.layer());
 	layers.deleteLayer(cmd.layer());
-	m_layerlist->deleteLayer(cmd.layer());
+
+	const int id = cmd.layer();
+	callInGuiThread([this, id]() { m_layerlist->deleteLayer(id); });
 }
 
 void StateTracker::handleDrawDabs(const protocol::Message &cmd)
@@ -610,7 +926,7 @@ void StateTracker::handleDrawDabs(const protocol::Message &cmd)
 
 	brushes::drawBrushDabs(cmd, layers);
 
-	if(_showallmarkers || cmd.contextId() != localId())
+	if(_showallmarkers.loadAcquire() || cmd.contextId() != localId())
 		emit userMarkerMove(cmd.contextId(), cmd.layer(), static_cast<const protocol::DrawDabs&>(cmd).lastPoint());
 }
 
@@ -631,7 +947,7 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	}
 
 	const int expectedLen = cmd.width() * cmd.height() * 4;
-	QByteArray data = qUncompress(cmd.image());
+	QByteArray data = net::compression::decompress(cmd.image(), expectedLen);
 	if(data.length() != expectedLen) {
 		qWarning() << "Invalid putImage: Expected" << expectedLen << "bytes, but got" << data.length();
 		return;
@@ -639,7 +955,7 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	QImage img(reinterpret_cast<const uchar*>(data.constData()), cmd.width(), cmd.height(), QImage::Format_ARGB32_Premultiplied);
 	layer.putImage(cmd.x(), cmd.y(), img, paintcore::BlendMode::Mode(cmd.blendmode()));
 
-	if(_showallmarkers || cmd.contextId() != m_myId)
+	if(_showallmarkers.loadAcquire() || cmd.contextId() != localId())
 		emit userMarkerMove(cmd.contextId(), layer->id(), QPoint(cmd.x() + cmd.width()/2, cmd.y()+cmd.height()/2));
 }
 
@@ -656,8 +972,20 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 	if(cmd.isSolidColor()) {
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()), cmd.contextId());
 
+	} else if(cmd.isReference()) {
+		const paintcore::Layer *source = m_layerstack->getLayer(cmd.sourceLayer());
+		if(source && cmd.sourceSublayer() > 0)
+			source = source->getVisibleSublayer(cmd.sourceSublayer());
+
+		if(!source || cmd.sourceColumn() >= paintcore::Tile::roundTiles(source->width()) || cmd.sourceRow() >= paintcore::Tile::roundTiles(source->height())) {
+			qWarning("Invalid putTile: no source tile %d,%d on layer #%d/%d", cmd.sourceColumn(), cmd.sourceRow(), cmd.sourceLayer(), cmd.sourceSublayer());
+			return;
+		}
+
+		t = source->tile(cmd.sourceColumn(), cmd.sourceRow());
+
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = net::compression::decompress(cmd.image(), paintcore::Tile::BYTES);
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid putTile: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -680,7 +1008,7 @@ void StateTracker::handleFillRect(const protocol::FillRect &cmd)
 
 	layer.fillRect(QRect(cmd.x(), cmd.y(), cmd.width(), cmd.height()), QColor::fromRgba(cmd.color()), paintcore::BlendMode::Mode(cmd.blend()));
 
-	if(_showallmarkers || cmd.contextId() != m_myId)
+	if(_showallmarkers.loadAcquire() || cmd.contextId() != localId())
 		emit userMarkerMove(cmd.contextId(), layer->id(), QPoint(cmd.x() + cmd.width()/2, cmd.y()+cmd.height()/2));
 }
 
@@ -693,7 +1021,7 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 		return;
 	}
 
-	if(cmd.contextId() == m_myId) {
+	if(cmd.contextId() == localId()) {
 		// Moving the layer for real: make sure my preview is removed
 		layer.removeSublayer(-1);
 	}
@@ -721,7 +1049,7 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 	QImage mask;
 	if(!cmd.mask().isEmpty()) {
 		const int expectedLen = (cmd.bw()+31)/32 * 4 * cmd.bh(); // 1bpp lines padded to 32bit boundaries
-		QByteArray maskData = qUncompress(cmd.mask());
+		QByteArray maskData = net::compression::decompress(cmd.mask(), expectedLen);
 		if(maskData.length() != expectedLen) {
 			qWarning("Invalid moveRegion mask: Expected %d bytes, but got %d", expectedLen, maskData.length());
 			return;
@@ -770,7 +1098,7 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 
 	layer.putImage(offset.x(), offset.y(), transformed, paintcore::BlendMode::MODE_NORMAL);
 
-	if(_showallmarkers || cmd.contextId() != m_myId)
+	if(_showallmarkers.loadAcquire() || cmd.contextId() != localId())
 		emit userMarkerMove(cmd.contextId(), layer->id(), target.boundingRect().center());
 }
 
@@ -780,54 +1108,9 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 	// commands in a linear sequence, this branching is represented by marking
 	// the unreachable commands as GONE.
 	if(!replay) {
-		int i = pos - 1; // skip the one just added
-		int upCount = 1;
-
-		// Mark undone actions as GONE
-		while(m_history.isValidIndex(i) && upCount < protocol::UNDO_DEPTH_LIMIT) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->type() == protocol::MSG_UNDOPOINT)
-				++upCount;
-			if(msg->contextId() == cmd.contextId()) {
-				// optimization: we can stop searching after finding the first GONE command
-				if(msg->type() != protocol::MSG_UNDO && msg->undoState() == protocol::GONE)
-					break;
-				else if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::GONE);
-			}
-			--i;
-		}
-
-		// Keep rewinding until the oldest reachable undo point is found
-		while(m_history.isValidIndex(i) && upCount < protocol::UNDO_DEPTH_LIMIT) {
-			if(m_history.at(i)->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-			}
-			--i;
-		}
-
-		// Release all state savepoints older then the oldest UndoPoint
-		if(upCount>=protocol::UNDO_DEPTH_LIMIT) {
-			if(!m_localfork.isEmpty())
-				i = qMin(i, m_localfork.offset() - 1);
-
-			QMutableListIterator<StateSavepoint> spi(m_savepoints);
-			spi.toBack();
-
-			// In order to be able to return to the oldest undo point, we must leave
-			// one snapshot that is as old, or older.
-			bool first = true;
-
-			while(spi.hasPrevious()) {
-				const StateSavepoint &sp = spi.previous();
-				if(sp->streampointer <= i) {
-					if(first)
-						first = false;
-					else
-						spi.remove();
-				}
-			}
-		}
+		const int oldestReachable = markUnreachableUndos(cmd.contextId(), pos);
+		if(oldestReachable >= 0)
+			releaseSavepoints(oldestReachable);
 	}
 
 	// Clear out history older than the oldest savepoint
@@ -841,7 +1124,63 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 	// sent by us. In practice, however, an UndoPoint is always sent
 	// when making changes so it is enough to set the flag here.
 	if(cmd.contextId() == localId())
-		m_hasParticipated = true;
+		m_hasParticipated.storeRelease(true);
+}
+
+/**
+ * @brief Mark the user's undone actions that a new undo point makes unreachable as GONE
+ *
+ * @param contextId the user who made the undo point
+ * @param pos the position of the new undo point
+ * @return position of the oldest reachable undo point or -1 if the undo depth limit has not been reached
+ */
+int StateTracker::markUnreachableUndos(uint8_t contextId, int pos)
+{
+	// Find the oldest reachable undo point. The new one counts as the first.
+	const QVector<int> &undoPoints = m_history.undoPoints();
+	const int upsBefore = int(std::lower_bound(undoPoints.constBegin(), undoPoints.constEnd(), pos) - undoPoints.constBegin());
+	const bool limitReached = upsBefore >= protocol::UNDO_DEPTH_LIMIT - 1;
+	const int oldestReachable = limitReached ? undoPoints.at(upsBefore - (protocol::UNDO_DEPTH_LIMIT - 1)) : m_history.offset();
+
+	// Mark undone actions as GONE. Only this user's own messages need to be checked.
+	const QVector<int> &own = m_history.messages(contextId);
+	for(int j=int(std::lower_bound(own.constBegin(), own.constEnd(), pos) - own.constBegin())-1;j>=0 && own.at(j) >= oldestReachable;--j) {
+		protocol::MessagePtr msg = m_history.at(own.at(j));
+		// optimization: we can stop searching after finding the first GONE command
+		if(msg->type() != protocol::MSG_UNDO && msg->undoState() == protocol::GONE)
+			break;
+		else if(msg->undoState() == protocol::UNDONE)
+			msg->setUndoState(protocol::GONE);
+	}
+
+	return limitReached ? oldestReachable : -1;
+}
+
+/**
+ * @brief Release all state savepoints older than the oldest reachable undo point
+ */
+void StateTracker::releaseSavepoints(int oldestReachable)
+{
+	int i = oldestReachable - 1;
+	if(!m_localfork.isEmpty())
+		i = qMin(i, m_localfork.offset() - 1);
+
+	QMutableListIterator<StateSavepoint> spi(m_savepoints);
+	spi.toBack();
+
+	// In order to be able to return to the oldest undo point, we must leave
+	// one snapshot that is as old, or older.
+	bool first = true;
+
+	while(spi.hasPrevious()) {
+		const StateSavepoint &sp = spi.previous();
+		if(sp->streampointer <= i) {
+			if(first)
+				first = false;
+			else
+				spi.remove();
+		}
+	}
 }
 
 void StateTracker::handleUndo(protocol::Undo &cmd)
@@ -853,98 +1192,137 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 	const uint8_t ctxid = cmd.overrideId() ? cmd.overrideId() : cmd.contextId();
 
 	// Step 1. Find undo or redo point
-	int pos = m_history.end();
-	int upCount = 0;
+	const int pos = findUndoStart(cmd);
+	if(pos < 0)
+		return;
+
+	// Step 2. Find nearest save point
+	StateSavepoint savepoint;
+	for(int i=m_savepoints.count()-1;i>=0;--i) {
+		if(m_savepoints.at(i)->streampointer <= pos) {
+			savepoint = m_savepoints.at(i);
+			break;
+		}
+	}
+
+	if(!savepoint) {
+		qWarning() << "Cannot" << (cmd.isRedo() ? "redo" : "undo") << "action by user" << ctxid << ": no savepoint found!";
+		return;
+	}
+
+	// Step 3. (Un)mark all actions by the user as undone
+	const protocol::MessageList changed = markUndone(ctxid, pos, cmd.isRedo());
+
+	// Step 4. Revert to the savepoint and replay with undone commands removed (or added back)
+	revertSavepointAndReplay(savepoint, changed);
+}
+
+/**
+ * @brief Find the undo point an undo or redo command starts from
+ *
+ * Only the user's own undo points are looked at. The number of undo points
+ * (by anyone) newer than an undo point tells if it is still reachable.
+ *
+ * @return position of the undo point or -1 if there is nothing to undo/redo
+ */
+int StateTracker::findUndoStart(const protocol::Undo &cmd) const
+{
+	const uint8_t ctxid = cmd.overrideId() ? cmd.overrideId() : cmd.contextId();
+	const QVector<int> &undoPoints = m_history.undoPoints(ctxid);
+	int pos = m_history.offset() - 1;
+	int upCount = qMin(m_history.undoPoints().size(), protocol::UNDO_DEPTH_LIMIT + 1);
 
 	if(cmd.isRedo()) {
 		// Find the oldest undone UndoPoint
-		int redostart = pos;
-		while(m_history.isValidIndex(--pos) && upCount <= protocol::UNDO_DEPTH_LIMIT) {
-			const protocol::MessagePtr msg = m_history.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-				if(msg->contextId() == ctxid) {
-					if(msg->undoState() != protocol::DONE)
-						redostart = pos;
-					else
-						break;
-				}
+		int redostart = m_history.end();
+		for(int i=undoPoints.size()-1;i>=0;--i) {
+			const int up = undoPoints.at(i);
+			const int depth = m_history.undoPointsSince(up);
+			if(depth > protocol::UNDO_DEPTH_LIMIT + 1)
+				break;
+
+			if(m_history.at(up)->undoState() != protocol::DONE) {
+				redostart = up;
+			} else {
+				upCount = depth;
+				break;
 			}
 		}
 
 		if(redostart == m_history.end()) {
 			qDebug() << "nothing to redo for user" << cmd.contextId();
-			return;
+			return -1;
 		}
 		pos = redostart;
 
 	} else {
 		// Find the newest UndoPoint not marked as undone.
-		while(m_history.isValidIndex(--pos) && upCount <= protocol::UNDO_DEPTH_LIMIT) {
-			const protocol::MessagePtr msg = m_history.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				++upCount;
-				if(msg->contextId() == ctxid && msg->undoState() == protocol::DONE)
-					break;
+		for(int i=undoPoints.size()-1;i>=0;--i) {
+			const int up = undoPoints.at(i);
+			const int depth = m_history.undoPointsSince(up);
+			if(depth > protocol::UNDO_DEPTH_LIMIT + 1)
+				break;
+
+			if(m_history.at(up)->undoState() == protocol::DONE) {
+				pos = up;
+				upCount = depth;
+				break;
 			}
 		}
 	}
 
 	if(upCount > protocol::UNDO_DEPTH_LIMIT) {
 		qDebug() << "user" << cmd.contextId() << "cannot undo/redo beyond history limit";
-		return;
+		return -1;
 	}
 
 	// pos is now at the starting UndoPoint
 	if(!m_history.isValidIndex(pos)) {
 		qWarning() << "Cannot " << (cmd.isRedo() ? "redo" : "undo") << "action by user" << ctxid << ": not enough messages in buffer!";
-		return;
+		return -1;
 	}
 
-	// Step 2. Find nearest save point
-	StateSavepoint savepoint;
-	for(int i=m_savepoints.count()-1;i>=0;--i) {
-		if(m_savepoints.at(i)->streampointer <= pos) {
-			savepoint = m_savepoints.at(i);
-			break;
-		}
-	}
+	return pos;
+}
 
-	if(!savepoint) {
-		qWarning() << "Cannot" << (cmd.isRedo() ? "redo" : "undo") << "action by user" << ctxid << ": no savepoint found!";
-		return;
-	}
+/**
+ * @brief (Un)mark the user's actions starting from the given undo point as undone
+ *
+ * @return the messages whose undo state changed between DONE and UNDONE
+ */
+protocol::MessageList StateTracker::markUndone(uint8_t contextId, int pos, bool redo)
+{
+	protocol::MessageList changed;
+	const QVector<int> &own = m_history.messages(contextId);
+	const int first = int(std::lower_bound(own.constBegin(), own.constEnd(), pos) - own.constBegin());
 
-	// Step 3. (Un)mark all actions by the user as undone
-	if(cmd.isRedo()) {
-		int i=pos;
+	if(redo) {
 		int sequence=2;
 		// Un-undo messages until the start of the next undone sequence
-		while(i<m_history.end()) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->contextId() == ctxid) {
-				if(msg->type() == protocol::MSG_UNDOPOINT && msg->undoState() != protocol::GONE)
-					if(--sequence==0)
-						break;
-
-				// GONE messages cannot be redone
-				if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::DONE);
+		for(int i=first;i<own.size();++i) {
+			protocol::MessagePtr msg = m_history.at(own.at(i));
+			if(msg->type() == protocol::MSG_UNDOPOINT && msg->undoState() != protocol::GONE)
+				if(--sequence==0)
+					break;
+
+			// GONE messages cannot be redone
+			if(msg->undoState() == protocol::UNDONE) {
+				msg->setUndoState(protocol::DONE);
+				changed << msg;
 			}
-			++i;
 		}
 
 	} else {
 		// Mark all messages from undo point to the end as undone.
-		for(int i=pos;i<m_history.end();++i) {
-			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->contextId() == ctxid)
-				msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
+		for(int i=first;i<own.size();++i) {
+			protocol::MessagePtr msg = m_history.at(own.at(i));
+			if(msg->undoState() == protocol::DONE)
+				changed << msg;
+			msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
 		}
 	}
 
-	// Step 4. Revert to the savepoint and replay with undone commands removed (or added back)
-	revertSavepointAndReplay(savepoint);
+	return changed;
 }
 
 StateSavepoint StateTracker::createSavepoint(int pos)
@@ -952,8 +1330,12 @@ StateSavepoint StateTracker::createSavepoint(int pos)
 	auto *data = new StateSavepoint::Data;
 	data->timestamp = QDateTime::currentMSecsSinceEpoch();
 	data->streampointer = pos;
+	data->replayCost = m_replayCost;
 	data->canvas = m_layerstack->makeSavepoint();
-	data->layermodel = m_layerlist->getLayers();
+
+	// The layer list model mirrors the layer stack, so it can be made from the
+	// savepoint without reading the GUI's model (which lives in another thread.)
+	data->layermodel = layerListItems(data->canvas);
 
 	return StateSavepoint(data);
 }
@@ -966,21 +1348,24 @@ void StateTracker::makeSavepoint(int pos)
 	if(!m_localfork.isEmpty())
 		return;
 
-	// Check if sufficient time and actions has elapsed from previous savepoint
+	// Savepoints are placed by how long it would take to replay the commands
+	// since the previous one. A long series of cheap commands gets a savepoint
+	// eventually too, since looking through the history isn't free either.
 	if(!m_savepoints.isEmpty()) {
-		static const qint64 MIN_INTERVAL_MS = 1000;
-		static const int MIN_INTERVAL_MSGS = 100;
+		static const qint64 MAX_REPLAY_COST_US = 50 * 1000;
+		static const int MAX_INTERVAL_MSGS = 1000;
 
 		const StateSavepoint sp = m_savepoints.last();
-		const auto now = QDateTime::currentMSecsSinceEpoch();
-		if(now - sp->timestamp < MIN_INTERVAL_MS && m_history.end() - sp->streampointer < MIN_INTERVAL_MSGS)
+		if(m_replayCost - sp->replayCost < MAX_REPLAY_COST_US && pos - sp->streampointer < MAX_INTERVAL_MSGS)
 			return;
 	}
 
 	// Looks like a good spot for a savepoint
 	const auto sp = createSavepoint(pos);
 	m_savepoints << sp;
+	thinSavepoints();
 
+	QMutexLocker lock(&m_resetpointLock);
 	if(m_resetpoints.isEmpty() || (sp.timestamp() - m_resetpoints.last().timestamp()) > (10*1000)) {
 		while(m_resetpoints.size() >= 6)
 			m_resetpoints.removeFirst();
@@ -989,8 +1374,134 @@ void StateTracker::makeSavepoint(int pos)
 }
 
 
+static const paintcore::Layer *sameLayer(const paintcore::Savepoint &savepoint, const paintcore::Layer *layer)
+{
+	for(const paintcore::Layer *l : savepoint.layers) {
+		if(l->id() == layer->id())
+			return l->width() == layer->width() && l->height() == layer->height() ? l : nullptr;
+	}
+	return nullptr;
+}
+
+/**
+ * Count the tiles the savepoint at the given index shares with neither of its neighbours.
+ *
+ * Savepoints share the tiles that did not change between them, so these
+ * are the tiles that are freed when the savepoint is removed.
+ */
+static int exclusiveTileCount(const QList<StateSavepoint> &savepoints, int index)
+{
+	const StateSavepoint::Data *sp = savepoints.at(index).operator->();
+	const StateSavepoint::Data *prev = index > 0 ? savepoints.at(index-1).operator->() : nullptr;
+	const StateSavepoint::Data *next = index < savepoints.size()-1 ? savepoints.at(index+1).operator->() : nullptr;
+	const qint64 prevSerial = prev ? prev->serial : 0;
+	const qint64 nextSerial = next ? next->serial : 0;
+
+	if(sp->exclusiveTiles >= 0 && sp->exclusivePrev == prevSerial && sp->exclusiveNext == nextSerial)
+		return sp->exclusiveTiles;
+
+	QSet<paintcore::Tile> tiles;
+	for(const paintcore::Layer *layer : sp->canvas.layers) {
+		const paintcore::Layer *p = prev ? sameLayer(prev->canvas, layer) : nullptr;
+		const paintcore::Layer *n = next ? sameLayer(next->canvas, layer) : nullptr;
+
+		const QVector<int> changed = p ? layer->differingTiles(p) : layer->nonNullTiles();
+		for(const int i : changed) {
+			const paintcore::Tile &t = layer->tile(i);
+			if(!t.isNull() && (!n || n->tile(i) != t))
+				tiles.insert(t);
+		}
+	}
+
+	sp->exclusiveTiles = tiles.size();
+	sp->exclusivePrev = prevSerial;
+	sp->exclusiveNext = nextSerial;
+	return sp->exclusiveTiles;
+}
+
+void StateTracker::thinSavepoints()
+{
+	// The number of savepoints kept is limited by the memory held by
+	// the tiles each savepoint alone has. The newest savepoint's tiles
+	// are mostly shared with the canvas itself, so they are not counted.
+	static const int MIN_SAVEPOINTS = 5;
+	static const int MAX_SAVEPOINTS = 100;
+
+	const qint64 tileBudget = m_savepointMemoryBudget / paintcore::Tile::BYTES;
+
+	qint64 tiles = 0;
+	for(int i=0;i<m_savepoints.size()-1;++i)
+		tiles += exclusiveTileCount(m_savepoints, i);
+
+	// The oldest savepoint is needed to reach the oldest undo point and the
+	// newest one to keep the next replay short, so only the ones in between
+	// are removed. The savepoint removed is the one whose removal results in
+	// the shortest replay.
+	while(m_savepoints.size() > MIN_SAVEPOINTS && (m_savepoints.size() > MAX_SAVEPOINTS || tiles > tileBudget)) {
+		int victim = 1;
+		qint64 victimCost = std::numeric_limits<qint64>::max();
+		for(int i=1;i<m_savepoints.size()-1;++i) {
+			const qint64 cost = m_savepoints.at(i+1)->replayCost - m_savepoints.at(i-1)->replayCost;
+			if(cost < victimCost) {
+				victim = i;
+				victimCost = cost;
+			}
+		}
+
+		// Removing a savepoint changes what its neighbours have exclusively
+		tiles -= exclusiveTileCount(m_savepoints, victim-1) + exclusiveTileCount(m_savepoints, victim);
+		if(victim+1 < m_savepoints.size()-1)
+			tiles -= exclusiveTileCount(m_savepoints, victim+1);
+
+		m_savepoints.removeAt(victim);
+
+		tiles += exclusiveTileCount(m_savepoints, victim-1);
+		if(victim < m_savepoints.size()-1)
+			tiles += exclusiveTileCount(m_savepoints, victim);
+	}
+}
+
+qint64 StateTracker::lastReplayDuration() const
+{
+	return m_lastReplayDuration.load();
+}
+
+void StateTracker::setScopedReplayEnabled(bool enabled)
+{
+	if(callInOwnThread([this, enabled]() { setScopedReplayEnabled(enabled); }))
+		return;
+
+	m_scopedReplay = enabled;
+}
+
+void StateTracker::setFastCatchupEnabled(bool enabled)
+{
+	if(callInOwnThread([this, enabled]() { setFastCatchupEnabled(enabled); }))
+		return;
+
+	m_fastCatchup = enabled;
+}
+
+void StateTracker::setSavepointMemoryBudget(qint64 bytes)
+{
+	if(callInOwnThread([this, bytes]() { setSavepointMemoryBudget(bytes); }))
+		return;
+
+	m_savepointMemoryBudget = bytes;
+	thinSavepoints();
+}
+
+QList<StateSavepoint> StateTracker::getResetPoints() const
+{
+	QMutexLocker lock(&m_resetpointLock);
+	return m_resetpoints;
+}
+
 void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 {
+	if(callInOwnThread([this, savepoint]() { resetToSavepoint(savepoint); }))
+		return;
+
 	// This function is called when jumping to a recorded savepoint
 	if(!savepoint) {
 		qWarning("resetToSavepoint() was called with a null savepoint!");
@@ -999,14 +1510,299 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 
 	m_history.resetTo(savepoint->streampointer);
 	m_savepoints.clear();
+	m_replayCost = savepoint->replayCost;
 
 	m_layerstack->editor(0).restoreSavepoint(savepoint->canvas);
-	m_layerlist->setLayers(savepoint->layermodel);
+	callInGuiThread([this, savepoint]() { m_layerlist->setLayers(savepoint->layermodel); });
 
 	m_savepoints.append(savepoint);
 }
 
-void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
+/**
+ * @brief Get the area brush dabs can actually paint on
+ *
+ * DrawDabs::bounds() is an approximation that rounds the dab radius
+ * down, so it can miss the edges of small dabs. This errs on the large side instead.
+ */
+static QRect dabFootprint(const protocol::DrawDabs &dd)
+{
+	using namespace protocol;
+	QRect footprint;
+
+	if(dd.type() == MSG_DRAWDABS_CLASSIC) {
+		// Coordinates are in quarter pixels and the size is the diameter * 256.
+		// The mask is centered on the whole pixel and is grown by a pixel or two for subpixel offsetting.
+		const DrawDabsClassic &ddc = static_cast<const DrawDabsClassic&>(dd);
+		int x = ddc.originX(), y = ddc.originY();
+		for(const ClassicBrushDab &d : ddc.dabs()) {
+			x += d.x;
+			y += d.y;
+			const int px = x >> 2;
+			const int py = y >> 2;
+			const int r = (d.size + 511) / 512 + 4;
+			footprint |= QRect(px - r, py - r, 2*r + 1, 2*r + 1);
+		}
+
+	} else {
+		const DrawDabsPixel &ddp = static_cast<const DrawDabsPixel&>(dd);
+		int x = ddp.originX(), y = ddp.originY();
+		for(const PixelBrushDab &d : ddp.dabs()) {
+			x += d.x;
+			y += d.y;
+			const int r = d.size / 2 + 1;
+			footprint |= QRect(x - r, y - r, 2*r + 1, 2*r + 1);
+		}
+	}
+
+	return footprint;
+}
+
+/**
+ * @brief Get the layer and the area of it a message changes, for tile scoped replay
+ *
+ * A layer ID of zero means the message does not change any layer content.
+ *
+ * @return false if the message cannot be replayed in a scoped replay
+ */
+static bool scopedReplayArea(const protocol::MessagePtr &msg, const QSize &canvasSize, int &layer, QRect &bounds)
+{
+	using namespace protocol;
+	layer = 0;
+	bounds = QRect();
+
+	switch(msg->type()) {
+	case MSG_PUTIMAGE: {
+		const PutImage &m = msg.cast<PutImage>();
+		layer = m.layer();
+		bounds = QRect(m.x(), m.y(), m.width(), m.height());
+		return true;
+	}
+	case MSG_PUTTILE: {
+		const PutTile &m = msg.cast<PutTile>();
+		// References read from other layers, and sublayers belong to strokes in progress
+		if(m.sublayer() != 0 || m.isReference())
+			return false;
+
+		const int xtiles = paintcore::Tile::roundTiles(canvasSize.width());
+		const int first = m.row() * xtiles + m.column();
+		const int last = first + m.repeat();
+		layer = m.layer();
+		if(first / xtiles == last / xtiles)
+			bounds = QRect(m.column() * paintcore::Tile::SIZE, m.row() * paintcore::Tile::SIZE, (m.repeat() + 1) * paintcore::Tile::SIZE, paintcore::Tile::SIZE);
+		else
+			bounds = QRect(0, m.row() * paintcore::Tile::SIZE, canvasSize.width(), (last / xtiles - m.row() + 1) * paintcore::Tile::SIZE);
+		return true;
+	}
+	case MSG_DRAWDABS_CLASSIC:
+	case MSG_DRAWDABS_PIXEL:
+	case MSG_DRAWDABS_PIXEL_SQUARE: {
+		const DrawDabs &dd = msg.cast<DrawDabs>();
+		// Indirect strokes are drawn on sublayers and merged at pen up
+		if(dd.isIndirect())
+			return false;
+		layer = dd.layer();
+		bounds = dabFootprint(dd);
+		return true;
+	}
+	case MSG_FILLRECT: {
+		const FillRect &fr = msg.cast<FillRect>();
+		layer = fr.layer();
+		bounds = QRect(fr.x(), fr.y(), fr.width(), fr.height());
+		return true;
+	}
+	case MSG_REGION_MOVE: {
+		const MoveRegion &mr = msg.cast<MoveRegion>();
+		layer = mr.layer();
+		bounds = mr.sourceBounds().united(mr.targetBounds());
+		return true;
+	}
+	case MSG_UNDOPOINT:
+	case MSG_PEN_UP: // no-op, since there are no indirect strokes
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * @brief Revert and replay only the tiles affected by the changed messages
+ *
+ * The changed messages' areas are restored from the savepoint and the messages
+ * touching them are replayed. Since a replayed message may also touch tiles outside
+ * the initial area, the area is grown until every message touching it fits inside it.
+ * Everything else on the canvas is left as is.
+ *
+ * This only works when all the messages involved just change the pixels of
+ * existing layers. Otherwise, nothing is done and false is returned.
+ */
+bool StateTracker::scopedRevertAndReplay(const StateSavepoint &savepoint, const protocol::MessageList &changed)
+{
+	const paintcore::Savepoint &canvas = savepoint->canvas;
+	const QSize canvasSize = m_layerstack->size();
+	if(canvas.size != canvasSize)
+		return false;
+
+	// Pixels of strokes in progress are in sublayers
+	for(const paintcore::Layer *layer : canvas.layers) {
+		for(const paintcore::Layer *sublayer : layer->sublayers()) {
+			if(sublayer->id() > 0)
+				return false;
+		}
+	}
+
+	const QRect canvasRect(QPoint(), canvasSize);
+	const auto alignToTiles = [canvasRect](const QRect &r) {
+		const QRect c = r & canvasRect;
+		if(c.isEmpty())
+			return QRect();
+		const int s = paintcore::Tile::SIZE;
+		return QRect(QPoint(c.left() / s * s, c.top() / s * s), QPoint((c.right() / s + 1) * s - 1, (c.bottom() / s + 1) * s - 1));
+	};
+
+	// The area that must be restored, by layer ID
+	QHash<int, QRect> scope;
+	for(const protocol::MessagePtr &msg : changed) {
+		int layer;
+		QRect bounds;
+		if(!scopedReplayArea(msg, canvasSize, layer, bounds))
+			return false;
+
+		bounds = alignToTiles(bounds);
+		if(layer && !bounds.isEmpty())
+			scope[layer] |= bounds;
+	}
+
+	// Gather the messages after the savepoint
+	struct ReplayItem {
+		protocol::MessagePtr msg;
+		int pos;
+		int layer;
+		QRect bounds;
+		bool replay;
+	};
+	QVector<ReplayItem> items;
+
+	int pos = savepoint->streampointer + 1;
+	for(;pos<m_history.end();++pos) {
+		const protocol::MessagePtr msg = m_history.at(pos);
+		if(msg->undoState() != protocol::DONE)
+			continue;
+
+		ReplayItem item { msg, pos, 0, QRect(), false };
+		if(!scopedReplayArea(msg, canvasSize, item.layer, item.bounds))
+			return false;
+		item.bounds = alignToTiles(item.bounds);
+		items << item;
+	}
+
+	const int forkPos = pos;
+	if(!m_localfork.isEmpty()) {
+		for(const protocol::MessagePtr &msg : m_localfork.messages()) {
+			if(msg->type() == protocol::MSG_UNDO || msg->type() == protocol::MSG_UNDOPOINT)
+				continue;
+
+			ReplayItem item { msg, forkPos, 0, QRect(), false };
+			if(!scopedReplayArea(msg, canvasSize, item.layer, item.bounds))
+				return false;
+			item.bounds = alignToTiles(item.bounds);
+			items << item;
+		}
+	}
+
+	// Grow the area until all messages touching it are inside it
+	bool grown;
+	do {
+		grown = false;
+		for(ReplayItem &item : items) {
+			if(item.replay || !item.layer || item.bounds.isEmpty() || !scope.contains(item.layer))
+				continue;
+
+			QRect &area = scope[item.layer];
+			if(area.intersects(item.bounds)) {
+				item.replay = true;
+				if(!area.contains(item.bounds)) {
+					area |= item.bounds;
+					grown = true;
+				}
+			}
+		}
+	} while(grown);
+
+	// The affected layers must exist both now and in the savepoint
+	QHash<int, const paintcore::Layer*> savedLayers;
+	for(const paintcore::Layer *layer : canvas.layers) {
+		if(scope.contains(layer->id()))
+			savedLayers[layer->id()] = layer;
+	}
+
+	for(auto i=scope.constBegin();i!=scope.constEnd();++i) {
+		if(!savedLayers.contains(i.key()) || !m_layerstack->getLayer(i.key()))
+			return false;
+	}
+
+	// Everything checks out: restore the affected tiles
+	{
+		auto editor = m_layerstack->editor(0);
+		for(auto i=scope.constBegin();i!=scope.constEnd();++i) {
+			const paintcore::Layer *saved = savedLayers[i.key()];
+			auto layer = editor.getEditableLayer(i.key());
+			const QRect &area = i.value();
+			for(int row=area.top()/paintcore::Tile::SIZE;row<=area.bottom()/paintcore::Tile::SIZE;++row) {
+				for(int col=area.left()/paintcore::Tile::SIZE;col<=area.right()/paintcore::Tile::SIZE;++col)
+					layer.putTile(col, row, 0, saved->tile(col, row));
+			}
+		}
+	}
+
+	// The newer savepoints differ from the correct state only in the restored
+	// area, so instead of being thrown away, they are patched as the replay passes them.
+	QList<StateSavepoint> newer;
+	while(m_savepoints.last() != savepoint)
+		newer.prepend(m_savepoints.takeLast());
+
+	const auto patchNextSavepoint = [this, &newer, &scope]() {
+		const StateSavepoint old = newer.takeFirst();
+		auto *data = new StateSavepoint::Data(*old.operator->());
+		for(paintcore::Layer *l : data->canvas.layers) {
+			if(!scope.contains(l->id()))
+				continue;
+
+			const paintcore::Layer *current = m_layerstack->getLayer(l->id());
+			paintcore::EditableLayer layer(l, nullptr, 0);
+			const QRect area = scope.value(l->id());
+			for(int row=area.top()/paintcore::Tile::SIZE;row<=area.bottom()/paintcore::Tile::SIZE;++row) {
+				for(int col=area.left()/paintcore::Tile::SIZE;col<=area.right()/paintcore::Tile::SIZE;++col)
+					layer.putTile(col, row, 0, current->tile(col, row));
+			}
+		}
+		m_savepoints << StateSavepoint(data);
+	};
+
+	// Replay the messages in the restored area. The replay cost counter still
+	// reflects the full history, since nothing else was reverted.
+	const qint64 replayCost = m_replayCost;
+	int replayed = 0;
+	for(const ReplayItem &item : items) {
+		while(!newer.isEmpty() && newer.first()->streampointer < item.pos)
+			patchNextSavepoint();
+
+		if(item.replay) {
+			handleCommand(item.msg, true, item.pos);
+			++replayed;
+		}
+	}
+	while(!newer.isEmpty())
+		patchNextSavepoint();
+	m_replayCost = replayCost;
+
+	if(!m_localfork.isEmpty())
+		m_localfork.setOffset(forkPos-1);
+
+	qDebug("Scoped replay: %d of %d messages replayed on %d layer(s)", replayed, items.size(), scope.size());
+	return true;
+}
+
+void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint, const protocol::MessageList &changed)
 {
 	// This function is called when reverting to an earlier state to undo
 	// an action.
@@ -1019,8 +1815,18 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 		return;
 	}
 
+	QElapsedTimer timer;
+	timer.start();
+
+	// Try restoring just the parts that changed first
+	if(m_scopedReplay && !changed.isEmpty() && scopedRevertAndReplay(savepoint, changed)) {
+		m_lastReplayDuration.store(timer.elapsed());
+		return;
+	}
+
 	m_layerstack->editor(0).restoreSavepoint(savepoint->canvas);
-	m_layerlist->setLayers(savepoint->layermodel);
+	callInGuiThread([this, savepoint]() { m_layerlist->setLayers(savepoint->layermodel); });
+	m_replayCost = savepoint->replayCost;
 
 	// Reverting a savepoint destroys all newer savepoints
 	while(m_savepoints.last() != savepoint)
@@ -1045,6 +1851,11 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 				handleCommand(msg, true, pos);
 		}
 	}
+
+	const qint64 elapsed = timer.elapsed();
+	m_lastReplayDuration.store(elapsed);
+	if(elapsed > 100)
+		qDebug("Replay from savepoint at %d took %lld ms", savepoint->streampointer, elapsed);
 }
 
 void StateTracker::handleTruncateHistory()
@@ -1068,30 +1879,44 @@ void StateTracker::handleTruncateHistory()
 
 void StateTracker::handleAnnotationCreate(const protocol::AnnotationCreate &cmd)
 {
-	m_layerstack->annotations()->addAnnotation(cmd.id(), QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h()));
+	const uint16_t id = cmd.id();
+	const QRect rect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+	m_layerstack->editAnnotations([id, rect](paintcore::AnnotationModel *am) {
+		am->addAnnotation(id, rect);
+	});
+
 	if(cmd.contextId() == localId())
 		emit myAnnotationCreated(cmd.id());
 }
 
 void StateTracker::handleAnnotationReshape(const protocol::AnnotationReshape &cmd)
 {
-	m_layerstack->annotations()->reshapeAnnotation(cmd.id(), QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h()));
+	const uint16_t id = cmd.id();
+	const QRect rect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+	m_layerstack->editAnnotations([id, rect](paintcore::AnnotationModel *am) {
+		am->reshapeAnnotation(id, rect);
+	});
 }
 
 void StateTracker::handleAnnotationEdit(const protocol::AnnotationEdit &cmd)
 {
-	m_layerstack->annotations()->changeAnnotation(
-		cmd.id(),
-		cmd.text(),
-		cmd.flags() & protocol::AnnotationEdit::FLAG_PROTECT,
-		cmd.flags() & (protocol::AnnotationEdit::FLAG_VALIGN_BOTTOM|protocol::AnnotationEdit::FLAG_VALIGN_CENTER),
-		QColor::fromRgba(cmd.bg())
-		);
+	const uint16_t id = cmd.id();
+	const QString text = cmd.text();
+	const bool protect = cmd.flags() & protocol::AnnotationEdit::FLAG_PROTECT;
+	const int valign = cmd.flags() & (protocol::AnnotationEdit::FLAG_VALIGN_BOTTOM|protocol::AnnotationEdit::FLAG_VALIGN_CENTER);
+	const QColor bg = QColor::fromRgba(cmd.bg());
+
+	m_layerstack->editAnnotations([=](paintcore::AnnotationModel *am) {
+		am->changeAnnotation(id, text, protect, valign, bg);
+	});
 }
 
 void StateTracker::handleAnnotationDelete(const protocol::AnnotationDelete &cmd)
 {
-	m_layerstack->annotations()->deleteAnnotation(cmd.id());
+	const uint16_t id = cmd.id();
+	m_layerstack->editAnnotations([id](paintcore::AnnotationModel *am) {
+		am->deleteAnnotation(id);
+	});
 }
 
 /**
@@ -25,6 +25,10 @@
 
 #include <QObject>
 #include <QExplicitlySharedDataPointer>
+#include <QMutex>
+#include <QAtomicInteger>
+
+#include <functional>
 
 namespace protocol {
 	class CanvasResize;
@@ -89,6 +93,9 @@ public:
 	//! Get this snapshot's timestamp
 	qint64 timestamp() const;
 
+	//! Get the position in the session history this snapshot was made at
+	int streamPointer() const;
+
 	//! Get the canvas snapshot
 	paintcore::Savepoint canvas() const;
 
@@ -137,6 +144,11 @@ class LayerListModel;
  * 
  * The state tracker object keeps track of each drawing context and performs
  * the drawing using the paint engine.
+ *
+ * The state tracker can be moved to a paint thread of its own. In that case,
+ * the public functions can still be called from the GUI thread: the calls are
+ * queued and executed in order in the paint thread. The layer list model and
+ * annotations are updated in the GUI thread.
  */
 class StateTracker : public QObject {
 	Q_OBJECT
@@ -152,25 +164,25 @@ public:
 	void endRemoteContexts();
 	void endPlayback();
 
-	//! Reset the entire history
+	//! Reset the canvas and the entire history
 	void reset();
 
 	/**
 	 * @brief Set if all user markers (own included) should be shown
 	 * @param showall
 	 */
-	void setShowAllUserMarkers(bool showall) { _showallmarkers = showall; }
+	void setShowAllUserMarkers(bool showall) { _showallmarkers.storeRelease(showall); }
 
 	/**
 	 * @brief Get the local user's ID
 	 * @return
 	 */
-	uint8_t localId() const { return m_myId; }
+	uint8_t localId() const { return uint8_t(m_myId.loadAcquire()); }
 
 	/**
 	 * @brief Set the local user's ID
 	 */
-	void setLocalId(uint8_t id) { m_myId = id; }
+	void setLocalId(uint8_t id) { m_myId.storeRelease(id); }
 
 	/**
 	 * @brief Get the paint canvas
@@ -182,7 +194,7 @@ public:
 	LayerListModel *layerList() const { return m_layerlist; }
 
 	//! Has the local user participated in the session yet?
-	bool hasParticipated() const { return m_hasParticipated; }
+	bool hasParticipated() const { return m_hasParticipated.loadAcquire(); }
 
 	StateTracker &operator=(const StateTracker&) = delete;
 
@@ -205,7 +217,48 @@ public:
 	void resetToSavepoint(StateSavepoint sp);
 
 	//! Get all existing reset points (savepoints set aside for session resetting use)
-	QList<StateSavepoint> getResetPoints() const { return m_resetpoints; }
+	QList<StateSavepoint> getResetPoints() const;
+
+	/**
+	 * @brief Get the time (in milliseconds) the last undo or rollback took
+	 *
+	 * This is the time spent reverting to a savepoint and replaying the
+	 * history after it. It can be called from any thread.
+	 */
+	qint64 lastReplayDuration() const;
+
+	/**
+	 * @brief Enable or disable tile scoped replays
+	 *
+	 * When disabled, undo and rollback always revert the whole canvas to
+	 * a savepoint. Both must give the same result, so this is mainly useful for testing.
+	 */
+	void setScopedReplayEnabled(bool enabled);
+
+	/**
+	 * @brief Enable or disable fast catchup
+	 *
+	 * When enabled, the history received during the initial catchup is
+	 * executed in one go once it has all arrived. This blocks the thread
+	 * for the duration, so it should only be enabled when running in
+	 * a paint thread of its own.
+	 */
+	void setFastCatchupEnabled(bool enabled);
+
+	/**
+	 * @brief Set how much memory the undo savepoints may hold on to
+	 *
+	 * Only the tiles each savepoint alone has are counted. When the budget
+	 * is exceeded, savepoints are removed, down to a minimum of five.
+	 * The default is 512 MB.
+	 */
+	void setSavepointMemoryBudget(qint64 bytes);
+
+	//! Get the session history (only safe to use from the state tracker's own thread)
+	const History &history() const { return m_history; }
+
+	//! Get the current savepoints (only safe to use from the state tracker's own thread)
+	const QList<StateSavepoint> &savepoints() const { return m_savepoints; }
 
 signals:
 	void myAnnotationCreated(int id);
@@ -217,7 +270,17 @@ signals:
 	void catchupProgress(int percent);
 	void sequencePoint(int);
 
-	void softResetPoint();
+	/**
+	 * @brief A soft reset point was reached
+	 *
+	 * The savepoint holds the canvas exactly as it was at the reset point,
+	 * so a snapshot can be made from it even after later messages have
+	 * been applied.
+	 */
+	void softResetPoint(const canvas::StateSavepoint &savepoint);
+
+	// Internal signals for calling functions in the GUI thread
+	void guiCallsQueued(QPrivateSignal);
 
 public slots:
 	void previewLayerOpacity(int id, float opacity);
@@ -232,13 +295,19 @@ public slots:
 	 * Not setting this flag doesn't break anything, but may cause
 	 * unnecessary rollbacks if a conflict occurs during local drawing.
 	 */
-	void setLocalDrawingInProgress(bool pendown) { m_localPenDown = pendown; }
+	void setLocalDrawingInProgress(bool pendown) { m_localPenDown.storeRelease(pendown); }
 
 private slots:
 	void processQueuedCommands();
+	void processPaintThreadQueue();
 
 private:
+	bool callInOwnThread(std::function<void()> fn);
+	void callInGuiThread(std::function<void()> fn);
+	void runGuiCalls();
+
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
+	void finishCatchup();
 
 	AffectedArea affectedArea(const protocol::MessagePtr msg) const;
 
@@ -264,8 +333,14 @@ private:
 	// Undo/redo
 	void handleUndoPoint(const protocol::UndoPoint &cmd, bool replay, int pos);
 	void handleUndo(protocol::Undo &cmd);
+	int markUnreachableUndos(uint8_t contextId, int pos);
+	void releaseSavepoints(int oldestReachable);
+	int findUndoStart(const protocol::Undo &cmd) const;
+	protocol::MessageList markUndone(uint8_t contextId, int pos, bool redo);
 	void makeSavepoint(int pos);
-	void revertSavepointAndReplay(const StateSavepoint savepoint);
+	void thinSavepoints();
+	void revertSavepointAndReplay(const StateSavepoint savepoint, const protocol::MessageList &changed=protocol::MessageList());
+	bool scopedRevertAndReplay(const StateSavepoint &savepoint, const protocol::MessageList &changed);
 	void handleTruncateHistory();
 
 	// Annotation related commands
@@ -278,7 +353,8 @@ private:
 	LayerListModel *m_layerlist;
 
 	QString _title;
-	uint8_t m_myId;
+	// These are set and read from both the GUI and the paint thread
+	QAtomicInt m_myId;
 	int m_myLastLayer;
 
 	History m_history;
@@ -287,15 +363,38 @@ private:
 
 	LocalFork m_localfork;
 
-	bool _showallmarkers;
-	bool m_hasParticipated;
-	bool m_localPenDown;
+	QAtomicInt _showallmarkers;
+	QAtomicInt m_hasParticipated;
+	QAtomicInt m_localPenDown;
 
 	protocol::MessageList m_msgqueue;
 	QTimer *m_queuetimer;
 	bool m_isQueued;
+	bool m_scopedReplay;
+
+	// Messages received during the initial catchup are collected here
+	// and executed in one go once the whole history has been received.
+	bool m_fastCatchup;
+	bool m_catchingUp;
+	protocol::MessageList m_catchupBuffer;
+
+	// Total time (in microseconds) spent executing the commands currently on the canvas.
+	// The difference between two savepoints is the time it takes to replay between them.
+	qint64 m_replayCost;
+	QAtomicInteger<qint64> m_lastReplayDuration;
+	qint64 m_savepointMemoryBudget;
+
+	QMutex m_paintQueueLock;
+	QList<std::function<void()>> m_paintqueue;
+
+	QMutex m_guiCallLock;
+	QList<std::function<void()>> m_guicalls;
+
+	mutable QMutex m_resetpointLock;
 };
 
 }
 
+Q_DECLARE_METATYPE(canvas::StateSavepoint)
+
 #endif
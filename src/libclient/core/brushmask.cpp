@@ -29,15 +29,16 @@ static const int LUT_RADIUS = 128;
 
 static BrushMask makeColorSamplingStamp(int radius)
 {
-	static QVector<uchar> lut;
-	if(lut.isEmpty()) {
+	// (initialized just once, even when called from several threads)
+	static const QVector<uchar> lut = []() {
 		// Generate a lookup table for a Gimp style exponential brush shape
 		const qreal hardness = 0.5;
 		const qreal exponent = 0.4 / (1.0 - hardness);
-		lut.resize(square(LUT_RADIUS));
-		for(int i=0;i<lut.size();++i)
-			lut[i] = 255 * (1-pow(pow(sqrt(i)/LUT_RADIUS, exponent), 2));
-	}
+		QVector<uchar> l(square(LUT_RADIUS));
+		for(int i=0;i<l.size();++i)
+			l[i] = 255 * (1-pow(pow(sqrt(i)/LUT_RADIUS, exponent), 2));
+		return l;
+	}();
 
 	const int diameter = radius*2;
 	const float lut_scale = square((LUT_RADIUS-1) / double(radius));
@@ -61,7 +62,8 @@ BrushStamp makeColorSamplingStamp(int radius, const QPoint &point)
 	Q_ASSERT(radius>0);
 
 	// Sampling mask doesn't change size very often
-	static BrushMask mask;
+	// (cached per thread, since the paint engine may have a thread of its own)
+	static thread_local BrushMask mask;
 	if(mask.diameter() != radius*2)
 		mask = makeColorSamplingStamp(radius);
 
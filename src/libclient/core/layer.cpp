@@ -30,8 +30,7 @@
 #include <QPainter>
 #include <QImage>
 #include <QDataStream>
-
-#define OBSERVERS(notification) for(auto *observer : owner->observers()) observer->notification
+#include <QHash>
 
 namespace paintcore {
 
@@ -115,7 +114,7 @@ Layer::Layer(int id, const QString& title, const QColor& color, const QSize& siz
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	m_tiles = QVector<Tile>(
+	m_tiles = TileMap(
 		m_xtiles * m_ytiles,
 		color.alpha() > 0 ? Tile(color) : Tile()
 	);
@@ -138,8 +137,13 @@ Layer::Layer(const QVector<Tile> &tiles, const QSize &size, const LayerInfo &inf
 {
 	if(m_xtiles * m_ytiles != m_tiles.size()) {
 		qWarning("Layer constructor: tile vector size mismatch!");
-		m_tiles.resize(m_xtiles * m_ytiles);
+		QVector<Tile> resized = tiles;
+		resized.resize(m_xtiles * m_ytiles);
+		m_tiles = TileMap(resized);
 	}
+
+	for(Layer *sl : m_sublayers)
+		sl->m_parent = this;
 }
 
 Layer::Layer(const Layer &layer)
@@ -152,8 +156,11 @@ Layer::Layer(const Layer &layer)
 	// Hidden sublayers are deleted layers, kept around only as a performance
 	// optimization. No need to copy them.
 	for(const Layer *sl : layer.sublayers()) {
-		if(!sl->isHidden())
-			m_sublayers.append(new Layer(*sl));
+		if(!sl->isHidden()) {
+			Layer *copy = new Layer(*sl);
+			copy->m_parent = this;
+			m_sublayers.append(copy);
+		}
 	}
 }
 
@@ -167,7 +174,7 @@ QImage Layer::toImage() const {
 	int i=0;
 	for(int y=0;y<m_ytiles;++y) {
 		for(int x=0;x<m_xtiles;++x,++i)
-			m_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
+			m_tiles.at(i).copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
 	}
 	return image;
 }
@@ -178,19 +185,18 @@ QImage Layer::toCroppedImage(int *xOffset, int *yOffset) const
 	int left=m_xtiles, right=0;
 
 	// Find bounding rectangle of non-blank tiles
-	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x) {
-			const Tile &t = m_tiles.at(y*m_xtiles + x);
-			if(!t.isBlank()) {
-				if(x<left)
-					left=x;
-				if(x>right)
-					right=x;
-				if(y<top)
-					top=y;
-				if(y>bottom)
-					bottom=y;
-			}
+	for(const int i : m_tiles.nonNullIndices()) {
+		if(!m_tiles.at(i).isBlank()) {
+			const int x = i % m_xtiles;
+			const int y = i / m_xtiles;
+			if(x<left)
+				left=x;
+			if(x>right)
+				right=x;
+			if(y<top)
+				top=y;
+			if(y>bottom)
+				bottom=y;
 		}
 	}
 
@@ -407,10 +413,7 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 void Layer::optimize()
 {
 	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
-	}
+	m_tiles.optimize();
 
 	// Delete unused sublayers
 	QMutableListIterator<Layer*> li(m_sublayers);
@@ -459,6 +462,7 @@ Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 	Layer *sl = new Layer(id, QSize(m_width, m_height));
 	sl->m_info.opacity = opacity;
 	sl->m_info.blend = blendmode;
+	sl->m_parent = this;
 	m_sublayers.append(sl);
 	return sl;
 }
@@ -489,17 +493,11 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
+	TileMap tiles(xtiles * ytiles);
 
 	// if there is no old content, resizing is simple
-	bool hascontent = false;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isBlank()) {
-			hascontent = true;
-			break;
-		}
-	}
-	if(!hascontent) {
+	// (the layer was just optimized, so blank tiles are null)
+	if(d->m_tiles.fillTile().isNull() && d->m_tiles.nonNullIndices().isEmpty()) {
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
@@ -558,6 +556,8 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		const int firstrow = Tile::roundTiles(-top);
 		const int firstcol = Tile::roundTiles(-left);
 
+		tiles.fill(bgtile);
+
 		int oldy = firstrow;
 		for(int y=0;y<ytiles;++y,++oldy) {
 			int oldx = firstcol;
@@ -566,13 +566,8 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 			for(int x=0;x<xtiles;++x,++oldx) {
 				const int i = yy + x;
 
-				if(oldy<0 || oldy>=d->m_ytiles || oldx<0 || oldx>=d->m_xtiles) {
-					tiles[i] = bgtile;
-
-				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = d->m_tiles.at(oldi);
-				}
+				if(oldy>=0 && oldy<d->m_ytiles && oldx>=0 && oldx<d->m_xtiles)
+					tiles.set(i, d->m_tiles.at(oldyy + oldx));
 			}
 		}
 
@@ -679,7 +674,7 @@ void EditableLayer::putImage(int x, int y, QImage image, BlendMode::Mode mode)
 	}
 
 	if(owner && d->isVisible())
-		OBSERVERS(markDirty(QRect(x, y, image.width(), image.height())));
+		owner->markDirty(d, QRect(x, y, image.width(), image.height()));
 }
 
 void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int sublayer)
@@ -698,9 +693,9 @@ void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int
 	int i=row*d->m_xtiles+col;
 	const int end = qMin(i+repeat, d->m_tiles.size()-1);
 	for(;i<=end;++i) {
-		d->m_tiles[i] = tile;
+		d->m_tiles.set(i, tile);
 		if(owner && d->isVisible())
-			OBSERVERS(markDirty(i));
+			owner->markDirty(d, i);
 	}
 }
 
@@ -744,7 +739,7 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 				int w = qMin((tx+1)*size, right) - tx*size - left;
 				int h = qMin((ty+1)*size, bottom) - ty*size - top;
 
-				Tile &t = d->m_tiles[ty*d->m_xtiles+tx];
+				Tile &t = d->m_tiles.ref(ty*d->m_xtiles+tx);
 				t.setLastEditedBy(contextId);
 
 				if(!t.isNull() || canIncrOpacity)
@@ -754,7 +749,7 @@ void EditableLayer::fillRect(const QRect &rectangle, const QColor &color, BlendM
 	}
 
 	if(owner && d->isVisible())
-		OBSERVERS(markDirty(rectangle));
+		owner->markDirty(d, rectangle);
 }
 
 void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode)
@@ -786,8 +781,8 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 			const int xindex = x / Tile::SIZE;
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
-			const int i = d->m_xtiles * yindex + xindex;
-			d->m_tiles[i].composite(
+			Tile &t = d->m_tiles.ref(d->m_xtiles * yindex + xindex);
+			t.composite(
 					blendmode,
 					values + yb * dia + xb,
 					color,
@@ -795,7 +790,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 					wb, hb,
 					dia-wb
 					);
-			d->m_tiles[i].setLastEditedBy(contextId);
+			t.setLastEditedBy(contextId);
 
 			x = (xindex+1) * Tile::SIZE;
 			xb = xb + wb;
@@ -805,7 +800,118 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 	}
 
 	if(owner && d->isVisible())
-		OBSERVERS(markDirty(QRect(left, top, right-left, bottom-top)));
+		owner->markDirty(d, QRect(left, top, right-left, bottom-top));
+}
+
+namespace {
+struct TileDabs {
+	int index;
+	int x, y;
+	QVector<int> stamps;
+	Tile *tile;
+};
+}
+
+/**
+ * @brief Dab a sequence of brush stamps
+ *
+ * The result is identical to calling putBrushStamp for each stamp in order,
+ * but the stamps are first sorted by the tile they touch. Each tile's stamps
+ * are then composited in their original order, and separate tiles are
+ * processed in parallel.
+ */
+void EditableLayer::putBrushStamps(const QVector<BrushStamp> &stamps, const QColor &color, BlendMode::Mode blendmode)
+{
+	Q_ASSERT(d);
+
+	// Not worth the threading overhead for short strokes
+	static const int MIN_CONCURRENT_AREA = 64 * 64 * 4;
+
+	int area = 0;
+	for(const BrushStamp &bs : stamps)
+		area += bs.mask.diameter() * bs.mask.diameter();
+
+	if(stamps.size() < 2 || area < MIN_CONCURRENT_AREA) {
+		for(const BrushStamp &bs : stamps)
+			putBrushStamp(bs, color, blendmode);
+		return;
+	}
+
+	// Gather the list of stamps touching each tile
+	QHash<int, TileDabs*> tileMap;
+	QList<TileDabs*> tiles;
+
+	for(int i=0;i<stamps.size();++i) {
+		const BrushStamp &bs = stamps.at(i);
+		const int dia = bs.mask.diameter();
+
+		if(bs.left+dia<=0 || bs.top+dia<=0 || bs.left>=d->m_width || bs.top>=d->m_height)
+			continue;
+
+		const int tx0 = qMax(0, bs.left) / Tile::SIZE;
+		const int tx1 = (qMin(bs.left + dia, d->m_width) - 1) / Tile::SIZE;
+		const int ty0 = qMax(0, bs.top) / Tile::SIZE;
+		const int ty1 = (qMin(bs.top + dia, d->m_height) - 1) / Tile::SIZE;
+
+		for(int ty=ty0;ty<=ty1;++ty) {
+			for(int tx=tx0;tx<=tx1;++tx) {
+				const int index = ty * d->m_xtiles + tx;
+				TileDabs *td = tileMap.value(index);
+				if(!td) {
+					td = new TileDabs { index, tx, ty, QVector<int>(), nullptr };
+					tileMap[index] = td;
+					tiles << td;
+				}
+				td->stamps << i;
+			}
+		}
+	}
+
+	// Make sure all the touched tiles exist before starting the threads,
+	// as the tile map must not be modified concurrently
+	for(const TileDabs *td : tiles)
+		d->m_tiles.ref(td->index);
+	for(TileDabs *td : tiles)
+		td->tile = &d->m_tiles.ref(td->index);
+
+	const int width = d->m_width;
+	const int height = d->m_height;
+	const int ctxId = contextId;
+
+	concurrentForEach<TileDabs*>(tiles, [&stamps, &color, blendmode, width, height, ctxId](TileDabs *td) {
+		Tile &tile = *td->tile;
+		const int tileLeft = td->x * Tile::SIZE;
+		const int tileTop = td->y * Tile::SIZE;
+		const int tileRight = qMin(tileLeft + Tile::SIZE, width);
+		const int tileBottom = qMin(tileTop + Tile::SIZE, height);
+
+		for(const int i : td->stamps) {
+			const BrushStamp &bs = stamps.at(i);
+			const int dia = bs.mask.diameter();
+
+			const int x0 = qMax(bs.left, tileLeft);
+			const int y0 = qMax(bs.top, tileTop);
+			const int x1 = qMin(bs.left + dia, tileRight);
+			const int y1 = qMin(bs.top + dia, tileBottom);
+
+			tile.composite(
+				blendmode,
+				bs.mask.data() + (y0 - bs.top) * dia + (x0 - bs.left),
+				color,
+				x0 - tileLeft, y0 - tileTop,
+				x1 - x0, y1 - y0,
+				dia - (x1 - x0)
+				);
+		}
+		tile.setLastEditedBy(ctxId);
+	});
+
+	if(owner && d->isVisible()) {
+		for(const TileDabs *td : tiles)
+			owner->markDirty(d, td->index);
+	}
+
+	qDeleteAll(tiles);
 }
 
 /**
@@ -822,20 +928,23 @@ void EditableLayer::merge(const Layer *layer)
 	Q_ASSERT(layer->m_xtiles == d->m_xtiles);
 	Q_ASSERT(layer->m_ytiles == d->m_ytiles);
 
-	// Gather a list of non-null source tiles to merge
-	QList<int> mergeidx;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!layer->m_tiles.at(i).isNull())
-			mergeidx.append(i);
-	}
+	// Gather a list of non-null source tiles to merge.
+	// The destination tiles are created here, since the tile map
+	// must not be modified concurrently.
+	const QVector<int> mergeidx = layer->m_tiles.nonNullIndices();
+	for(const int idx : mergeidx)
+		d->m_tiles.ref(idx);
 
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
-	d->m_tiles.detach();
+	QList<QPair<Tile*, const Tile*>> merges;
+	merges.reserve(mergeidx.size());
+	for(const int idx : mergeidx)
+		merges << qMakePair(&d->m_tiles.ref(idx), &layer->m_tiles.at(idx));
 
 	// Merge tiles
-	concurrentForEach<int>(mergeidx, [this, layer](int idx) {
-		d->m_tiles[idx].merge(layer->m_tiles.at(idx), layer->opacity(), layer->blendmode());
+	const uchar opacity = layer->opacity();
+	const BlendMode::Mode blendmode = layer->blendmode();
+	concurrentForEach<QPair<Tile*, const Tile*>>(merges, [opacity, blendmode](QPair<Tile*, const Tile*> m) {
+		m.first->merge(*m.second, opacity, blendmode);
 	});
 
 	// Merging a layer does not cause an immediate visual change, so we don't
@@ -848,7 +957,7 @@ void EditableLayer::makeBlank()
 	d->m_tiles.fill(Tile());
 
 	if(owner && d->isVisible())
-		OBSERVERS(markDirty());
+		owner->markDirty(d);
 }
 
 /**
@@ -920,10 +1029,8 @@ void EditableLayer::markOpaqueDirty(bool forceVisible)
 	if(!owner || !(forceVisible || d->isVisible()))
 		return;
 
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isNull())
-			OBSERVERS(markDirty(i));
-	}
+	for(const int i : d->m_tiles.nonNullIndices())
+		owner->markDirty(d, i);
 }
 
 }
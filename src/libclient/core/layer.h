@@ -19,7 +19,7 @@
 #ifndef PAINTCORE_LAYER_H
 #define PAINTCORE_LAYER_H
 
-#include "tile.h"
+#include "tilemap.h"
 
 #include <QVector>
 #include <QColor>
@@ -167,15 +167,18 @@ public:
 	const Tile &tile(int x, int y) const {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles.at(y*m_xtiles+x);
 	}
 
 	//! Get a tile
-	const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
+	const Tile &tile(int index) const { return m_tiles.at(index); }
 
 	//! Get the sublayers
 	const QList<Layer*> &sublayers() const { return m_sublayers; }
 
+	//! Get the layer this is a sublayer of (null for top level layers)
+	const Layer *parentLayer() const { return m_parent; }
+
 	//! Does this layer have any visible sublayers?
 	bool hasSublayers() const {
 		for(const Layer *l : m_sublayers)
@@ -197,8 +200,19 @@ public:
 	 */
 	const LayerInfo &info() const { return m_info; }
 
-	//! Get this layer's tile vector
-	const QVector<Tile> tiles() const { return m_tiles; }
+	//! Get this layer's tiles as a dense vector
+	const QVector<Tile> tiles() const { return m_tiles.toVector(); }
+
+	//! Get the indices of all non-null tiles
+	QVector<int> nonNullTiles() const { return m_tiles.nonNullIndices(); }
+
+	/**
+	 * @brief Get the indices of tiles that differ from the other layer's tiles
+	 *
+	 * This is an identity comparison, like Tile::operator==. Both layers
+	 * should be the same size.
+	 */
+	QVector<int> differingTiles(const Layer *other) const { return m_tiles.differingIndices(other->m_tiles); }
 
 	/**
 	 * @brief Get the layer's change bounds
@@ -229,15 +243,16 @@ private:
 	Tile &rtile(int x, int y) {
 		Q_ASSERT(x>=0 && x<m_xtiles);
 		Q_ASSERT(y>=0 && y<m_ytiles);
-		return m_tiles[y*m_xtiles+x];
+		return m_tiles.ref(y*m_xtiles+x);
 	}
 
 
 	LayerInfo m_info;
 	QRect m_changeBounds;
 
-	QVector<Tile> m_tiles;
+	TileMap m_tiles;
 	QList<Layer*> m_sublayers;
+	Layer *m_parent = nullptr;
 
 	int m_width;
 	int m_height;
@@ -298,13 +313,16 @@ public:
 	//! Dab a brush
 	void putBrushStamp(const BrushStamp &bs, const QColor &color, BlendMode::Mode blendmode);
 
+	//! Dab a sequence of brush stamps, using multiple threads when worthwhile
+	void putBrushStamps(const QVector<BrushStamp> &stamps, const QColor &color, BlendMode::Mode blendmode);
+
 	//! Fill a rectangle
 	void fillRect(const QRect &rect, const QColor &color, BlendMode::Mode blendmode);
 
 	//! Get a reference to a tile
 	Tile &rtile(int x, int y) { Q_ASSERT(d); return d->rtile(x, y); }
 
-	Tile &rtile(int index) { return d->m_tiles[index]; }
+	Tile &rtile(int index) { return d->m_tiles.ref(index); }
 
 	//! Merge a sublayer with this layer
 	void mergeSublayer(int id);
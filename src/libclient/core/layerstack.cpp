@@ -27,6 +27,7 @@
 #include <QPainter>
 #include <QMimeData>
 #include <QDataStream>
+#include <QThread>
 
 namespace paintcore {
 
@@ -35,12 +36,22 @@ static const Tile ZEBRA_TILE = Tile::ZebraBlock(Qt::red, Qt::black, 2);
 
 static const int MAX_SIZE = 32767;
 
+// Maximum number of cached flattened tiles (4096 tiles is 64 megabytes)
+static const int FLAT_TILE_CACHE_SIZE = 4096;
+
+// Maximum number of base tiles to cache flattened tiles for
+static const int FLAT_TILE_MAX_BASES = 4;
+
 LayerStack::LayerStack(QObject *parent)
 	: QObject(parent), m_width(0), m_height(0), m_xtiles(0), m_ytiles(0), m_dpix(0), m_dpiy(0),
 	m_viewmode(NORMAL), m_viewlayeridx(0), m_highlightId(0),
-	m_onionskinsBelow(4), m_onionskinsAbove(4), m_openEditors(0), m_onionskinTint(true), m_censorLayers(false)
+	m_onionskinsBelow(4), m_onionskinsAbove(4), m_openEditors(0), m_observersSuspended(false), m_onionskinTint(true), m_censorLayers(false),
+	m_lastDirtyIndex(0), m_flatTiles(FLAT_TILE_CACHE_SIZE)
 {
 	m_annotations = new AnnotationModel(this);
+	m_annotationState = new AnnotationModel(this);
+
+	connect(this, &LayerStack::annotationEditsQueued, this, &LayerStack::runQueuedAnnotationEdits, Qt::QueuedConnection);
 }
 
 LayerStack::LayerStack(const LayerStack *orig, QObject *parent)
@@ -56,13 +67,21 @@ LayerStack::LayerStack(const LayerStack *orig, QObject *parent)
 	  m_highlightId(orig->m_highlightId),
 	  m_onionskinsBelow(orig->m_onionskinsBelow),
 	  m_openEditors(0),
+	  m_observersSuspended(false),
 	  m_onionskinTint(orig->m_onionskinTint),
-	  m_censorLayers(orig->m_censorLayers)
+	  m_censorLayers(orig->m_censorLayers),
+	  m_lastDirtyIndex(0),
+	  m_flatTiles(FLAT_TILE_CACHE_SIZE)
 {
+	QMutexLocker lock(&orig->m_mutex);
+
 	m_annotations = orig->m_annotations->clone(this);
+	m_annotationState = m_annotations->clone(this);
 	m_backgroundTile = orig->m_backgroundTile;
 	for(const Layer *l : orig->m_layers)
 		m_layers << new Layer(*l);
+
+	connect(this, &LayerStack::annotationEditsQueued, this, &LayerStack::runQueuedAnnotationEdits, Qt::QueuedConnection);
 }
 
 LayerStack::~LayerStack()
@@ -76,6 +95,7 @@ LayerStack::~LayerStack()
 
 QPair<int,QRect> LayerStack::findChangeBounds(int contextId)
 {
+	QMutexLocker lock(&m_mutex);
 	for(const Layer *l : m_layers) {
 		const QRect r = l->changeBounds(contextId);
 		if(!r.isNull())
@@ -114,13 +134,89 @@ int LayerStack::indexOf(int id) const
 
 Tile LayerStack::getFlatTile(int x, int y) const
 {
-	Tile t = m_backgroundTile;
-	flattenTile(t.data(), x, y);
-	return t;
+	QMutexLocker lock(&m_mutex);
+	return cachedFlatTile(m_backgroundTile, x, y);
+}
+
+/**
+ * @brief Get a flattened tile, using the cache when possible
+ *
+ * If the cached tile is stale, but a partial composite of the layers
+ * below the edited layer is still valid, only the layers above it are
+ * composited again.
+ *
+ * This may be called from multiple threads at once, but the
+ * layer stack lock must be held.
+ *
+ * @param base the tile onto which the layers are composited
+ */
+Tile LayerStack::cachedFlatTile(const Tile &base, int xindex, int yindex) const
+{
+	const FlatTileKey key { base, yindex * m_xtiles + xindex };
+
+	int split = 0;
+	Tile below;
+	{
+		QMutexLocker lock(&m_flatTileLock);
+		useFlatBase(base);
+		const FlatTile *ft = m_flatTiles.object(key);
+		if(ft) {
+			if(!ft->flat.isNull())
+				return ft->flat;
+			if(ft->belowLayer < m_layers.size()) {
+				split = ft->belowLayer;
+				below = ft->below;
+			}
+		}
+	}
+
+	Tile flat;
+	if(!below.isNull()) {
+		flat = below;
+		flattenTile(flat.data(), xindex, yindex, split);
+
+	} else if(split > 0) {
+		flat = base;
+		flattenTile(flat.data(), xindex, yindex, 0, split);
+		below = flat;
+		flattenTile(flat.data(), xindex, yindex, split);
+
+	} else {
+		flat = base;
+		flattenTile(flat.data(), xindex, yindex);
+	}
+
+	QMutexLocker lock(&m_flatTileLock);
+	m_flatTiles.insert(key, new FlatTile { below, flat, below.isNull() ? 0 : split }, below.isNull() ? 1 : 2);
+
+	return flat;
+}
+
+/**
+ * @brief Start caching flattened tiles for the given base tile
+ *
+ * When there are too many bases in use, the tiles of the least recently
+ * added one are dropped. The flat tile lock must be held.
+ */
+void LayerStack::useFlatBase(const Tile &base) const
+{
+	if(m_flatBases.contains(base))
+		return;
+
+	if(m_flatBases.size() >= FLAT_TILE_MAX_BASES) {
+		const Tile dropped = m_flatBases.takeFirst();
+		for(const FlatTileKey &key : m_flatTiles.keys()) {
+			if(key.base == dropped)
+				m_flatTiles.remove(key);
+		}
+	}
+
+	m_flatBases.append(base);
 }
 
 const Layer *LayerStack::layerAt(int x, int y) const
 {
+	QMutexLocker lock(&m_mutex);
 	for(int i=m_layers.size()-1;i>=0;--i) {
 		const Layer * l = m_layers.at(i);
 		if(l->isVisible()) {
@@ -139,6 +235,7 @@ const Layer *LayerStack::layerAt(int x, int y) const
 
 QColor LayerStack::colorAt(int x, int y, int dia) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(m_layers.isEmpty())
 		return QColor();
 
@@ -175,6 +272,7 @@ QColor LayerStack::colorAt(int x, int y, int dia) const
 
 int LayerStack::tileLastEditedBy(int tx, int ty) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(tx < 0 || ty < 0 || tx >= m_xtiles || ty >= m_ytiles)
 		return 0;
 
@@ -191,6 +289,7 @@ int LayerStack::tileLastEditedBy(int tx, int ty) const
 
 QImage LayerStack::toFlatImage(bool includeAnnotations, bool includeBackground, bool includeSublayers) const
 {
+	QMutexLocker lock(&m_mutex);
 	if(m_layers.isEmpty())
 		return QImage();
 
@@ -232,6 +331,7 @@ QImage LayerStack::toFlatImage(bool includeAnnotations, bool includeBackground,
 
 QImage LayerStack::flatLayerImage(int layerIdx) const
 {
+	QMutexLocker lock(&m_mutex);
 	Q_ASSERT(layerIdx>=0 && layerIdx < m_layers.size());
 
 	Layer flat(0, QString(), Qt::transparent, size());
@@ -254,11 +354,14 @@ QImage LayerStack::flatLayerImage(int layerIdx) const
 }
 
 // Flatten a single tile
-void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
+void LayerStack::flattenTile(quint32 *data, int xindex, int yindex, int firstLayer, int lastLayer) const
 {
+	if(lastLayer < 0)
+		lastLayer = m_layers.size();
+
 	// Composite visible layers
-	int layeridx = 0;
-	for(const Layer *l : m_layers) {
+	for(int layeridx=firstLayer;layeridx<lastLayer;++layeridx) {
+		const Layer *l = m_layers.at(layeridx);
 		if(isVisible(layeridx)) {
 			const Tile &tile = l->tile(xindex, yindex);
 			const quint32 tint = layerTint(layeridx);
@@ -305,13 +408,114 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 						Tile::LENGTH, layerOpacity(layeridx));
 			}
 		}
+	}
+}
+
+void LayerStack::markDirty(const Layer *layer, const QRect &area)
+{
+	if(m_layers.isEmpty() || m_width<=0 || m_height<=0)
+		return;
+
+	const int layerIdx = topLevelIndexOf(layer);
+
+	const int tx0 = qBound(0, area.left() / Tile::SIZE, m_xtiles-1);
+	const int tx1 = qBound(tx0, area.right() / Tile::SIZE, m_xtiles-1);
+	const int ty0 = qBound(0, area.top() / Tile::SIZE, m_ytiles-1);
+	const int ty1 = qBound(ty0, area.bottom() / Tile::SIZE, m_ytiles-1);
+
+	for(int ty=ty0;ty<=ty1;++ty) {
+		for(int tx=tx0;tx<=tx1;++tx)
+			invalidateFlatTile(ty * m_xtiles + tx, layerIdx);
+	}
+
+	if(m_observersSuspended)
+		return;
+
+	for(auto observer : m_observers)
+		observer->markDirty(area);
+}
 
-		++layeridx;
+void LayerStack::markDirty(const Layer *layer, int index)
+{
+	invalidateFlatTile(index, topLevelIndexOf(layer));
+
+	if(m_observersSuspended)
+		return;
+
+	for(auto observer : m_observers)
+		observer->markDirty(index);
+}
+
+void LayerStack::markDirty(const Layer *layer)
+{
+	Q_UNUSED(layer);
+	clearFlatTileCache();
+
+	if(m_observersSuspended)
+		return;
+
+	for(auto observer : m_observers)
+		observer->markDirty();
+}
+
+/**
+ * @brief Invalidate a flattened tile
+ *
+ * The partial composite of the tile is kept if the change was in
+ * a layer above it. Otherwise, the next composite is split at the
+ * changed layer, so repeated changes to it (or to the layers above)
+ * need to re-blend only the layers above the split.
+ *
+ * Each tile has a split of its own, so changes to different layers
+ * in different parts of the canvas don't compete for it.
+ *
+ * @param index tile index
+ * @param layerIdx index of the changed layer (or -1 if not known)
+ */
+void LayerStack::invalidateFlatTile(int index, int layerIdx)
+{
+	QMutexLocker lock(&m_flatTileLock);
+	for(const Tile &base : m_flatBases) {
+		const FlatTileKey key { base, index };
+		FlatTile *ft = m_flatTiles.object(key);
+
+		if(layerIdx < 0)
+			m_flatTiles.remove(key);
+		else if(ft && ft->belowLayer > 0 && layerIdx >= ft->belowLayer)
+			ft->flat = Tile();
+		else
+			m_flatTiles.insert(key, new FlatTile { Tile(), Tile(), layerIdx }, 0);
 	}
 }
 
+void LayerStack::clearFlatTileCache()
+{
+	QMutexLocker lock(&m_flatTileLock);
+	m_flatTiles.clear();
+	m_flatBases.clear();
+}
+
+// Find the index of the layer, or the layer the given sublayer belongs to
+int LayerStack::topLevelIndexOf(const Layer *layer) const
+{
+	if(!layer)
+		return -1;
+
+	if(layer->parentLayer())
+		layer = layer->parentLayer();
+
+	// Consecutive changes are usually made to the same layer
+	if(m_lastDirtyIndex >= 0 && m_lastDirtyIndex < m_layers.size() && m_layers.at(m_lastDirtyIndex) == layer)
+		return m_lastDirtyIndex;
+
+	m_lastDirtyIndex = m_layers.indexOf(const_cast<Layer*>(layer));
+	return m_lastDirtyIndex;
+}
+
 void LayerStack::beginWriteSequence()
 {
+	// The lock is held until the matching endWriteSequence call
+	m_mutex.lock();
 	++m_openEditors;
 }
 
@@ -319,10 +523,70 @@ void LayerStack::endWriteSequence()
 {
 	--m_openEditors;
 	Q_ASSERT(m_openEditors>=0);
-	if(m_openEditors == 0) {
+	if(m_openEditors == 0 && !m_observersSuspended) {
 		for(auto observer : m_observers)
 			observer->canvasWriteSequenceDone();
 	}
+	m_mutex.unlock();
+}
+
+void LayerStack::beginBatch()
+{
+	QMutexLocker lock(&m_mutex);
+	++m_openEditors;
+}
+
+void LayerStack::endBatch()
+{
+	m_mutex.lock();
+	endWriteSequence();
+}
+
+void LayerStack::suspendObservers()
+{
+	QMutexLocker lock(&m_mutex);
+	Q_ASSERT(!m_observersSuspended);
+	m_observersSuspended = true;
+}
+
+void LayerStack::resumeObservers()
+{
+	QMutexLocker lock(&m_mutex);
+	Q_ASSERT(m_observersSuspended);
+	m_observersSuspended = false;
+
+	for(auto observer : m_observers) {
+		observer->markDirty();
+		if(m_openEditors == 0)
+			observer->canvasWriteSequenceDone();
+	}
+}
+
+void LayerStack::editAnnotations(std::function<void(AnnotationModel*)> fn)
+{
+	fn(m_annotationState);
+
+	if(thread() == QThread::currentThread()) {
+		fn(m_annotations);
+		return;
+	}
+
+	QMutexLocker lock(&m_annotationEditLock);
+	m_annotationEdits << fn;
+	if(m_annotationEdits.size() == 1)
+		emit annotationEditsQueued(QPrivateSignal());
+}
+
+void LayerStack::runQueuedAnnotationEdits()
+{
+	QList<std::function<void(AnnotationModel*)>> edits;
+	{
+		QMutexLocker lock(&m_annotationEditLock);
+		edits.swap(m_annotationEdits);
+	}
+
+	for(const auto &fn : edits)
+		fn(m_annotations);
 }
 
 int LayerStack::layerOpacity(int idx) const
@@ -376,13 +640,15 @@ bool LayerStack::isVisible(int idx) const
 
 Savepoint LayerStack::makeSavepoint()
 {
+	QMutexLocker lock(&m_mutex);
+
 	Savepoint sp;
 	for(Layer *l : m_layers) {
 		l->optimize();
 		sp.layers.append(new Layer(*l));
 	}
 
-	sp.annotations = m_annotations->getAnnotations();
+	sp.annotations = m_annotationState->getAnnotations();
 	sp.background = m_backgroundTile;
 
 	sp.size = size();
@@ -423,6 +689,11 @@ Savepoint::~Savepoint()
 void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 {
 	const QSize oldsize(d->m_width, d->m_height);
+
+	// Layers may be added, removed or moved around, so all the cached partial
+	// composites must go
+	d->clearFlatTileCache();
+
 	if(d->width() != savepoint.size.width() || d->height() != savepoint.size.height()) {
 		// Restore canvas size if it was different in the savepoint
 		d->m_width = savepoint.size.width();
@@ -439,8 +710,7 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 		if(savepoint.layers.size() != d->m_layers.size()) {
 			// Layers added or deleted, just refresh everything
 			// (force refresh even if layer stack is empty)
-			for(auto observer : d->m_observers)
-				observer->markDirty();
+			d->markDirty(nullptr);
 
 		} else {
 			// Layer count has not changed, compare layer contents
@@ -449,8 +719,7 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 				const Layer *l1 = savepoint.layers.at(l);
 				if(l0->effectiveOpacity() != l1->effectiveOpacity()) {
 					// Layer opacity has changed, refresh everything
-					for(auto observer : d->m_observers)
-						observer->markDirty();
+					d->markDirty(nullptr);
 					break;
 				}
 
@@ -465,8 +734,6 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 						sublayers << sl->id();
 
 				// Compare sublayers
-				const int tilecount = d->m_xtiles * d->m_ytiles;
-
 				for(int sublayerId : sublayers) {
 					const Layer *sl0 = l0->getVisibleSublayer(sublayerId);
 					const Layer *sl1 = l1->getVisibleSublayer(sublayerId);
@@ -475,15 +742,11 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 					if(sl0) {
 						if(sl1) {
 							// Visible in both, compare content
-							for(int i=0;i<tilecount;++i) {
-								// Note: An identity comparison works here, because the tiles
-								// utilize copy-on-write semantics. Unchanged tiles will share
-								// data pointers between savepoints.
-								if(sl0->tile(i) != sl1->tile(i)) {
-									for(auto observer : d->m_observers)
-										observer->markDirty(i);
-								}
-							}
+							// Note: An identity comparison works here, because the tiles
+							// utilize copy-on-write semantics. Unchanged tiles will share
+							// data pointers between savepoints.
+							for(const int i : sl0->differingTiles(sl1))
+								d->markDirty(nullptr, i);
 						} else {
 							// Not visible in sl1
 							delta = sl0;
@@ -495,24 +758,14 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 
 					if(delta) {
 						// Visible in one but not both: mark opaque areas as dirty
-						for(int i=0;i<tilecount;++i) {
-							if(!delta->tile(i).isNull())
-								for(auto observer : d->m_observers)
-									observer->markDirty(i);
-						}
+						for(const int i : delta->nonNullTiles())
+							d->markDirty(nullptr, i);
 					}
 				}
 
 				// Compare the main layer
-				for(int i=0;i<d->m_xtiles*d->m_ytiles;++i) {
-					// Note: An identity comparison works here, because the tiles
-					// utilize copy-on-write semantics. Unchanged tiles will share
-					// data pointers between savepoints.
-					if(l0->tile(i) != l1->tile(i)) {
-						for(auto observer : d->m_observers)
-							observer->markDirty(i);
-					}
-				}
+				for(const int i : l0->differingTiles(l1))
+					d->markDirty(nullptr, i);
 			}
 		}
 	}
@@ -527,7 +780,10 @@ void EditableLayerStack::restoreSavepoint(const Savepoint &savepoint)
 	setBackground(savepoint.background);
 
 	// Restore annotations
-	d->m_annotations->setAnnotations(savepoint.annotations);
+	const QList<Annotation> annotations = savepoint.annotations;
+	d->editAnnotations([annotations](AnnotationModel *am) {
+		am->setAnnotations(annotations);
+	});
 }
 
 void EditableLayerStack::resize(int top, int right, int bottom, int left)
@@ -563,11 +819,15 @@ void EditableLayerStack::resize(int top, int right, int bottom, int left)
 	if(left || top) {
 		// Update annotation positions
 		QPoint offset(left, top);
-		for(const Annotation &a : d->m_annotations->getAnnotations()) {
-			d->m_annotations->reshapeAnnotation(a.id, a.rect.translated(offset));
-		}
+		d->editAnnotations([offset](AnnotationModel *am) {
+			for(const Annotation &a : am->getAnnotations()) {
+				am->reshapeAnnotation(a.id, a.rect.translated(offset));
+			}
+		});
 	}
 
+	d->clearFlatTileCache();
+
 	for(auto observer : d->m_observers)
 		observer->canvasResized(left, top, oldsize);
 
@@ -580,6 +840,7 @@ void EditableLayerStack::setBackground(const Tile &tile)
 		return;
 
 	d->m_backgroundTile = tile;
+	d->clearFlatTileCache();
 
 	for(auto observer : d->m_observers)
 		observer->canvasBackgroundChanged(tile);
@@ -648,6 +909,7 @@ EditableLayer EditableLayerStack::createLayer(int id, int source, const QColor &
 		pos = d->m_layers.size();
 
 	d->m_layers.insert(pos, nl);
+	d->clearFlatTileCache();
 
 	// Dirty regions must be marked after the layer is in the stack
 	EditableLayer editable(nl, d, 0);
@@ -656,8 +918,7 @@ EditableLayer EditableLayerStack::createLayer(int id, int source, const QColor &
 		editable.markOpaqueDirty();
 
 	} else if(color.alpha()>0) {
-		for(auto observer : d->m_observers)
-			observer->markDirty();
+		d->markDirty(nullptr);
 	}
 
 	return editable;
@@ -673,6 +934,7 @@ bool EditableLayerStack::deleteLayer(int id)
 		if(d->m_layers.at(i)->id() == id) {
 			EditableLayer(d->m_layers.at(i), d, contextId).markOpaqueDirty();
 			delete d->m_layers.takeAt(i);
+			d->clearFlatTileCache();
 
 			return true;
 		}
@@ -701,8 +963,7 @@ void EditableLayerStack::reorderLayers(const QList<uint16_t> &neworder)
 		newstack.append(l);
 	}
 	d->m_layers = newstack;
-	for(auto observer : d->m_observers)
-		observer->markDirty();
+	d->markDirty(nullptr);
 }
 
 /**
@@ -719,9 +980,10 @@ void EditableLayerStack::mergeLayerDown(int id) {
 			break;
 		}
 	}
-	if(btm)
+	if(btm) {
 		EditableLayer(btm, d, contextId).merge(top);
-	else
+		d->clearFlatTileCache();
+	} else
 		qWarning("Tried to merge bottom-most layer");
 }
 
@@ -748,9 +1010,10 @@ void EditableLayerStack::reset()
 	for(Layer *l : d->m_layers)
 		delete l;
 	d->m_layers.clear();
-	d->m_annotations->clear();
+	d->editAnnotations([](AnnotationModel *am) { am->clear(); });
 
 	d->m_backgroundTile = Tile();
+	d->clearFlatTileCache();
 
 	for(auto *observer : d->m_observers) {
 		observer->canvasResized(0, 0, oldsize);
@@ -785,8 +1048,7 @@ void EditableLayerStack::setViewMode(LayerStack::ViewMode mode)
 {
 	if(mode != d->m_viewmode) {
 		d->m_viewmode = mode;
-		for(auto observer : d->m_observers)
-			observer->markDirty();
+		d->markDirty(nullptr);
 	}
 }
 
@@ -795,10 +1057,8 @@ void EditableLayerStack::setViewLayer(int id)
 	for(int i=0;i<d->m_layers.size();++i) {
 		if(d->m_layers.at(i)->id() == id) {
 			d->m_viewlayeridx = i;
-			if(d->m_viewmode != LayerStack::NORMAL) {
-				for(auto observer : d->m_observers)
-					observer->markDirty();
-			}
+			if(d->m_viewmode != LayerStack::NORMAL)
+				d->markDirty(nullptr);
 			break;
 		}
 	}
@@ -808,8 +1068,7 @@ void EditableLayerStack::setInspectorHighlight(int contextId)
 {
 	if(d->m_highlightId != contextId) {
 		d->m_highlightId = contextId;
-		for(auto observer : d->m_observers)
-			observer->markDirty();
+		d->markDirty(nullptr);
 	}
 }
 
@@ -819,10 +1078,8 @@ void EditableLayerStack::setOnionskinMode(int below, int above, bool tint)
 	d->m_onionskinsAbove = above;
 	d->m_onionskinTint = tint;
 
-	if(d->m_viewmode == LayerStack::ONIONSKIN) {
-		for(auto observer : d->m_observers)
-			observer->markDirty();
-	}
+	if(d->m_viewmode == LayerStack::ONIONSKIN)
+		d->markDirty(nullptr);
 }
 
 void EditableLayerStack::setCensorship(bool censor)
@@ -831,8 +1088,7 @@ void EditableLayerStack::setCensorship(bool censor)
 		d->m_censorLayers = censor;
 		// We could check if this really needs to be called, but this
 		// flag is changed very infrequently
-		for(auto observer : d->m_observers)
-			observer->markDirty();
+		d->markDirty(nullptr);
 	}
 }
 
@@ -27,6 +27,10 @@
 #include <QObject>
 #include <QList>
 #include <QImage>
+#include <QMutex>
+#include <QCache>
+
+#include <functional>
 
 class QDataStream;
 
@@ -47,6 +51,7 @@ class LayerStack : public QObject {
 	Q_PROPERTY(AnnotationModel* annotations READ annotations CONSTANT)
 	Q_OBJECT
 	friend class EditableLayerStack;
+	friend class EditableLayer;
 	friend class LayerStackObserver;
 public:
 	enum ViewMode {
@@ -120,10 +125,19 @@ public:
 	 */
 	QImage flatLayerImage(int layerIdx) const;
 
-	//! Get a merged tile
+	/**
+	 * @brief Get a merged tile
+	 *
+	 * Merged tiles are cached until the layers under them change.
+	 */
 	Tile getFlatTile(int x, int y) const;
 
-	//! Create a new savepoint
+	/**
+	 * @brief Create a new savepoint
+	 *
+	 * Annotations are included only when called from the thread this
+	 * layer stack lives in.
+	 */
 	Savepoint makeSavepoint();
 
 	//! Get the current view rendering mode
@@ -161,10 +175,67 @@ public:
 	//! Start a layer stack editing sequence
 	inline EditableLayerStack editor(int contextId);
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+	typedef QRecursiveMutex Mutex;
+#else
+	typedef QMutex Mutex;
+#endif
+
+	/**
+	 * @brief Get the layer stack lock
+	 *
+	 * When the paint engine runs in its own thread, the layer stack
+	 * is locked for the duration of each editing sequence. The public
+	 * read functions of this class take the lock themselves, but a reader
+	 * holding on to a Layer pointer must hold the lock while using it.
+	 */
+	Mutex *mutex() const { return &m_mutex; }
+
+	/**
+	 * @brief Start a batch of editing sequences
+	 *
+	 * Change notifications are held until the matching endBatch() call.
+	 * Unlike an editor, a batch does not keep the layer stack locked, so
+	 * other threads can still access it between the edits.
+	 */
+	void beginBatch();
+	void endBatch();
+
+	/**
+	 * @brief Stop sending change notifications to observers
+	 *
+	 * This is used when a large amount of history is applied at once.
+	 * Instead of tracking every change, the observers are told that the
+	 * whole canvas changed when resumeObservers() is called.
+	 * Resizes are still passed through, so the observers can safely
+	 * keep painting the canvas in the mean time.
+	 */
+	void suspendObservers();
+	void resumeObservers();
+
+	/**
+	 * @brief Modify the annotations
+	 *
+	 * The annotation model is used directly by the GUI, so it may only be touched
+	 * from the thread the layer stack lives in. When called from another thread,
+	 * the function is queued and called later in the right thread.
+	 * Queued functions are called in the order they were queued.
+	 *
+	 * The function is also applied right away to a copy of the annotations
+	 * that savepoints are made from, so making one never has to wait for the GUI.
+	 */
+	void editAnnotations(std::function<void(AnnotationModel*)> fn);
+
 signals:
 	//! Canvas width/height changed
 	void resized(int xoffset, int yoffset, const QSize &oldsize);
 
+	//! Annotation edits were queued from another thread
+	void annotationEditsQueued(QPrivateSignal);
+
+private slots:
+	void runQueuedAnnotationEdits();
+
 private:
 	LayerStack(const LayerStack *orig, QObject *parent);
 
@@ -172,7 +243,22 @@ private:
 	void beginWriteSequence();
 	void endWriteSequence();
 
-	void flattenTile(quint32 *data, int xindex, int yindex) const;
+	// Composite layers [firstLayer, lastLayer) onto the given tile data
+	void flattenTile(quint32 *data, int xindex, int yindex, int firstLayer=0, int lastLayer=-1) const;
+
+	// Get a flattened tile from the cache, compositing it if needed
+	Tile cachedFlatTile(const Tile &base, int xindex, int yindex) const;
+
+	// Notify observers of changes in the given layer and invalidate the
+	// flattened tiles affected. A null layer means any layer may have changed.
+	void markDirty(const Layer *layer, const QRect &area);
+	void markDirty(const Layer *layer, int index);
+	void markDirty(const Layer *layer);
+
+	void useFlatBase(const Tile &base) const;
+	void invalidateFlatTile(int index, int layerIdx);
+	void clearFlatTileCache();
+	int topLevelIndexOf(const Layer *layer) const;
 
 	bool isVisible(int idx) const;
 	int layerOpacity(int idx) const;
@@ -186,6 +272,7 @@ private:
 
 	QList<Layer*> m_layers;
 	AnnotationModel *m_annotations;
+	AnnotationModel *m_annotationState; // used only by the thread that edits the layer stack
 
 	Tile m_backgroundTile;
 
@@ -195,8 +282,44 @@ private:
 	int m_onionskinsBelow, m_onionskinsAbove;
 	int m_openEditors;
 
+	bool m_observersSuspended;
 	bool m_onionskinTint;
 	bool m_censorLayers;
+
+	// Index of the most recently changed layer, checked first by topLevelIndexOf
+	mutable int m_lastDirtyIndex;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+	mutable QRecursiveMutex m_mutex;
+#else
+	mutable QMutex m_mutex { QMutex::Recursive };
+#endif
+
+	QMutex m_annotationEditLock;
+	QList<std::function<void(AnnotationModel*)>> m_annotationEdits;
+
+	struct FlatTile {
+		Tile below;     // base + layers below belowLayer
+		Tile flat;      // base + all layers (null if stale)
+		int belowLayer; // zero if there is no partial composite
+	};
+
+	// Flattened tiles are cached separately for each base tile (i.e. each
+	// background used by getFlatTile and the observers), so they don't
+	// evict each other's tiles.
+	struct FlatTileKey {
+		Tile base;
+		int index;
+
+		bool operator==(const FlatTileKey &other) const { return base == other.base && index == other.index; }
+		friend uint qHash(const FlatTileKey &key, uint seed=0) { return qHash(key.base, seed) ^ uint(key.index); }
+	};
+
+	// Base tiles in use, least recently added first
+	mutable QVector<Tile> m_flatBases;
+
+	mutable QCache<FlatTileKey, FlatTile> m_flatTiles;
+	mutable QMutex m_flatTileLock;
 };
 
 /// Layer stack savepoint for undo use
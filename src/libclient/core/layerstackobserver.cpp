@@ -39,9 +39,9 @@ void LayerStackObserver::attachToLayerStack(LayerStack *layerstack)
 {
 	Q_ASSERT(layerstack);
 
-	if(m_layerstack)
-		m_layerstack->m_observers.removeAll(this);
+	detachFromLayerStack();
 
+	QMutexLocker lock(layerstack->mutex());
 	m_layerstack = layerstack;
 	m_layerstack->m_observers.append(this);
 
@@ -52,6 +52,7 @@ void LayerStackObserver::attachToLayerStack(LayerStack *layerstack)
 void LayerStackObserver::detachFromLayerStack()
 {
 	if(m_layerstack) {
+		QMutexLocker lock(m_layerstack->mutex());
 		m_layerstack->m_observers.removeAll(this);
 		m_layerstack = nullptr;
 	}
@@ -156,13 +157,17 @@ namespace {
 		UpdateTile(int x_, int y_) : x(x_), y(y_) {}
 
 		int x, y;
-		quint32 data[Tile::LENGTH];
+		Tile tile;
 	};
 }
 
 void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *target)
 {
 	Q_ASSERT(m_layerstack);
+
+	// The paint engine may be running in another thread
+	QMutexLocker lock(m_layerstack->mutex());
+
 	if(m_layerstack->width() <=0 || m_layerstack->height() <= 0)
 		return;
 
@@ -189,8 +194,7 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 	if(!updates.isEmpty()) {
 		// Flatten tiles
 		concurrentForEach<UpdateTile*>(updates, [this](UpdateTile *t) {
-			m_paintBackgroundTile.copyTo(t->data);
-			m_layerstack->flattenTile(t->data, t->x, t->y);
+			t->tile = m_layerstack->cachedFlatTile(m_paintBackgroundTile, t->x, t->y);
 		});
 
 		// Paint flattened tiles
@@ -201,7 +205,7 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 			painter.drawImage(
 				ut->x*Tile::SIZE,
 				ut->y*Tile::SIZE,
-				QImage(reinterpret_cast<const uchar*>(ut->data),
+				QImage(reinterpret_cast<const uchar*>(ut->tile.constData()),
 					Tile::SIZE, Tile::SIZE,
 					QImage::Format_ARGB32_Premultiplied
 				)
@@ -18,6 +18,7 @@
 */
 
 #include "rasterop.h"
+#include "rasterop_simd.h"
 
 #include <QRgb>
 
@@ -92,6 +93,42 @@ inline uint blend_subtract(uchar base, uchar blend) {
 	return qMax(base-blend, 0);
 }
 
+static std::array<quint32, 256> makeInvAlphaTable()
+{
+	std::array<quint32, 256> table;
+	table[0] = 0;
+	for(uint a=1;a<256;++a)
+		table[a] = 0x00ff00ffu / a;
+	return table;
+}
+
+const std::array<quint32, 256> rasterop::INV_ALPHA = makeInvAlphaTable();
+
+// These are the same algorithms as in (recent versions of) Qt, but the
+// rounding of qUnpremultiply has changed between Qt versions. The vectorized
+// kernels must be able to reproduce the results exactly.
+// (c * (0x00ff00ff/a) + 0x8000) >> 16 == round(c*255/a) for all c <= a
+inline quint32 unpremultiply(quint32 p)
+{
+	const uint inv = rasterop::INV_ALPHA[qAlpha(p)];
+	return qRgba(
+		(qRed(p) * inv + 0x8000) >> 16,
+		(qGreen(p) * inv + 0x8000) >> 16,
+		(qBlue(p) * inv + 0x8000) >> 16,
+		qAlpha(p)
+	);
+}
+
+inline quint32 premultiply(quint32 p)
+{
+	const uint a = qAlpha(p);
+	uint t = (p & 0xff00ff) * a;
+	t = ((t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+	uint g = ((p >> 8) & 0xff) * a;
+	g = (g + ((g >> 8) & 0xff) + 0x80) & 0xff00;
+	return t | g | (a << 24);
+}
+
 // Normal alpha blend
 void doAlphaMaskBlend(quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
@@ -305,12 +342,12 @@ void doMaskComposite(quint32 *base, quint32 color, const uchar *mask,
 				++base;
 
 			} else {
-				quint32 dest = qUnpremultiply(*reinterpret_cast<QRgb*>(base));
+				quint32 dest = unpremultiply(*base);
 				uchar *d = reinterpret_cast<uchar*>(&dest);
 				d[0] = UINT8_BLEND(BO(d[0], src[0]), d[0], *mask);
 				d[1] = UINT8_BLEND(BO(d[1], src[1]), d[1], *mask);
 				d[2] = UINT8_BLEND(BO(d[2], src[2]), d[2], *mask);
-				*(base++) = qPremultiply(dest);
+				*(base++) = premultiply(dest);
 			}
 		}
 		base += baseskip;
@@ -436,8 +473,8 @@ void doPixelComposite(quint32 *base, const quint32 *source, uchar alpha, int len
 	while(len--) {
 		if(*source & *base) {
 			// Blend only if neither source nor destination pixels are fully transparent
-			quint32 dest = qUnpremultiply(*reinterpret_cast<QRgb*>(base));
-			const quint32 src = qUnpremultiply(*reinterpret_cast<const QRgb*>(source));
+			quint32 dest = unpremultiply(*base);
+			const quint32 src = unpremultiply(*source);
 
 			auto *d = reinterpret_cast<uchar*>(&dest);
 			auto *s = reinterpret_cast<const uchar*>(&src);
@@ -448,16 +485,155 @@ void doPixelComposite(quint32 *base, const quint32 *source, uchar alpha, int len
 			d[1] = UINT8_BLEND(BO(d[1], s[1]), d[1], a);
 			d[2] = UINT8_BLEND(BO(d[2], s[2]), d[2], a);
 
-			*base = qPremultiply(dest);
+			*base = premultiply(dest);
 		}
 		++base;
 		++source;
 	}
 }
 
+static const rasterop::Kernels *detectKernels()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	if(rasterop::KERNELS_AVX2 && __builtin_cpu_supports("avx2"))
+		return rasterop::KERNELS_AVX2;
+	if(rasterop::KERNELS_SSE41 && __builtin_cpu_supports("sse4.1"))
+		return rasterop::KERNELS_SSE41;
+#endif
+	return rasterop::KERNELS_SSE2;
+}
+
+// The active vectorized kernel set. Null if only the scalar implementation is used.
+static const rasterop::Kernels *KERNELS = detectKernels();
+
+CompositingKernel activeCompositingKernel()
+{
+	if(!KERNELS)
+		return CompositingKernel::Scalar;
+	else if(KERNELS == rasterop::KERNELS_AVX2)
+		return CompositingKernel::AVX2;
+	else if(KERNELS == rasterop::KERNELS_SSE41)
+		return CompositingKernel::SSE41;
+	else
+		return CompositingKernel::SSE2;
+}
+
+bool setCompositingKernel(CompositingKernel kernel)
+{
+	const rasterop::Kernels *k = nullptr;
+	switch(kernel) {
+	case CompositingKernel::Scalar: break;
+	case CompositingKernel::SSE2:
+		k = rasterop::KERNELS_SSE2;
+		if(!k)
+			return false;
+		break;
+	case CompositingKernel::SSE41: {
+		// All CPUs with AVX2 support SSE4.1 too
+		const rasterop::Kernels *best = detectKernels();
+		k = rasterop::KERNELS_SSE41;
+		if(!k || (best != k && best != rasterop::KERNELS_AVX2))
+			return false;
+		break;
+	}
+	case CompositingKernel::AVX2:
+		k = detectKernels();
+		if(!k || k != rasterop::KERNELS_AVX2)
+			return false;
+		break;
+	}
+
+	KERNELS = k;
+	return true;
+}
+
+const char *compositingKernelName()
+{
+	return KERNELS ? KERNELS->name : "scalar";
+}
+
+// Run a vectorized kernel over each row and let the scalar reference
+// implementation handle whatever is left over at the end.
+typedef void(*ScalarMaskFunc)(quint32*, quint32, const uchar*, int, int, int, int);
+
+static void doMaskRows(rasterop::MaskRowFunc kernel, ScalarMaskFunc scalar,
+		quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	for(int y=0;y<h;++y) {
+		const int done = kernel(base, color, mask, w);
+		if(done < w)
+			scalar(base+done, color, mask+done, w-done, 1, 0, 0);
+		base += w + baseskip;
+		mask += w + maskskip;
+	}
+}
+
+// The scalar implementations of the separable blending modes, indexed like the kernel tables
+static const ScalarMaskFunc SCALAR_MASK_COMPOSITE[rasterop::SEPARABLE_MODE_COUNT] = {
+	doMaskComposite<blend_multiply>,
+	doMaskComposite<blend_divide>,
+	doMaskComposite<blend_burn>,
+	doMaskComposite<blend_dodge>,
+	doMaskComposite<blend_darken>,
+	doMaskComposite<blend_lighten>,
+	doMaskComposite<blend_subtract>,
+	doMaskComposite<blend_add>,
+	doMaskComposite<blend_blend>
+};
+
+static void doMaskEraseWithColor(quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	Q_UNUSED(color);
+	doMaskErase(base, mask, w, h, maskskip, baseskip);
+}
+
+typedef void(*ScalarPixelFunc)(quint32*, const quint32*, uchar, int);
+
+static const ScalarPixelFunc SCALAR_PIXEL_COMPOSITE[rasterop::SEPARABLE_MODE_COUNT] = {
+	doPixelComposite<blend_multiply>,
+	doPixelComposite<blend_divide>,
+	doPixelComposite<blend_burn>,
+	doPixelComposite<blend_dodge>,
+	doPixelComposite<blend_darken>,
+	doPixelComposite<blend_lighten>,
+	doPixelComposite<blend_subtract>,
+	doPixelComposite<blend_add>,
+	doPixelComposite<blend_blend>
+};
+
+static void doPixels(rasterop::PixelRowFunc kernel, ScalarPixelFunc scalar,
+		quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const int done = kernel(base, over, opacity, len);
+	if(done < len)
+		scalar(base+done, over+done, opacity, len-done);
+}
+
+static bool isSeparable(BlendMode::Mode mode)
+{
+	return mode >= BlendMode::MODE_MULTIPLY && mode <= BlendMode::MODE_RECOLOR;
+}
+
 void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
 {
+	const rasterop::Kernels *k = KERNELS;
+	if(k) {
+		switch(mode) {
+		case BlendMode::MODE_ERASE: doMaskRows(k->maskErase, doMaskEraseWithColor, base, color, mask, w, h, maskskip, baseskip); return;
+		case BlendMode::MODE_NORMAL: doMaskRows(k->maskAlphaBlend, doAlphaMaskBlend, base, color, mask, w, h, maskskip, baseskip); return;
+		case BlendMode::MODE_BEHIND: doMaskRows(k->maskAlphaUnder, doAlphaMaskUnder, base, color, mask, w, h, maskskip, baseskip); return;
+		case BlendMode::MODE_REPLACE: doMaskRows(k->maskCopy, doMaskCopy, base, color, mask, w, h, maskskip, baseskip); return;
+		default:
+			if(isSeparable(mode) && k->maskComposite[mode - BlendMode::MODE_MULTIPLY]) {
+				const int i = mode - BlendMode::MODE_MULTIPLY;
+				doMaskRows(k->maskComposite[i], SCALAR_MASK_COMPOSITE[i], base, color, mask, w, h, maskskip, baseskip);
+				return;
+			}
+			break;
+		}
+	}
+
 	switch(mode) {
 	case BlendMode::MODE_ERASE: doMaskErase(base, mask, w, h, maskskip, baseskip); break;
 	case BlendMode::MODE_NORMAL: doAlphaMaskBlend(base, color, mask, w, h, maskskip, baseskip); break;
@@ -480,6 +656,22 @@ void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, i
 {
 	Q_ASSERT(len>=0);
 
+	const rasterop::Kernels *k = KERNELS;
+	if(k) {
+		switch(mode) {
+		case BlendMode::MODE_ERASE: doPixels(k->pixelErase, doPixelErase, base, over, opacity, len); return;
+		case BlendMode::MODE_NORMAL: doPixels(k->pixelAlphaBlend, doPixelAlphaBlend, base, over, opacity, len); return;
+		case BlendMode::MODE_BEHIND: doPixels(k->pixelAlphaUnder, doPixelAlphaUnder, base, over, opacity, len); return;
+		default:
+			if(isSeparable(mode) && k->pixelComposite[mode - BlendMode::MODE_MULTIPLY]) {
+				const int i = mode - BlendMode::MODE_MULTIPLY;
+				doPixels(k->pixelComposite[i], SCALAR_PIXEL_COMPOSITE[i], base, over, opacity, len);
+				return;
+			}
+			break;
+		}
+	}
+
 	switch(mode) {
 	case BlendMode::MODE_ERASE: doPixelErase(base, over, opacity, len); break;
 	case BlendMode::MODE_NORMAL: doPixelAlphaBlend(base, over, opacity, len); break;
@@ -67,6 +67,38 @@ std::array<quint32, 5> sampleMask(const quint32 *pixels, const uchar *mask, int
  */
 void tintPixels(quint32 *pixels, int len, quint32 tint);
 
+/**
+ * Compositing kernel implementations.
+ *
+ * The scalar implementation is the reference. The vectorized kernels
+ * produce bit-identical results. All blending modes except color erase
+ * (which is computed in floating point) are vectorized, apart from the
+ * separable modes in the SSE2 set, which lacks a 32 bit multiply.
+ * The best kernel supported by the CPU is selected automatically at startup.
+ */
+enum class CompositingKernel {
+	Scalar,
+	SSE2,
+	SSE41,
+	AVX2
+};
+
+//! Get the currently active compositing kernel
+CompositingKernel activeCompositingKernel();
+
+//! Get the name of the currently active compositing kernel
+const char *compositingKernelName();
+
+/**
+ * @brief Override the automatically selected compositing kernel
+ *
+ * This is meant for testing and benchmarking. It is not thread safe,
+ * so it should not be called while the paint engine is running.
+ *
+ * @return false if the kernel is not supported on this CPU
+ */
+bool setCompositingKernel(CompositingKernel kernel);
+
 }
 
 #endif
@@ -0,0 +1,463 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rasterop_simd.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#include <cstring>
+
+namespace paintcore {
+namespace rasterop {
+
+namespace {
+
+// The kernels process eight pixels at a time. See rasterop_sse2.cpp for the
+// details: this is the same algorithm, but with twice as wide registers.
+// Note that AVX2 unpack and pack instructions operate within 128 bit lanes,
+// so the low register contains pixels 0,1,4,5 and the high one 2,3,6,7.
+// Since all operations are per pixel, this does not matter as long as the
+// mask is unpacked the same way. 16 bit lanes are enough headroom to do
+// the exact same integer math as UINT8_MULT in rasterop.cpp:
+// a*b + 0x80 <= 65153 and ((c>>8) + c) <= 65407
+
+inline __m256i mult(__m256i a, __m256i b)
+{
+	const __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(c, 8), c), 8);
+}
+
+// Broadcast the alpha channel of each pixel to all their channels
+inline __m256i alpha(__m256i v)
+{
+	return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xff), 0xff);
+}
+
+// Pack 16 bit lanes back into bytes. The scalar code stores its results
+// in uchars, so the values are truncated rather than saturated.
+inline __m256i pack(__m256i lo, __m256i hi)
+{
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	return _mm256_packus_epi16(_mm256_and_si256(lo, ff), _mm256_and_si256(hi, ff));
+}
+
+// Select a where cond is set, b elsewhere
+inline __m256i select(__m256i cond, __m256i a, __m256i b)
+{
+	return _mm256_or_si256(_mm256_and_si256(cond, a), _mm256_andnot_si256(cond, b));
+}
+
+// Load eight mask values, each replicated to all four bytes of a pixel
+inline __m256i loadMask(const uchar *mask, quint64 &raw)
+{
+	memcpy(&raw, mask, 8);
+	const __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask)));
+	const __m256i replicate = _mm256_setr_epi8(
+		0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+		0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12
+	);
+	return _mm256_shuffle_epi8(m, replicate);
+}
+
+inline __m256i load(const quint32 *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline void store(quint32 *p, __m256i v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+
+int maskAlphaBlend(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+
+	// Color alpha is ignored: the mask value is used as the alpha instead.
+	// UINT8_MULT(255, mask) == mask
+	const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color | 0xff000000)), zero);
+
+	int x=0;
+	for(;x+8<=w;x+=8) {
+		quint64 raw;
+		const __m256i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i mlo = _mm256_unpacklo_epi8(m, zero);
+		const __m256i mhi = _mm256_unpackhi_epi8(m, zero);
+
+		const __m256i lo = _mm256_add_epi16(mult(c, mlo), mult(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(ff, mlo)));
+		const __m256i hi = _mm256_add_epi16(mult(c, mhi), mult(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(ff, mhi)));
+
+		store(base+x, pack(lo, hi));
+	}
+	return x;
+}
+
+int maskAlphaUnder(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color | 0xff000000)), zero);
+
+	int x=0;
+	for(;x+8<=w;x+=8) {
+		quint64 raw;
+		const __m256i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i dlo = _mm256_unpacklo_epi8(d, zero);
+		const __m256i dhi = _mm256_unpackhi_epi8(d, zero);
+
+		// Transparent mask or opaque destination yields a=0, leaving the pixel unchanged
+		const __m256i alo = mult(_mm256_sub_epi16(ff, alpha(dlo)), _mm256_unpacklo_epi8(m, zero));
+		const __m256i ahi = mult(_mm256_sub_epi16(ff, alpha(dhi)), _mm256_unpackhi_epi8(m, zero));
+
+		store(base+x, pack(
+			_mm256_add_epi16(mult(c, alo), dlo),
+			_mm256_add_epi16(mult(c, ahi), dhi)
+		));
+	}
+	return x;
+}
+
+int maskErase(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	Q_UNUSED(color);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+
+	int x=0;
+	for(;x+8<=w;x+=8) {
+		quint64 raw;
+		const __m256i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i dlo = _mm256_unpacklo_epi8(d, zero);
+		const __m256i dhi = _mm256_unpackhi_epi8(d, zero);
+
+		const __m256i lo = mult(dlo, _mm256_sub_epi16(ff, _mm256_unpacklo_epi8(m, zero)));
+		const __m256i hi = mult(dhi, _mm256_sub_epi16(ff, _mm256_unpackhi_epi8(m, zero)));
+
+		// The scalar version does not touch pixels whose alpha is zero
+		store(base+x, pack(
+			select(_mm256_cmpeq_epi16(alpha(dlo), zero), dlo, lo),
+			select(_mm256_cmpeq_epi16(alpha(dhi), zero), dhi, hi)
+		));
+	}
+	return x;
+}
+
+int maskCopy(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color)), zero);
+
+	int x=0;
+	for(;x+8<=w;x+=8) {
+		quint64 raw;
+		const __m256i m = loadMask(mask+x, raw);
+		store(base+x, pack(
+			mult(c, _mm256_unpacklo_epi8(m, zero)),
+			mult(c, _mm256_unpackhi_epi8(m, zero))
+		));
+	}
+	return x;
+}
+
+int pixelAlphaBlend(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+8<=len;x+=8) {
+		const __m256i s = load(over+x);
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) == -1)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i dlo = _mm256_unpacklo_epi8(d, zero);
+		const __m256i dhi = _mm256_unpackhi_epi8(d, zero);
+
+		const __m256i slo = mult(_mm256_unpacklo_epi8(s, zero), o);
+		const __m256i shi = mult(_mm256_unpackhi_epi8(s, zero), o);
+		const __m256i salo = alpha(slo);
+		const __m256i sahi = alpha(shi);
+
+		const __m256i lo = _mm256_add_epi16(slo, mult(dlo, _mm256_sub_epi16(ff, salo)));
+		const __m256i hi = _mm256_add_epi16(shi, mult(dhi, _mm256_sub_epi16(ff, sahi)));
+
+		// The scalar version skips pixels whose effective source alpha is zero
+		store(base+x, pack(
+			select(_mm256_cmpeq_epi16(salo, zero), dlo, lo),
+			select(_mm256_cmpeq_epi16(sahi, zero), dhi, hi)
+		));
+	}
+	return x;
+}
+
+int pixelAlphaUnder(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+8<=len;x+=8) {
+		const __m256i s = load(over+x);
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) == -1)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i dlo = _mm256_unpacklo_epi8(d, zero);
+		const __m256i dhi = _mm256_unpackhi_epi8(d, zero);
+		const __m256i slo = _mm256_unpacklo_epi8(s, zero);
+		const __m256i shi = _mm256_unpackhi_epi8(s, zero);
+
+		// Transparent source or opaque destination yields a=0, leaving the pixel unchanged
+		const __m256i alo = mult(_mm256_sub_epi16(ff, alpha(dlo)), mult(alpha(slo), o));
+		const __m256i ahi = mult(_mm256_sub_epi16(ff, alpha(dhi)), mult(alpha(shi), o));
+
+		store(base+x, pack(
+			_mm256_add_epi16(mult(slo, alo), dlo),
+			_mm256_add_epi16(mult(shi, ahi), dhi)
+		));
+	}
+	return x;
+}
+
+int pixelErase(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+8<=len;x+=8) {
+		const __m256i s = load(over+x);
+		const __m256i d = load(base+x);
+
+		const __m256i alo = _mm256_sub_epi16(ff, mult(alpha(_mm256_unpacklo_epi8(s, zero)), o));
+		const __m256i ahi = _mm256_sub_epi16(ff, mult(alpha(_mm256_unpackhi_epi8(s, zero)), o));
+
+		store(base+x, pack(
+			mult(_mm256_unpacklo_epi8(d, zero), alo),
+			mult(_mm256_unpackhi_epi8(d, zero), ahi)
+		));
+	}
+	return x;
+}
+
+// The separable blending modes. See rasterop_sse41.cpp for the details.
+
+// UINT8_BLEND(a, b, alpha): 255*255 + 0x80 <= 65153
+inline __m256i blend(__m256i a, __m256i b, __m256i alpha)
+{
+	const __m256i c = _mm256_add_epi16(
+		_mm256_add_epi16(_mm256_mullo_epi16(a, alpha), _mm256_mullo_epi16(b, _mm256_sub_epi16(_mm256_set1_epi16(0xff), alpha))),
+		_mm256_set1_epi16(0x80)
+	);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(c, 8), c), 8);
+}
+
+// Integer division of 16 bit lanes, exact for quotients below 256
+inline __m256i divide(__m256i n, __m256i d)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lo = _mm256_cvttps_epi32(_mm256_div_ps(
+		_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(n, zero)),
+		_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(d, zero))
+	));
+	const __m256i hi = _mm256_cvttps_epi32(_mm256_div_ps(
+		_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(n, zero)),
+		_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(d, zero))
+	));
+	return _mm256_packus_epi32(lo, hi);
+}
+
+// Unpremultiply eight pixels. Same as unpremultiply() in rasterop.cpp
+inline __m256i unpremultiply(__m256i p)
+{
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	const __m256i half = _mm256_set1_epi32(0x8000);
+
+	const __m256i inv = _mm256_i32gather_epi32(reinterpret_cast<const int*>(INV_ALPHA.data()), _mm256_srli_epi32(p, 24), 4);
+
+	const __m256i b = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(p, ff), inv), half), 16);
+	const __m256i g = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 8), ff), inv), half), 16);
+	const __m256i r = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 16), ff), inv), half), 16);
+
+	return _mm256_or_si256(
+		_mm256_or_si256(_mm256_and_si256(b, ff), _mm256_slli_epi32(_mm256_and_si256(g, ff), 8)),
+		_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(r, ff), 16), _mm256_andnot_si256(_mm256_set1_epi32(0x00ffffff), p))
+	);
+}
+
+// Premultiply the color channels of unpacked pixels, keeping the alpha channel
+inline __m256i premultiply(__m256i v)
+{
+	const __m256i t = _mm256_mullo_epi16(v, alpha(v));
+	const __m256i c = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), _mm256_set1_epi16(0x80)), 8);
+	return _mm256_blend_epi16(c, v, 0x88);
+}
+
+typedef __m256i (*BlendOp)(__m256i, __m256i);
+
+inline __m256i blendMultiply(__m256i base, __m256i blend)
+{
+	return mult(base, blend);
+}
+
+inline __m256i blendDivide(__m256i base, __m256i blend)
+{
+	const __m256i n = _mm256_add_epi16(_mm256_slli_epi16(base, 8), _mm256_srli_epi16(blend, 1));
+	return _mm256_min_epu16(divide(n, _mm256_add_epi16(blend, _mm256_set1_epi16(1))), _mm256_set1_epi16(0xff));
+}
+
+inline __m256i blendBurn(__m256i base, __m256i blend)
+{
+	const __m256i ff = _mm256_set1_epi16(0xff);
+	const __m256i q = divide(_mm256_slli_epi16(_mm256_sub_epi16(ff, base), 8), _mm256_add_epi16(blend, _mm256_set1_epi16(1)));
+	return _mm256_sub_epi16(ff, _mm256_min_epu16(q, ff));
+}
+
+inline __m256i blendDodge(__m256i base, __m256i blend)
+{
+	const __m256i q = divide(_mm256_slli_epi16(base, 8), _mm256_sub_epi16(_mm256_set1_epi16(256), blend));
+	return _mm256_min_epu16(q, _mm256_set1_epi16(0xff));
+}
+
+inline __m256i blendDarken(__m256i base, __m256i blend) { return _mm256_min_epu16(base, blend); }
+inline __m256i blendLighten(__m256i base, __m256i blend) { return _mm256_max_epu16(base, blend); }
+inline __m256i blendSubtract(__m256i base, __m256i blend) { return _mm256_subs_epu16(base, blend); }
+inline __m256i blendAdd(__m256i base, __m256i blend) { return _mm256_min_epu16(_mm256_add_epi16(base, blend), _mm256_set1_epi16(0xff)); }
+inline __m256i blendRecolor(__m256i base, __m256i blend) { Q_UNUSED(base); return blend; }
+
+template<BlendOp BO>
+int maskComposite(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color)), zero);
+
+	int x=0;
+	for(;x+8<=w;x+=8) {
+		quint64 raw;
+		const __m256i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m256i d = load(base+x);
+		const __m256i u = unpremultiply(d);
+		const __m256i ulo = _mm256_unpacklo_epi8(u, zero);
+		const __m256i uhi = _mm256_unpackhi_epi8(u, zero);
+
+		const __m256i lo = premultiply(_mm256_blend_epi16(blend(BO(ulo, c), ulo, _mm256_unpacklo_epi8(m, zero)), ulo, 0x88));
+		const __m256i hi = premultiply(_mm256_blend_epi16(blend(BO(uhi, c), uhi, _mm256_unpackhi_epi8(m, zero)), uhi, 0x88));
+
+		// The scalar version does not touch pixels where the mask or the destination is zero
+		const __m256i skip = _mm256_or_si256(_mm256_cmpeq_epi32(m, zero), _mm256_cmpeq_epi32(d, zero));
+		store(base+x, select(skip, d, pack(lo, hi)));
+	}
+	return x;
+}
+
+template<BlendOp BO>
+int pixelComposite(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i o = _mm256_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+8<=len;x+=8) {
+		const __m256i s = load(over+x);
+		const __m256i d = load(base+x);
+
+		// The scalar version blends only if the source and destination pixels have bits in common
+		const __m256i skip = _mm256_cmpeq_epi32(_mm256_and_si256(s, d), zero);
+		if(_mm256_movemask_epi8(skip) == -1)
+			continue;
+
+		const __m256i us = unpremultiply(s);
+		const __m256i ud = unpremultiply(d);
+		const __m256i slo = _mm256_unpacklo_epi8(us, zero);
+		const __m256i shi = _mm256_unpackhi_epi8(us, zero);
+		const __m256i dlo = _mm256_unpacklo_epi8(ud, zero);
+		const __m256i dhi = _mm256_unpackhi_epi8(ud, zero);
+
+		const __m256i lo = premultiply(_mm256_blend_epi16(blend(BO(dlo, slo), dlo, mult(alpha(slo), o)), dlo, 0x88));
+		const __m256i hi = premultiply(_mm256_blend_epi16(blend(BO(dhi, shi), dhi, mult(alpha(shi), o)), dhi, 0x88));
+
+		store(base+x, select(skip, d, pack(lo, hi)));
+	}
+	return x;
+}
+
+const Kernels AVX2 {
+	"AVX2",
+	maskAlphaBlend,
+	maskAlphaUnder,
+	maskErase,
+	maskCopy,
+	pixelAlphaBlend,
+	pixelAlphaUnder,
+	pixelErase,
+	{
+		maskComposite<blendMultiply>,
+		maskComposite<blendDivide>,
+		maskComposite<blendBurn>,
+		maskComposite<blendDodge>,
+		maskComposite<blendDarken>,
+		maskComposite<blendLighten>,
+		maskComposite<blendSubtract>,
+		maskComposite<blendAdd>,
+		maskComposite<blendRecolor>
+	},
+	{
+		pixelComposite<blendMultiply>,
+		pixelComposite<blendDivide>,
+		pixelComposite<blendBurn>,
+		pixelComposite<blendDodge>,
+		pixelComposite<blendDarken>,
+		pixelComposite<blendLighten>,
+		pixelComposite<blendSubtract>,
+		pixelComposite<blendAdd>,
+		pixelComposite<blendRecolor>
+	}
+};
+
+}
+
+const Kernels * const KERNELS_AVX2 = &AVX2;
+
+}
+}
+
+#else
+
+namespace paintcore {
+namespace rasterop {
+
+const Kernels * const KERNELS_AVX2 = nullptr;
+
+}
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RASTEROP_SIMD_H
+#define PAINTCORE_RASTEROP_SIMD_H
+
+#include <QtGlobal>
+#include <array>
+
+#include "blendmodes.h"
+
+/*
+ * Private interface between rasterop.cpp and the vectorized kernels.
+ *
+ * Each kernel processes a single row and returns the number of pixels
+ * it handled. The number is always a multiple of the vector width;
+ * the remaining pixels are left for the scalar reference implementation.
+ * The kernels must produce output bit-identical to the scalar code.
+ */
+namespace paintcore {
+namespace rasterop {
+
+typedef int (*MaskRowFunc)(quint32 *base, quint32 color, const uchar *mask, int w);
+typedef int (*PixelRowFunc)(quint32 *base, const quint32 *over, uchar opacity, int len);
+
+// The separable blending modes (multiply to recolor) are done on unpremultiplied
+// pixels. They are indexed by mode - MODE_MULTIPLY in the kernel tables.
+static const int SEPARABLE_MODE_COUNT = BlendMode::MODE_RECOLOR - BlendMode::MODE_MULTIPLY + 1;
+
+// Reciprocal alpha values for unpremultiplying: 0x00ff00ff / alpha (and 0 for alpha 0)
+extern const std::array<quint32, 256> INV_ALPHA;
+
+struct Kernels {
+	const char *name;
+
+	MaskRowFunc maskAlphaBlend;
+	MaskRowFunc maskAlphaUnder;
+	MaskRowFunc maskErase;
+	MaskRowFunc maskCopy;
+
+	PixelRowFunc pixelAlphaBlend;
+	PixelRowFunc pixelAlphaUnder;
+	PixelRowFunc pixelErase;
+
+	// Separable blending modes. Null if not implemented by this kernel set.
+	MaskRowFunc maskComposite[SEPARABLE_MODE_COUNT];
+	PixelRowFunc pixelComposite[SEPARABLE_MODE_COUNT];
+};
+
+// The SSE2 kernels for the basic modes are shared by the SSE4.1 set,
+// since SSE4.1 has nothing that would make them faster.
+namespace sse2 {
+	int maskAlphaBlend(quint32 *base, quint32 color, const uchar *mask, int w);
+	int maskAlphaUnder(quint32 *base, quint32 color, const uchar *mask, int w);
+	int maskErase(quint32 *base, quint32 color, const uchar *mask, int w);
+	int maskCopy(quint32 *base, quint32 color, const uchar *mask, int w);
+	int pixelAlphaBlend(quint32 *base, const quint32 *over, uchar opacity, int len);
+	int pixelAlphaUnder(quint32 *base, const quint32 *over, uchar opacity, int len);
+	int pixelErase(quint32 *base, const quint32 *over, uchar opacity, int len);
+}
+
+// These are null if the kernel set was not compiled in.
+// Note: the tables are constant initialized, so no code from the
+// kernel translation units runs before the CPU check is done.
+extern const Kernels * const KERNELS_SSE2;
+extern const Kernels * const KERNELS_SSE41;
+extern const Kernels * const KERNELS_AVX2;
+
+}
+}
+
+#endif
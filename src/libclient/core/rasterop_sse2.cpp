@@ -0,0 +1,302 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rasterop_simd.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#include <cstring>
+
+namespace paintcore {
+namespace rasterop {
+
+namespace {
+
+// The kernels process four pixels at a time. The pixels are unpacked
+// into two registers of 16 bit lanes (two pixels each), which is enough
+// headroom to do the exact same integer math as UINT8_MULT in rasterop.cpp:
+// a*b + 0x80 <= 65153 and ((c>>8) + c) <= 65407
+
+inline __m128i mult(__m128i a, __m128i b)
+{
+	const __m128i c = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(c, 8), c), 8);
+}
+
+// Broadcast the alpha channel of both pixels to all their channels
+inline __m128i alpha(__m128i v)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+}
+
+// Pack 16 bit lanes back into bytes. The scalar code stores its results
+// in uchars, so the values are truncated rather than saturated.
+inline __m128i pack(__m128i lo, __m128i hi)
+{
+	const __m128i ff = _mm_set1_epi16(0xff);
+	return _mm_packus_epi16(_mm_and_si128(lo, ff), _mm_and_si128(hi, ff));
+}
+
+// Select a where cond is set, b elsewhere
+inline __m128i select(__m128i cond, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(cond, a), _mm_andnot_si128(cond, b));
+}
+
+// Load four mask values, each replicated to all four bytes of a pixel
+inline __m128i loadMask(const uchar *mask, quint32 &raw)
+{
+	memcpy(&raw, mask, 4);
+	__m128i m = _mm_cvtsi32_si128(int(raw));
+	m = _mm_unpacklo_epi8(m, m);
+	return _mm_unpacklo_epi16(m, m);
+}
+
+inline __m128i load(const quint32 *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline void store(quint32 *p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+}
+
+namespace sse2 {
+
+int maskAlphaBlend(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+
+	// Color alpha is ignored: the mask value is used as the alpha instead.
+	// UINT8_MULT(255, mask) == mask
+	const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(int(color | 0xff000000)), zero);
+
+	int x=0;
+	for(;x+4<=w;x+=4) {
+		quint32 raw;
+		const __m128i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m128i d = load(base+x);
+		const __m128i mlo = _mm_unpacklo_epi8(m, zero);
+		const __m128i mhi = _mm_unpackhi_epi8(m, zero);
+
+		const __m128i lo = _mm_add_epi16(mult(c, mlo), mult(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(ff, mlo)));
+		const __m128i hi = _mm_add_epi16(mult(c, mhi), mult(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(ff, mhi)));
+
+		store(base+x, pack(lo, hi));
+	}
+	return x;
+}
+
+int maskAlphaUnder(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(int(color | 0xff000000)), zero);
+
+	int x=0;
+	for(;x+4<=w;x+=4) {
+		quint32 raw;
+		const __m128i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m128i d = load(base+x);
+		const __m128i dlo = _mm_unpacklo_epi8(d, zero);
+		const __m128i dhi = _mm_unpackhi_epi8(d, zero);
+
+		// Transparent mask or opaque destination yields a=0, leaving the pixel unchanged
+		const __m128i alo = mult(_mm_sub_epi16(ff, alpha(dlo)), _mm_unpacklo_epi8(m, zero));
+		const __m128i ahi = mult(_mm_sub_epi16(ff, alpha(dhi)), _mm_unpackhi_epi8(m, zero));
+
+		store(base+x, pack(
+			_mm_add_epi16(mult(c, alo), dlo),
+			_mm_add_epi16(mult(c, ahi), dhi)
+		));
+	}
+	return x;
+}
+
+int maskErase(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	Q_UNUSED(color);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+
+	int x=0;
+	for(;x+4<=w;x+=4) {
+		quint32 raw;
+		const __m128i m = loadMask(mask+x, raw);
+		if(raw == 0)
+			continue;
+
+		const __m128i d = load(base+x);
+		const __m128i dlo = _mm_unpacklo_epi8(d, zero);
+		const __m128i dhi = _mm_unpackhi_epi8(d, zero);
+
+		const __m128i lo = mult(dlo, _mm_sub_epi16(ff, _mm_unpacklo_epi8(m, zero)));
+		const __m128i hi = mult(dhi, _mm_sub_epi16(ff, _mm_unpackhi_epi8(m, zero)));
+
+		// The scalar version does not touch pixels whose alpha is zero
+		store(base+x, pack(
+			select(_mm_cmpeq_epi16(alpha(dlo), zero), dlo, lo),
+			select(_mm_cmpeq_epi16(alpha(dhi), zero), dhi, hi)
+		));
+	}
+	return x;
+}
+
+int maskCopy(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(int(color)), zero);
+
+	int x=0;
+	for(;x+4<=w;x+=4) {
+		quint32 raw;
+		const __m128i m = loadMask(mask+x, raw);
+		store(base+x, pack(
+			mult(c, _mm_unpacklo_epi8(m, zero)),
+			mult(c, _mm_unpackhi_epi8(m, zero))
+		));
+	}
+	return x;
+}
+
+int pixelAlphaBlend(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i o = _mm_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+4<=len;x+=4) {
+		const __m128i s = load(over+x);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xffff)
+			continue;
+
+		const __m128i d = load(base+x);
+		const __m128i dlo = _mm_unpacklo_epi8(d, zero);
+		const __m128i dhi = _mm_unpackhi_epi8(d, zero);
+
+		const __m128i slo = mult(_mm_unpacklo_epi8(s, zero), o);
+		const __m128i shi = mult(_mm_unpackhi_epi8(s, zero), o);
+		const __m128i salo = alpha(slo);
+		const __m128i sahi = alpha(shi);
+
+		const __m128i lo = _mm_add_epi16(slo, mult(dlo, _mm_sub_epi16(ff, salo)));
+		const __m128i hi = _mm_add_epi16(shi, mult(dhi, _mm_sub_epi16(ff, sahi)));
+
+		// The scalar version skips pixels whose effective source alpha is zero
+		store(base+x, pack(
+			select(_mm_cmpeq_epi16(salo, zero), dlo, lo),
+			select(_mm_cmpeq_epi16(sahi, zero), dhi, hi)
+		));
+	}
+	return x;
+}
+
+int pixelAlphaUnder(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i o = _mm_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+4<=len;x+=4) {
+		const __m128i s = load(over+x);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xffff)
+			continue;
+
+		const __m128i d = load(base+x);
+		const __m128i dlo = _mm_unpacklo_epi8(d, zero);
+		const __m128i dhi = _mm_unpackhi_epi8(d, zero);
+		const __m128i slo = _mm_unpacklo_epi8(s, zero);
+		const __m128i shi = _mm_unpackhi_epi8(s, zero);
+
+		// Transparent source or opaque destination yields a=0, leaving the pixel unchanged
+		const __m128i alo = mult(_mm_sub_epi16(ff, alpha(dlo)), mult(alpha(slo), o));
+		const __m128i ahi = mult(_mm_sub_epi16(ff, alpha(dhi)), mult(alpha(shi), o));
+
+		store(base+x, pack(
+			_mm_add_epi16(mult(slo, alo), dlo),
+			_mm_add_epi16(mult(shi, ahi), dhi)
+		));
+	}
+	return x;
+}
+
+int pixelErase(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i o = _mm_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+4<=len;x+=4) {
+		const __m128i s = load(over+x);
+		const __m128i d = load(base+x);
+
+		const __m128i alo = _mm_sub_epi16(ff, mult(alpha(_mm_unpacklo_epi8(s, zero)), o));
+		const __m128i ahi = _mm_sub_epi16(ff, mult(alpha(_mm_unpackhi_epi8(s, zero)), o));
+
+		store(base+x, pack(
+			mult(_mm_unpacklo_epi8(d, zero), alo),
+			mult(_mm_unpackhi_epi8(d, zero), ahi)
+		));
+	}
+	return x;
+}
+
+}
+
+namespace {
+
+// The separable blending modes need a 32 bit multiply for unpremultiplying,
+// so they are left to the scalar code here and done in the SSE4.1 set instead.
+const Kernels SSE2 {
+	"SSE2",
+	sse2::maskAlphaBlend,
+	sse2::maskAlphaUnder,
+	sse2::maskErase,
+	sse2::maskCopy,
+	sse2::pixelAlphaBlend,
+	sse2::pixelAlphaUnder,
+	sse2::pixelErase,
+	{},
+	{}
+};
+
+}
+
+const Kernels * const KERNELS_SSE2 = &SSE2;
+
+}
+}
+
+#else
+
+namespace paintcore {
+namespace rasterop {
+
+const Kernels * const KERNELS_SSE2 = nullptr;
+
+}
+}
+
+#endif
@@ -0,0 +1,269 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rasterop_simd.h"
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#include <cstring>
+
+namespace paintcore {
+namespace rasterop {
+
+namespace {
+
+// The separable blending modes. These work on unpremultiplied pixels, so
+// each group of four pixels is unpremultiplied, blended and premultiplied again.
+// See rasterop_sse2.cpp for the 16 bit lane layout and the UINT8_MULT headroom.
+
+inline __m128i mult(__m128i a, __m128i b)
+{
+	const __m128i c = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(c, 8), c), 8);
+}
+
+// Broadcast the alpha channel of both pixels to all their channels
+inline __m128i alpha(__m128i v)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+}
+
+// UINT8_BLEND(a, b, alpha) == UINT8_MULT-style rounding of a*alpha + b*(255-alpha).
+// Both terms are non-negative, so unlike the refactored scalar formula,
+// this fits in 16 bits: 255*255 + 0x80 <= 65153
+inline __m128i blend(__m128i a, __m128i b, __m128i alpha)
+{
+	const __m128i c = _mm_add_epi16(
+		_mm_add_epi16(_mm_mullo_epi16(a, alpha), _mm_mullo_epi16(b, _mm_sub_epi16(_mm_set1_epi16(0xff), alpha))),
+		_mm_set1_epi16(0x80)
+	);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(c, 8), c), 8);
+}
+
+// Integer division of 16 bit lanes. Single precision division is exact
+// for all quotients below 256, and larger ones are clamped by the callers anyway.
+inline __m128i divide(__m128i n, __m128i d)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_cvttps_epi32(_mm_div_ps(
+		_mm_cvtepi32_ps(_mm_unpacklo_epi16(n, zero)),
+		_mm_cvtepi32_ps(_mm_unpacklo_epi16(d, zero))
+	));
+	const __m128i hi = _mm_cvttps_epi32(_mm_div_ps(
+		_mm_cvtepi32_ps(_mm_unpackhi_epi16(n, zero)),
+		_mm_cvtepi32_ps(_mm_unpackhi_epi16(d, zero))
+	));
+	return _mm_packus_epi32(lo, hi);
+}
+
+// Unpremultiply four pixels. Same as unpremultiply() in rasterop.cpp
+inline __m128i unpremultiply(__m128i p)
+{
+	const __m128i ff = _mm_set1_epi32(0xff);
+	const __m128i half = _mm_set1_epi32(0x8000);
+
+	const __m128i inv = _mm_setr_epi32(
+		int(INV_ALPHA[quint32(_mm_extract_epi32(p, 0)) >> 24]),
+		int(INV_ALPHA[quint32(_mm_extract_epi32(p, 1)) >> 24]),
+		int(INV_ALPHA[quint32(_mm_extract_epi32(p, 2)) >> 24]),
+		int(INV_ALPHA[quint32(_mm_extract_epi32(p, 3)) >> 24])
+	);
+
+	const __m128i b = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(p, ff), inv), half), 16);
+	const __m128i g = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(p, 8), ff), inv), half), 16);
+	const __m128i r = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(p, 16), ff), inv), half), 16);
+
+	return _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(b, ff), _mm_slli_epi32(_mm_and_si128(g, ff), 8)),
+		_mm_or_si128(_mm_slli_epi32(_mm_and_si128(r, ff), 16), _mm_andnot_si128(_mm_set1_epi32(0x00ffffff), p))
+	);
+}
+
+// Premultiply the color channels of two unpacked pixels. Same as premultiply() in rasterop.cpp
+// c*a + ((c*a)>>8) + 0x80 <= 65407
+inline __m128i premultiply(__m128i v)
+{
+	const __m128i a = alpha(v);
+	const __m128i t = _mm_mullo_epi16(v, a);
+	const __m128i c = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), _mm_set1_epi16(0x80)), 8);
+
+	// Keep the original alpha channel
+	return _mm_blend_epi16(c, v, 0x88);
+}
+
+// Pack 16 bit lanes back into bytes. All values are in the 0..255 range here.
+inline __m128i pack(__m128i lo, __m128i hi)
+{
+	return _mm_packus_epi16(lo, hi);
+}
+
+inline __m128i load(const quint32 *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline void store(quint32 *p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+// The blend functions. Same as the blend_* functions in rasterop.cpp
+typedef __m128i (*BlendOp)(__m128i, __m128i);
+
+inline __m128i blendMultiply(__m128i base, __m128i blend)
+{
+	return mult(base, blend);
+}
+
+inline __m128i blendDivide(__m128i base, __m128i blend)
+{
+	// (base*256 + blend/2) / (1+blend)
+	const __m128i n = _mm_add_epi16(_mm_slli_epi16(base, 8), _mm_srli_epi16(blend, 1));
+	return _mm_min_epu16(divide(n, _mm_add_epi16(blend, _mm_set1_epi16(1))), _mm_set1_epi16(0xff));
+}
+
+inline __m128i blendBurn(__m128i base, __m128i blend)
+{
+	// 255 - (255-base)*256 / (blend+1)
+	const __m128i ff = _mm_set1_epi16(0xff);
+	const __m128i q = divide(_mm_slli_epi16(_mm_sub_epi16(ff, base), 8), _mm_add_epi16(blend, _mm_set1_epi16(1)));
+	return _mm_sub_epi16(ff, _mm_min_epu16(q, ff));
+}
+
+inline __m128i blendDodge(__m128i base, __m128i blend)
+{
+	// base*256 / (256-blend)
+	const __m128i q = divide(_mm_slli_epi16(base, 8), _mm_sub_epi16(_mm_set1_epi16(256), blend));
+	return _mm_min_epu16(q, _mm_set1_epi16(0xff));
+}
+
+inline __m128i blendDarken(__m128i base, __m128i blend) { return _mm_min_epu16(base, blend); }
+inline __m128i blendLighten(__m128i base, __m128i blend) { return _mm_max_epu16(base, blend); }
+inline __m128i blendSubtract(__m128i base, __m128i blend) { return _mm_subs_epu16(base, blend); }
+inline __m128i blendAdd(__m128i base, __m128i blend) { return _mm_min_epu16(_mm_add_epi16(base, blend), _mm_set1_epi16(0xff)); }
+inline __m128i blendRecolor(__m128i base, __m128i blend) { Q_UNUSED(base); return blend; }
+
+template<BlendOp BO>
+int maskComposite(quint32 *base, quint32 color, const uchar *mask, int w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(int(color)), zero);
+
+	int x=0;
+	for(;x+4<=w;x+=4) {
+		quint32 raw;
+		memcpy(&raw, mask+x, 4);
+		if(raw == 0)
+			continue;
+
+		// Mask values replicated to all four bytes of a pixel
+		__m128i m = _mm_cvtsi32_si128(int(raw));
+		m = _mm_unpacklo_epi8(m, m);
+		m = _mm_unpacklo_epi16(m, m);
+
+		const __m128i d = load(base+x);
+		const __m128i u = unpremultiply(d);
+		const __m128i ulo = _mm_unpacklo_epi8(u, zero);
+		const __m128i uhi = _mm_unpackhi_epi8(u, zero);
+
+		const __m128i lo = premultiply(_mm_blend_epi16(blend(BO(ulo, c), ulo, _mm_unpacklo_epi8(m, zero)), ulo, 0x88));
+		const __m128i hi = premultiply(_mm_blend_epi16(blend(BO(uhi, c), uhi, _mm_unpackhi_epi8(m, zero)), uhi, 0x88));
+
+		// The scalar version does not touch pixels where the mask or the destination is zero
+		const __m128i skip = _mm_or_si128(_mm_cmpeq_epi32(m, zero), _mm_cmpeq_epi32(d, zero));
+		store(base+x, _mm_blendv_epi8(pack(lo, hi), d, skip));
+	}
+	return x;
+}
+
+template<BlendOp BO>
+int pixelComposite(quint32 *base, const quint32 *over, uchar opacity, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i o = _mm_set1_epi16(opacity);
+
+	int x=0;
+	for(;x+4<=len;x+=4) {
+		const __m128i s = load(over+x);
+		const __m128i d = load(base+x);
+
+		// The scalar version blends only if the source and destination pixels have bits in common
+		const __m128i skip = _mm_cmpeq_epi32(_mm_and_si128(s, d), zero);
+		if(_mm_movemask_epi8(skip) == 0xffff)
+			continue;
+
+		const __m128i us = unpremultiply(s);
+		const __m128i ud = unpremultiply(d);
+		const __m128i slo = _mm_unpacklo_epi8(us, zero);
+		const __m128i shi = _mm_unpackhi_epi8(us, zero);
+		const __m128i dlo = _mm_unpacklo_epi8(ud, zero);
+		const __m128i dhi = _mm_unpackhi_epi8(ud, zero);
+
+		const __m128i lo = premultiply(_mm_blend_epi16(blend(BO(dlo, slo), dlo, mult(alpha(slo), o)), dlo, 0x88));
+		const __m128i hi = premultiply(_mm_blend_epi16(blend(BO(dhi, shi), dhi, mult(alpha(shi), o)), dhi, 0x88));
+
+		store(base+x, _mm_blendv_epi8(pack(lo, hi), d, skip));
+	}
+	return x;
+}
+
+const Kernels SSE41 {
+	"SSE4.1",
+	sse2::maskAlphaBlend,
+	sse2::maskAlphaUnder,
+	sse2::maskErase,
+	sse2::maskCopy,
+	sse2::pixelAlphaBlend,
+	sse2::pixelAlphaUnder,
+	sse2::pixelErase,
+	{
+		maskComposite<blendMultiply>,
+		maskComposite<blendDivide>,
+		maskComposite<blendBurn>,
+		maskComposite<blendDodge>,
+		maskComposite<blendDarken>,
+		maskComposite<blendLighten>,
+		maskComposite<blendSubtract>,
+		maskComposite<blendAdd>,
+		maskComposite<blendRecolor>
+	},
+	{
+		pixelComposite<blendMultiply>,
+		pixelComposite<blendDivide>,
+		pixelComposite<blendBurn>,
+		pixelComposite<blendDodge>,
+		pixelComposite<blendDarken>,
+		pixelComposite<blendLighten>,
+		pixelComposite<blendSubtract>,
+		pixelComposite<blendAdd>,
+		pixelComposite<blendRecolor>
+	}
+};
+
+}
+
+const Kernels * const KERNELS_SSE41 = &SSE41;
+
+}
+}
+
+#else
+
+namespace paintcore {
+namespace rasterop {
+
+const Kernels * const KERNELS_SSE41 = nullptr;
+
+}
+}
+
+#endif
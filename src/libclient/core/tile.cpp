@@ -302,11 +302,4 @@ QDataStream &operator>>(QDataStream &ds, Tile &t)
 	return ds;
 }
 
-#ifndef NDEBUG
-QAtomicInt TileData::_count;
-TileData::TileData() { _count.fetchAndAddOrdered(1); }
-TileData::TileData(const TileData &td) : QSharedData() { memcpy(pixels, td.pixels, sizeof pixels); _count.fetchAndAddOrdered(1); }
-TileData::~TileData() { _count.fetchAndAddOrdered(-1); }
-#endif
-
 }
@@ -20,13 +20,10 @@
 #define TILE_H
 
 #include "blendmodes.h"
+#include "tilepool.h"
 
 #include <QSharedDataPointer>
 
-#ifndef NDEBUG
-#include <QAtomicInt>
-#endif
-
 #include <array>
 
 class QColor;
@@ -40,23 +37,13 @@ struct TileData : public QSharedData {
 	quint32 pixels[64*64]; // the pixel data
 	int lastEditedBy;     // ID of the user who last edited this tile
 
-#ifndef NDEBUG // Debug tool for measuring memory usage
-	TileData();
-	TileData(const TileData &td);
-	~TileData();
-
-	static int globalCount()
-	{
-#if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
-		return _count.load(); // deprecated since Qt 5.14
-#else
-		return _count.loadRelaxed();
-#endif
-	}
+	// Tile data is allocated from a pool to avoid heap churn and fragmentation
+	static void *operator new(size_t size) { Q_ASSERT(size == TilePool::blockSize()); Q_UNUSED(size); return TilePool::allocate(); }
+	static void operator delete(void *ptr) { TilePool::release(ptr); }
+
+	//! Get the number of tiles currently allocated
+	static int globalCount() { return TilePool::stats().inUse; }
 	static float megabytesUsed() { return globalCount() * sizeof(pixels) / float(1024*1024); }
-private:
-	static QAtomicInt _count;
-#endif
 };
 
 /**
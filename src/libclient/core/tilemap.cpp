@@ -0,0 +1,141 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilemap.h"
+
+#include <algorithm>
+
+namespace paintcore {
+
+TileMap::TileMap(const QVector<Tile> &tiles)
+	: m_size(tiles.size())
+{
+	// Use the most common tile as the fill tile
+	QHash<Tile, int> counts;
+	int maxCount = 0;
+	for(const Tile &t : tiles) {
+		const int count = ++counts[t];
+		if(count > maxCount) {
+			maxCount = count;
+			m_fill = t;
+		}
+	}
+
+	for(int i=0;i<tiles.size();++i) {
+		if(tiles.at(i) != m_fill)
+			m_tiles.insert(i, tiles.at(i));
+	}
+}
+
+Tile &TileMap::ref(int index)
+{
+	Q_ASSERT(index>=0 && index<m_size);
+	auto i = m_tiles.find(index);
+	if(i == m_tiles.end())
+		i = m_tiles.insert(index, m_fill);
+	return *i;
+}
+
+void TileMap::set(int index, const Tile &tile)
+{
+	Q_ASSERT(index>=0 && index<m_size);
+	if(tile == m_fill)
+		m_tiles.remove(index);
+	else
+		m_tiles.insert(index, tile);
+}
+
+QVector<int> TileMap::nonNullIndices() const
+{
+	QVector<int> indices;
+
+	if(!m_fill.isNull()) {
+		indices.reserve(m_size);
+		for(int i=0;i<m_size;++i) {
+			if(!at(i).isNull())
+				indices << i;
+		}
+
+	} else {
+		indices.reserve(m_tiles.size());
+		for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+			if(!i.value().isNull())
+				indices << i.key();
+		}
+		std::sort(indices.begin(), indices.end());
+	}
+
+	return indices;
+}
+
+QVector<int> TileMap::differingIndices(const TileMap &other) const
+{
+	QVector<int> indices;
+
+	if(m_size != other.m_size || m_fill != other.m_fill) {
+		// Every tile may be different
+		const int size = qMax(m_size, other.m_size);
+		for(int i=0;i<size;++i) {
+			if(i >= m_size || i >= other.m_size || at(i) != other.at(i))
+				indices << i;
+		}
+		return indices;
+	}
+
+	if(m_tiles.isSharedWith(other.m_tiles))
+		return indices;
+
+	// Only the explicitly stored tiles can differ
+	for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+		if(i.value() != other.at(i.key()))
+			indices << i.key();
+	}
+	for(auto i=other.m_tiles.constBegin();i!=other.m_tiles.constEnd();++i) {
+		if(!m_tiles.contains(i.key()) && i.value() != m_fill)
+			indices << i.key();
+	}
+
+	std::sort(indices.begin(), indices.end());
+	return indices;
+}
+
+void TileMap::optimize()
+{
+	if(!m_fill.isNull() && m_fill.isBlank())
+		m_fill = Tile();
+
+	QMutableHashIterator<int, Tile> i(m_tiles);
+	while(i.hasNext()) {
+		Tile &t = i.next().value();
+		if(!t.isNull() && t.isBlank())
+			t = Tile();
+		if(t == m_fill)
+			i.remove();
+	}
+}
+
+QVector<Tile> TileMap::toVector() const
+{
+	QVector<Tile> tiles(m_size, m_fill);
+	for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i)
+		tiles[i.key()] = i.value();
+	return tiles;
+}
+
+}
@@ -0,0 +1,99 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEMAP_H
+#define PAINTCORE_TILEMAP_H
+
+#include "tile.h"
+
+#include <QHash>
+#include <QVector>
+
+namespace paintcore {
+
+/**
+ * @brief A sparse grid of tiles
+ *
+ * Only tiles that differ from the fill tile are stored. A freshly created
+ * (or solid color filled) layer therefore takes no per-tile memory at all,
+ * and the cost of iterating over its content scales with the painted area
+ * rather than the size of the canvas.
+ *
+ * Like Tile, the map is implicitly shared.
+ */
+class TileMap {
+public:
+	TileMap() : m_size(0) { }
+
+	//! Construct a map of the given size where every tile is the fill tile
+	TileMap(int size, const Tile &fill=Tile()) : m_fill(fill), m_size(size) { }
+
+	//! Construct a map from a dense tile vector
+	explicit TileMap(const QVector<Tile> &tiles);
+
+	//! Get the number of tiles in the grid
+	int size() const { return m_size; }
+
+	//! Get the tile at the given index
+	const Tile &at(int index) const {
+		Q_ASSERT(index>=0 && index<m_size);
+		const auto i = m_tiles.constFind(index);
+		return i != m_tiles.constEnd() ? *i : m_fill;
+	}
+
+	/**
+	 * @brief Get a modifiable reference to a tile
+	 *
+	 * The fill tile is copied to the index if nothing has been stored there yet.
+	 * The reference remains valid until the next call to a non-const function.
+	 */
+	Tile &ref(int index);
+
+	//! Set the tile at the given index
+	void set(int index, const Tile &tile);
+
+	//! Replace every tile with the given one
+	void fill(const Tile &tile) { m_tiles.clear(); m_fill = tile; }
+
+	//! Get the tile used for all indices that have no tile of their own
+	const Tile &fillTile() const { return m_fill; }
+
+	//! Get the indices of all non-null tiles in ascending order
+	QVector<int> nonNullIndices() const;
+
+	//! Get the indices of tiles that may differ between this and the other map
+	QVector<int> differingIndices(const TileMap &other) const;
+
+	//! Drop blank tiles and tiles identical to the fill tile
+	void optimize();
+
+	//! Convert to a dense tile vector
+	QVector<Tile> toVector() const;
+
+	//! Make sure this map is not shared, so concurrent edits all go to the same storage
+	void detach() { m_tiles.detach(); }
+
+private:
+	QHash<int, Tile> m_tiles;
+	Tile m_fill;
+	int m_size;
+};
+
+}
+
+#endif
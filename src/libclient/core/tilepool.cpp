@@ -0,0 +1,232 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilepool.h"
+#include "tile.h"
+
+#include <QMutex>
+#include <QAtomicInteger>
+
+#include <new>
+
+namespace paintcore {
+
+namespace {
+
+// Free blocks are kept in singly linked lists stored in the blocks themselves
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+static const int THREAD_CACHE_SIZE = 32;  // max. blocks cached per thread
+static const int TRANSFER_BATCH = 16;     // blocks moved between a thread cache and the shared pool at once
+static const int SHARED_POOL_SIZE = 2048; // max. blocks kept in the shared pool (32 MB)
+
+struct SharedPool {
+	QMutex mutex;
+	FreeBlock *head = nullptr;
+	int count = 0;
+
+	QAtomicInteger<qint64> allocations;
+	QAtomicInteger<qint64> heapAllocations;
+	QAtomicInt inUse;
+	QAtomicInt highWaterMark;
+	QAtomicInt pooled;
+};
+
+// The shared pool is never destroyed, since tiles held in static
+// variables may still be freed while the program is exiting.
+SharedPool &sharedPool()
+{
+	static SharedPool *pool = new SharedPool;
+	return *pool;
+}
+
+// The thread cache must be trivially destructible, so it stays usable
+// after the thread's cache flusher has run.
+struct ThreadCache {
+	FreeBlock *head;
+	int count;
+	bool finished;
+};
+
+thread_local ThreadCache t_cache = { nullptr, 0, false };
+
+// Move up to n blocks from the thread cache to the shared pool
+void flushThreadCache(ThreadCache &cache, int n)
+{
+	SharedPool &pool = sharedPool();
+	FreeBlock *heapFree = nullptr;
+	{
+		QMutexLocker lock(&pool.mutex);
+		while(n-- > 0 && cache.head) {
+			FreeBlock *b = cache.head;
+			cache.head = b->next;
+			--cache.count;
+
+			if(pool.count < SHARED_POOL_SIZE) {
+				b->next = pool.head;
+				pool.head = b;
+				++pool.count;
+			} else {
+				b->next = heapFree;
+				heapFree = b;
+			}
+		}
+	}
+
+	while(heapFree) {
+		FreeBlock *b = heapFree;
+		heapFree = b->next;
+		pool.pooled.fetchAndSubRelaxed(1);
+		::operator delete(b);
+	}
+}
+
+struct ThreadCacheFlusher {
+	~ThreadCacheFlusher() {
+		flushThreadCache(t_cache, t_cache.count);
+		t_cache.finished = true;
+	}
+};
+
+// Get this thread's cache, or null if the thread is exiting
+ThreadCache *threadCache()
+{
+	if(t_cache.finished)
+		return nullptr;
+
+	static thread_local ThreadCacheFlusher flusher;
+	Q_UNUSED(flusher);
+
+	return &t_cache;
+}
+
+}
+
+size_t TilePool::blockSize()
+{
+	return sizeof(TileData);
+}
+
+void *TilePool::allocate()
+{
+	SharedPool &pool = sharedPool();
+
+	pool.allocations.fetchAndAddRelaxed(1);
+	const int inUse = pool.inUse.fetchAndAddRelaxed(1) + 1;
+	int hwm = pool.highWaterMark.loadAcquire();
+	while(inUse > hwm && !pool.highWaterMark.testAndSetOrdered(hwm, inUse, hwm)) { }
+
+	ThreadCache *cache = threadCache();
+	if(cache) {
+		if(!cache->head) {
+			// Refill the thread cache from the shared pool
+			QMutexLocker lock(&pool.mutex);
+			for(int i=0;i<TRANSFER_BATCH && pool.head;++i) {
+				FreeBlock *b = pool.head;
+				pool.head = b->next;
+				--pool.count;
+				b->next = cache->head;
+				cache->head = b;
+				++cache->count;
+			}
+		}
+
+		if(cache->head) {
+			FreeBlock *b = cache->head;
+			cache->head = b->next;
+			--cache->count;
+			pool.pooled.fetchAndSubRelaxed(1);
+			return b;
+		}
+	}
+
+	pool.heapAllocations.fetchAndAddRelaxed(1);
+	return ::operator new(blockSize());
+}
+
+void TilePool::release(void *block)
+{
+	if(!block)
+		return;
+
+	SharedPool &pool = sharedPool();
+	pool.inUse.fetchAndSubRelaxed(1);
+	pool.pooled.fetchAndAddRelaxed(1);
+
+	FreeBlock *b = static_cast<FreeBlock*>(block);
+
+	ThreadCache *cache = threadCache();
+	if(cache) {
+		b->next = cache->head;
+		cache->head = b;
+		++cache->count;
+
+		if(cache->count > THREAD_CACHE_SIZE)
+			flushThreadCache(*cache, TRANSFER_BATCH);
+
+	} else {
+		// The thread is exiting: put the block straight into the shared pool
+		{
+			QMutexLocker lock(&pool.mutex);
+			if(pool.count < SHARED_POOL_SIZE) {
+				b->next = pool.head;
+				pool.head = b;
+				++pool.count;
+				return;
+			}
+		}
+		pool.pooled.fetchAndSubRelaxed(1);
+		::operator delete(b);
+	}
+}
+
+TilePool::Stats TilePool::stats()
+{
+	const SharedPool &pool = sharedPool();
+	return Stats {
+		pool.allocations.loadAcquire(),
+		pool.heapAllocations.loadAcquire(),
+		pool.inUse.loadAcquire(),
+		pool.highWaterMark.loadAcquire(),
+		pool.pooled.loadAcquire()
+	};
+}
+
+void TilePool::trim()
+{
+	SharedPool &pool = sharedPool();
+	FreeBlock *head;
+	{
+		QMutexLocker lock(&pool.mutex);
+		head = pool.head;
+		pool.head = nullptr;
+		pool.count = 0;
+	}
+
+	while(head) {
+		FreeBlock *b = head;
+		head = b->next;
+		pool.pooled.fetchAndSubRelaxed(1);
+		::operator delete(b);
+	}
+}
+
+}
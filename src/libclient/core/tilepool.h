@@ -0,0 +1,82 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_CORE_TILEPOOL_H
+#define DP_CORE_TILEPOOL_H
+
+#include <QtGlobal>
+
+namespace paintcore {
+
+/**
+ * @brief A pool of memory blocks for tile data
+ *
+ * Tile data is allocated and freed at a high rate (every copy-on-write
+ * detach allocates a new block), and all blocks are the same size. Instead of
+ * going to the heap each time, freed blocks are kept for reuse.
+ *
+ * Each thread has a small cache of free blocks that can be used without locking.
+ * When a thread's cache runs empty or overflows, blocks are moved in batches
+ * to/from a shared pool. Blocks beyond the shared pool's limit are returned to the heap.
+ *
+ * All functions are thread-safe.
+ */
+class TilePool
+{
+public:
+	struct Stats {
+		//! Total number of blocks handed out
+		qint64 allocations;
+
+		//! Number of blocks handed out that had to be allocated from the heap
+		qint64 heapAllocations;
+
+		//! Number of blocks currently in use
+		int inUse;
+
+		//! Highest number of blocks in use at the same time
+		int highWaterMark;
+
+		//! Number of free blocks kept in the pool
+		int pooled;
+	};
+
+	//! The size of a single block in bytes
+	static size_t blockSize();
+
+	//! Get a block of blockSize() bytes
+	static void *allocate();
+
+	//! Return a block got from allocate()
+	static void release(void *block);
+
+	//! Get the current memory usage statistics
+	static Stats stats();
+
+	/**
+	 * @brief Return the blocks in the shared pool to the heap
+	 *
+	 * Blocks cached by threads are not affected.
+	 */
+	static void trim();
+};
+
+}
+
+#endif
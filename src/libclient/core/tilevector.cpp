@@ -19,6 +19,7 @@
 
 #include "tilevector.h"
 #include "layer.h"
+#include "concurrent.h"
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
 
@@ -91,23 +92,104 @@ LayerTileSet LayerTileSet::fromImage(const QImage &image, const QSize &layerSize
 	return fromLayer(l);
 }
 
-void LayerTileSet::toPutTiles(uint8_t contextId, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs) const
+/**
+ * Compress the given tiles in the thread pool.
+ * The output is in the same order as the input.
+ */
+static QVector<QByteArray> compressTiles(const QVector<const Tile*> &tiles, int level, net::compression::Codec codec)
 {
+	QVector<QByteArray> compressed(tiles.size());
+	QByteArray *out = compressed.data();
+
+	QList<int> indices;
+	indices.reserve(tiles.size());
+	for(int i=0;i<tiles.size();++i)
+		indices << i;
+
+	concurrentForEach<int>(indices, [&tiles, out, level, codec](int i) {
+		out[i] = net::compression::compress(reinterpret_cast<const uchar*>(tiles.at(i)->constData()), Tile::BYTES, codec, level);
+	});
+
+	return compressed;
+}
+
+void LayerTileSet::compressAll(const QVector<LayerTileSet*> &sets, int level, net::compression::Codec codec)
+{
+	QVector<const Tile*> tiles;
+	QVector<QByteArray*> targets;
+
+	for(LayerTileSet *set : sets) {
+		for(TileRun &t : set->tiles) {
+			if(!t.color.isValid() && !t.ref.valid && t.compressed.isEmpty()) {
+				Q_ASSERT(!t.tile.isNull());
+				tiles << &t.tile;
+				targets << &t.compressed;
+			}
+		}
+	}
+
+	const QVector<QByteArray> compressed = compressTiles(tiles, level, codec);
+	for(int i=0;i<compressed.size();++i)
+		*targets[i] = compressed.at(i);
+}
+
+void LayerTileSet::toPutTiles(uint8_t contextId, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs, int level, net::compression::Codec codec) const
+{
+	QVector<const Tile*> uncompressed;
+	for(const TileRun &t : tiles) {
+		if(!t.color.isValid() && !t.ref.valid && t.compressed.isEmpty()) {
+			Q_ASSERT(!t.tile.isNull());
+			uncompressed << &t.tile;
+		}
+	}
+
+	const QVector<QByteArray> compressed = compressTiles(uncompressed, level, codec);
+	int next = 0;
+
 	for(const TileRun &t : tiles) {
 		Q_ASSERT(t.len>0);
 
 		if(t.color.isValid()) {
 			msgs << protocol::MessagePtr(new protocol::PutTile(contextId, layerId, sublayer, t.col, t.row, t.len-1, t.color.rgba()));
 
-		} else {
-			Q_ASSERT(!t.tile.isNull());
+		} else if(t.ref.valid) {
+			msgs << protocol::PutTile::reference(contextId, layerId, sublayer, t.col, t.row, t.len-1, t.ref.layer, t.ref.sublayer, t.ref.col, t.ref.row);
 
+		} else {
 			msgs << protocol::MessagePtr(new protocol::PutTile(contextId, layerId, sublayer, t.col, t.row, t.len-1,
-				qCompress(reinterpret_cast<const uchar*>(t.tile.constData()), paintcore::Tile::BYTES)
+				t.compressed.isEmpty() ? compressed.at(next++) : t.compressed
 				));
 		}
 	}
 }
 
+int TileDictionary::deduplicate(LayerTileSet &tileset, uint16_t layerId, uint8_t sublayer)
+{
+	int found = 0;
+
+	for(TileRun &t : tileset.tiles) {
+		// Solid color tiles are already as small as they get
+		if(t.color.isValid() || t.ref.valid)
+			continue;
+
+		QVector<Entry> &bucket = m_entries[qHashBits(t.tile.constData(), Tile::BYTES)];
+
+		bool seen = false;
+		for(const Entry &e : bucket) {
+			if(e.tile.equals(t.tile)) {
+				t.ref = e.ref;
+				t.compressed = QByteArray();
+				seen = true;
+				++found;
+				break;
+			}
+		}
+
+		if(!seen)
+			bucket << Entry { t.tile, TileRef { true, layerId, sublayer, uint16_t(t.col), uint16_t(t.row) } };
+	}
+
+	return found;
 }
 
+}
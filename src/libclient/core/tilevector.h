@@ -21,10 +21,12 @@
 #define DP_CORE_TILEVECTOR_H
 
 #include "tile.h"
+#include "net/compression.h"
 #include "../libshared/net/message.h"
 
 #include <QVector>
 #include <QColor>
+#include <QHash>
 
 class QSize;
 class QPoint;
@@ -33,6 +35,17 @@ namespace paintcore {
 
 class Layer;
 
+/**
+ * @brief Location of a tile that has already been put
+ */
+struct TileRef {
+	bool valid;
+	uint16_t layer;
+	uint8_t sublayer;
+	uint16_t col;
+	uint16_t row;
+};
+
 /**
  * @brief One or more tile to be placed on a layer
  */
@@ -42,6 +55,8 @@ struct TileRun {
 	int row;
 	int len;      // the length of the tile run (always at least 1)
 	QColor color; // if valid, this tile is filled with solid color
+	QByteArray compressed; // precompressed tile content (see LayerTileSet::compressAll)
+	TileRef ref;  // if valid, this tile is a copy of an earlier one (see TileDictionary)
 };
 
 /**
@@ -61,14 +76,69 @@ struct LayerTileSet {
 	static LayerTileSet fromImage(const QImage &image);
 	static LayerTileSet fromImage(const QImage &image, const QSize &layerSize, const QPoint &offset);
 
+	/**
+	 * @brief Compress the non-solid tiles of all the given tile sets
+	 *
+	 * The tiles are compressed in parallel using the global thread pool.
+	 * Compressing all the layers of a canvas in one go keeps all cores
+	 * busy even when most of the content is on just a few layers.
+	 *
+	 * The result is identical to what toPutTiles would produce by itself.
+	 *
+	 * @param sets the tile sets to compress
+	 * @param level compression level (-1 for the codec's default)
+	 * @param codec compression codec
+	 */
+	static void compressAll(const QVector<LayerTileSet*> &sets, int level=-1, net::compression::Codec codec=net::compression::Codec::Zlib);
+
 	/**
 	 * @brief Generate PutTiles commands
+	 *
+	 * Tiles not already compressed by compressAll are compressed in parallel.
+	 * The messages are always generated in tile run order.
+	 *
 	 * @param contextid the message context ID to use
 	 * @param layerId target layer ID
 	 * @param sublayer target sublayer (0 for normal layers)
 	 * @param msgs where to put the messages
+	 * @param level compression level (-1 for the codec's default)
+	 * @param codec compression codec
 	 */
-	void toPutTiles(uint8_t contextid, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs) const;
+	void toPutTiles(uint8_t contextid, uint16_t layerId, uint8_t sublayer, protocol::MessageList &msgs, int level=-1, net::compression::Codec codec=net::compression::Codec::Zlib) const;
+};
+
+/**
+ * @brief A dictionary of the tiles put in a snapshot
+ *
+ * The RLE encoding of LayerTileSet only catches identical tiles that are
+ * next to each other. The dictionary catches the rest (e.g. repeating
+ * patterns or copied layers), so each unique tile is compressed and sent
+ * only once. Repeats are sent as PutTile references instead.
+ *
+ * Tile references require protocol version dp:4.21.3 or newer.
+ */
+class TileDictionary {
+public:
+	/**
+	 * @brief Replace already seen tiles with references
+	 *
+	 * New tiles are added to the dictionary. This must be called
+	 * for each tile set in the order their PutTiles will be sent.
+	 *
+	 * @param tileset the tile set to deduplicate
+	 * @param layerId the layer the tile set will be put on
+	 * @param sublayer the sublayer the tile set will be put on (0 for none)
+	 * @return number of tiles replaced with references
+	 */
+	int deduplicate(LayerTileSet &tileset, uint16_t layerId, uint8_t sublayer);
+
+private:
+	struct Entry {
+		Tile tile;
+		TileRef ref;
+	};
+
+	QHash<uint, QVector<Entry>> m_entries;
 };
 
 }
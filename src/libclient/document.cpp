@@ -107,7 +107,10 @@ Document::~Document()
 void Document::initCanvas()
 {
 	delete m_canvas;
-	m_canvas = new canvas::CanvasModel(m_client->myId(), this);
+
+	// Experimental: run the paint engine in its own thread
+	const bool paintThread = QSettings().value("settings/paintthread", false).toBool();
+	m_canvas = new canvas::CanvasModel(m_client->myId(), this, paintThread);
 
 	m_toolctrl->setModel(m_canvas);
 
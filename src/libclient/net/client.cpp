@@ -284,6 +284,9 @@ void Client::handleServerCommand(const protocol::Command &msg)
 		m_catchupTo = reply.reply["count"].toInt();
 		m_caughtUp = 0;
 		m_catchupProgress = 0;
+		// Lets the state tracker know the history download is starting
+		if(m_catchupTo > 0)
+			emit messageReceived(protocol::ClientInternal::makeCatchup(0));
 		break;
 	}
 }
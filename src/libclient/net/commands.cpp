@@ -18,6 +18,7 @@
 */
 
 #include "commands.h"
+#include "compression.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/net/image.h"
@@ -60,7 +61,7 @@ void splitImage(uint8_t ctxid, uint16_t layer, int x, int y, const QImage &image
 		image.sizeInBytes()
 #endif
 		);
-	QByteArray compressed = qCompress(data);
+	QByteArray compressed = compression::compress(data, compression::defaultCodec());
 
 	if(compressed.length() > protocol::PutImage::MAX_LEN) {
 		// Too big! Recursively divide the image and try sending those
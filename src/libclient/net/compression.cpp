@@ -0,0 +1,117 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compression.h"
+#include "../libshared/net/protover.h"
+
+#include <QtEndian>
+
+#include <zstd.h>
+
+namespace net {
+namespace compression {
+
+// A zstd frame starts with this magic number (little endian.)
+// A qCompressed payload starts with the big endian length of the
+// uncompressed data, so the first byte would be 0x28 only if the
+// payload was over 600 megabytes long, which no message can be.
+static const quint32 ZSTD_FRAME_MAGIC = 0xFD2FB528;
+
+static bool isZstdFrame(const QByteArray &data)
+{
+	return data.length() >= 4 && qFromLittleEndian<quint32>(data.constData()) == ZSTD_FRAME_MAGIC;
+}
+
+// Creating a compression context allocates its working memory,
+// so each thread keeps one around and reuses it.
+struct CompressionContext {
+	ZSTD_CCtx *ctx;
+
+	CompressionContext() : ctx(ZSTD_createCCtx()) { }
+	~CompressionContext() { ZSTD_freeCCtx(ctx); }
+	CompressionContext(const CompressionContext&) = delete;
+	CompressionContext &operator=(const CompressionContext&) = delete;
+};
+
+static ZSTD_CCtx *compressionContext()
+{
+	static thread_local CompressionContext context;
+	return context.ctx;
+}
+
+Codec codecFor(const protocol::ProtocolVersion &version)
+{
+	return version.supportsZstd() ? Codec::Zstd : Codec::Zlib;
+}
+
+Codec defaultCodec()
+{
+	return codecFor(protocol::ProtocolVersion::current());
+}
+
+QByteArray compress(const uchar *data, int len, Codec codec, int level)
+{
+	switch(codec) {
+	case Codec::Zlib:
+		return qCompress(data, len, level);
+
+	case Codec::Zstd: {
+		QByteArray out(int(ZSTD_compressBound(size_t(len))), 0);
+
+		ZSTD_CCtx *ctx = compressionContext();
+		if(!ctx) {
+			qWarning("Couldn't create zstd compression context");
+			return QByteArray();
+		}
+
+		// Level 0 is zstd's default level
+		const size_t outlen = ZSTD_compressCCtx(ctx, out.data(), size_t(out.length()), data, size_t(len), level < 0 ? 0 : level);
+		if(ZSTD_isError(outlen)) {
+			qWarning("Zstd compression failed: %s", ZSTD_getErrorName(outlen));
+			return QByteArray();
+		}
+
+		out.truncate(int(outlen));
+		return out;
+	}
+	}
+
+	Q_UNREACHABLE();
+	return QByteArray();
+}
+
+QByteArray decompress(const QByteArray &data, int expectedLength)
+{
+	if(!isZstdFrame(data))
+		return qUncompress(data);
+
+	const unsigned long long contentSize = ZSTD_getFrameContentSize(data.constData(), size_t(data.length()));
+	if(contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize != (unsigned long long)expectedLength)
+		return QByteArray();
+
+	QByteArray out(expectedLength, 0);
+	const size_t outlen = ZSTD_decompress(out.data(), size_t(out.length()), data.constData(), size_t(data.length()));
+	if(ZSTD_isError(outlen) || outlen != size_t(expectedLength))
+		return QByteArray();
+
+	return out;
+}
+
+}
+}
@@ -0,0 +1,84 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef NET_COMPRESSION_H
+#define NET_COMPRESSION_H
+
+#include <QByteArray>
+
+namespace protocol {
+	class ProtocolVersion;
+}
+
+namespace net {
+
+/**
+ * @brief Compression of bitmap payloads (PutImage, PutTile and CanvasBackground)
+ *
+ * The payload is self describing: the decoder detects the codec from the data,
+ * so content from older recordings and sessions can always be decoded.
+ */
+namespace compression {
+
+enum class Codec {
+	Zlib, // qCompress format. Supported by all protocol versions
+	Zstd  // Zstandard frame with content size. Added in dp:4.21.3
+};
+
+//! Get the best codec the given protocol version supports
+Codec codecFor(const protocol::ProtocolVersion &version);
+
+//! Get the codec to use in sessions of the current protocol version
+Codec defaultCodec();
+
+/**
+ * @brief Compress a bitmap payload
+ *
+ * This function is thread safe.
+ *
+ * @param data the data to compress
+ * @param len data length in bytes
+ * @param codec the codec to use
+ * @param level codec specific compression level (-1 for the codec's default)
+ */
+QByteArray compress(const uchar *data, int len, Codec codec, int level=-1);
+
+inline QByteArray compress(const QByteArray &data, Codec codec, int level=-1)
+{
+	return compress(reinterpret_cast<const uchar*>(data.constData()), data.length(), codec, level);
+}
+
+/**
+ * @brief Decompress a bitmap payload
+ *
+ * The codec is detected automatically.
+ *
+ * The expected length is used to reject bad data before allocating
+ * memory for it when the codec allows it. The caller should still check
+ * the length of the returned data.
+ *
+ * @param data compressed data
+ * @param expectedLength the expected length of the decompressed data
+ * @return decompressed data or an empty array on error
+ */
+QByteArray decompress(const QByteArray &data, int expectedLength);
+
+}
+}
+
+#endif
@@ -24,6 +24,7 @@
 #include "ora/orareader.h"
 #include "ora/orawriter.h"
 #include "canvas/features.h"
+#include "net/compression.h"
 
 #include "../libshared/net/layer.h"
 #include "../libshared/net/image.h"
@@ -471,7 +472,7 @@ static OraResult makeInitCommands(KZip &zip, const Canvas &canvas)
 				if(isSolidColor)
 					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, color));
 				else
-					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, qCompress(bgimage.constBits(), paintcore::Tile::BYTES)));
+					result.commands << MessagePtr(new protocol::CanvasBackground(ctxId, net::compression::compress(bgimage.constBits(), paintcore::Tile::BYTES, net::compression::defaultCodec())));
 
 				continue;
 			}
@@ -512,7 +513,7 @@ static OraResult makeInitCommands(KZip &zip, const Canvas &canvas)
 			blend
 		));
 
-		tileset.toPutTiles(ctxId, layerId, 0, result.commands);
+		tileset.toPutTiles(ctxId, layerId, 0, result.commands, -1, net::compression::defaultCodec());
 
 		if(layer.locked) {
 			result.commands << MessagePtr(new protocol::LayerACL(ctxId, layerId, true, int(canvas::Tier::Guest), QList<uint8_t>()));
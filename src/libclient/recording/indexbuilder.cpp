@@ -34,6 +34,12 @@
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QSaveFile>
+#include <QThread>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSemaphore>
+#include <QQueue>
 
 namespace recording {
 
@@ -195,6 +201,146 @@ static LayerStackWriteResult writeLayerStack(QDataStream &stream, const paintcor
 	return result;
 }
 
+//! A snapshot waiting to be written to the index file
+struct SnapshotJob {
+	canvas::StateSavepoint savepoint;
+	IndexEntry entry;
+	bool makeThumbnail;
+};
+
+class ThumbnailRunnable : public QRunnable {
+public:
+	ThumbnailRunnable(const canvas::StateSavepoint &savepoint, QSemaphore *done)
+		: m_savepoint(savepoint), m_done(done)
+	{
+		setAutoDelete(false);
+	}
+
+	void run() override
+	{
+		thumbnail = m_savepoint.thumbnail(QSize(171, 128));
+		m_savepoint = canvas::StateSavepoint();
+		m_done->release();
+	}
+
+	QImage thumbnail;
+
+private:
+	canvas::StateSavepoint m_savepoint;
+	QSemaphore *m_done;
+};
+
+/**
+ * @brief Background thread for writing snapshots into the index file
+ *
+ * The snapshots must be written in order, since each one reuses the tiles
+ * written by the previous one. Savepoints are copy-on-write, so the replay
+ * can continue while a snapshot is being serialized.
+ * Thumbnails don't depend on each other and are rendered in the global thread pool.
+ */
+class SnapshotWriter : public QThread {
+public:
+	//! Maximum number of snapshots waiting to be written before replay is paused
+	static const int MAX_QUEUED = 8;
+
+	explicit SnapshotWriter(QDataStream &stream)
+		: m_stream(stream), m_finished(false)
+	{
+	}
+
+	~SnapshotWriter()
+	{
+		cancel();
+	}
+
+	//! Queue a snapshot for writing. Blocks if the writer has fallen too far behind.
+	void enqueue(const SnapshotJob &job)
+	{
+		QMutexLocker lock(&m_mutex);
+		while(m_queue.size() >= MAX_QUEUED)
+			m_notFull.wait(&m_mutex);
+
+		m_queue.enqueue(job);
+		m_notEmpty.wakeOne();
+	}
+
+	//! Write out all queued snapshots and return the finished index entries
+	QVector<IndexEntry> finish()
+	{
+		{
+			QMutexLocker lock(&m_mutex);
+			m_finished = true;
+			m_notEmpty.wakeOne();
+		}
+		wait();
+
+		m_thumbnailsDone.acquire(m_thumbnails.size());
+		for(const auto &t : m_thumbnails) {
+			m_index[t.first].thumbnail = t.second->thumbnail;
+			delete t.second;
+		}
+		m_thumbnails.clear();
+
+		return m_index;
+	}
+
+	//! Discard the queued snapshots and stop the thread
+	void cancel()
+	{
+		{
+			QMutexLocker lock(&m_mutex);
+			m_queue.clear();
+			m_notFull.wakeAll();
+		}
+		finish();
+	}
+
+protected:
+	void run() override
+	{
+		LayerStackWriteResult lastSnapshot;
+
+		forever {
+			SnapshotJob job;
+			{
+				QMutexLocker lock(&m_mutex);
+				while(m_queue.isEmpty() && !m_finished)
+					m_notEmpty.wait(&m_mutex);
+
+				if(m_queue.isEmpty())
+					return;
+
+				job = m_queue.dequeue();
+				m_notFull.wakeOne();
+			}
+
+			lastSnapshot = writeLayerStack(m_stream, job.savepoint.canvas(), lastSnapshot.tileMap);
+			job.entry.snapshotOffset = lastSnapshot.offset;
+
+			if(job.makeThumbnail) {
+				auto *runnable = new ThumbnailRunnable(job.savepoint, &m_thumbnailsDone);
+				m_thumbnails << QPair<int, ThumbnailRunnable*>(m_index.size(), runnable);
+				QThreadPool::globalInstance()->start(runnable);
+			}
+
+			m_index << job.entry;
+		}
+	}
+
+private:
+	QDataStream &m_stream;
+
+	QMutex m_mutex;
+	QWaitCondition m_notEmpty;
+	QWaitCondition m_notFull;
+	QQueue<SnapshotJob> m_queue;
+	bool m_finished;
+
+	QVector<IndexEntry> m_index;
+	QVector<QPair<int, ThumbnailRunnable*>> m_thumbnails;
+	QSemaphore m_thumbnailsDone;
+};
+
 } // end anonymous namespace
 
 bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
@@ -211,7 +357,10 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 	QElapsedTimer timer;
 	int messagesSinceLastEntry = SNAPSHOT_MIN_ACTIONS + 1;
 	int messagesSinceLastThumbnail = THUMBNAIL_INTERVAL + 1;
-	LayerStackWriteResult lastSnapshot;
+
+	// Snapshots and thumbnails are written in the background while replay continues
+	SnapshotWriter writer(stream);
+	writer.start();
 
 	do {
 #if QT_VERSION < QT_VERSION_CHECK(5, 14, 0)
@@ -220,6 +369,7 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 		if(m_abortflag.loadRelaxed()) {
 #endif
 			qWarning() << "Indexing aborted";
+			writer.cancel();
 			return false;
 		}
 
@@ -238,28 +388,28 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 			) {
 				messagesSinceLastEntry = 0;
 
-				// A snapshot is saved at each index entry
-				const canvas::StateSavepoint sp = statetracker.createSavepoint(0);
-				lastSnapshot = writeLayerStack(stream, sp.canvas(), lastSnapshot.tileMap);
-
 				// A thumbnail is saved no more often than once every THUMBNAIL_INTERVAL messages
-				QImage thumbnail;
-				if(messagesSinceLastThumbnail >= THUMBNAIL_INTERVAL) {
+				const bool makeThumbnail = messagesSinceLastThumbnail >= THUMBNAIL_INTERVAL;
+				if(makeThumbnail)
 					messagesSinceLastThumbnail = 0;
-					thumbnail = sp.thumbnail(QSize(171, 128));
-				}
-
-				// Remember the position of the message and the state snapshot at that point in time
-				m_index << IndexEntry {
-					quint32(reader.currentIndex()),
-					messageOffset,
-					lastSnapshot.offset,
-					record.message->type() == protocol::MSG_MARKER ?
-						record.message.cast<protocol::Marker>().text()
-						:
-						QString(),
-					thumbnail
-				};
+
+				// A snapshot is saved at each index entry.
+				// Remember the position of the message and the state snapshot at that point in time.
+				// The snapshot offset and thumbnail are filled in by the writer.
+				writer.enqueue(SnapshotJob {
+					statetracker.createSavepoint(0),
+					IndexEntry {
+						quint32(reader.currentIndex()),
+						messageOffset,
+						0,
+						record.message->type() == protocol::MSG_MARKER ?
+							record.message.cast<protocol::Marker>().text()
+							:
+							QString(),
+						QImage()
+					},
+					makeThumbnail
+				});
 
 				emit progress(messageOffset);
 
@@ -275,6 +425,7 @@ bool IndexBuilder::generateIndex(QDataStream &stream, Reader &reader)
 	} while(record.status != MessageRecord::END_OF_RECORDING);
 
 	m_messageCount = reader.currentIndex();
+	m_index = writer.finish();
 
 	return true;
 }
@@ -29,6 +29,7 @@
 #include <QFile>
 #include <QImage>
 #include <QCache>
+#include <QtEndian>
 
 namespace recording {
 
@@ -41,6 +42,10 @@ struct IndexLoader::Private : public QSharedData
 	QFile file;
 	QDataStream stream;
 
+	// The whole index file, if it could be memory mapped
+	const uchar *mapped = nullptr;
+	qint64 mappedSize = 0;
+
 	QVector<IndexEntry> index;
 	QVector<IndexEntry> markers;
 	QVector<IndexEntry> thumbnails;
@@ -48,6 +53,7 @@ struct IndexLoader::Private : public QSharedData
 	QCache<quint32, paintcore::Tile> tileCache;
 
 	paintcore::Tile readTile(quint32 offset);
+	bool readMappedTile(quint32 offset, paintcore::Tile &tile) const;
 	paintcore::Layer *readLayer(quint32 layerOffset, const QSize &size, bool readSublayers=true);
 };
 
@@ -95,6 +101,10 @@ bool IndexLoader::open()
 
 	d->stream.setDevice(&d->file);
 
+	// Tiles are read straight from the mapping when possible
+	d->mapped = d->file.map(0, d->file.size());
+	d->mappedSize = d->mapped ? d->file.size() : 0;
+
 	// Check magic numbers
 	char magic[5];
 	d->stream.readRawData(magic, 5);
@@ -200,13 +210,49 @@ paintcore::Tile IndexLoader::Private::readTile(quint32 offset)
 	if(tileCache.contains(offset))
 		return *tileCache[offset];
 
-	file.seek(offset);
 	auto *t = new paintcore::Tile;
-	stream >> *t;
+	if(!mapped || !readMappedTile(offset, *t)) {
+		file.seek(offset);
+		stream >> *t;
+	}
 	tileCache.insert(offset, t);
 	return *t;
 }
 
+/**
+ * Read a tile directly from the memory mapped index.
+ *
+ * This parses the same format as operator>>(QDataStream&, Tile&), but decompresses
+ * the tile from the mapping without copying the compressed data first.
+ */
+bool IndexLoader::Private::readMappedTile(quint32 offset, paintcore::Tile &tile) const
+{
+	// Format: u32 compressed length, compressed data, i32 last edited by
+	if(qint64(offset) + 4 > mappedSize)
+		return false;
+
+	const uchar *ptr = mapped + offset;
+	const quint32 len = qFromBigEndian<quint32>(ptr);
+
+	// Null and empty byte arrays are both null tiles
+	if(len == 0 || len == 0xffffffff) {
+		tile = paintcore::Tile();
+		return true;
+	}
+
+	if(qint64(offset) + 4 + len + 4 > mappedSize)
+		return false;
+
+	const QByteArray data = qUncompress(ptr + 4, int(len));
+	if(data.length() != paintcore::Tile::BYTES) {
+		qWarning("Deserialized Tile length (%d) is wrong", data.length());
+		return false;
+	}
+
+	tile = paintcore::Tile(data, qFromBigEndian<qint32>(ptr + 4 + len));
+	return true;
+}
+
 paintcore::Layer *IndexLoader::Private::readLayer(quint32 layerOffset, const QSize &size, bool readSublayers)
 {
 	file.seek(layerOffset);
@@ -54,9 +54,9 @@ PlaybackController::PlaybackController(canvas::CanvasModel *canvas, Reader *read
 	connect(m_autoplayTimer, &QTimer::timeout, this, &PlaybackController::nextCommand);
 
 	// Calculate hash of the recording file if it is indexable.
-	// (only uncompressed recordings can be indexed)
+	// (only uncompressed and chunked recordings can be indexed)
 	// This is used to match up the index file to the recording.
-	if(!reader->isCompressed()) {
+	if(reader->isSeekable()) {
 		m_recordingHash = hashRecording(reader->filename());
 	}
 
@@ -88,7 +88,7 @@ qint64 PlaybackController::progress() const
 
 qint64 PlaybackController::maxProgress() const
 {
-	if(m_reader->isCompressed())
+	if(!m_reader->isSeekable())
 		return -1;
 	return m_reader->filesize();
 }
@@ -390,7 +390,7 @@ void PlaybackController::buildIndex()
 void PlaybackController::loadIndex()
 {
 	if(m_recordingHash.isEmpty()) {
-		emit indexLoadError(tr("Cannot index compressed recordings."), false);
+		emit indexLoadError(tr("Cannot index stream compressed recordings."), false);
 		return;
 	}
 
@@ -0,0 +1,110 @@
+#include "../core/layer.h"
+#include "../core/brushmask.h"
+#include "../brushes/classicbrushpainter.h"
+#include "../../libshared/net/brushes.h"
+
+#include <QtTest/QtTest>
+#include <QImage>
+
+using namespace paintcore;
+
+class TestBrushStamps : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Tile parallel stamping must give the same result as stamping one at a time
+	void testParallelStampsMatchSequential()
+	{
+		const QSize size(300, 200);
+
+		quint32 rng = 1234;
+		auto next = [&rng]() {
+			rng ^= rng << 13;
+			rng ^= rng >> 17;
+			rng ^= rng << 5;
+			return rng;
+		};
+
+		QVector<BrushStamp> stamps;
+		for(int i=0;i<100;++i) {
+			const int dia = 1 + next() % 90;
+			QVector<uchar> mask(dia*dia);
+			for(int j=0;j<mask.size();++j)
+				mask[j] = next() % 256;
+
+			stamps << BrushStamp {
+				int(next() % (size.width() + dia)) - dia,
+				int(next() % (size.height() + dia)) - dia,
+				BrushMask(dia, mask)
+			};
+		}
+
+		const BlendMode::Mode modes[] = {
+			BlendMode::MODE_NORMAL,
+			BlendMode::MODE_ERASE,
+			BlendMode::MODE_BEHIND,
+			BlendMode::MODE_MULTIPLY
+		};
+
+		for(const BlendMode::Mode mode : modes) {
+			Layer expected(1, QString(), QColor(0, 0, 255, 128), size);
+			Layer actual(1, QString(), QColor(0, 0, 255, 128), size);
+
+			EditableLayer e(&expected, nullptr, 1);
+			for(const BrushStamp &bs : stamps)
+				e.putBrushStamp(bs, Qt::red, mode);
+
+			EditableLayer(&actual, nullptr, 1).putBrushStamps(stamps, Qt::red, mode);
+
+			QCOMPARE(actual.toImage(), expected.toImage());
+		}
+	}
+
+	// Classic dabs drawn with cached masks must be identical to ones drawn with freshly made masks
+	void testClassicMaskCache()
+	{
+		const QSize size(200, 200);
+
+		// Dab positions are in quarter pixels, so this covers all the subpixel offsets,
+		// both above and below the high resolution mask size limit.
+		protocol::ClassicBrushDabVector dabs;
+		const uint16_t sizes[] = { 1*256, 3*256+100, 7*256, 20*256 };
+		for(const uint16_t dabSize : sizes) {
+			for(int i=0;i<8;++i)
+				dabs << protocol::ClassicBrushDab { int8_t(i % 2 ? 5 : -3), int8_t(i % 3 ? 7 : -1), dabSize, uint8_t(60 + i*20), uint8_t(255 - i*10) };
+		}
+
+		const protocol::DrawDabsClassic msg(1, 1, -10, 30, 0x00ff0000, BlendMode::MODE_NORMAL, dabs);
+		const QColor color = QColor::fromRgba(msg.color());
+
+		QVector<BrushStamp> stamps;
+		int x = msg.originX(), y = msg.originY();
+		for(const protocol::ClassicBrushDab &d : dabs) {
+			x += d.x;
+			y += d.y;
+			stamps << brushes::makeGimpStyleBrushStamp(QPointF(x/4.0, y/4.0), d.size/256.0, d.hardness/255.0, d.opacity/255.0);
+		}
+
+		Layer expected(1, QString(), Qt::transparent, size);
+		EditableLayer(&expected, nullptr, 1).putBrushStamps(stamps, color, BlendMode::MODE_NORMAL);
+
+		// The first round fills the cache and the second one uses it
+		for(int round=0;round<2;++round) {
+			const brushes::MaskCacheStats before = brushes::classicBrushMaskCacheStats();
+
+			Layer actual(1, QString(), Qt::transparent, size);
+			brushes::drawClassicBrushDabs(msg, EditableLayer(&actual, nullptr, 1));
+			QCOMPARE(actual.toImage(), expected.toImage());
+
+			if(round > 0) {
+				const brushes::MaskCacheStats after = brushes::classicBrushMaskCacheStats();
+				QCOMPARE(after.misses, before.misses);
+				QCOMPARE(after.hits, before.hits + dabs.size());
+			}
+		}
+	}
+};
+
+
+QTEST_MAIN(TestBrushStamps)
+#include "brushstamps.moc"
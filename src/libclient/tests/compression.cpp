@@ -0,0 +1,63 @@
+#include "../net/compression.h"
+#include "../../libshared/net/protover.h"
+
+#include <QtTest/QtTest>
+
+using namespace net::compression;
+
+Q_DECLARE_METATYPE(Codec)
+
+class TestCompression : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testRoundTrip_data()
+	{
+		QTest::addColumn<Codec>("codec");
+		QTest::newRow("zlib") << Codec::Zlib;
+		QTest::newRow("zstd") << Codec::Zstd;
+	}
+
+	void testRoundTrip()
+	{
+		QFETCH(Codec, codec);
+
+		QByteArray data(64*64*4, 0);
+		for(int i=0;i<data.length();++i)
+			data[i] = char((i * 7) ^ (i >> 5));
+
+		const QByteArray compressed = compress(data, codec);
+		QVERIFY(!compressed.isEmpty());
+		QVERIFY(compressed.length() < data.length());
+
+		// The codec is detected from the data
+		QCOMPARE(decompress(compressed, data.length()), data);
+	}
+
+	void testZlibCompatibility()
+	{
+		// Payloads made with plain qCompress must still decode
+		const QByteArray data(1000, 'x');
+		QCOMPARE(decompress(qCompress(data), data.length()), data);
+		QCOMPARE(compress(data, Codec::Zlib), qCompress(data));
+	}
+
+	void testWrongLength()
+	{
+		// A zstd frame whose content size doesn't match is rejected outright
+		const QByteArray data(1000, 'x');
+		QVERIFY(decompress(compress(data, Codec::Zstd), 2000).isEmpty());
+		QVERIFY(decompress(QByteArray("garbage"), 1000).isEmpty());
+	}
+
+	void testCodecFor()
+	{
+		QCOMPARE(codecFor(protocol::ProtocolVersion("dp", 4, 21, 2)), Codec::Zlib);
+		QCOMPARE(codecFor(protocol::ProtocolVersion("dp", 4, 21, 3)), Codec::Zstd);
+		QCOMPARE(codecFor(protocol::ProtocolVersion("xx", 4, 21, 3)), Codec::Zlib);
+	}
+};
+
+
+QTEST_MAIN(TestCompression)
+#include "compression.moc"
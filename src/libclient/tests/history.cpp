@@ -0,0 +1,54 @@
+#include "../canvas/history.h"
+#include "../../libshared/net/undo.h"
+#include "../../libshared/net/brushes.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using namespace canvas;
+
+class TestHistory : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testContextIndex()
+	{
+		History history;
+		history.resetTo(10);
+
+		// 10: UP(1), 11: PenUp(1), 12: UP(2), 13: PenUp(2), 14: UP(1), 15: PenUp(1)
+		history.append(MessagePtr(new UndoPoint(1)));
+		history.append(MessagePtr(new PenUp(1)));
+		history.append(MessagePtr(new UndoPoint(2)));
+		history.append(MessagePtr(new PenUp(2)));
+		history.append(MessagePtr(new UndoPoint(1)));
+		history.append(MessagePtr(new PenUp(1)));
+
+		QCOMPARE(history.undoPoints(), QVector<int>({10, 12, 14}));
+		QCOMPARE(history.undoPoints(1), QVector<int>({10, 14}));
+		QCOMPARE(history.undoPoints(2), QVector<int>({12}));
+		QCOMPARE(history.messages(1), QVector<int>({10, 11, 14, 15}));
+		QCOMPARE(history.messages(2), QVector<int>({12, 13}));
+		QVERIFY(history.messages(3).isEmpty());
+
+		QCOMPARE(history.undoPointsSince(10), 3);
+		QCOMPARE(history.undoPointsSince(11), 2);
+		QCOMPARE(history.undoPointsSince(15), 0);
+
+		// Indexes of discarded messages are removed
+		history.cleanup(13);
+		QCOMPARE(history.offset(), 13);
+		QCOMPARE(history.undoPoints(), QVector<int>({14}));
+		QCOMPARE(history.messages(1), QVector<int>({14, 15}));
+		QCOMPARE(history.messages(2), QVector<int>({13}));
+		QVERIFY(history.undoPoints(2).isEmpty());
+
+		history.resetTo(20);
+		QVERIFY(history.undoPoints().isEmpty());
+		QVERIFY(history.messages(1).isEmpty());
+	}
+};
+
+
+QTEST_MAIN(TestHistory)
+#include "history.moc"
@@ -0,0 +1,172 @@
+#include "../core/layerstack.h"
+#include "../core/layerstackobserver.h"
+#include "../core/layer.h"
+#include "../core/tile.h"
+#include "../core/blendmodes.h"
+
+#include <QtTest/QtTest>
+#include <QImage>
+
+using namespace paintcore;
+
+// An observer that paints the flattened canvas onto an image
+class ImageObserver : public LayerStackObserver
+{
+public:
+	QImage image;
+
+	void paint() { paintChangedTiles(QRect(QPoint(), image.size()), &image); }
+
+protected:
+	void areaChanged(const QRect &area) override { Q_UNUSED(area); }
+
+	void resized(int xoffset, int yoffset, const QSize &oldsize) override
+	{
+		Q_UNUSED(xoffset);
+		Q_UNUSED(yoffset);
+		Q_UNUSED(oldsize);
+		image = QImage(layerStack()->size(), QImage::Format_ARGB32_Premultiplied);
+		image.fill(0);
+	}
+};
+
+struct Edit {
+	int layer;
+	int sublayer;
+	QRect rect;
+	QColor color;
+};
+
+Q_DECLARE_METATYPE(QVector<Edit>)
+
+class TestLayerStack : public QObject
+{
+	Q_OBJECT
+private slots:
+	// The cached flattened tiles must match freshly composited ones after
+	// any sequence of edits, both for the layer stack's own background and
+	// for the observers' (checkerboard) background
+	void testFlatTileCache_data()
+	{
+		QTest::addColumn<QVector<Edit>>("edits");
+
+		const QRect left(10, 10, 80, 100);
+		const QRect right(100, 50, 120, 120);
+
+		QTest::newRow("same layer") << QVector<Edit> {
+			{ 3, 0, left, Qt::red },
+			{ 3, 0, right, Qt::blue },
+			{ 3, 0, left, Qt::green }
+		};
+		QTest::newRow("alternating layers") << QVector<Edit> {
+			{ 3, 0, left, Qt::red },
+			{ 1, 0, left, Qt::blue },
+			{ 3, 0, left, Qt::green },
+			{ 1, 0, right, Qt::yellow },
+			{ 2, 0, right, Qt::cyan },
+			{ 3, 0, right, Qt::magenta }
+		};
+		QTest::newRow("top and bottom") << QVector<Edit> {
+			{ 1, 0, left, Qt::red },
+			{ 3, 0, right, Qt::blue },
+			{ 1, 0, right, Qt::green },
+			{ 3, 0, left, Qt::yellow }
+		};
+		QTest::newRow("sublayers") << QVector<Edit> {
+			{ 3, 0, left, Qt::red },
+			{ 1, 5, left, Qt::blue },
+			{ 3, 0, left, Qt::green },
+			{ 2, 5, right, Qt::yellow },
+			{ 1, 6, right, Qt::cyan }
+		};
+	}
+
+	void testFlatTileCache()
+	{
+		QFETCH(QVector<Edit>, edits);
+
+		LayerStack stack;
+		{
+			EditableLayerStack es(&stack, 1);
+			es.resize(0, 256, 192, 0);
+			es.setBackground(Tile(QColor(255, 255, 255, 128)));
+			es.createLayer(1, 0, QColor(0, 0, 0, 64), false, false, "Bottom");
+			es.createLayer(2, 0, Qt::transparent, false, false, "Middle");
+			es.createLayer(3, 0, Qt::transparent, false, false, "Top");
+			es.getEditableLayer(2).setBlend(BlendMode::MODE_MULTIPLY);
+		}
+
+		ImageObserver observer;
+		observer.attachToLayerStack(&stack);
+
+		// Fill the cache before editing
+		compareFlattened(stack, observer);
+
+		for(const Edit &e : edits) {
+			{
+				EditableLayerStack es(&stack, 1);
+				EditableLayer l = es.getEditableLayer(e.layer);
+				QColor c = e.color;
+				c.setAlpha(160);
+				if(e.sublayer) {
+					l.getEditableSubLayer(e.sublayer, BlendMode::MODE_NORMAL, 200).fillRect(e.rect, c, BlendMode::MODE_NORMAL);
+				} else {
+					l.fillRect(e.rect, c, BlendMode::MODE_NORMAL);
+				}
+			}
+			compareFlattened(stack, observer);
+		}
+
+		// Merged sublayers must give the same result too
+		{
+			EditableLayerStack es(&stack, 1);
+			es.mergeAllSublayers();
+		}
+		compareFlattened(stack, observer);
+	}
+
+	// Sublayers know which layer they belong to, also in copied layers
+	void testSublayerParent()
+	{
+		LayerStack stack;
+		{
+			EditableLayerStack es(&stack, 1);
+			es.resize(0, 128, 128, 0);
+			es.createLayer(1, 0, Qt::transparent, false, false, "Layer");
+			es.getEditableLayer(1).getEditableSubLayer(5, BlendMode::MODE_NORMAL, 255).fillRect(QRect(0, 0, 10, 10), Qt::red, BlendMode::MODE_NORMAL);
+		}
+
+		const Layer *layer = stack.getLayer(1);
+		QVERIFY(!layer->parentLayer());
+		QCOMPARE(layer->sublayers().size(), 1);
+		QCOMPARE(layer->sublayers().first()->parentLayer(), layer);
+
+		QScopedPointer<LayerStack> copy(stack.clone());
+		const Layer *copiedLayer = copy->getLayer(1);
+		QCOMPARE(copiedLayer->sublayers().size(), 1);
+		QCOMPARE(copiedLayer->sublayers().first()->parentLayer(), copiedLayer);
+	}
+
+private:
+	// Compare the cached flattened tiles with ones composited by a copy of the stack
+	void compareFlattened(LayerStack &stack, ImageObserver &observer)
+	{
+		observer.paint();
+
+		QScopedPointer<LayerStack> fresh(stack.clone());
+		ImageObserver freshObserver;
+		freshObserver.attachToLayerStack(fresh.data());
+		freshObserver.paint();
+
+		QCOMPARE(observer.image, freshObserver.image);
+
+		for(int y=0;y<Tile::roundTiles(stack.height());++y) {
+			for(int x=0;x<Tile::roundTiles(stack.width());++x)
+				QVERIFY(stack.getFlatTile(x, y).equals(fresh->getFlatTile(x, y)));
+		}
+	}
+};
+
+
+QTEST_MAIN(TestLayerStack)
+#include "layerstack.moc"
@@ -0,0 +1,124 @@
+#include "../core/rasterop.h"
+
+#include <QtTest/QtTest>
+#include <QVector>
+
+using namespace paintcore;
+
+Q_DECLARE_METATYPE(CompositingKernel)
+
+class TestRasterOp : public QObject
+{
+	Q_OBJECT
+private slots:
+	void cleanup()
+	{
+		setCompositingKernel(m_default);
+	}
+
+	// The vectorized kernels must produce results identical to the scalar code
+	void testKernelsMatchScalar_data()
+	{
+		QTest::addColumn<CompositingKernel>("kernel");
+		QTest::newRow("SSE2") << CompositingKernel::SSE2;
+		QTest::newRow("SSE4.1") << CompositingKernel::SSE41;
+		QTest::newRow("AVX2") << CompositingKernel::AVX2;
+	}
+
+	void testKernelsMatchScalar()
+	{
+		QFETCH(CompositingKernel, kernel);
+		if(!setCompositingKernel(kernel))
+			QSKIP("Kernel not supported on this CPU");
+
+		const BlendMode::Mode modes[] = {
+			BlendMode::MODE_ERASE,
+			BlendMode::MODE_NORMAL,
+			BlendMode::MODE_MULTIPLY,
+			BlendMode::MODE_DIVIDE,
+			BlendMode::MODE_BURN,
+			BlendMode::MODE_DODGE,
+			BlendMode::MODE_DARKEN,
+			BlendMode::MODE_LIGHTEN,
+			BlendMode::MODE_SUBTRACT,
+			BlendMode::MODE_ADD,
+			BlendMode::MODE_RECOLOR,
+			BlendMode::MODE_BEHIND,
+			BlendMode::MODE_COLORERASE,
+			BlendMode::MODE_REPLACE
+		};
+
+		// Odd sized rectangle so the scalar tail code is exercised too
+		const int W = 37, H = 11, BASEW = 64;
+
+		Random rng;
+
+		for(int round=0;round<50;++round) {
+			QVector<quint32> base(BASEW*H), over(BASEW*H);
+			QVector<uchar> mask(W*H);
+
+			for(int i=0;i<base.size();++i) {
+				base[i] = randomPixel(rng);
+				over[i] = randomPixel(rng);
+			}
+			for(int i=0;i<mask.size();++i) {
+				switch(rng.bounded(3)) {
+				case 0: mask[i] = 0; break;
+				case 1: mask[i] = 255; break;
+				default: mask[i] = rng.bounded(256);
+				}
+			}
+			const quint32 color = rng.generate();
+			const uchar opacity = round % 5 == 0 ? 255 : rng.bounded(256);
+
+			for(const BlendMode::Mode mode : modes) {
+				QVector<quint32> expected = base, actual = base;
+
+				setCompositingKernel(CompositingKernel::Scalar);
+				compositeMask(mode, expected.data(), color, mask.constData(), W, H, 0, BASEW-W);
+				setCompositingKernel(kernel);
+				compositeMask(mode, actual.data(), color, mask.constData(), W, H, 0, BASEW-W);
+				QVERIFY2(expected == actual, qPrintable(QString("compositeMask mode %1").arg(mode)));
+
+				expected = base;
+				actual = base;
+				setCompositingKernel(CompositingKernel::Scalar);
+				compositePixels(mode, expected.data(), over.constData(), base.size()-3, opacity);
+				setCompositingKernel(kernel);
+				compositePixels(mode, actual.data(), over.constData(), base.size()-3, opacity);
+				QVERIFY2(expected == actual, qPrintable(QString("compositePixels mode %1").arg(mode)));
+			}
+		}
+	}
+
+private:
+	// A simple deterministic PRNG (xorshift32)
+	struct Random {
+		quint32 state = 1234;
+
+		quint32 generate()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+		quint32 bounded(quint32 max) { return generate() % max; }
+	};
+
+	static quint32 randomPixel(Random &rng)
+	{
+		switch(rng.bounded(4)) {
+		case 0: return 0;
+		case 1: return rng.generate() | 0xff000000;
+		default: return qPremultiply(rng.generate());
+		}
+	}
+
+	const CompositingKernel m_default = activeCompositingKernel();
+};
+
+
+QTEST_MAIN(TestRasterOp)
+#include "rasterop.moc"
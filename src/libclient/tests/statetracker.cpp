@@ -0,0 +1,252 @@
+#include "../canvas/statetracker.h"
+#include "../canvas/layerlist.h"
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../core/blendmodes.h"
+#include "../net/internalmsg.h"
+#include "../../libshared/net/brushes.h"
+#include "../../libshared/net/layer.h"
+#include "../../libshared/net/undo.h"
+
+#include <QtTest/QtTest>
+#include <QImage>
+
+using namespace protocol;
+using namespace canvas;
+
+static const int LAYER = 0x0101;
+
+// A state tracker with a canvas of its own
+struct Tracker {
+	paintcore::LayerStack image;
+	LayerListModel layers;
+	StateTracker tracker;
+
+	Tracker() : tracker(&image, &layers, 1) { }
+
+	void receive(const MessageList &msgs)
+	{
+		for(const MessagePtr &msg : msgs)
+			tracker.receiveCommand(msg);
+	}
+
+	QImage layerImage() const { return image.getLayer(LAYER)->toImage(); }
+};
+
+// Make a direct mode classic dab stroke. Coordinates are in quarter pixels.
+static MessagePtr classicDabs(uint8_t ctx, int x, int y, const QVector<QPoint> &offsets, uint16_t size)
+{
+	ClassicBrushDabVector dabs;
+	for(const QPoint &p : offsets)
+		dabs << ClassicBrushDab { int8_t(p.x()), int8_t(p.y()), size, 255, 128 };
+
+	return MessagePtr(new DrawDabsClassic(ctx, LAYER, x, y, 0x00ff0000 | ctx * 0x40, paintcore::BlendMode::MODE_NORMAL, dabs));
+}
+
+// Messages that do nothing, but make the history long enough for a new savepoint
+static MessageList filler(uint8_t ctx)
+{
+	MessageList msgs;
+	for(int i=0;i<1100;++i)
+		msgs << MessagePtr(new PenUp(ctx));
+	msgs << MessagePtr(new UndoPoint(ctx));
+	return msgs;
+}
+
+static MessageList canvasSetup()
+{
+	return MessageList()
+		<< MessagePtr(new CanvasResize(1, 0, 256, 192, 0))
+		<< MessagePtr(new LayerCreate(1, LAYER, 0, 0, 0, "Layer"))
+		<< filler(1);
+}
+
+class TestStateTracker : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Undoing by restoring and replaying just the affected tiles must give
+	// the same result as a full revert and replay. Small dabs right at the
+	// tile edges must not escape the restored area.
+	void testScopedUndo()
+	{
+		Tracker scoped, full;
+		full.tracker.setScopedReplayEnabled(false);
+
+		const MessageList history = canvasSetup()
+			// A large dab in the second column of tiles
+			<< MessagePtr(new UndoPoint(2))
+			<< classicDabs(2, 80*4, 20*4, { {0, 0}, {8, 4} }, 20*256)
+			<< filler(1)
+			// Small dabs right at the tile edges
+			<< classicDabs(1, 64*4-1, 20*4, { {0, 0}, {1, 0}, {1, 0}, {0, 100} }, 256)
+			<< classicDabs(1, 64*4-2, 64*4-1, { {0, 0}, {3, 1}, {1, 2} }, 300)
+			<< classicDabs(1, 128*4+1, 64*4+2, { {0, 0}, {-2, -3} }, 200);
+
+		scoped.receive(history);
+		full.receive(history);
+		QCOMPARE(scoped.layerImage(), full.layerImage());
+
+		// Undo the large dab: this is replayed from the first savepoint
+		const MessageList undo2 { MessagePtr(new Undo(2, 0, false)) };
+		scoped.receive(undo2);
+		full.receive(undo2);
+		QCOMPARE(scoped.layerImage(), full.layerImage());
+
+		// Undo the small dabs: this is replayed from the second savepoint,
+		// which must not include the large dab anymore
+		const MessageList undo1 { MessagePtr(new Undo(1, 0, false)) };
+		scoped.receive(undo1);
+		full.receive(undo1);
+		QCOMPARE(scoped.layerImage(), full.layerImage());
+
+		// And redo both
+		const MessageList redo { MessagePtr(new Undo(2, 0, true)), MessagePtr(new Undo(1, 0, true)) };
+		scoped.receive(redo);
+		full.receive(redo);
+		QCOMPARE(scoped.layerImage(), full.layerImage());
+	}
+
+	// Executing the catchup history in one go must give the same result
+	// as receiving the messages one at a time
+	void testFastCatchup()
+	{
+		Tracker fast, slow;
+		fast.tracker.setFastCatchupEnabled(true);
+
+		const MessageList history = canvasSetup()
+			<< MessagePtr(new UndoPoint(2))
+			<< classicDabs(2, 80*4, 20*4, { {0, 0}, {8, 4} }, 20*256)
+			<< filler(1)
+			<< classicDabs(1, 30*4, 30*4, { {0, 0}, {100, 100} }, 10*256)
+			<< MessagePtr(new UndoPoint(1))
+			<< classicDabs(1, 150*4, 100*4, { {0, 0}, {-50, 20} }, 16*256)
+			<< MessagePtr(new Undo(2, 0, false))
+			<< MessagePtr(new Undo(1, 0, false))
+			<< MessagePtr(new Undo(1, 0, true))
+			<< MessagePtr(new UndoPoint(1))
+			<< classicDabs(1, 200*4, 150*4, { {0, 0}, {10, -10} }, 30*256);
+
+		fast.receive(MessageList() << ClientInternal::makeCatchup(0) << history << ClientInternal::makeCatchup(100));
+		slow.receive(history);
+
+		compareTrackers(fast, slow);
+
+		// Both must also behave the same after the catchup
+		const MessageList more {
+			MessagePtr(new Undo(2, 0, true)),
+			MessagePtr(new Undo(1, 0, false))
+		};
+		fast.receive(more);
+		slow.receive(more);
+
+		compareTrackers(fast, slow);
+	}
+
+	// A savepoint is made at an undo point once there are enough messages
+	// since the previous one, or replaying them would take long enough
+	void testSavepointPlacement()
+	{
+		Tracker t;
+		t.receive(canvasSetup());
+		const int initial = t.tracker.savepoints().size();
+		const int lastPos = t.tracker.savepoints().last().streamPointer();
+
+		// A few cheap messages are not worth a savepoint
+		MessageList few;
+		for(int i=0;i<500;++i)
+			few << MessagePtr(new PenUp(1));
+		few << MessagePtr(new UndoPoint(1));
+		t.receive(few);
+		QCOMPARE(t.tracker.savepoints().size(), initial);
+		QCOMPARE(t.tracker.savepoints().last().streamPointer(), lastPos);
+
+		// But many of them are
+		t.receive(filler(1));
+		QCOMPARE(t.tracker.savepoints().size(), initial + 1);
+		QCOMPARE(t.tracker.savepoints().last().streamPointer(), t.tracker.history().end()-1);
+
+		// A few expensive messages are too
+		const int cheapPos = t.tracker.savepoints().last().streamPointer();
+		int sent = 0;
+		while(t.tracker.savepoints().last().streamPointer() == cheapPos && sent < 800) {
+			t.receive(MessageList()
+				<< classicDabs(1, 128*4, 96*4, QVector<QPoint>(40), 255*256)
+				<< MessagePtr(new UndoPoint(1))
+			);
+			sent += 2;
+		}
+		QVERIFY(t.tracker.savepoints().last().streamPointer() != cheapPos);
+		QCOMPARE(t.tracker.savepoints().last().streamPointer(), t.tracker.history().end()-1);
+	}
+
+	// Savepoints are thinned by the memory held by the tiles that only they have
+	void testSavepointThinning_data()
+	{
+		QTest::addColumn<int>("dabSize");
+		QTest::addColumn<int>("budgetTiles");
+		QTest::addColumn<bool>("thinned");
+
+		// Each savepoint has one tile of its own
+		QTest::newRow("small within budget") << 10 << 30 << false;
+		QTest::newRow("small over budget") << 10 << 10 << true;
+
+		// Each savepoint has every tile of the canvas to itself
+		QTest::newRow("large over budget") << 255 << 30 << true;
+	}
+
+	void testSavepointThinning()
+	{
+		QFETCH(int, dabSize);
+		QFETCH(int, budgetTiles);
+		QFETCH(bool, thinned);
+
+		Tracker t;
+		t.tracker.setSavepointMemoryBudget(qint64(budgetTiles) * paintcore::Tile::BYTES);
+		t.receive(canvasSetup());
+		const int oldest = t.tracker.savepoints().first().streamPointer();
+		const int before = t.tracker.savepoints().size();
+
+		// The same spot is painted between each savepoint, so every savepoint
+		// differs from both of its neighbours there
+		const int rounds = 20;
+		for(int i=0;i<rounds;++i)
+			t.receive(MessageList() << classicDabs(1, 32*4, 32*4, { {0, 0} }, dabSize*256) << filler(1));
+
+		const QList<StateSavepoint> &savepoints = t.tracker.savepoints();
+		if(thinned) {
+			QVERIFY(savepoints.size() < before + rounds);
+			QVERIFY(savepoints.size() >= 5);
+		} else {
+			QCOMPARE(savepoints.size(), before + rounds);
+		}
+
+		// The oldest and newest savepoints are always kept
+		QCOMPARE(savepoints.first().streamPointer(), oldest);
+		QCOMPARE(savepoints.last().streamPointer(), t.tracker.history().end()-1);
+	}
+
+private:
+	void compareTrackers(const Tracker &a, const Tracker &b)
+	{
+		const History &ha = a.tracker.history();
+		const History &hb = b.tracker.history();
+		QCOMPARE(ha.end(), hb.end());
+		for(int i=qMax(ha.offset(), hb.offset());i<ha.end();++i)
+			QCOMPARE(int(ha.at(i)->undoState()), int(hb.at(i)->undoState()));
+
+		const QList<StateSavepoint> &spa = a.tracker.savepoints();
+		const QList<StateSavepoint> &spb = b.tracker.savepoints();
+		QCOMPARE(spa.size(), spb.size());
+		for(int i=0;i<spa.size();++i) {
+			QCOMPARE(spa.at(i).streamPointer(), spb.at(i).streamPointer());
+			QCOMPARE(spa.at(i).thumbnail(QSize(256, 192)), spb.at(i).thumbnail(QSize(256, 192)));
+		}
+
+		QCOMPARE(a.layerImage(), b.layerImage());
+	}
+};
+
+
+QTEST_MAIN(TestStateTracker)
+#include "statetracker.moc"
@@ -0,0 +1,119 @@
+#include "../core/tilemap.h"
+
+#include <QtTest/QtTest>
+#include <QColor>
+
+using namespace paintcore;
+
+class TestTileMap : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Indices without a tile of their own return the fill tile
+	void testFill()
+	{
+		const Tile red(QColor(Qt::red));
+		TileMap map(10, red);
+		QCOMPARE(map.size(), 10);
+		for(int i=0;i<map.size();++i)
+			QVERIFY(map.at(i) == red);
+
+		const Tile blue(QColor(Qt::blue));
+		map.set(3, blue);
+		QVERIFY(map.at(3) == blue);
+		QVERIFY(map.at(4) == red);
+
+		map.fill(Tile());
+		QVERIFY(map.fillTile().isNull());
+		for(int i=0;i<map.size();++i)
+			QVERIFY(map.at(i).isNull());
+	}
+
+	// Modifying a tile through ref() must not change the fill tile or other maps
+	void testRef()
+	{
+		const Tile red(QColor(Qt::red));
+		TileMap map(4, red);
+		const TileMap copy = map;
+
+		map.ref(1).data()[0] = 0;
+		QCOMPARE(map.at(1).pixel(0, 0), quint32(0));
+		QCOMPARE(map.at(0).pixel(0, 0), red.pixel(0, 0));
+		QCOMPARE(map.fillTile().pixel(0, 0), red.pixel(0, 0));
+		QCOMPARE(copy.at(1).pixel(0, 0), red.pixel(0, 0));
+	}
+
+	// Converting to and from a dense vector must give back the same tiles
+	void testDenseRoundtrip()
+	{
+		const Tile red(QColor(Qt::red));
+		const Tile blue(QColor(Qt::blue));
+		const QVector<Tile> tiles { Tile(), blue, blue, Tile(), red, blue };
+
+		const TileMap map(tiles);
+		QCOMPARE(map.size(), tiles.size());
+		QVERIFY(map.fillTile() == blue);
+
+		const QVector<Tile> dense = map.toVector();
+		QCOMPARE(dense.size(), tiles.size());
+		for(int i=0;i<tiles.size();++i)
+			QVERIFY(dense.at(i) == tiles.at(i));
+	}
+
+	void testNonNullIndices()
+	{
+		const Tile red(QColor(Qt::red));
+
+		TileMap sparse(8);
+		sparse.set(6, red);
+		sparse.set(2, red);
+		QCOMPARE(sparse.nonNullIndices(), QVector<int>({2, 6}));
+
+		TileMap filled(5, red);
+		filled.set(0, Tile());
+		filled.set(3, Tile());
+		QCOMPARE(filled.nonNullIndices(), QVector<int>({1, 2, 4}));
+	}
+
+	void testDifferingIndices()
+	{
+		const Tile red(QColor(Qt::red));
+		const Tile blue(QColor(Qt::blue));
+
+		TileMap a(6, red);
+		a.set(1, blue);
+		TileMap b = a;
+		QVERIFY(a.differingIndices(b).isEmpty());
+
+		b.set(4, blue);
+		b.set(1, red);
+		QCOMPARE(a.differingIndices(b), QVector<int>({1, 4}));
+		QCOMPARE(b.differingIndices(a), QVector<int>({1, 4}));
+
+		// Identical contents, but different tiles
+		TileMap c(6, Tile(QColor(Qt::red)));
+		c.set(1, blue);
+		QCOMPARE(a.differingIndices(c), QVector<int>({0, 2, 3, 4, 5}));
+	}
+
+	// Blank tiles are replaced with null ones and tiles matching the fill tile are dropped
+	void testOptimize()
+	{
+		const Tile red(QColor(Qt::red));
+
+		TileMap map(4, Tile(QColor(Qt::transparent)));
+		map.set(1, red);
+		map.ref(2);
+		map.optimize();
+
+		QVERIFY(map.fillTile().isNull());
+		QVERIFY(map.at(0).isNull());
+		QVERIFY(map.at(1) == red);
+		QVERIFY(map.at(2).isNull());
+		QCOMPARE(map.nonNullIndices(), QVector<int>({1}));
+	}
+};
+
+
+QTEST_MAIN(TestTileMap)
+#include "tilemap.moc"
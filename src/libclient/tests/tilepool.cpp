@@ -0,0 +1,87 @@
+#include "../core/tile.h"
+#include "../core/tilepool.h"
+
+#include <QtTest/QtTest>
+#include <QThread>
+#include <QColor>
+
+using namespace paintcore;
+
+class TileMakerThread : public QThread
+{
+public:
+	QVector<Tile> tiles;
+
+	void run() override
+	{
+		for(int i=0;i<100;++i)
+			tiles << Tile(QColor(Qt::yellow));
+	}
+};
+
+class TestTilePool : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Allocation counters must track tiles as they are created, detached and destroyed
+	void testAccounting()
+	{
+		const TilePool::Stats before = TilePool::stats();
+		{
+			Tile a(QColor(Qt::red));
+			Tile b = a;
+			QCOMPARE(TilePool::stats().inUse, before.inUse + 1);
+
+			// copy-on-write detach allocates a new block
+			b.data()[0] = 0;
+			QCOMPARE(TilePool::stats().inUse, before.inUse + 2);
+			QVERIFY(TilePool::stats().highWaterMark >= before.inUse + 2);
+			QCOMPARE(a.pixel(0, 0), qPremultiply(QColor(Qt::red).rgba()));
+			QCOMPARE(b.pixel(0, 0), quint32(0));
+		}
+
+		const TilePool::Stats after = TilePool::stats();
+		QCOMPARE(after.inUse, before.inUse);
+		QCOMPARE(after.allocations, before.allocations + 2);
+		QVERIFY(after.pooled >= 2);
+	}
+
+	// Freed blocks should be reused rather than allocated from the heap again
+	void testReuse()
+	{
+		{
+			QVector<Tile> tiles;
+			for(int i=0;i<10;++i)
+				tiles << Tile(QColor(Qt::blue));
+		}
+
+		const TilePool::Stats before = TilePool::stats();
+		{
+			QVector<Tile> tiles;
+			for(int i=0;i<10;++i)
+				tiles << Tile(QColor(Qt::green));
+		}
+		QCOMPARE(TilePool::stats().heapAllocations, before.heapAllocations);
+	}
+
+	// Tiles may be freed in a different thread than where they were allocated
+	void testCrossThread()
+	{
+		const TilePool::Stats before = TilePool::stats();
+
+		TileMakerThread thread;
+		thread.start();
+		QVERIFY(thread.wait());
+
+		QCOMPARE(TilePool::stats().inUse, before.inUse + 100);
+		thread.tiles.clear();
+		QCOMPARE(TilePool::stats().inUse, before.inUse);
+
+		TilePool::trim();
+		QVERIFY(TilePool::stats().pooled <= 32);
+	}
+};
+
+
+QTEST_MAIN(TestTilePool)
+#include "tilepool.moc"
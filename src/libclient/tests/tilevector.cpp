@@ -0,0 +1,99 @@
+#include "../core/tilevector.h"
+#include "../../libshared/net/image.h"
+
+#include <QtTest/QtTest>
+#include <QImage>
+
+using namespace paintcore;
+
+class TestTileVector : public QObject
+{
+	Q_OBJECT
+private slots:
+	// Parallel compression must produce the same messages, in the same order, as compressing one tile at a time
+	void testDeterministicOutput()
+	{
+		QImage image(Tile::SIZE * 7 + 13, Tile::SIZE * 5 + 3, QImage::Format_ARGB32_Premultiplied);
+		image.fill(Qt::transparent);
+
+		quint32 seed = 12345;
+		for(int y=0;y<image.height();++y) {
+			// Leave some rows empty so the tile set contains solid tiles too
+			if((y / Tile::SIZE) % 2 == 1)
+				continue;
+			quint32 *row = reinterpret_cast<quint32*>(image.scanLine(y));
+			for(int x=0;x<image.width();++x) {
+				seed = seed * 1103515245 + 12345;
+				row[x] = 0xff000000 | (seed >> 8);
+			}
+		}
+
+		const LayerTileSet tileset = LayerTileSet::fromImage(image);
+
+		protocol::MessageList expected;
+		for(const TileRun &t : tileset.tiles) {
+			if(t.color.isValid())
+				expected << protocol::MessagePtr(new protocol::PutTile(1, 2, 0, t.col, t.row, t.len-1, t.color.rgba()));
+			else
+				expected << protocol::MessagePtr(new protocol::PutTile(1, 2, 0, t.col, t.row, t.len-1,
+					qCompress(reinterpret_cast<const uchar*>(t.tile.constData()), Tile::BYTES, 1)));
+		}
+
+		protocol::MessageList direct;
+		tileset.toPutTiles(1, 2, 0, direct, 1);
+
+		LayerTileSet precompressed = tileset;
+		LayerTileSet::compressAll({&precompressed}, 1);
+		protocol::MessageList batched;
+		precompressed.toPutTiles(1, 2, 0, batched, 1);
+
+		QCOMPARE(direct.size(), expected.size());
+		QCOMPARE(batched.size(), expected.size());
+		for(int i=0;i<expected.size();++i) {
+			QVERIFY(direct.at(i).equals(expected.at(i)));
+			QVERIFY(batched.at(i).equals(expected.at(i)));
+		}
+	}
+
+	// Repeated tiles should be replaced with references to the first copy
+	void testDeduplication()
+	{
+		// Two tile wide checkerboard: the same two tiles repeat, but never next to each other
+		QImage image(Tile::SIZE * 3, Tile::SIZE * 2, QImage::Format_ARGB32_Premultiplied);
+		for(int y=0;y<image.height();++y) {
+			quint32 *row = reinterpret_cast<quint32*>(image.scanLine(y));
+			for(int x=0;x<image.width();++x) {
+				const bool odd = ((x / Tile::SIZE) + (y / Tile::SIZE)) % 2;
+				row[x] = ((x ^ y) & 1) ? 0xff000000 : (odd ? 0xffff0000 : 0xff0000ff);
+			}
+		}
+
+		LayerTileSet first = LayerTileSet::fromImage(image);
+		LayerTileSet second = first;
+		QCOMPARE(first.tiles.size(), 6);
+
+		TileDictionary dictionary;
+		QCOMPARE(dictionary.deduplicate(first, 0x0101, 0), 4);
+		QCOMPARE(dictionary.deduplicate(second, 0x0102, 0), 6);
+
+		// The first two tiles are unique, the rest refer to them
+		QVERIFY(!first.tiles.at(0).ref.valid);
+		QVERIFY(!first.tiles.at(1).ref.valid);
+		for(int i=2;i<first.tiles.size();++i) {
+			const TileRef &ref = first.tiles.at(i).ref;
+			QVERIFY(ref.valid);
+			QCOMPARE(int(ref.layer), 0x0101);
+			QVERIFY(first.tiles.at(ref.col + ref.row * 3).tile.equals(first.tiles.at(i).tile));
+		}
+
+		protocol::MessageList msgs;
+		second.toPutTiles(1, 0x0102, 0, msgs);
+		QCOMPARE(msgs.size(), 6);
+		for(const protocol::MessagePtr &msg : msgs)
+			QVERIFY(msg.cast<protocol::PutTile>().isReference());
+	}
+};
+
+
+QTEST_MAIN(TestTileVector)
+#include "tilevector.moc"
@@ -112,11 +112,13 @@ QString fileFormatFilter(FileFormatOptions formats)
 				<< QGuiApplication::tr("Text Recordings (%1)").arg("*.dptxt")
 				<< QGuiApplication::tr("Compressed Binary Recordings (%1)").arg("*.dprecz")
 				<< QGuiApplication::tr("Compressed Text Recordings (%1)").arg("*.dptxtz")
+				<< QGuiApplication::tr("Seekable Compressed Binary Recordings (%1)").arg("*.dprecc")
+				<< QGuiApplication::tr("Seekable Compressed Text Recordings (%1)").arg("*.dptxtc")
 				;
 
 		} else {
 			// A single Recordings filter for loading
-			recordings = "*.dprec *.dptxt *.dprecz *.dptxtz *.dprec.gz *.dptxt.gz";
+			recordings = "*.dprec *.dptxt *.dprecz *.dptxtz *.dprecc *.dptxtc *.dprec.gz *.dptxt.gz";
 			filter
 				<< QGuiApplication::tr("Recordings (%1)").arg(recordings)
 				;
@@ -24,6 +24,7 @@
 #include "serverlog.h"
 
 #include <QTimerEvent>
+#include <QThread>
 
 namespace sessionlisting {
 
@@ -40,6 +41,14 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 	Q_ASSERT(session);
 	Q_ASSERT(mode != PrivacyMode::Undefined);
 
+	if(QThread::currentThread() != thread()) {
+		// Called from a session thread
+		QMetaObject::invokeMethod(this, [this, session, listServer, mode]() {
+			announceSession(session, listServer, mode);
+		}, Qt::QueuedConnection);
+		return;
+	}
+
 	if(!listServer.isValid() || !m_config->isAllowedAnnouncementUrl(listServer)) {
 		server::Log()
 			.about(server::Log::Level::Warn, server::Log::Topic::PubList)
@@ -56,13 +65,16 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 		return;
 
 	// Make announcement
-	m_announcements << Listing {
-		listServer,
-		session,
-		Announcement {},
-		QElapsedTimer(),
-		PrivacyMode::Undefined
-	};
+	{
+		QMutexLocker lock(&m_mutex);
+		m_announcements << Listing {
+			listServer,
+			session,
+			Announcement {},
+			QElapsedTimer(),
+			PrivacyMode::Undefined
+		};
+	}
 
 	server::Log()
 		.about(server::Log::Level::Info, server::Log::Topic::PubList)
@@ -101,10 +113,13 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 			listing->session->sendListserverMessage(message);
 		}
 
-		listing->announcement = result.value<sessionlisting::Announcement>();
-		Q_ASSERT(listing->announcement.apiUrl == listing->listServer);
-		listing->mode = listing->announcement.isPrivate ? PrivacyMode::Private : PrivacyMode::Public;
-		listing->refreshTimer.start();
+		{
+			QMutexLocker lock(&m_mutex);
+			listing->announcement = result.value<sessionlisting::Announcement>();
+			Q_ASSERT(listing->announcement.apiUrl == listing->listServer);
+			listing->mode = listing->announcement.isPrivate ? PrivacyMode::Private : PrivacyMode::Public;
+			listing->refreshTimer.start();
+		}
 
 		emit announcementsChanged(listing->session);
 
@@ -117,6 +132,14 @@ void Announcements::announceSession(Announcable *session, const QUrl &listServer
 
 void Announcements::unlistSession(Announcable *session, const QUrl &listServer, bool delist)
 {
+	if(QThread::currentThread() != thread()) {
+		// Called from a session thread
+		QMetaObject::invokeMethod(this, [this, session, listServer, delist]() {
+			unlistSession(session, listServer, delist);
+		}, Qt::QueuedConnection);
+		return;
+	}
+
 	QMutableVectorIterator<Listing> i(m_announcements);
 	QSet<Announcable*> changes;
 
@@ -140,6 +163,7 @@ void Announcements::unlistSession(Announcable *session, const QUrl &listServer,
 				connect(response, &AnnouncementApiResponse::finished, response, &AnnouncementApiResponse::deleteLater);
 			}
 
+			QMutexLocker lock(&m_mutex);
 			i.remove();
 		}
 	}
@@ -276,6 +300,7 @@ void Announcements::refreshListings()
 QVector<Announcement> Announcements::getAnnouncements(const Announcable *session) const
 {
 	QVector<Announcement> list;
+	QMutexLocker lock(&m_mutex);
 	for(const auto &listing : m_announcements) {
 		if(listing.mode != PrivacyMode::Undefined && listing.session == session)
 			list << listing.announcement;
@@ -24,6 +24,7 @@
 #include <QObject>
 #include <QVector>
 #include <QElapsedTimer>
+#include <QMutex>
 
 namespace server {
 	class ServerConfig;
@@ -35,6 +36,10 @@ class Announcable;
 
 /**
  * @brief All session announcements made from this server
+ *
+ * The announcements object lives in the main thread. Sessions running
+ * in worker threads may call announceSession and unlistSession, which
+ * are then queued to the main thread, and getAnnouncements.
  */
 class Announcements : public QObject
 {
@@ -92,6 +97,7 @@ private:
 	void refreshListings();
 
 	QVector<Listing> m_announcements;
+	mutable QMutex m_mutex; // held when m_announcements is modified or read from another thread
 	server::ServerConfig *m_config;
 
 	int m_timerId;
@@ -328,7 +328,10 @@ void Client::receiveMessages()
 
 		if(d->session.isNull()) {
 			// No session? We must be in the login phase
-			if(msg->type() == protocol::MSG_COMMAND)
+			if(isHoldLocked())
+				// ...which just ended: we're being handed over to a session in another thread
+				d->holdqueue << msg;
+			else if(msg->type() == protocol::MSG_COMMAND)
 				emit loginMessage(msg);
 			else
 				log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(
@@ -396,8 +399,12 @@ void Client::setHoldLocked(bool lock)
 {
 	d->isHoldLocked = lock;
 	if(!lock) {
-		for(MessagePtr msg : d->holdqueue)
+		for(MessagePtr msg : d->holdqueue) {
+			// Messages held before joining the session haven't been checked yet
+			if(d->session->initUserId() != d->id && msg->contextId() != d->id)
+				msg->setContextId(d->id);
 			d->session->handleClientMessage(*this, msg);
+		}
 		d->holdqueue.clear();
 	}
 }
@@ -249,6 +249,10 @@ public:
 	 * When hold-locked, all incoming messages are saved in a buffer
 	 * until the lock is released.
 	 *
+	 * A client that is hold-locked while it's not yet in a session
+	 * is being handed over to a session thread. Its messages are held
+	 * until it has joined.
+	 *
 	 * @param lock
 	 */
 	void setHoldLocked(bool lock);
@@ -18,39 +18,54 @@
 */
 
 #include "filedhistory.h"
+#include "historyblockloader.h"
+#include "historywriter.h"
 #include "../libshared/util/passwordhash.h"
 #include "../libshared/util/filename.h"
 #include "../libshared/record/header.h"
 #include "../libshared/net/meta.h"
 
 #include <QFile>
+#include <QSaveFile>
+#include <QCryptographicHash>
 #include <QJsonObject>
-#include <QVarLengthArray>
 #include <QDebug>
 #include <QTimerEvent>
+#include <QThreadPool>
 
 namespace server {
 
 // A block is closed when its size goes above this limit
 static const qint64 MAX_BLOCK_SIZE = 0xffff * 10;
 
+// Default interval between group commits (milliseconds)
+static const int DEFAULT_COMMIT_INTERVAL = 1000;
+
+// The block index includes a hash of this many bytes before the end of the indexed part of the recording
+static const int INDEX_TAIL_LENGTH = 4096;
+
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
 	: SessionHistory(id, parent),
 	  m_dir(dir),
 	  m_journal(journal),
 	  m_recording(nullptr),
+	  m_journalWriter(new HistoryWriter(journal->fileName())),
+	  m_recordingWriter(nullptr),
+	  m_commitInterval(DEFAULT_COMMIT_INTERVAL),
+	  m_syncWrites(false),
 	  m_alias(alias),
 	  m_founder(founder),
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_flags(),
+	  m_loadGeneration(0),
 	  m_fileCount(0),
 	  m_archive(false)
 {
 	Q_ASSERT(journal);
 
-	// Flush the recording file periodically
-	startTimer(1000 * 30, Qt::VeryCoarseTimer);
+	// Write out the buffered changes periodically
+	m_commitTimer = startTimer(m_commitInterval);
 }
 
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, QObject *parent)
@@ -60,6 +75,54 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QString &id, Q
 
 FiledHistory::~FiledHistory()
 {
+	commitWrites();
+	closeWriters();
+}
+
+void FiledHistory::setWritePolicy(int commitInterval, bool sync)
+{
+	commitWrites();
+
+	m_commitInterval = qMax(0, commitInterval);
+	m_syncWrites = sync;
+
+	if(m_commitTimer)
+		killTimer(m_commitTimer);
+	m_commitTimer = m_commitInterval > 0 ? startTimer(m_commitInterval) : 0;
+}
+
+void FiledHistory::writeJournal(const QByteArray &entry)
+{
+	m_journalBuffer += entry;
+	if(m_commitInterval == 0)
+		commitWrites();
+}
+
+void FiledHistory::commitWrites()
+{
+	if(!m_journalBuffer.isEmpty()) {
+		if(m_journalWriter)
+			m_journalWriter->write(m_journalBuffer, m_syncWrites);
+		m_journalBuffer = QByteArray();
+	}
+
+	if(!m_recordingBuffer.isEmpty()) {
+		if(m_recordingWriter)
+			m_recordingWriter->write(m_recordingBuffer, m_syncWrites);
+		m_recordingBuffer = QByteArray();
+	}
+}
+
+void FiledHistory::closeWriters()
+{
+	if(m_journalWriter) {
+		m_journalWriter->close();
+		m_journalWriter = nullptr;
+	}
+	if(m_recordingWriter) {
+		m_recordingWriter->close();
+		m_recordingWriter = nullptr;
+	}
 }
 
 QString FiledHistory::journalFilename(const QString &id)
@@ -131,9 +194,11 @@ bool FiledHistory::create()
 		return false;
 
 	if(!m_alias.isEmpty())
-		m_journal->write(QString("ALIAS %1\n").arg(m_alias).toUtf8());
-	m_journal->write(QString("FOUNDER %1\n").arg(m_founder).toUtf8());
-	m_journal->flush();
+		writeJournal(QString("ALIAS %1\n").arg(m_alias).toUtf8());
+	writeJournal(QString("FOUNDER %1\n").arg(m_founder).toUtf8());
+
+	// Don't wait for the next group commit: the journal is not loadable without these
+	commitWrites();
 
 	return true;
 }
@@ -156,15 +221,22 @@ bool FiledHistory::initRecording()
 
 	m_recording->flush();
 
-	m_journal->write(QString("FILE %1\n").arg(filename).toUtf8());
-	m_journal->flush();
+	// The header is needed for the block index checksum if the recording is short
+	m_recording->seek(0);
+	m_recordingTail = m_recording->readAll();
+
+	// The rest of the recording is written in the background
+	m_recordingWriter = new HistoryWriter(m_recording->fileName());
+
+	writeJournal(QString("FILE %1\n").arg(filename).toUtf8());
 
 	m_blocks << Block {
 		m_recording->pos(),
 		firstIndex(),
 		0,
 		m_recording->pos(),
-		protocol::MessageList()
+		protocol::MessageList(),
+		QByteArray()
 		};
 
 	return true;
@@ -343,6 +415,22 @@ bool FiledHistory::load()
 		return false;
 	}
 
+	m_recording->flush();
+	const qint64 recordingEnd = m_recording->size();
+	m_recording->seek(qMax(qint64(0), recordingEnd - INDEX_TAIL_LENGTH));
+	m_recordingTail = m_recording->read(INDEX_TAIL_LENGTH);
+	m_recording->seek(recordingEnd);
+
+	// The active block is always kept in memory, so it can be served
+	// to clients without waiting for the writer thread
+	if(m_blocks.last().count > 0 && !loadBlock(m_blocks.size()-1).isLoaded()) {
+		qWarning() << recordingFile << "error loading the last block";
+		return false;
+	}
+
+	// The rest of the recording is written in the background
+	m_recordingWriter = new HistoryWriter(m_recording->fileName());
+
 	historyLoaded(m_blocks.last().endOffset-startOffset, m_blocks.last().startIndex+m_blocks.last().count);
 
 	// If a loaded session is empty, the server expects the first joining client
@@ -361,54 +449,66 @@ bool FiledHistory::scanBlocks()
 	Q_ASSERT(m_blocks.isEmpty());
 	// Note: m_recording should be at the start of the recording
 
-	m_blocks << Block {
-		m_recording->pos(),
-		firstIndex(),
-		0,
-		m_recording->pos(),
-		protocol::MessageList()
-	};
+	m_joinedUsers.clear();
+	m_leftUsers.clear();
 
-	QSet<uint8_t> users;
+	// Skip the part of the recording covered by the block index, if there is one
+	if(loadBlockIndex()) {
+		m_recording->seek(m_blocks.last().endOffset);
+		for(const uint8_t user : m_leftUsers)
+			idQueue().reserveId(user);
 
-	do {
-		Block &b = m_blocks.last();
+	} else {
+		m_blocks << Block {
+			m_recording->pos(),
+			firstIndex(),
+			0,
+			m_recording->pos(),
+			protocol::MessageList(),
+			QByteArray()
+		};
+	}
+
+	while(!m_recording->atEnd()) {
 		uint8_t msgType, ctxId;
 
 		const int msglen = recording::skipRecordingMessage(m_recording, &msgType, &ctxId);
 		if(msglen<0) {
 			// Truncated message encountered.
 			// Rewind back to the end of the previous message
-			qWarning() << m_recording->fileName() << "Recording truncated at" << int(b.endOffset);
-			m_recording->seek(b.endOffset);
+			qWarning() << m_recording->fileName() << "Recording truncated at" << int(m_blocks.last().endOffset);
+			m_recording->seek(m_blocks.last().endOffset);
 			break;
 		}
-		++m_blocks.last().count;
 
+		Block &b = m_blocks.last();
+		++b.count;
 		b.endOffset += msglen;
 		Q_ASSERT(b.endOffset == m_recording->pos());
 
 		if(b.endOffset-b.startOffset >= MAX_BLOCK_SIZE) {
-			m_blocks << Block {
+			const Block next {
 				b.endOffset,
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QByteArray()
 			};
+			m_blocks << next;
 		}
 
 		switch(msgType) {
-		case protocol::MSG_USER_JOIN: users.insert(ctxId); break;
+		case protocol::MSG_USER_JOIN: userJoined(ctxId); break;
 		case protocol::MSG_USER_LEAVE:
-			users.remove(ctxId);
+			userLeft(ctxId);
 			idQueue().reserveId(ctxId);
 			break;
 		}
-	} while(!m_recording->atEnd());
+	}
 
 	// There should be no users at the end of the recording.
-	for(const uint8_t user : users) {
+	for(const uint8_t user : m_joinedUsers) {
 		protocol::UserLeave msg(user);
 		m_blocks.last().count++;
 		m_blocks.last().endOffset += msg.length();
@@ -416,15 +516,202 @@ bool FiledHistory::scanBlocks()
 		msg.serialize(buf);
 		m_recording->write(buf, msg.length());
 		idQueue().reserveId(user);
+		m_leftUsers.removeOne(user);
+		m_leftUsers << user;
 	}
+	m_joinedUsers.clear();
+
+	return true;
+}
+
+void FiledHistory::userJoined(uint8_t id)
+{
+	m_joinedUsers.insert(id);
+}
+
+void FiledHistory::userLeft(uint8_t id)
+{
+	m_joinedUsers.remove(id);
+
+	// Only the order in which the IDs were last released matters
+	m_leftUsers.removeOne(id);
+	m_leftUsers << id;
+}
+
+QString FiledHistory::blockIndexFilename(const QString &recordingFilename)
+{
+	return recordingFilename + ".index";
+}
+
+static QByteArray tailHash(QFile *file, qint64 end)
+{
+	// Hash of the last bytes covered by the index. This is used to check
+	// that the recording still matches the index.
+	const qint64 start = qMax(qint64(0), end - INDEX_TAIL_LENGTH);
+	if(!file->seek(start))
+		return QByteArray();
+
+	return QCryptographicHash::hash(file->read(end - start), QCryptographicHash::Sha1).toHex();
+}
+
+void FiledHistory::saveBlockIndex()
+{
+	Q_ASSERT(m_blocks.size() > 1);
+
+	// Only closed blocks are indexed
+	const Block &last = m_blocks.at(m_blocks.size()-2);
+
+	// The closed block ends at the current end of the recording, so the
+	// hash can be calculated without reading the file back
+	Q_ASSERT(last.endOffset == m_blocks.last().endOffset);
+	const QByteArray hash = QCryptographicHash::hash(m_recordingTail.right(INDEX_TAIL_LENGTH), QCryptographicHash::Sha1).toHex();
+
+	QByteArray index = "DPINDEX 1\n";
+	index += "FILE " + QFileInfo(m_recording->fileName()).fileName().toUtf8() + "\n";
+	index += "END " + QByteArray::number(last.endOffset) + " " + hash + "\n";
+
+	for(int i=0;i<m_blocks.size()-1;++i) {
+		const Block &b = m_blocks.at(i);
+		index += "BLOCK "
+			+ QByteArray::number(b.startOffset) + " "
+			+ QByteArray::number(b.count) + " "
+			+ QByteArray::number(b.endOffset) + "\n";
+	}
+
+	index += "USERS";
+	for(const uint8_t id : m_joinedUsers)
+		index += " " + QByteArray::number(int(id));
+	index += "\nLEFT";
+	for(const uint8_t id : m_leftUsers)
+		index += " " + QByteArray::number(int(id));
+	index += "\n";
+
+	index += "SHA1 " + QCryptographicHash::hash(index, QCryptographicHash::Sha1).toHex() + "\n";
+
+	// The index is written after the recording content it describes
+	const QString filename = blockIndexFilename(m_recording->fileName());
+	m_recordingWriter->after([filename, index]() {
+		QSaveFile f(filename);
+		if(!f.open(QFile::WriteOnly) || f.write(index) != index.length() || !f.commit())
+			qWarning() << f.fileName() << "couldn't write block index:" << f.errorString();
+	});
+}
+
+bool FiledHistory::loadBlockIndex()
+{
+	QFile f(blockIndexFilename(m_recording->fileName()));
+	if(!f.exists())
+		return false;
+
+	if(!f.open(QFile::ReadOnly)) {
+		qWarning() << f.fileName() << f.errorString();
+		return false;
+	}
+
+	const QByteArray index = f.readAll();
+
+	// Check the index file's own checksum first
+	const int checksumPos = index.lastIndexOf("SHA1 ");
+	if(checksumPos < 0 || index.mid(checksumPos+5).trimmed() != QCryptographicHash::hash(index.left(checksumPos), QCryptographicHash::Sha1).toHex()) {
+		qWarning() << f.fileName() << "block index checksum mismatch, rescanning recording";
+		return false;
+	}
+
+	const qint64 recordingStart = m_recording->pos();
+	QVector<Block> blocks;
+	QSet<uint8_t> joinedUsers;
+	QList<uint8_t> leftUsers;
+	qint64 end = -1;
+	QByteArray hash;
+
+	for(const QByteArray &line : index.left(checksumPos).split('\n')) {
+		const QList<QByteArray> args = line.split(' ');
+		const QByteArray &cmd = args.first();
+
+		if(cmd == "DPINDEX") {
+			if(args.length() != 2 || args.at(1) != "1")
+				return false;
+
+		} else if(cmd == "FILE") {
+			if(args.length() != 2 || QString::fromUtf8(args.at(1)) != QFileInfo(m_recording->fileName()).fileName())
+				return false;
+
+		} else if(cmd == "END") {
+			if(args.length() != 3)
+				return false;
+			end = args.at(1).toLongLong();
+			hash = args.at(2);
+
+		} else if(cmd == "BLOCK") {
+			if(args.length() != 4)
+				return false;
+			const qint64 startOffset = blocks.isEmpty() ? recordingStart : blocks.last().endOffset;
+			const int startIndex = blocks.isEmpty() ? firstIndex() : blocks.last().startIndex + blocks.last().count;
+			if(args.at(1).toLongLong() != startOffset)
+				return false;
+
+			blocks << Block {
+				startOffset,
+				startIndex,
+				args.at(2).toInt(),
+				args.at(3).toLongLong(),
+				protocol::MessageList(),
+				QByteArray()
+			};
+
+		} else if(cmd == "USERS" || cmd == "LEFT") {
+			for(int i=1;i<args.length();++i) {
+				const int id = args.at(i).toInt();
+				if(id < IdQueue::FIRST_ID || id > IdQueue::LAST_ID)
+					return false;
+				if(cmd == "USERS")
+					joinedUsers.insert(id);
+				else
+					leftUsers << id;
+			}
+		}
+	}
+
+	if(blocks.isEmpty() || blocks.last().endOffset != end || m_recording->size() < end) {
+		qWarning() << f.fileName() << "block index does not match the recording, rescanning";
+		return false;
+	}
+
+	// Check that the recording hasn't been changed
+	const bool hashMatches = tailHash(m_recording, end) == hash;
+	m_recording->seek(recordingStart);
+	if(!hashMatches) {
+		qWarning() << f.fileName() << "block index is stale, rescanning recording";
+		return false;
+	}
+
+	// The part of the recording after the indexed blocks goes in a new block
+	blocks << Block {
+		end,
+		blocks.last().startIndex + blocks.last().count,
+		0,
+		end,
+		protocol::MessageList(),
+		QByteArray()
+	};
+
+	m_blocks = blocks;
+	m_joinedUsers = joinedUsers;
+	m_leftUsers = leftUsers;
 	return true;
 }
 
 void FiledHistory::terminate()
 {
+	// Make sure everything has been written before the files are renamed or removed
+	commitWrites();
+	closeWriters();
+
 	m_recording->close();
 	m_journal->close();
 
+	QFile::remove(blockIndexFilename(m_recording->fileName()));
+
 	if(m_archive) {
 		m_journal->rename(m_journal->fileName() + ".archived");
 		m_recording->rename(m_recording->fileName() + ".archived");
@@ -436,9 +723,8 @@ void FiledHistory::terminate()
 
 void FiledHistory::closeBlock()
 {
-	// Flush the output files just to be safe
-	m_recording->flush();
-	m_journal->flush();
+	// Write out the buffered changes just to be safe
+	commitWrites();
 
 	// Check if anything needs to be done
 	Block &b = m_blocks.last();
@@ -446,13 +732,18 @@ void FiledHistory::closeBlock()
 		return;
 
 	// Mark last block as closed and start a new one
-	m_blocks << Block {
+	const Block next {
 				b.endOffset,
 				b.startIndex+b.count,
 				0,
 				b.endOffset,
-				protocol::MessageList()
+				protocol::MessageList(),
+				QByteArray()
 	};
+	m_blocks << next;
+
+	// Update the block index, so the closed blocks need not be rescanned when the session is loaded again
+	saveBlockIndex();
 }
 
 void FiledHistory::setPasswordHash(const QByteArray &password)
@@ -460,11 +751,7 @@ void FiledHistory::setPasswordHash(const QByteArray &password)
 	if(m_password != password) {
 		m_password = password;
 
-		m_journal->write("PASSWORD ");
-		if(!m_password.isEmpty())
-			m_journal->write(m_password);
-		m_journal->write("\n");
-		m_journal->flush();
+		writeJournal("PASSWORD " + m_password + "\n");
 	}
 }
 
@@ -472,11 +759,7 @@ void FiledHistory::setOpwordHash(const QByteArray &opword)
 {
 	m_opword = opword;
 
-	m_journal->write("OPWORD ");
-	if(!m_opword.isEmpty())
-		m_journal->write(m_opword);
-	m_journal->write("\n");
-	m_journal->flush();
+	writeJournal("OPWORD " + m_opword + "\n");
 }
 
 void FiledHistory::setMaxUsers(int max)
@@ -484,8 +767,7 @@ void FiledHistory::setMaxUsers(int max)
 	const int newMax = qBound(1, max, 254);
 	if(newMax != m_maxUsers) {
 		m_maxUsers = newMax;
-		m_journal->write(QString("MAXUSERS %1\n").arg(newMax).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("MAXUSERS %1\n").arg(newMax).toUtf8());
 	}
 }
 
@@ -494,8 +776,7 @@ void FiledHistory::setAutoResetThreshold(uint limit)
 	const uint newLimit = sizeLimit() == 0 ? limit : qMin(uint(sizeLimit() * 0.9), limit);
 	if(newLimit != m_autoResetThreshold) {
 		m_autoResetThreshold = newLimit;
-		m_journal->write(QString("AUTORESET %1\n").arg(newLimit).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("AUTORESET %1\n").arg(newLimit).toUtf8());
 	}
 }
 
@@ -503,8 +784,7 @@ void FiledHistory::setTitle(const QString &title)
 {
 	if(title != m_title) {
 		m_title = title;
-		m_journal->write(QString("TITLE %1\n").arg(title).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("TITLE %1\n").arg(title).toUtf8());
 	}
 }
 
@@ -523,24 +803,22 @@ void FiledHistory::setFlags(Flags f)
 			fstr << "deputies";
 		if(f.testFlag(AuthOnly))
 			fstr << "authonly";
-		m_journal->write(QString("FLAGS %1\n").arg(fstr.join(' ')).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("FLAGS %1\n").arg(fstr.join(' ')).toUtf8());
 	}
 }
 
 void FiledHistory::joinUser(uint8_t id, const QString &name)
 {
 	SessionHistory::joinUser(id, name);
-	m_journal->write(
+	writeJournal(
 		"USER "
 		+ QByteArray::number(int(id))
 		+ " "
 		+ name.toUtf8().toPercentEncoding(QByteArray(), " ")
 		+ "\n");
-	m_journal->flush();
 }
 
-std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+int FiledHistory::blockFor(int after) const
 {
 	// Find the block that contains the index *after*
 	int i=m_blocks.size()-1;
@@ -549,70 +827,221 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 		if(b.startIndex+b.count-1 <= after)
 			break;
 	}
+	return i;
+}
+
+const FiledHistory::Block &FiledHistory::loadBlock(int block) const
+{
+	const Block &b = m_blocks.at(block);
+	if(b.isLoaded() || b.count == 0)
+		return b;
+
+	// Load the block to memory if not already loaded.
+	// (If a background load is in progress, its result will be discarded.)
+	// Only closed blocks can be unloaded. Their content was handed to the
+	// writer when they were closed, so there is normally nothing to wait for.
+	Q_ASSERT(block < m_blocks.size()-1 || !m_recordingWriter);
+	if(m_recordingWriter)
+		m_recordingWriter->drain();
+
+	const qint64 prevPos = m_recording->pos();
+	qDebug() << m_recording->fileName() << "loading block" << block;
+	QByteArray data;
+	if(!HistoryBlockLoader::readBlock(m_recording, b.startOffset, b.endOffset - b.startOffset, b.count, data)) {
+		// The block stays unloaded and the load is retried when it is needed again
+		qWarning() << m_recording->fileName() << "error loading block" << block;
+		data = QByteArray();
+	}
+	const_cast<Block&>(b).data = data;
+	m_backgroundLoads.remove(block);
+
+	m_recording->seek(prevPos);
+	return b;
+}
 
+std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
+{
+	const int i = blockFor(after);
 	const Block &b = m_blocks.at(i);
 
 	const int idxOffset = qMax(0, after - b.startIndex + 1);
 	if(idxOffset >= b.count)
 		return std::make_tuple(protocol::MessageList(), b.startIndex+b.count-1);
 
-	if(b.messages.isEmpty() && b.count>0) {
-		// Load the block worth of messages to memory if not already loaded
-		const qint64 prevPos = m_recording->pos();
-		qDebug() << m_recording->fileName() << "loading block" << i;
-		m_recording->seek(b.startOffset);
-		QByteArray buffer;
-		for(int m=0;m<b.count;++m) {
-			if(!recording::readRecordingMessage(m_recording, buffer)) {
-				qWarning() << m_recording->fileName() << "read error!";
-				m_recording->close();
-				break;
-			}
-			protocol::NullableMessageRef msg = protocol::Message::deserialize((const uchar*)buffer.constData(), buffer.length(), false);
-			if(msg.isNull()) {
-				qWarning() << m_recording->fileName() << "Invalid message in block" << i;
-				m_recording->close();
-				break;
-			}
-			const_cast<Block&>(b).messages << protocol::MessagePtr::fromNullable(msg);
-		}
+	if(b.messages.size() != b.count) {
+		// If the block could not be read, no progress is made rather than skipping the messages
+		if(!loadBlock(i).isLoaded())
+			return std::make_tuple(protocol::MessageList(), after);
 
-		m_recording->seek(prevPos);
+		protocol::MessageList messages;
+		if(!HistoryBlockLoader::deserializeBlock(b.data, messages) || messages.size() != b.count) {
+			qWarning() << m_recording->fileName() << "Invalid message in block" << i;
+			return std::make_tuple(protocol::MessageList(), after);
+		}
+		const_cast<Block&>(b).messages = messages;
 	}
-	Q_ASSERT(b.messages.size() == b.count);
 	return std::make_tuple(b.messages.mid(idxOffset), b.startIndex+b.count-1);
 }
 
+std::tuple<QByteArray, int> FiledHistory::getRawBatch(int after) const
+{
+	const int i = blockFor(after);
+	const Block &b = loadBlock(i);
+
+	const int idxOffset = qMax(0, after - b.startIndex + 1);
+	if(idxOffset >= b.count)
+		return std::make_tuple(QByteArray(), b.startIndex+b.count-1);
+
+	// If the block could not be read, no progress is made rather than skipping the messages
+	if(!b.isLoaded())
+		return std::make_tuple(QByteArray(), after);
+
+	// The whole block is typically sent at once, in which case the cached buffer can be shared as is
+	if(idxOffset == 0)
+		return std::make_tuple(b.data, b.startIndex+b.count-1);
+
+	return std::make_tuple(
+		b.data.mid(HistoryBlockLoader::messageOffset(b.data, idxOffset)),
+		b.startIndex+b.count-1
+	);
+}
+
+bool FiledHistory::isBatchReady(int after) const
+{
+	const int i = blockFor(after);
+	const Block &b = m_blocks.at(i);
+
+	const int idxOffset = qMax(0, after - b.startIndex + 1);
+	if(idxOffset < b.count && !b.isLoaded()) {
+		const auto load = m_backgroundLoads.constFind(i);
+		if(load == m_backgroundLoads.constEnd()) {
+			loadBlockInBackground(i);
+			return false;
+		}
+
+		// If the background load did not work out, the block will be loaded synchronously
+		return !load.value();
+	}
+
+	// The client will probably want the next block soon too
+	if(i < m_blocks.size()-1 && !m_blocks.at(i+1).isLoaded())
+		loadBlockInBackground(i+1);
+
+	return true;
+}
+
+void FiledHistory::loadBlockInBackground(int block) const
+{
+	const Block &b = m_blocks.at(block);
+	if(b.count == 0 || m_backgroundLoads.contains(block))
+		return;
+
+	m_backgroundLoads[block] = true;
+
+	qDebug() << m_recording->fileName() << "loading block" << block << "in the background";
+	HistoryBlockLoader *loader = new HistoryBlockLoader(
+		m_recording->fileName(),
+		block,
+		b.startOffset,
+		b.endOffset - b.startOffset,
+		b.count
+	);
+
+	FiledHistory *self = const_cast<FiledHistory*>(this);
+	const int generation = m_loadGeneration;
+	connect(loader, &HistoryBlockLoader::loaded, self, [self, loader, generation]() {
+		self->onBlockLoaded(loader, generation);
+	});
+	connect(loader, &HistoryBlockLoader::loaded, loader, &QObject::deleteLater);
+
+	// The loader reads the file through its own handle, so it is started
+	// only once the writes queued so far have reached the file.
+	// (Only closed blocks are loaded, and their content has already been queued.)
+	if(m_recordingWriter)
+		m_recordingWriter->after([loader]() { QThreadPool::globalInstance()->start(loader); });
+	else
+		QThreadPool::globalInstance()->start(loader);
+}
+
+void FiledHistory::onBlockLoaded(HistoryBlockLoader *loader, int generation)
+{
+	// Results of loads started before a history reset are stale
+	if(generation != m_loadGeneration)
+		return;
+
+	const QByteArray data = loader->data();
+	Block &b = m_blocks[loader->block()];
+
+	// The block may have been loaded synchronously already, or the read may
+	// have failed. In the latter case, the block is loaded synchronously next.
+	if(!b.isLoaded() && b.startOffset == loader->offset() && data.length() == b.endOffset - b.startOffset) {
+		b.data = data;
+		m_backgroundLoads.remove(loader->block());
+	} else {
+		m_backgroundLoads[loader->block()] = false;
+	}
+
+	// Clients waiting for this block can continue now
+	emit newMessagesAvailable();
+}
+
 void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 {
-	QVarLengthArray<char> buf(msg->length());
-	const int len = msg->serialize(buf.data());
-	Q_ASSERT(len == buf.length());
-	m_recording->write(buf.data(), len);
+	const QByteArray wire = msg->serialized();
+	m_recordingBuffer += wire;
+
+	m_recordingTail += wire;
+	if(m_recordingTail.length() > INDEX_TAIL_LENGTH * 2)
+		m_recordingTail = m_recordingTail.right(INDEX_TAIL_LENGTH);
+
+	switch(msg->type()) {
+	case protocol::MSG_USER_JOIN: userJoined(msg->contextId()); break;
+	case protocol::MSG_USER_LEAVE: userLeft(msg->contextId()); break;
+	default: break;
+	}
 
+	// The active block is always in memory (a new block is empty and thus trivially loaded)
 	Block &b = m_blocks.last();
+	Q_ASSERT(b.count == 0 || b.isLoaded());
 	b.count++;
-	b.endOffset += len;
-
-	// Add message to cache, if already active (if cache is empty, it will be loaded from disk when needed)
+	b.endOffset += wire.length();
+	b.data.append(wire);
 	if(!b.messages.isEmpty())
 		b.messages.append(msg);
 
+	// The wire format is now kept in the block and the write buffer
+	msg->releaseSerialized();
+
 	if(b.endOffset-b.startOffset > MAX_BLOCK_SIZE)
 		closeBlock();
+	else if(m_commitInterval == 0)
+		commitWrites();
 }
 
 void FiledHistory::historyReset(const protocol::MessageList &newHistory)
 {
+	// Finish writing the old recording
+	commitWrites();
+	if(m_recordingWriter) {
+		m_recordingWriter->close();
+		m_recordingWriter = nullptr;
+	}
+	m_recordingTail = QByteArray();
+
 	QFile *oldRecording = m_recording;
 	oldRecording->close();
 
 	m_recording = nullptr;
 	m_blocks.clear();
+	m_joinedUsers.clear();
+	m_leftUsers.clear();
+	m_backgroundLoads.clear();
+	++m_loadGeneration;
 	initRecording();
 
 	// Remove old recording after the new one has been created so
 	// that the new file will not have the same name.
+	QFile::remove(blockIndexFilename(oldRecording->fileName()));
 	if(m_archive)
 		oldRecording->rename(oldRecording->fileName() + ".archived");
 	else
@@ -625,12 +1054,15 @@ void FiledHistory::historyReset(const protocol::MessageList &newHistory)
 
 void FiledHistory::cleanupBatches(int before)
 {
-	for(Block &b : m_blocks) {
+	// The last block is still being written to and is never released
+	for(int i=0;i<m_blocks.size()-1;++i) {
+		Block &b = m_blocks[i];
 		if(b.startIndex+b.count >= before)
 			break;
-		if(!b.messages.isEmpty()) {
+		if(!b.messages.isEmpty() || !b.data.isEmpty()) {
 			qDebug() << "releasing history block cache from" << b.startIndex << "to" << b.startIndex+b.count-1;
 			b.messages = protocol::MessageList();
+			b.data = QByteArray();
 		}
 	}
 }
@@ -644,28 +1076,24 @@ void FiledHistory::historyAddBan(int id, const QString &username, const QHostAdd
 			ip.toString().toUtf8() + " " +
 			extAuthId.toUtf8().toPercentEncoding(QByteArray(), include) + " " +
 			bannedBy.toUtf8().toPercentEncoding(QByteArray(), include) + "\n";
-	m_journal->write(entry);
-	m_journal->flush();
+	writeJournal(entry);
 }
 
 void FiledHistory::historyRemoveBan(int id)
 {
-	m_journal->write(QByteArray("UNBAN ") + QByteArray::number(id) + "\n");
-	m_journal->flush();
+	writeJournal(QByteArray("UNBAN ") + QByteArray::number(id) + "\n");
 }
 
 void FiledHistory::timerEvent(QTimerEvent *)
 {
-	if(m_recording)
-		m_recording->flush();
+	commitWrites();
 }
 
 void FiledHistory::addAnnouncement(const QString &url)
 {
 	if(!m_announcements.contains(url)) {
 		m_announcements << url;
-		m_journal->write(QString("ANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("ANNOUNCE %1\n").arg(url).toUtf8());
 	}
 }
 
@@ -673,8 +1101,7 @@ void FiledHistory::removeAnnouncement(const QString &url)
 {
 	if(m_announcements.contains(url)) {
 		m_announcements.removeAll(url);
-		m_journal->write(QString("UNANNOUNCE %1\n").arg(url).toUtf8());
-		m_journal->flush();
+		writeJournal(QString("UNANNOUNCE %1\n").arg(url).toUtf8());
 	}
 }
 
@@ -686,14 +1113,12 @@ void FiledHistory::setAuthenticatedOperator(const QString &authId, bool op)
 	if(op) {
 		if(!m_ops.contains(authId)) {
 			m_ops.insert(authId);
-			m_journal->write(QStringLiteral("OP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			writeJournal(QStringLiteral("OP %1\n").arg(authId).toUtf8());
 		}
 	} else {
 		if(m_ops.contains(authId)) {
 			m_ops.remove(authId);
-			m_journal->write(QStringLiteral("DEOP %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			writeJournal(QStringLiteral("DEOP %1\n").arg(authId).toUtf8());
 		}
 	}
 }
@@ -706,14 +1131,12 @@ void FiledHistory::setAuthenticatedTrust(const QString &authId, bool trusted)
 	if(trusted) {
 		if(!m_trusted.contains(authId)) {
 			m_trusted.insert(authId);
-			m_journal->write(QStringLiteral("TRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			writeJournal(QStringLiteral("TRUST %1\n").arg(authId).toUtf8());
 		}
 	} else {
 		if(m_trusted.contains(authId)) {
 			m_trusted.remove(authId);
-			m_journal->write(QStringLiteral("UNTRUST %1\n").arg(authId).toUtf8());
-			m_journal->flush();
+			writeJournal(QStringLiteral("UNTRUST %1\n").arg(authId).toUtf8());
 		}
 	}
 }
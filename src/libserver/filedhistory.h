@@ -26,9 +26,13 @@
 #include <QDir>
 #include <QVector>
 #include <QSet>
+#include <QHash>
 
 namespace server {
 
+class HistoryBlockLoader;
+class HistoryWriter;
+
 class FiledHistory : public SessionHistory
 {
 	Q_OBJECT
@@ -69,9 +73,23 @@ public:
 	 */
 	void setArchive(bool archive) { m_archive = archive; }
 
+	/**
+	 * @brief Set how changes are written to disk
+	 *
+	 * Changes are buffered in memory and written out by a background
+	 * writer thread in groups.
+	 *
+	 * @param commitInterval milliseconds between group commits (0 means write every change right away)
+	 * @param sync wait for each group to reach the disk (fdatasync)
+	 */
+	void setWritePolicy(int commitInterval, bool sync);
+
 	//! Get the metadata journal file name for the given session ID
 	static QString journalFilename(const QString &id);
 
+	//! Get the name of the block index file for the given recording file
+	static QString blockIndexFilename(const QString &recordingFilename);
+
 	QString idAlias() const override { return m_alias; }
 	QString founderName() const override { return m_founder; }
 	protocol::ProtocolVersion protocolVersion() const override { return m_version; }
@@ -93,6 +111,8 @@ public:
 	void terminate() override;
 	void cleanupBatches(int before) override;
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
+	std::tuple<QByteArray, int> getRawBatch(int after) const override;
+	bool isBatchReady(int after) const override;
 
 	void addAnnouncement(const QString &) override;
 	void removeAnnouncement(const QString &url) override;
@@ -122,17 +142,42 @@ private:
 		int count;
 		qint64 endOffset;
 		protocol::MessageList messages;
+		QByteArray data; // the block in wire format
+
+		bool isLoaded() const { return !data.isEmpty() && data.length() == endOffset - startOffset; }
 	};
 
 	bool create();
 	bool load();
 	bool scanBlocks();
+	bool loadBlockIndex();
+	void saveBlockIndex();
+	void writeJournal(const QByteArray &entry);
+	void commitWrites();
+	void closeWriters();
+	void userJoined(uint8_t id);
+	void userLeft(uint8_t id);
 	bool initRecording();
 
+	int blockFor(int after) const;
+	const Block &loadBlock(int block) const;
+	void loadBlockInBackground(int block) const;
+	void onBlockLoaded(HistoryBlockLoader *loader, int generation);
+
 	QDir m_dir;
 	QFile *m_journal;
 	QFile *m_recording;
 
+	// Write-behind buffers
+	HistoryWriter *m_journalWriter;
+	HistoryWriter *m_recordingWriter;
+	QByteArray m_journalBuffer;
+	QByteArray m_recordingBuffer;
+	QByteArray m_recordingTail; // the last bytes written to the recording (for the block index)
+	int m_commitInterval;
+	int m_commitTimer;
+	bool m_syncWrites;
+
 	// Current state:
 	QString m_alias;
 	QString m_founder;
@@ -148,6 +193,13 @@ private:
 	QSet<QString> m_trusted;
 
 	QVector<Block> m_blocks;
+	mutable QHash<int, bool> m_backgroundLoads; // block index -> is load still in progress
+	int m_loadGeneration;
+
+	// Users present at the end of the recording and the order of users who have left
+	// (needed for the block index)
+	QSet<uint8_t> m_joinedUsers;
+	QList<uint8_t> m_leftUsers;
 	int m_fileCount;
 	bool m_archive;
 };
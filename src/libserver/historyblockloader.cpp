@@ -0,0 +1,103 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "historyblockloader.h"
+
+#include <QFile>
+#include <QDebug>
+
+namespace server {
+
+HistoryBlockLoader::HistoryBlockLoader(const QString &filename, int block, qint64 offset, qint64 length, int count, QObject *parent)
+	: QObject(parent),
+	  m_filename(filename),
+	  m_block(block),
+	  m_offset(offset),
+	  m_length(length),
+	  m_count(count)
+{
+	setAutoDelete(false);
+}
+
+void HistoryBlockLoader::run()
+{
+	QFile file(m_filename);
+	if(!file.open(QFile::ReadOnly)) {
+		qWarning() << m_filename << file.errorString();
+
+	} else if(!readBlock(&file, m_offset, m_length, m_count, m_data)) {
+		qWarning() << m_filename << "error loading block" << m_block;
+		m_data = QByteArray();
+	}
+
+	emit loaded();
+}
+
+bool HistoryBlockLoader::readBlock(QIODevice *file, qint64 offset, qint64 length, int count, QByteArray &data)
+{
+	if(!file->seek(offset))
+		return false;
+
+	data = file->read(length);
+	if(data.length() != length)
+		return false;
+
+	// Check that the block consists of whole messages
+	int pos = 0;
+	for(int m=0;m<count;++m) {
+		if(data.length() - pos < protocol::Message::HEADER_LEN)
+			return false;
+
+		const int len = protocol::Message::sniffLength(data.constData() + pos);
+		if(len > data.length() - pos)
+			return false;
+
+		pos += len;
+	}
+
+	return pos == data.length();
+}
+
+bool HistoryBlockLoader::deserializeBlock(const QByteArray &data, protocol::MessageList &messages)
+{
+	const uchar *ptr = reinterpret_cast<const uchar*>(data.constData());
+	int pos = 0;
+
+	while(pos < data.length()) {
+		const int len = protocol::Message::sniffLength(data.constData() + pos);
+		protocol::NullableMessageRef msg = protocol::Message::deserialize(ptr + pos, len, false);
+		if(msg.isNull())
+			return false;
+
+		messages << protocol::MessagePtr::fromNullable(msg);
+		pos += len;
+	}
+
+	return true;
+}
+
+int HistoryBlockLoader::messageOffset(const QByteArray &data, int index)
+{
+	int pos = 0;
+	for(int m=0;m<index && pos < data.length();++m)
+		pos += protocol::Message::sniffLength(data.constData() + pos);
+	return pos;
+}
+
+}
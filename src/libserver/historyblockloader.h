@@ -0,0 +1,105 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_HISTORYBLOCKLOADER_H
+#define DP_SERVER_HISTORYBLOCKLOADER_H
+
+#include "../libshared/net/message.h"
+
+#include <QObject>
+#include <QRunnable>
+
+class QIODevice;
+
+namespace server {
+
+/**
+ * @brief A runnable for reading a block of session history in a background thread
+ *
+ * The loader opens its own handle to the recording file, so the
+ * block must have been flushed to disk before the loader is started.
+ *
+ * The loader is not auto-deleted: the receiver of the loaded() signal
+ * should pick up the messages and then delete the loader.
+ */
+class HistoryBlockLoader : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	HistoryBlockLoader(const QString &filename, int block, qint64 offset, qint64 length, int count, QObject *parent=nullptr);
+
+	void run() override;
+
+	//! Index of the block being loaded
+	int block() const { return m_block; }
+
+	//! The file offset of the block
+	qint64 offset() const { return m_offset; }
+
+	//! The loaded block in wire format. Only valid after the loaded() signal
+	QByteArray data() const { return m_data; }
+
+	/**
+	 * @brief Read a block of messages
+	 *
+	 * The whole block is read with a single read call. The messages are not
+	 * deserialized, but the block is checked to contain exactly \a count
+	 * complete messages.
+	 *
+	 * @param file the recording file to read from
+	 * @param offset position of the first message of the block
+	 * @param length length of the block in bytes
+	 * @param count number of messages in the block
+	 * @param data the block is read here
+	 * @return false on read error or if the block was malformed
+	 */
+	static bool readBlock(QIODevice *file, qint64 offset, qint64 length, int count, QByteArray &data);
+
+	/**
+	 * @brief Deserialize a block of messages
+	 * @param data the block in wire format
+	 * @param messages deserialized messages are appended here
+	 * @return false if the block contained an invalid message
+	 */
+	static bool deserializeBlock(const QByteArray &data, protocol::MessageList &messages);
+
+	/**
+	 * @brief Find the position of a message in a block
+	 * @param data the block in wire format
+	 * @param index message index relative to the start of the block
+	 * @return byte offset of the message
+	 */
+	static int messageOffset(const QByteArray &data, int index);
+
+signals:
+	//! Emitted when the block has been loaded (or the load failed, in which case data() is empty)
+	void loaded();
+
+private:
+	QString m_filename;
+	int m_block;
+	qint64 m_offset;
+	qint64 m_length;
+	int m_count;
+	QByteArray m_data;
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "historywriter.h"
+
+#include <QFile>
+#include <QThread>
+#include <QCoreApplication>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+namespace server {
+
+namespace {
+
+class WriterThread : public QThread
+{
+public:
+	WriterThread()
+	{
+		setObjectName(QStringLiteral("history writer"));
+		start();
+	}
+
+	~WriterThread()
+	{
+		quit();
+		wait();
+	}
+
+protected:
+	void run() override
+	{
+		exec();
+
+		// Quitting the event loop leaves the queued writes unperformed.
+		// Perform them now, so nothing is lost at shutdown.
+		QCoreApplication::sendPostedEvents();
+	}
+};
+
+Q_GLOBAL_STATIC(WriterThread, writerThread)
+
+}
+
+HistoryWriter::HistoryWriter(const QString &filename)
+	: QObject(nullptr),
+	  m_file(new QFile(filename, this))
+{
+	moveToThread(writerThread());
+}
+
+void HistoryWriter::write(const QByteArray &data, bool sync)
+{
+	QMetaObject::invokeMethod(this, [this, data, sync]() { writeNow(data, sync); }, Qt::QueuedConnection);
+}
+
+void HistoryWriter::drain()
+{
+	Q_ASSERT(QThread::currentThread() != thread());
+	QMetaObject::invokeMethod(this, []() { }, Qt::BlockingQueuedConnection);
+}
+
+void HistoryWriter::close()
+{
+	Q_ASSERT(QThread::currentThread() != thread());
+	QMetaObject::invokeMethod(this, [this]() { m_file->close(); }, Qt::BlockingQueuedConnection);
+	deleteLater();
+}
+
+void HistoryWriter::writeNow(const QByteArray &data, bool sync)
+{
+	if(!m_file->isOpen() && !m_file->open(QFile::WriteOnly | QFile::Append)) {
+		qWarning() << m_file->fileName() << m_file->errorString();
+		return;
+	}
+
+	if(m_file->write(data) != data.length())
+		qWarning() << m_file->fileName() << "write error:" << m_file->errorString();
+
+	m_file->flush();
+
+	if(sync) {
+#if defined(Q_OS_LINUX)
+		::fdatasync(m_file->handle());
+#elif defined(Q_OS_UNIX)
+		::fsync(m_file->handle());
+#endif
+	}
+}
+
+}
@@ -0,0 +1,83 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SERVER_HISTORYWRITER_H
+#define DP_SERVER_HISTORYWRITER_H
+
+#include <QObject>
+
+class QFile;
+
+namespace server {
+
+/**
+ * @brief Appends data to a file in a shared background writer thread
+ *
+ * All writers live in the same thread, so sessions never block on disk
+ * writes. Writes to the same file are performed in the order they were queued.
+ *
+ * The writer object itself should not be deleted directly. Call close()
+ * instead, which waits for all pending writes to finish first.
+ */
+class HistoryWriter : public QObject
+{
+	Q_OBJECT
+public:
+	/**
+	 * @brief Create a writer for the given file
+	 *
+	 * The file is opened in append mode when the first write is performed.
+	 */
+	explicit HistoryWriter(const QString &filename);
+
+	/**
+	 * @brief Queue data to be appended to the file
+	 *
+	 * @param data the data to write
+	 * @param sync if true, wait for the data to reach the disk (fdatasync)
+	 */
+	void write(const QByteArray &data, bool sync);
+
+	/**
+	 * @brief Call a function in the writer thread once all the writes queued so far are done
+	 */
+	template<typename Func> void after(Func func)
+	{
+		QMetaObject::invokeMethod(this, func, Qt::QueuedConnection);
+	}
+
+	/**
+	 * @brief Wait until all queued writes have been performed
+	 */
+	void drain();
+
+	/**
+	 * @brief Wait for pending writes, close the file and delete this writer
+	 */
+	void close();
+
+private:
+	void writeNow(const QByteArray &data, bool sync);
+
+	QFile *m_file;
+};
+
+}
+
+#endif
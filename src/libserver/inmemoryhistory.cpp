@@ -29,7 +29,8 @@ InMemoryHistory::InMemoryHistory(const QString &id, const QString &alias, const
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_autoReset(0),
-	  m_flags()
+	  m_flags(),
+	  m_releasedIndex(-1)
 {
 }
 
@@ -44,6 +45,17 @@ std::tuple<protocol::MessageList, int> InMemoryHistory::getBatch(int after) cons
 	return std::make_tuple(m_history.mid(offset), lastIndex());
 }
 
+void InMemoryHistory::cleanupBatches(int before)
+{
+	// Messages before this index have been sent to everyone,
+	// so their cached wire format is not needed anymore.
+	const int end = qMin(before - firstIndex(), m_history.size());
+	for(int i=qMax(0, m_releasedIndex - firstIndex() + 1);i<end;++i)
+		m_history.at(i)->releaseSerialized();
+
+	m_releasedIndex = qMax(m_releasedIndex, before - 1);
+}
+
 void InMemoryHistory::historyAdd(const protocol::MessagePtr &msg)
 {
 	m_history << msg;
@@ -37,7 +37,7 @@ public:
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
 
 	void terminate() override { /* nothing to do */ }
-	void cleanupBatches(int) override { /* no caching, nothing to do */ }
+	void cleanupBatches(int before) override;
 
 	QString idAlias() const override { return m_alias; }
 	QString founderName() const override { return m_founder; }
@@ -86,6 +86,7 @@ protected:
 
 private:
 	protocol::MessageList m_history;
+	int m_releasedIndex;
 	QSet<QString> m_ops;
 	QSet<QString> m_trusted;
 	QSet<QString> m_announcements;
@@ -23,6 +23,7 @@
 #include "sessions.h"
 #include "serverconfig.h"
 #include "serverlog.h"
+#include "sessionthreadpool.h"
 
 #include "../libshared/net/control.h"
 #include "../libshared/util/authtoken.h"
@@ -35,6 +36,8 @@
 #include <QRegularExpression>
 #include <QNetworkRequest>
 #include <QNetworkReply>
+#include <QPointer>
+#include <QHostAddress>
 
 #ifndef Q_FALLTHROUGH
 	#define Q_FALLTHROUGH() (void)0  // work-around for qt<5.8
@@ -46,6 +49,11 @@ Sessions::~Sessions()
 {
 }
 
+void Sessions::joinSession(Session *session, Client *client, bool host)
+{
+	session->joinUser(client, host);
+}
+
 LoginHandler::LoginHandler(Client *client, Sessions *sessions, ServerConfig *config)
 	: QObject(client), m_client(client), m_sessions(sessions), m_config(config)
 {
@@ -139,6 +147,14 @@ void LoginHandler::announceSession(const QJsonObject &session)
 
 void LoginHandler::announceSessionEnd(const QString &id)
 {
+	if(m_state == State::WaitForJoin && id == m_pendingJoin) {
+		// The session ended before the join checks were finished
+		m_pendingJoin = QString();
+		m_state = State::WaitForLogin;
+		sendError("notFound", "Session not found!");
+		return;
+	}
+
 	if(m_state != State::WaitForLogin)
 		return;
 
@@ -179,6 +195,10 @@ void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
 			m_client->log(Log().about(Log::Level::Error, Log::Topic::RuleBreak).message("Invalid login command (while waiting for ident): " + cmd.cmd));
 			m_client->disconnectClient(Client::DisconnectionReason::Error, "invalid message");
 		}
+	} else if(m_state == State::WaitForJoin) {
+		// The client should wait for the join reply before sending anything else
+		m_client->log(Log().about(Log::Level::Error, Log::Topic::RuleBreak).message("Invalid login command (while joining): " + cmd.cmd));
+		m_client->disconnectClient(Client::DisconnectionReason::Error, "invalid message");
 	} else {
 		if(cmd.cmd == "host") {
 			handleHostMessage(cmd);
@@ -562,8 +582,13 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(cmd.kwargs["password"].isString())
-		session->history()->setPassword(cmd.kwargs["password"].toString());
+	if(cmd.kwargs["password"].isString()) {
+		const QString password = cmd.kwargs["password"].toString();
+		postToThread(session, [session, password]() {
+			session->history()->setPassword(password);
+			session->refreshSnapshot();
+		});
+	}
 
 	// Mark login phase as complete. No more login messages will be sent to this user
 	protocol::ServerReply reply;
@@ -579,7 +604,7 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 	send(reply);
 
 	m_complete = true;
-	session->joinUser(m_client, true);
+	m_sessions->joinSession(session, m_client, true);
 
 	deleteLater();
 }
@@ -600,41 +625,89 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 		return;
 	}
 
-	if(!m_client->isModerator()) {
-		// Non-moderators have to obey access restrictions
-		if(session->history()->banlist().isBanned(m_client->peerAddress(), m_client->authId())) {
-			sendError("banned", "You have been banned from this session");
-			return;
-		}
-		if(session->isClosed()) {
-			sendError("closed", "This session is closed");
-			return;
-		}
-		if(session->history()->hasFlag(SessionHistory::AuthOnly) && !m_client->isAuthenticated()) {
-			sendError("authOnly", "This session does not allow guest logins");
-			return;
-		}
+	// The session may be running in another thread, so the checks
+	// and the ID assignment are done there. The reply is sent
+	// once the result is back in this thread.
+	const bool moderator = m_client->isModerator();
+	const bool authenticated = m_client->isAuthenticated();
+	const QHostAddress peerAddress = m_client->peerAddress();
+	const QString authId = m_client->authId();
+	const QString username = m_client->username();
+	const QString password = cmd.kwargs.value("password").toString();
+	const QString pendingId = session->id();
+
+	m_state = State::WaitForJoin;
+	m_pendingJoin = pendingId;
+
+	QPointer<LoginHandler> self = this;
+	callInThreadAsync(session, [session, moderator, authenticated, peerAddress, authId, username, password]() {
+		JoinCheck check;
+
+		if(!moderator) {
+			// Non-moderators have to obey access restrictions
+			if(session->history()->banlist().isBanned(peerAddress, authId)) {
+				check.errorCode = "banned";
+				check.errorMessage = "You have been banned from this session";
+				return check;
+			}
+			if(session->isClosed()) {
+				check.errorCode = "closed";
+				check.errorMessage = "This session is closed";
+				return check;
+			}
+			if(session->history()->hasFlag(SessionHistory::AuthOnly) && !authenticated) {
+				check.errorCode = "authOnly";
+				check.errorMessage = "This session does not allow guest logins";
+				return check;
+			}
 
-		if(!session->history()->checkPassword(cmd.kwargs.value("password").toString())) {
-			sendError("badPassword", "Incorrect password");
-			return;
+			if(!session->history()->checkPassword(password)) {
+				check.errorCode = "badPassword";
+				check.errorMessage = "Incorrect password";
+				return check;
+			}
 		}
-	}
 
-	if(session->getClientByUsername(m_client->username())) {
+		if(session->getClientByUsername(username)) {
 #ifdef NDEBUG
-		sendError("nameInuse", "This username is already in use");
-		return;
+			check.errorCode = "nameInuse";
+			check.errorMessage = "This username is already in use";
+			return check;
 #else
+			check.nameClash = true;
+#endif
+		}
+
+		// Ok, join the session
+		check.userId = session->pickId(username);
+		return check;
+
+	}, [self, session, pendingId](const JoinCheck &check) {
+		// The session is known to still exist if the join is still pending,
+		// since the end of a session cancels it.
+		if(self && self->m_state == State::WaitForJoin && self->m_pendingJoin == pendingId)
+			self->finishJoin(session, check);
+	});
+}
+
+void LoginHandler::finishJoin(Session *session, const JoinCheck &check)
+{
+	m_pendingJoin = QString();
+	m_state = State::WaitForLogin;
+
+	if(!check.errorCode.isEmpty()) {
+		sendError(check.errorCode, check.errorMessage);
+		return;
+	}
+
+	if(check.nameClash) {
 		// Allow identical usernames in debug builds, so I don't have to keep changing
 		// the username when testing. There is no technical requirement for unique usernames;
 		// the limitation is solely for the benefit of the human users.
 		m_client->log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message("Username clash ignored because this is a debug build."));
-#endif
 	}
 
-	// Ok, join the session
-	session->assignId(m_client);
+	m_client->setId(check.userId);
 
 	protocol::ServerReply reply;
 	reply.type = protocol::ServerReply::RESULT;
@@ -649,7 +722,7 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 
 	m_complete = true;
 
-	session->joinUser(m_client, false);
+	m_sessions->joinSession(session, m_client, false);
 
 	deleteLater();
 }
@@ -658,7 +731,15 @@ void LoginHandler::handleAbuseReport(const protocol::ServerCommand &cmd)
 {
 	Session *s = m_sessions->getSessionById(cmd.kwargs["session"].toString(), false);
 	if(s) {
-		s->sendAbuseReport(m_client, 0, cmd.kwargs["reason"].toString());
+		const QString reason = cmd.kwargs["reason"].toString();
+		m_client->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Abuse report about session received: " + reason));
+
+		const QString username = m_client->username();
+		const bool authenticated = m_client->isAuthenticated();
+		const QHostAddress peerAddress = m_client->peerAddress();
+		postToThread(s, [s, username, authenticated, peerAddress, reason]() {
+			s->sendAbuseReport(username, authenticated, peerAddress, 0, reason);
+		});
 	}
 }
 
@@ -98,13 +98,23 @@ private:
 	enum class State {
 		WaitForSecure,
 		WaitForIdent,
-		WaitForLogin
+		WaitForLogin,
+		WaitForJoin
+	};
+
+	//! Result of the join checks made in the session's thread
+	struct JoinCheck {
+		QString errorCode;
+		QString errorMessage;
+		uint8_t userId = 0;
+		bool nameClash = false;
 	};
 
 	void announceServerInfo();
 	void handleIdentMessage(const protocol::ServerCommand &cmd);
 	void handleHostMessage(const protocol::ServerCommand &cmd);
 	void handleJoinMessage(const protocol::ServerCommand &cmd);
+	void finishJoin(Session *session, const JoinCheck &check);
 	void handleAbuseReport(const protocol::ServerCommand &cmd);
 	void handleStarttls();
 	void requestExtAuth();
@@ -122,6 +132,7 @@ private:
 	quint64 m_extauth_nonce = 0;
 	bool m_hostPrivilege = false;
 	bool m_complete = false;
+	QString m_pendingJoin; // ID of the session whose join checks are in progress
 };
 
 }
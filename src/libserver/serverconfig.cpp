@@ -26,7 +26,11 @@ namespace server {
 QString ServerConfig::getConfigString(ConfigKey key) const
 {
 	bool found;
-	const QString val = getConfigValue(key, found);
+	QString val;
+	{
+		QMutexLocker lock(&m_storageMutex);
+		val = getConfigValue(key, found);
+	}
 	if(!found) {
 		return key.defaultValue;
 	}
@@ -109,6 +113,7 @@ bool ServerConfig::setConfigString(ConfigKey key, const QString &value)
 
 	// TODO key specific validation
 
+	QMutexLocker lock(&m_storageMutex);
 	setConfigValue(key, value);
 	return true;
 }
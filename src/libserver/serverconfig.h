@@ -24,6 +24,7 @@
 #include <QString>
 #include <QHash>
 #include <QUrl>
+#include <QMutex>
 
 class QHostAddress;
 
@@ -87,6 +88,9 @@ struct InternalConfig {
 	int announcePort = 0;  // The port to use in session announcements
 	QUrl extAuthUrl;       // URL of the external authentication server
 	QUrl reportUrl;        // Abuse report handler backend URL
+	int sessionThreads = 0; // Number of session worker threads (0 means sessions run in the main thread)
+	int commitInterval = 1000; // Milliseconds between file backed session group commits
+	bool syncWrites = false;   // Fdatasync file backed session changes
 
 	int getAnnouncePort() const { return announcePort > 0 ? announcePort : realPort; }
 };
@@ -195,8 +199,19 @@ protected:
 	virtual QString getConfigValue(const ConfigKey key, bool &found) const = 0;
 	virtual void setConfigValue(const ConfigKey key, const QString &value) = 0;
 
+	/**
+	 * @brief Lock guarding the configuration storage
+	 *
+	 * When sessions run in worker threads, configuration values are read
+	 * from several threads at once. getConfigValue and setConfigValue are
+	 * always called with this lock held. Implementations should take it
+	 * in any other function that touches the same storage.
+	 */
+	QMutex *storageMutex() const { return &m_storageMutex; }
+
 private:
 	InternalConfig m_internalCfg;
+	mutable QMutex m_storageMutex { QMutex::Recursive };
 };
 
 }
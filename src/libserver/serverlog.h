@@ -22,6 +22,7 @@
 
 #include <QDateTime>
 #include <QHostAddress>
+#include <QMutex>
 
 #include "../libshared/util/ulid.h"
 
@@ -226,6 +227,7 @@ protected:
 private:
 	QList<Log> m_history;
 	int m_limit;
+	mutable QMutex m_mutex;
 };
 
 }
@@ -34,6 +34,7 @@
 #include "config.h"
 
 #include <QTimer>
+#include <QThread>
 #include <QNetworkRequest>
 #include <QNetworkReply>
 
@@ -55,6 +56,8 @@ Session::Session(SessionHistory *history, ServerConfig *config, sessionlisting::
 	if(history->sizeInBytes()>0)
 		m_state = State::Running;
 
+	refreshSnapshot();
+
 	// Session announcements
 	connect(m_announcements, &sessionlisting::Announcements::announcementsChanged, this, &Session::onAnnouncementsChanged);
 	for(const QString &announcement : m_history->announcements())
@@ -155,7 +158,12 @@ void Session::switchState(State newstate)
 
 void Session::assignId(Client *user)
 {
-	uint8_t id = m_history->idQueue().getIdForName(user->username());
+	user->setId(pickId(user->username()));
+}
+
+uint8_t Session::pickId(const QString &username)
+{
+	uint8_t id = m_history->idQueue().getIdForName(username);
 
 	int loops=256;
 	while(loops>0 && (id==0 || getClientById(id))) {
@@ -163,7 +171,7 @@ void Session::assignId(Client *user)
 		  --loops;
 	}
 	Q_ASSERT(loops>0); // shouldn't happen, since we don't let new users in if the session is full
-	user->setId(id);
+	return id;
 }
 
 void Session::joinUser(Client *user, bool host)
@@ -219,6 +227,7 @@ void Session::joinUser(Client *user, bool host)
 	m_history->joinUser(user->id(), user->username());
 
 	user->log(Log().about(Log::Level::Info, Log::Topic::Join).message("Joined session"));
+	refreshSnapshot();
 	emit sessionAttributeChanged(this);
 }
 
@@ -258,6 +267,7 @@ void Session::removeUser(Client *user)
 		setClosed(false);
 	}
 
+	refreshSnapshot();
 	emit sessionAttributeChanged(this);
 }
 
@@ -541,6 +551,7 @@ void Session::sendUpdatedSessionProperties()
 	props.reply["config"] = conf;
 
 	addToHistory(protocol::MessagePtr(new protocol::Command(0, props)));
+	refreshSnapshot();
 	emit sessionAttributeChanged(this);
 }
 
@@ -803,7 +814,10 @@ void Session::killSession(bool terminate)
 	if(terminate)
 		m_history->terminate();
 
-	this->deleteLater();
+	if(thread() == m_announcements->thread())
+		this->deleteLater();
+	else
+		emit sessionShutdown(this);
 }
 
 void Session::directToAll(protocol::MessagePtr msg)
@@ -885,7 +899,12 @@ void Session::restartRecording()
 	int lastBatchIndex=0;
 	do {
 		protocol::MessageList history;
+		const int previousBatchIndex = lastBatchIndex;
 		std::tie(history, lastBatchIndex) = m_history->getBatch(lastBatchIndex);
+		if(lastBatchIndex == previousBatchIndex && lastBatchIndex < m_history->lastIndex()) {
+			log(Log().about(Log::Level::Error, Log::Topic::Status).message("Session history could not be read: recording is incomplete"));
+			break;
+		}
 		for(MessagePtr m : history)
 			m_recorder->recordMessage(m);
 
@@ -957,6 +976,11 @@ void Session::unlistAnnouncement(const QUrl &url, bool terminate)
 
 sessionlisting::Session Session::getSessionAnnouncement() const
 {
+	if(QThread::currentThread() != thread()) {
+		QMutexLocker lock(&m_snapshotMutex);
+		return m_announcementSnapshot;
+	}
+
 	const bool privateUserList = m_config->getConfigBool(config::PrivateUserList);
 
 	return sessionlisting::Session {
@@ -975,6 +999,16 @@ sessionlisting::Session Session::getSessionAnnouncement() const
 	};
 }
 
+void Session::sendListserverMessage(const QString &message)
+{
+	if(QThread::currentThread() != thread()) {
+		QMetaObject::invokeMethod(this, [this, message]() {
+			messageAll(message, false);
+		}, Qt::QueuedConnection);
+	} else {
+		messageAll(message, false);
+	}
+}
 
 void Session::onAnnouncementsChanged(const sessionlisting::Announcable *session)
 {
@@ -988,6 +1022,11 @@ void Session::sendAbuseReport(const Client *reporter, int aboutUser, const QStri
 
 	reporter->log(Log().about(Log::Level::Info, Log::Topic::Status).message(QString("Abuse report about user %1 received: %2").arg(aboutUser).arg(message)));
 
+	sendAbuseReport(reporter->username(), reporter->isAuthenticated(), reporter->peerAddress(), aboutUser, message);
+}
+
+void Session::sendAbuseReport(const QString &reporterName, bool reporterAuthenticated, const QHostAddress &reporterAddress, int aboutUser, const QString &message)
+{
 	const QUrl url = m_config->internalConfig().reportUrl;
 	if(!url.isValid()) {
 		// This shouldn't happen normally. If the URL is not configured,
@@ -1005,9 +1044,9 @@ void Session::sendAbuseReport(const Client *reporter, int aboutUser, const QStri
 	QJsonObject o;
 	o["session"] = id();
 	o["sessionTitle"] = m_history->title();
-	o["user"] = reporter->username();
-	o["auth"] = reporter->isAuthenticated();
-	o["ip"] = reporter->peerAddress().toString();
+	o["user"] = reporterName;
+	o["auth"] = reporterAuthenticated;
+	o["ip"] = reporterAddress.toString();
 	if(aboutUser>0)
 		o["perp"] = aboutUser;
 
@@ -1102,6 +1141,38 @@ QJsonObject Session::getDescription(bool full) const
 	return o;
 }
 
+void Session::refreshSnapshot()
+{
+	Q_ASSERT(QThread::currentThread() == thread());
+
+	const QJsonObject description = getDescription();
+	const sessionlisting::Session announcement = getSessionAnnouncement();
+
+	QJsonArray users;
+	for(const Client *c : m_clients)
+		users << c->description();
+
+	QMutexLocker lock(&m_snapshotMutex);
+	m_descriptionSnapshot = description;
+	m_userSnapshot = users;
+	m_announcementSnapshot = announcement;
+}
+
+QJsonObject Session::descriptionSnapshot() const
+{
+	if(QThread::currentThread() == thread())
+		return getDescription();
+
+	QMutexLocker lock(&m_snapshotMutex);
+	return m_descriptionSnapshot;
+}
+
+QJsonArray Session::userSnapshot() const
+{
+	QMutexLocker lock(&m_snapshotMutex);
+	return m_userSnapshot;
+}
+
 JsonApiResult Session::callJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
 {
 	if(!path.isEmpty()) {
@@ -32,6 +32,8 @@
 #include <QDateTime>
 #include <QElapsedTimer>
 #include <QJsonObject>
+#include <QJsonArray>
+#include <QMutex>
 
 class QTimer;
 
@@ -139,6 +141,14 @@ public:
 	 */
 	void assignId(Client *user);
 
+	/**
+	 * @brief Pick an ID for a user who is about to join
+	 *
+	 * Like assignId, but the ID is returned rather than set. This is used
+	 * when the user is still owned by the login handler in another thread.
+	 */
+	uint8_t pickId(const QString &username);
+
 	/**
 	 * @brief Get a client by ID
 	 * @param id user ID
@@ -255,9 +265,14 @@ public:
 	 */
 	void unlistAnnouncement(const QUrl &url, bool terminate=true);
 
+	/**
+	 * @brief Get the session description for a listing server
+	 *
+	 * When called from another thread, the last snapshot is returned.
+	 */
 	sessionlisting::Session getSessionAnnouncement() const override;
 
-	void sendListserverMessage(const QString &message) override { messageAll(message, false); }
+	void sendListserverMessage(const QString &message) override;
 
 	//! Get the session state
 	State state() const { return m_state; }
@@ -305,6 +320,14 @@ public:
 	 */
 	void sendAbuseReport(const Client *reporter, int aboutUser, const QString &message);
 
+	/**
+	 * @brief Send an abuse report made during the login phase
+	 *
+	 * The reporter's details are passed by value, since the reporting
+	 * client does not belong to this session.
+	 */
+	void sendAbuseReport(const QString &reporterName, bool reporterAuthenticated, const QHostAddress &reporterAddress, int aboutUser, const QString &message);
+
 	/**
 	 * @brief Get a JSON object describing the session
 	 *
@@ -316,6 +339,21 @@ public:
 	 */
 	QJsonObject getDescription(bool full=false) const;
 
+	/**
+	 * @brief Take a snapshot of the session description and the user list
+	 *
+	 * The snapshot is what other threads see via descriptionSnapshot(),
+	 * userSnapshot() and getSessionAnnouncement(). It is refreshed whenever
+	 * a publishable attribute changes. Must be called in the session's thread.
+	 */
+	void refreshSnapshot();
+
+	//! Get the basic session description. Safe to call from any thread.
+	QJsonObject descriptionSnapshot() const;
+
+	//! Get the descriptions of the logged in users. Safe to call from any thread.
+	QJsonArray userSnapshot() const;
+
 	/**
 	 * @brief Call the server's JSON administration API
 	 *
@@ -351,6 +389,16 @@ signals:
 	 */
 	void sessionAttributeChanged(Session *thisSession);
 
+	/**
+	 * @brief This session has shut down and can now be deleted
+	 *
+	 * A session running in the server's main thread deletes itself
+	 * after shutting down. A session running in a worker thread emits this
+	 * signal instead, so the session server can forget about it before it
+	 * is deleted.
+	 */
+	void sessionShutdown(Session *thisSession);
+
 private slots:
 	void removeUser(Client *user);
 	void onAnnouncementsChanged(const Announcable *session);
@@ -435,6 +483,11 @@ private:
 	QElapsedTimer m_lastEventTime;
 
 	bool m_closed = false;
+
+	mutable QMutex m_snapshotMutex;
+	QJsonObject m_descriptionSnapshot;
+	QJsonArray m_userSnapshot;
+	sessionlisting::Session m_announcementSnapshot;
 };
 
 }
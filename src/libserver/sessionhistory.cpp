@@ -88,6 +88,24 @@ bool SessionHistory::reset(const protocol::MessageList &newHistory)
 	return true;
 }
 
+std::tuple<QByteArray, int> SessionHistory::getRawBatch(int after) const
+{
+	protocol::MessageList batch;
+	int batchLast;
+	std::tie(batch, batchLast) = getBatch(after);
+
+	int len = 0;
+	for(const protocol::MessagePtr &msg : batch)
+		len += msg->length();
+
+	QByteArray data;
+	data.reserve(len);
+	for(const protocol::MessagePtr &msg : batch)
+		data += msg->serialized();
+
+	return std::make_tuple(data, batchLast);
+}
+
 uint SessionHistory::effectiveAutoResetThreshold() const
 {
 	uint t = autoResetThreshold();
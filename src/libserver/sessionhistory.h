@@ -159,6 +159,25 @@ public:
 	 */
 	virtual std::tuple<protocol::MessageList, int> getBatch(int after) const = 0;
 
+	/**
+	 * @brief Get a batch of messages in wire format
+	 *
+	 * This is like getBatch, but the messages are returned as one contiguous
+	 * buffer that can be written to a socket as is. Storage backends that
+	 * keep the history in serialized form can implement this without
+	 * deserializing any messages.
+	 */
+	virtual std::tuple<QByteArray, int> getRawBatch(int after) const;
+
+	/**
+	 * @brief Check if getBatch(after) can return without waiting for disk I/O
+	 *
+	 * If the batch is not ready, the storage backend starts loading it in
+	 * the background and emits newMessagesAvailable() once done.
+	 * Backends that keep everything in memory are always ready.
+	 */
+	virtual bool isBatchReady(int after) const { Q_UNUSED(after); return true; }
+
 	/**
 	 * @brief Mark messages before the given index as unneeded (for now)
 	 *
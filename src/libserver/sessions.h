@@ -32,6 +32,7 @@ namespace protocol {
 namespace server {
 
 class Session;
+class Client;
 
 /**
  * Interface for a class that can accept client logins
@@ -71,6 +72,17 @@ public:
 	 * @return session, error string pair: if session is null, error string contains the error code
 	 */
 	virtual std::tuple<Session*, QString> createSession(const QString &id, const QString &alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder) = 0;
+
+	/**
+	 * Add a client who has just completed the login handshake to a session
+	 *
+	 * The default implementation calls Session::joinUser directly.
+	 *
+	 * @param session the session to join
+	 * @param client the client whose login handshake just completed
+	 * @param host is this the hosting user
+	 */
+	virtual void joinSession(Session *session, Client *client, bool host);
 };
 
 }
@@ -27,8 +27,10 @@
 #include "filedhistory.h"
 #include "templateloader.h"
 #include "announcements.h"
+#include "sessionthreadpool.h"
 
 #include <QTimer>
+#include <QPointer>
 #include <QJsonArray>
 #include <QJsonDocument>
 
@@ -38,7 +40,9 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 	: QObject(parent),
 	m_config(config),
 	m_tpls(nullptr),
-	m_useFiledSessions(false)
+	m_useFiledSessions(false),
+	m_threadPool(nullptr),
+	m_threadedClients(0)
 {
 	m_announcements = new sessionlisting::Announcements(config, this);
 
@@ -76,6 +80,7 @@ void SessionServer::loadNewSessions()
 		FiledHistory *fh = FiledHistory::load(f.absoluteFilePath());
 		if(fh) {
 			fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
+			fh->setWritePolicy(m_config->internalConfig().commitInterval, m_config->internalConfig().syncWrites);
 			Session *session = new ThinSession(fh, m_config, m_announcements, this);
 			initSession(session);
 			session->log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Loaded from file."));
@@ -88,8 +93,8 @@ QJsonArray SessionServer::sessionDescriptions() const
 	QJsonArray descs;
 	QStringList aliases;
 
-	for(const Session *s : m_sessions) {
-		descs.append(s->getDescription());
+	for(Session *s : m_sessions) {
+		descs.append(s->descriptionSnapshot());
 		if(!s->idAlias().isEmpty())
 			aliases << s->idAlias();
 	}
@@ -111,6 +116,7 @@ SessionHistory *SessionServer::initHistory(const QString &id, const QString alia
 	if(m_useFiledSessions) {
 		FiledHistory *fh = FiledHistory::startNew(m_sessiondir, id, alias, protocolVersion, founder);
 		fh->setArchive(m_config->getConfigBool(config::ArchiveMode));
+		fh->setWritePolicy(m_config->internalConfig().commitInterval, m_config->internalConfig().syncWrites);
 		return fh;
 	} else {
 		return new InMemoryHistory(id, alias, protocolVersion, founder);
@@ -181,6 +187,7 @@ void SessionServer::initSession(Session *session)
 	const QString idString = session->id();
 
 	connect(session, &Session::sessionAttributeChanged, this, &SessionServer::onSessionAttributeChanged);
+	connect(session, &Session::sessionShutdown, this, &SessionServer::onSessionShutdown);
 	connect(session, &Session::destroyed, this, [this, idString](QObject *object) {
 		auto *session = static_cast<Session*>(object);
 		m_sessions.removeOne(session);
@@ -191,6 +198,33 @@ void SessionServer::initSession(Session *session)
 
 	emit sessionCreated(session);
 	emit sessionChanged(session->getDescription());
+
+	// Move the session to a worker thread, if enabled.
+	// From now on, the session must not be touched directly from this thread.
+	const int threads = m_config->internalConfig().sessionThreads;
+	if(!m_threadPool && threads > 0)
+		m_threadPool = new SessionThreadPool(threads, this);
+
+	if(m_threadPool) {
+		session->setParent(nullptr);
+		m_threadPool->adopt(session);
+	}
+}
+
+void SessionServer::onSessionShutdown(Session *session)
+{
+	// A session running in a worker thread has shut down and is waiting to be deleted.
+	// It is forgotten about here first, so nothing in this thread is left pointing to it.
+	Q_ASSERT(m_threadPool);
+	const QString idString = session->id();
+
+	session->disconnect(this);
+	m_sessions.removeOne(session);
+	m_announcements->unlistSession(session);
+	m_threadPool->release(session);
+	session->deleteLater();
+
+	emit sessionEnded(idString);
 }
 
 Session *SessionServer::getSessionById(const QString &id, bool load)
@@ -214,14 +248,16 @@ void SessionServer::stopAll()
 		c->disconnectClient(Client::DisconnectionReason::Shutdown, "Server shutting down");
 	}
 
+	// Clients that have joined a session running in a worker thread
+	// are disconnected by the session itself.
 	for(Session *s : m_sessions)
-		s->killSession(false);
+		runInThread(s, [s]() { s->killSession(false); });
 }
 
 void SessionServer::messageAll(const QString &message, bool alert)
 {
 	for(Session *s : m_sessions) {
-		s->messageAll(message, alert);
+		postToThread(s, [s, message, alert]() { s->messageAll(message, alert); });
 	}
 }
 
@@ -237,7 +273,7 @@ void SessionServer::addClient(ThinServerClient *client)
 	m_clients.append(client);
 	connect(client, &Client::destroyed, this, &SessionServer::removeClient);
 
-	emit userCountChanged(m_clients.size());
+	emit userCountChanged(totalUsers());
 
 	auto *login = new LoginHandler(client, this, m_config);
 	connect(this, &SessionServer::sessionChanged, login, &LoginHandler::announceSession);
@@ -245,10 +281,62 @@ void SessionServer::addClient(ThinServerClient *client)
 	login->startLoginProcess();
 }
 
+void SessionServer::joinSession(Session *session, Client *client, bool host)
+{
+	if(session->thread() == thread()) {
+		session->joinUser(client, host);
+		return;
+	}
+
+	// The session is running in a worker thread, so the client must be moved there.
+	// We are still inside the client's message handler at this point, so the move
+	// is made once control returns to the event loop. Until the client has joined,
+	// its incoming messages are held.
+	client->setHoldLocked(true);
+
+	m_clients.removeOne(static_cast<ThinServerClient*>(client));
+	disconnect(client, &Client::destroyed, this, &SessionServer::removeClient);
+	connect(client, &Client::destroyed, this, [this]() {
+		--m_threadedClients;
+		emit userCountChanged(totalUsers());
+	});
+	++m_threadedClients;
+
+	QPointer<Client> clientPtr = client;
+	QMetaObject::invokeMethod(this, [this, session, clientPtr, host]() {
+		if(!clientPtr)
+			return;
+
+		if(!m_sessions.contains(session)) {
+			clientPtr->disconnectClient(Client::DisconnectionReason::Shutdown, "Session terminated");
+			return;
+		}
+
+		clientPtr->setParent(nullptr);
+		clientPtr->moveToThread(session->thread());
+
+		QMetaObject::invokeMethod(session, [session, clientPtr, host]() {
+			if(!clientPtr)
+				return;
+
+			if(session->state() == Session::State::Shutdown) {
+				clientPtr->disconnectClient(Client::DisconnectionReason::Shutdown, "Session terminated");
+				return;
+			}
+
+			session->joinUser(clientPtr, host);
+
+			// A joining client stays hold-locked while the session is still initializing
+			if(host || session->state() != Session::State::Initialization)
+				clientPtr->setHoldLocked(false);
+		}, Qt::QueuedConnection);
+	}, Qt::QueuedConnection);
+}
+
 void SessionServer::removeClient(QObject *client)
 {
 	m_clients.removeOne(static_cast<ThinServerClient*>(client));
-	emit userCountChanged(m_clients.size());
+	emit userCountChanged(totalUsers());
 }
 
 /**
@@ -262,23 +350,32 @@ void SessionServer::onSessionAttributeChanged(Session *session)
 {
 	Q_ASSERT(session);
 
-	bool delSession = false;
+	// The notification may have been queued from a session thread
+	if(!m_sessions.contains(session))
+		return;
+
+	// The session refreshed its snapshot just before emitting the signal,
+	// so the description can be read here even if the session runs in another thread.
+	const QJsonObject description = session->descriptionSnapshot();
 
-	if(session->userCount()==0 && session->state() != Session::State::Shutdown) {
-		session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Last user left."));
+	postToThread(session, [session]() {
+		if(session->userCount()==0 && session->state() != Session::State::Shutdown) {
+			session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Last user left."));
 
-		// A non-persistent session is deleted when the last user leaves
-		// A persistent session can also be deleted if it doesn't contain a snapshot point.
-		if(!session->history()->hasFlag(SessionHistory::Persistent)) {
-			session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Closing non-persistent session."));
-			delSession = true;
+			// A non-persistent session is deleted when the last user leaves
+			// A persistent session can also be deleted if it doesn't contain a snapshot point.
+			if(!session->history()->hasFlag(SessionHistory::Persistent)) {
+				session->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Closing non-persistent session."));
+				session->killSession();
+			}
 		}
-	}
+	});
 
-	if(delSession)
-		session->killSession();
-	else
-		emit sessionChanged(session->getDescription());
+	// No need to announce a change to a session that is about to be closed
+	if(description["userCount"].toInt()==0 && !description["persistent"].toBool())
+		return;
+
+	emit sessionChanged(description);
 }
 
 void SessionServer::cleanupSessions()
@@ -287,15 +384,17 @@ void SessionServer::cleanupSessions()
 
 	if(expirationTime>0) {
 		for(Session *s : m_sessions) {
-			if(s->lastEventTime() > expirationTime) {
-				s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
-				s->killSession();
-			}
+			postToThread(s, [s, expirationTime]() {
+				if(s->lastEventTime() > expirationTime) {
+					s->log(Log().about(Log::Level::Info, Log::Topic::Status).message("Idle session expired."));
+					s->killSession();
+				}
+			});
 		}
 	}
 }
 
-JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
+void SessionServer::callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request, std::function<void(const JsonApiResult&)> callback)
 {
 	QString head;
 	QStringList tail;
@@ -304,11 +403,17 @@ JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStr
 	if(!head.isEmpty()) {
 		Session *s = getSessionById(head, false);
 		if(s)
-			return s->callJsonApi(method, tail, request);
+			callInThreadAsync(s, [s, method, tail, request]() { return s->callJsonApi(method, tail, request); }, callback);
 		else
-			return JsonApiNotFound();
+			callback(JsonApiNotFound());
+		return;
 	}
 
+	callback(sessionListJsonApi(method, request));
+}
+
+JsonApiResult SessionServer::sessionListJsonApi(JsonApiMethod method, const QJsonObject &request)
+{
 	if(method == JsonApiMethod::Get) {
 		return {JsonApiResult::Ok, QJsonDocument(sessionDescriptions())};
 
@@ -341,6 +446,15 @@ JsonApiResult SessionServer::callUserJsonApi(JsonApiMethod method, const QString
 		for(const ThinServerClient *c : m_clients)
 			userlist << c->description();
 
+		// Clients that have joined a session running in a worker thread
+		if(m_threadPool) {
+			for(const Session *s : m_sessions) {
+				const QJsonArray sessionUsers = s->userSnapshot();
+				for(const QJsonValue &u : sessionUsers)
+					userlist << u;
+			}
+		}
+
 		return {JsonApiResult::Ok, QJsonDocument(userlist)};
 
 	} else {
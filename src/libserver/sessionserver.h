@@ -24,6 +24,8 @@
 #include <QObject>
 #include <QDir>
 
+#include <functional>
+
 namespace sessionlisting {
 	class Announcements;
 }
@@ -35,6 +37,7 @@ class SessionHistory;
 class ThinServerClient;
 class ServerConfig;
 class TemplateLoader;
+class SessionThreadPool;
 
 /**
  * @brief Session manager
@@ -115,10 +118,12 @@ public:
 	 */
 	Session *getSessionById(const QString &id, bool load) override;
 
+	void joinSession(Session *session, Client *client, bool host) override;
+
 	/**
 	 * @brief Get the total number of connected users
 	 */
-	int totalUsers() const { return m_clients.size(); }
+	int totalUsers() const { return m_clients.size() + m_threadedClients; }
 
 	/**
 	 * @brief Get the number of active sessions
@@ -142,14 +147,24 @@ public:
 	 *
 	 * This is used by the HTTP admin API.
 	 *
+	 * Requests about a specific session are answered in the session's own thread,
+	 * so the callback may be called after this function has returned.
+	 *
 	 * @param method query method
 	 * @param path path components
 	 * @param request request body content
-	 * @return JSON API response content
+	 * @param callback function that receives the JSON API response content
 	 */
-	JsonApiResult callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
+	void callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request, std::function<void(const JsonApiResult&)> callback);
 
-	//! Like callSessionJsonApi, but for the user list
+	/**
+	 * @brief Call the server's JSON administration API (user list)
+	 *
+	 * @param method query method
+	 * @param path path components
+	 * @param request request body content
+	 * @return JSON API response content
+	 */
 	JsonApiResult callUserJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
 signals:
@@ -186,11 +201,13 @@ signals:
 private slots:
 	void removeClient(QObject *client);
 	void onSessionAttributeChanged(Session *session);
+	void onSessionShutdown(Session *session);
 	void cleanupSessions();
 
 private:
 	SessionHistory *initHistory(const QString &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder);
 	void initSession(Session *session);
+	JsonApiResult sessionListJsonApi(JsonApiMethod method, const QJsonObject &request);
 
 	sessionlisting::Announcements *m_announcements;
 	ServerConfig *m_config;
@@ -198,8 +215,11 @@ private:
 	QDir m_sessiondir;
 	bool m_useFiledSessions;
 
+	SessionThreadPool *m_threadPool;
+
 	QList<Session*> m_sessions;
-	QList<ThinServerClient*> m_clients;
+	QList<ThinServerClient*> m_clients; // clients in this thread
+	int m_threadedClients;              // clients handed over to a session thread
 
 #ifndef NDEBUG
 	uint m_randomlag;
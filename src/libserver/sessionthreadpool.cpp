@@ -0,0 +1,75 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sessionthreadpool.h"
+#include "session.h"
+
+namespace server {
+
+SessionThreadPool::SessionThreadPool(int threadCount, QObject *parent)
+	: QObject(parent)
+{
+	Q_ASSERT(threadCount > 0);
+
+	for(int i=0;i<threadCount;++i) {
+		QThread *thread = new QThread;
+		thread->setObjectName(QStringLiteral("session worker %1").arg(i+1));
+		thread->start();
+
+		m_threads << thread;
+		m_sessionCount << 0;
+	}
+}
+
+SessionThreadPool::~SessionThreadPool()
+{
+	for(QThread *thread : m_threads) {
+		thread->quit();
+		thread->wait();
+		delete thread;
+	}
+}
+
+void SessionThreadPool::adopt(Session *session)
+{
+	Q_ASSERT(session->parent() == nullptr);
+	Q_ASSERT(!m_assignments.contains(session));
+
+	int idx = 0;
+	for(int i=1;i<m_threads.size();++i) {
+		if(m_sessionCount.at(i) < m_sessionCount.at(idx))
+			idx = i;
+	}
+
+	++m_sessionCount[idx];
+	m_assignments[session] = idx;
+
+	session->moveToThread(m_threads.at(idx));
+}
+
+void SessionThreadPool::release(Session *session)
+{
+	const auto i = m_assignments.find(session);
+	if(i != m_assignments.end()) {
+		--m_sessionCount[i.value()];
+		m_assignments.erase(i);
+	}
+}
+
+}
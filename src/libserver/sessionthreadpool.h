@@ -0,0 +1,149 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DP_SRV_SESSIONTHREADPOOL_H
+#define DP_SRV_SESSIONTHREADPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QCoreApplication>
+#include <QVector>
+#include <QHash>
+
+namespace server {
+
+class Session;
+
+/**
+ * @brief A fixed pool of worker threads for running sessions in
+ *
+ * A session and the clients that have joined it live in the same worker thread.
+ * Everything else (login, the admin API, session announcements) stays in
+ * the main thread.
+ *
+ * Rules for crossing threads:
+ *  - The main thread must not wait on a session thread while serving clients.
+ *    Requests are posted to the session (see callInThreadAsync) and
+ *    state that is needed immediately is read from the session's snapshot.
+ *    Blocking calls (see callInThread) are only for shutdown and tests.
+ *  - A session thread must never wait on the main thread. Calls the other
+ *    way are always queued.
+ */
+class SessionThreadPool : public QObject
+{
+	Q_OBJECT
+public:
+	SessionThreadPool(int threadCount, QObject *parent=nullptr);
+	~SessionThreadPool();
+
+	//! Get the number of worker threads in this pool
+	int threadCount() const { return m_threads.size(); }
+
+	/**
+	 * @brief Move a session to the least busy worker thread
+	 *
+	 * This must be called from the thread the session currently lives in
+	 * and the session must not have a parent.
+	 */
+	void adopt(Session *session);
+
+	/**
+	 * @brief Forget a session that is about to be deleted
+	 */
+	void release(Session *session);
+
+private:
+	QVector<QThread*> m_threads;
+	QVector<int> m_sessionCount;
+	QHash<const Session*, int> m_assignments;
+};
+
+/**
+ * @brief Call a function in the thread of the context object and wait for the result
+ *
+ * If the context object lives in the current thread, the function is called directly.
+ *
+ * The context object must outlive the call.
+ */
+template<typename Func>
+auto callInThread(QObject *context, Func func) -> decltype(func())
+{
+	if(context->thread() == QThread::currentThread())
+		return func();
+
+	decltype(func()) result;
+	QMetaObject::invokeMethod(context, [&result, &func]() { result = func(); }, Qt::BlockingQueuedConnection);
+	return result;
+}
+
+//! Like callInThread, but for functions with no return value
+template<typename Func>
+void runInThread(QObject *context, Func func)
+{
+	if(context->thread() == QThread::currentThread())
+		func();
+	else
+		QMetaObject::invokeMethod(context, func, Qt::BlockingQueuedConnection);
+}
+
+/**
+ * @brief Call a function in the thread of the context object without waiting for it
+ *
+ * If the context object lives in the current thread, the function is called directly.
+ * Otherwise, it is queued and the call returns immediately.
+ *
+ * If the context object is deleted before the call is made, the call is dropped.
+ */
+template<typename Func>
+void postToThread(QObject *context, Func func)
+{
+	if(context->thread() == QThread::currentThread())
+		func();
+	else
+		QMetaObject::invokeMethod(context, func, Qt::QueuedConnection);
+}
+
+/**
+ * @brief Call a function in the thread of the context object and pass the result to a callback
+ *
+ * The callback is called in the main thread. If the context object lives in the
+ * current thread, both are called directly before this function returns.
+ *
+ * If the context object is deleted before the call is made, neither function is called.
+ * The callback must check that whatever it refers to still exists.
+ */
+template<typename Func, typename Callback>
+void callInThreadAsync(QObject *context, Func func, Callback callback)
+{
+	if(context->thread() == QThread::currentThread()) {
+		callback(func());
+		return;
+	}
+
+	QMetaObject::invokeMethod(context, [func, callback]() {
+		const auto result = func();
+		QMetaObject::invokeMethod(QCoreApplication::instance(), [callback, result]() {
+			callback(result);
+		}, Qt::QueuedConnection);
+	}, Qt::QueuedConnection);
+}
+
+}
+
+#endif
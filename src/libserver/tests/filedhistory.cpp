@@ -6,6 +6,7 @@
 #include <QtTest/QtTest>
 #include <QTemporaryDir>
 #include <QDir>
+#include <QFileInfo>
 #include <memory>
 
 using namespace server;
@@ -275,6 +276,125 @@ private slots:
 		QCOMPARE(lastIdx, 5);
 	}
 
+	void testBackgroundBlockLoad()
+	{
+		QString file = makeTestRecording();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(file)) };
+		QVERIFY(fh.get());
+
+		fh->closeBlock();
+		fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4"))));
+
+		// Once released, a closed block must be read from disk again
+		fh->cleanupBatches(4);
+		QSignalSpy spy(fh.get(), &SessionHistory::newMessagesAvailable);
+		QVERIFY(!fh->isBatchReady(-1));
+		QVERIFY(spy.wait());
+		QVERIFY(fh->isBatchReady(-1));
+
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+		QCOMPARE(msgs.size(), 3);
+		QCOMPARE(lastIdx, 2);
+		QCOMPARE(msgs.last().cast<protocol::Chat>().message(), QString("test3"));
+
+		// The second block is the active one and always in memory
+		while(!fh->isBatchReady(lastIdx))
+			QVERIFY(spy.wait());
+
+		std::tie(msgs, lastIdx) = fh->getBatch(lastIdx);
+		QCOMPARE(msgs.size(), 1);
+		QCOMPARE(msgs.first().cast<protocol::Chat>().message(), QString("test4"));
+	}
+
+	void testRawBatch()
+	{
+		QString file = makeTestRecording();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(file)) };
+		QVERIFY(fh.get());
+
+		QByteArray data;
+		int lastIdx;
+		std::tie(data, lastIdx) = fh->getRawBatch(-1);
+		QCOMPARE(lastIdx, 2);
+
+		protocol::MessageList msgs;
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+
+		QByteArray expected;
+		for(const protocol::MessagePtr &msg : msgs)
+			expected += msg->serialized();
+		QCOMPARE(data, expected);
+
+		// Partial batch
+		std::tie(data, lastIdx) = fh->getRawBatch(0);
+		QCOMPARE(data, expected.mid(msgs.first()->length()));
+		QCOMPARE(lastIdx, 2);
+
+		// Messages added to the active block are served from memory,
+		// even before the buffered writes have reached the file
+		auto testMsg = protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4")));
+		fh->addMessage(testMsg);
+		QVERIFY(fh->isBatchReady(2));
+		std::tie(data, lastIdx) = fh->getRawBatch(2);
+		QCOMPARE(data, testMsg->serialized());
+		QCOMPARE(lastIdx, 3);
+	}
+
+	void testBlockIndex()
+	{
+		auto id = Ulid::make().toString();
+		QString recordingFile;
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			fh->addMessage(protocol::MessagePtr(new protocol::UserJoin(1, 0, QByteArray("u1"), QByteArray())));
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test1"))));
+			fh->closeBlock();
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test2"))));
+			fh->closeBlock();
+			// This part is not in the index
+			fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test3"))));
+		}
+
+		const QStringList indexes = m_dir.entryList({id + "*.index"});
+		QCOMPARE(indexes.size(), 1);
+		const QString indexFile = m_dir.absoluteFilePath(indexes.first());
+
+		auto checkContent = [this, id]() {
+			std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+			QVERIFY(fh.get());
+
+			protocol::MessageList msgs;
+			int lastIdx = -1;
+			do {
+				protocol::MessageList batch;
+				std::tie(batch, lastIdx) = fh->getBatch(lastIdx);
+				msgs += batch;
+			} while(lastIdx < fh->lastIndex());
+
+			// User 1 was still logged in at the end: a leave message should have been added
+			QCOMPARE(msgs.size(), 5);
+			QCOMPARE(msgs.at(2).cast<protocol::Chat>().message(), QString("test2"));
+			QCOMPARE(msgs.at(3).cast<protocol::Chat>().message(), QString("test3"));
+			QCOMPARE(msgs.last()->type(), protocol::MSG_USER_LEAVE);
+		};
+
+		// Load using the index
+		checkContent();
+
+		// A corrupted index should be ignored
+		{
+			QFile f(indexFile);
+			QVERIFY(f.open(QFile::ReadWrite));
+			QByteArray content = f.readAll();
+			content.replace("BLOCK", "BLOCX");
+			f.seek(0);
+			f.write(content);
+		}
+		checkContent();
+	}
+
 	void testUserLeave()
 	{
 		auto id = Ulid::make().toString();
@@ -302,6 +422,39 @@ private slots:
 		}
 	}
 
+	// Buffered messages are written out together in a group commit,
+	// and none are lost when the history is closed before the next one.
+	void testGroupCommit()
+	{
+		auto id = Ulid::make().toString();
+		{
+			std::unique_ptr<FiledHistory> fh { FiledHistory::startNew(m_dir, id, QString(), protocol::ProtocolVersion::current(), "test") };
+			QVERIFY(fh.get());
+			fh->setWritePolicy(60 * 1000, false);
+
+			const QStringList recordings = m_dir.entryList({id + "*.dprec"});
+			QCOMPARE(recordings.size(), 1);
+			const QFileInfo recording(m_dir.absoluteFilePath(recordings.first()));
+			const qint64 headerSize = recording.size();
+
+			for(int i=0;i<100;++i)
+				fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray::number(i))));
+
+			// Nothing has been committed yet
+			QFileInfo recordingNow(recording.absoluteFilePath());
+			QCOMPARE(recordingNow.size(), headerSize);
+		}
+
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(FiledHistory::journalFilename(id))) };
+		QVERIFY(fh.get());
+
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+		QCOMPARE(msgs.size(), 100);
+		QCOMPARE(msgs.last().cast<protocol::Chat>().message(), QString("99"));
+	}
+
 private:
 	// Generate a test recording containing three messages.
 	QString makeTestRecording()
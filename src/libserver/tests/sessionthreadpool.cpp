@@ -0,0 +1,180 @@
+#include "../sessionthreadpool.h"
+#include "../sessionserver.h"
+#include "../thinsession.h"
+#include "../thinserverclient.h"
+#include "../inmemoryhistory.h"
+#include "../inmemoryconfig.h"
+#include "../announcements.h"
+
+#include <QtTest/QtTest>
+#include <QThread>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+using namespace server;
+
+class TestSessionThreadPool: public QObject
+{
+	Q_OBJECT
+private slots:
+	void init()
+	{
+		m_config = new InMemoryConfig(this);
+		m_announcements = new sessionlisting::Announcements(m_config, this);
+	}
+
+	void cleanup()
+	{
+		delete m_announcements;
+		delete m_config;
+	}
+
+	// Sessions are placed in the worker thread with the fewest sessions
+	void testAdopt()
+	{
+		SessionThreadPool pool(2);
+		QCOMPARE(pool.threadCount(), 2);
+
+		Session *s1 = makeSession("1");
+		Session *s2 = makeSession("2");
+		Session *s3 = makeSession("3");
+		pool.adopt(s1);
+		pool.adopt(s2);
+		pool.adopt(s3);
+
+		QVERIFY(s1->thread() != QThread::currentThread());
+		QVERIFY(s2->thread() != QThread::currentThread());
+		QVERIFY(s1->thread() != s2->thread());
+		QCOMPARE(s3->thread(), s1->thread());
+
+		// A released session frees up its thread for the next one
+		QThread *freed = s2->thread();
+		pool.release(s2);
+		deleteSession(s2);
+
+		Session *s4 = makeSession("4");
+		pool.adopt(s4);
+		QCOMPARE(s4->thread(), freed);
+
+		for(Session *s : { s1, s3, s4 }) {
+			pool.release(s);
+			deleteSession(s);
+		}
+	}
+
+	// Calls are run in the session's thread, or directly when already there
+	void testCallInThread()
+	{
+		SessionThreadPool pool(1);
+		Session *s = makeSession("1");
+
+		QCOMPARE(callInThread(s, []() { return QThread::currentThread(); }), QThread::currentThread());
+
+		pool.adopt(s);
+		QCOMPARE(callInThread(s, []() { return QThread::currentThread(); }), s->thread());
+		QCOMPARE(callInThread(s, [s]() { return s->id(); }), QString("1"));
+
+		QThread *ranIn = nullptr;
+		runInThread(s, [&ranIn]() { ranIn = QThread::currentThread(); });
+		QCOMPARE(ranIn, s->thread());
+
+		pool.release(s);
+		deleteSession(s);
+	}
+
+	// The result of an asynchronous call is delivered back in the main thread
+	void testCallInThreadAsync()
+	{
+		SessionThreadPool pool(1);
+		Session *s = makeSession("1");
+		pool.adopt(s);
+
+		QThread *ranIn = nullptr;
+		QThread *calledBackIn = nullptr;
+		callInThreadAsync(s, []() { return QThread::currentThread(); }, [&](QThread *t) {
+			ranIn = t;
+			calledBackIn = QThread::currentThread();
+		});
+
+		QTRY_VERIFY(calledBackIn);
+		QCOMPARE(ranIn, s->thread());
+		QCOMPARE(calledBackIn, QThread::currentThread());
+
+		pool.release(s);
+		deleteSession(s);
+	}
+
+	// A client that joins a threaded session is moved to the session's thread,
+	// and the session is cleaned up in the main thread after it shuts down
+	void testJoinThreadedSession()
+	{
+		InternalConfig icfg = m_config->internalConfig();
+		icfg.sessionThreads = 1;
+		m_config->setInternalConfig(icfg);
+
+		SessionServer server(m_config);
+
+		Session *session;
+		QString error;
+		std::tie(session, error) = server.createSession("test", QString(), protocol::ProtocolVersion::current(), "tester");
+		QVERIFY(session);
+		QVERIFY(session->thread() != QThread::currentThread());
+
+		// Connect a real client
+		QTcpServer listener;
+		QVERIFY(listener.listen(QHostAddress::LocalHost));
+		QTcpSocket peer;
+		peer.connectToHost(QHostAddress::LocalHost, listener.serverPort());
+		QVERIFY(listener.waitForNewConnection(5000));
+
+		auto *client = new ThinServerClient(listener.nextPendingConnection(), m_config->logger());
+		client->setUsername("tester");
+		client->setId(1);
+		QPointer<Client> clientPtr = client;
+
+		server.joinSession(session, client, true);
+
+		QTRY_VERIFY(clientPtr && clientPtr->thread() == session->thread());
+		QTRY_COMPARE(session->descriptionSnapshot()["userCount"].toInt(), 1);
+		QCOMPARE(server.totalUsers(), 1);
+		QCOMPARE(server.sessionDescriptions().size(), 1);
+		QCOMPARE(server.callUserJsonApi(JsonApiMethod::Get, QStringList(), QJsonObject()).body.array().size(), 1);
+
+		// Shut the session down in its own thread
+		QSignalSpy ended(&server, &SessionServer::sessionEnded);
+		QPointer<Session> sessionPtr = session;
+		postToThread(session, [session]() { session->killSession(false); });
+
+		QTRY_COMPARE(ended.count(), 1);
+		QCOMPARE(ended.first().first().toString(), QString("test"));
+		QCOMPARE(server.sessionCount(), 0);
+		QTRY_VERIFY(sessionPtr.isNull());
+		QTRY_VERIFY(clientPtr.isNull());
+		QTRY_COMPARE(server.totalUsers(), 0);
+	}
+
+private:
+	Session *makeSession(const QString &id)
+	{
+		return new ThinSession(
+			new InMemoryHistory(id, QString(), protocol::ProtocolVersion::current(), "test"),
+			m_config,
+			m_announcements
+		);
+	}
+
+	// Bring a session back from its worker thread and delete it
+	void deleteSession(Session *s)
+	{
+		QThread *mainThread = QThread::currentThread();
+		runInThread(s, [s, mainThread]() { s->moveToThread(mainThread); });
+		delete s;
+	}
+
+	InMemoryConfig *m_config;
+	sessionlisting::Announcements *m_announcements;
+};
+
+
+QTEST_MAIN(TestSessionThreadPool)
+#include "sessionthreadpool.moc"
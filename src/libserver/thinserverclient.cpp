@@ -39,11 +39,26 @@ void ThinServerClient::sendNextHistoryBatch()
 	if(session() == nullptr || messageQueue()->isUploading() || session()->state() != Session::State::Running)
 		return;
 
-	protocol::MessageList batch;
+	// If the next batch must be read from disk first, we'll get
+	// another newMessagesAvailable signal when it's ready.
+	if(!session()->history()->isBatchReady(m_historyPosition))
+		return;
+
+	// The thin server does not need to look at the history messages,
+	// so they can be passed through in wire format.
+	QByteArray batch;
 	int batchLast;
-	std::tie(batch, batchLast) = session()->history()->getBatch(m_historyPosition);
+	std::tie(batch, batchLast) = session()->history()->getRawBatch(m_historyPosition);
+
+	// If there are messages left but none could be read, the history is broken.
+	// Skipping ahead would leave the client with a corrupt canvas.
+	if(batchLast == m_historyPosition && m_historyPosition < session()->history()->lastIndex()) {
+		disconnectClient(DisconnectionReason::Error, "Session history could not be read");
+		return;
+	}
+
 	m_historyPosition = batchLast;
-	messageQueue()->send(batch);
+	messageQueue()->sendRaw(batch);
 
 	static_cast<ThinSession*>(session())->cleanupHistoryCache();
 }
@@ -99,6 +99,7 @@ void ThinSession::addToHistory(protocol::MessagePtr msg)
 		status.type = protocol::ServerReply::STATUS;
 		status.reply["size"] = int(history()->sizeInBytes());
 		directToAll(protocol::MessagePtr(new protocol::Command(0, status)));
+		refreshSnapshot();
 		m_lastStatusUpdate.start();
 	}
 }
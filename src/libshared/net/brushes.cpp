@@ -228,6 +228,7 @@ bool DrawDabsClassic::extend(const DrawDabs &dabs)
 		qAbs(offsetY) > ClassicBrushDab::MAX_XY_DELTA)
 		return false;
 
+	invalidateSerialized();
 	m_dabs.reserve(newLength);
 
 	dab.x = offsetX;
@@ -440,6 +441,7 @@ bool DrawDabsPixel::extend(const DrawDabs &dabs)
 		qAbs(offsetY) > ClassicBrushDab::MAX_XY_DELTA)
 		return false;
 
+	invalidateSerialized();
 	m_dabs.reserve(newLength);
 
 	dab.x = offsetX;
@@ -145,7 +145,9 @@ public:
 	bool isIndirect() const override { return (m_color & 0xff000000) > 0; }
 
 	const ClassicBrushDabVector &dabs() const { return m_dabs; }
-	ClassicBrushDabVector &dabs() { return m_dabs; }
+
+	//! Append a dab to the end of the stroke
+	void appendDab(const ClassicBrushDab &dab) { Q_ASSERT(m_dabs.size() < MAX_DABS); m_dabs << dab; invalidateSerialized(); }
 
 	QString toString() const override;
 	QString messageName() const override { return QStringLiteral("classicdabs"); }
@@ -211,7 +213,9 @@ public:
 	bool isIndirect() const override { return (m_color & 0xff000000) > 0; }
 
 	const PixelBrushDabVector &dabs() const { return m_dabs; }
-	PixelBrushDabVector &dabs() { return m_dabs; }
+
+	//! Append a dab to the end of the stroke
+	void appendDab(const PixelBrushDab &dab) { Q_ASSERT(m_dabs.size() < MAX_DABS); m_dabs << dab; invalidateSerialized(); }
 
 	QString toString() const override;
 	QString messageName() const override { return isSquare() ? QStringLiteral("squarepixeldabs") : QStringLiteral("pixeldabs"); }
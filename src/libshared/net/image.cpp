@@ -131,6 +131,22 @@ PutTile::PutTile(uint8_t ctx, uint16_t layer, uint8_t sublayer, uint16_t col, ui
 {
 }
 
+static QByteArray referenceByteArray(uint16_t layer, uint8_t sublayer, uint16_t col, uint16_t row)
+{
+	QByteArray ba(PutTile::REFERENCE_LEN, 0);
+	uchar *ptr = reinterpret_cast<uchar*>(ba.data());
+	qToBigEndian(layer, ptr); ptr += 2;
+	*(ptr++) = sublayer;
+	qToBigEndian(col, ptr); ptr += 2;
+	qToBigEndian(row, ptr);
+	return ba;
+}
+
+MessagePtr PutTile::reference(uint8_t ctx, uint16_t layer, uint8_t sublayer, uint16_t col, uint16_t row, uint16_t repeat, uint16_t srcLayer, uint8_t srcSublayer, uint16_t srcCol, uint16_t srcRow)
+{
+	return MessagePtr(new PutTile(ctx, layer, sublayer, col, row, repeat, referenceByteArray(srcLayer, srcSublayer, srcCol, srcRow)));
+}
+
 PutTile *PutTile::deserialize(uint8_t ctx, const uchar *data, uint len)
 {
 	if(len < 13)
@@ -173,6 +189,30 @@ uint32_t PutTile::color() const
 	return qFromBigEndian<quint32>(m_image.constData());
 }
 
+uint16_t PutTile::sourceLayer() const
+{
+	Q_ASSERT(isReference());
+	return qFromBigEndian<quint16>(m_image.constData());
+}
+
+uint8_t PutTile::sourceSublayer() const
+{
+	Q_ASSERT(isReference());
+	return uint8_t(m_image.at(2));
+}
+
+uint16_t PutTile::sourceColumn() const
+{
+	Q_ASSERT(isReference());
+	return qFromBigEndian<quint16>(m_image.constData()+3);
+}
+
+uint16_t PutTile::sourceRow() const
+{
+	Q_ASSERT(isReference());
+	return qFromBigEndian<quint16>(m_image.constData()+5);
+}
+
 bool PutTile::payloadEquals(const Message &m) const
 {
 	const PutTile &p = static_cast<const PutTile&>(m);
@@ -195,10 +235,17 @@ Kwargs PutTile::kwargs() const
 	kw["col"] = QString::number(m_col);
 	if(m_repeat>0)
 		kw["repeat"] = QString::number(m_repeat);
-	if(isSolidColor())
+	if(isSolidColor()) {
 		kw["color"] = text::argbString(color());
-	else
+	} else if(isReference()) {
+		kw["srclayer"] = text::idString(sourceLayer());
+		if(sourceSublayer()>0)
+			kw["srcsublayer"] = QString::number(sourceSublayer());
+		kw["srccol"] = QString::number(sourceColumn());
+		kw["srcrow"] = QString::number(sourceRow());
+	} else {
 		kw["img"] = splitToColumns(m_image.toBase64(), 70);
+	}
 
 	return kw;
 }
@@ -209,6 +256,14 @@ PutTile *PutTile::fromText(uint8_t ctx, const Kwargs &kwargs)
 	if(kwargs.contains("color")) {
 		img = colorByteArray(text::parseColor(kwargs["color"]));
 
+	} else if(kwargs.contains("srclayer")) {
+		img = referenceByteArray(
+			text::parseIdString16(kwargs["srclayer"]),
+			kwargs["srcsublayer"].toInt(),
+			kwargs["srccol"].toInt(),
+			kwargs["srcrow"].toInt()
+			);
+
 	} else {
 		img = QByteArray::fromBase64(kwargs["img"].toUtf8());
 		if(img.length()<=4)
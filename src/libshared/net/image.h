@@ -89,9 +89,17 @@ private:
  *
  * PutTiles can be targeted at sublayers as well. This is used when generating a reset image
  * with incomplete indirect strokes. Sending a PenUp command will merge the sublayer.
+ *
+ * Since protocol version dp:4.21.3, a PutTile can also be a reference to a tile
+ * put earlier. The content of the source tile (on any layer or visible sublayer)
+ * is copied as is. This is used to avoid sending the same tile content
+ * more than once in a snapshot.
  */
 class PutTile : public Message {
 public:
+	//! Length of the image field of a tile reference
+	static const int REFERENCE_LEN = 7;
+
 	/**
 	 * @brief Construct a solid color PutTile
 	 * @param ctx context ID
@@ -123,6 +131,24 @@ public:
 		Q_ASSERT(image.length() >= 4);
 	}
 
+	/**
+	 * @brief Construct a PutTile that copies an earlier tile
+	 *
+	 * The receiver must support protocol version dp:4.21.3 or newer
+	 *
+	 * @param ctx context ID
+	 * @param layer target layer
+	 * @param sublayer target sublayer (0 means no sublayer)
+	 * @param col tile column
+	 * @param row tile row
+	 * @param repeat put this many extra tiles
+	 * @param srcLayer source layer
+	 * @param srcSublayer source sublayer (0 means no sublayer)
+	 * @param srcCol source tile column
+	 * @param srcRow source tile row
+	 */
+	static MessagePtr reference(uint8_t ctx, uint16_t layer, uint8_t sublayer, uint16_t col, uint16_t row, uint16_t repeat, uint16_t srcLayer, uint8_t srcSublayer, uint16_t srcCol, uint16_t srcRow);
+
 	static PutTile *deserialize(uint8_t ctx, const uchar *data, uint len);
 	static PutTile *fromText(uint8_t ctx, const Kwargs &kwargs);
 
@@ -135,6 +161,13 @@ public:
 	const QByteArray &image() const { return m_image; }
 
 	bool isSolidColor() const { return m_image.length() == 4; }
+	bool isReference() const { return m_image.length() == REFERENCE_LEN; }
+
+	// Source tile of a reference
+	uint16_t sourceLayer() const;
+	uint8_t sourceSublayer() const;
+	uint16_t sourceColumn() const;
+	uint16_t sourceRow() const;
 
 	QString messageName() const override { return QStringLiteral("puttile"); }
 
@@ -52,6 +52,24 @@ int Message::serialize(char *data) const
 	return HEADER_LEN + written;
 }
 
+QByteArray Message::serialized() const
+{
+	const QByteArray *wire = m_wire.loadAcquire();
+	if(!wire) {
+		QByteArray *buf = new QByteArray(length(), Qt::Uninitialized);
+		serialize(buf->data());
+
+		// Another thread may have beaten us to it
+		if(m_wire.testAndSetOrdered(nullptr, buf)) {
+			wire = buf;
+		} else {
+			delete buf;
+			wire = m_wire.loadAcquire();
+		}
+	}
+	return *wire;
+}
+
 bool Message::equals(const Message &m) const
 {
 	if(type() != m.type() || contextId() != m.contextId())
@@ -23,6 +23,9 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QByteArray>
 
 namespace protocol {
 
@@ -107,8 +110,9 @@ public:
 	//! Length of the fixed message header
 	static const int HEADER_LEN = 4;
 
-	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_contextid(ctx) {}
-	virtual ~Message() {}
+	Message(MessageType type, uint8_t ctx): m_type(type), _undone(DONE), m_refcount(0), m_wire(nullptr), m_contextid(ctx) {}
+	Message(const Message &m): m_type(m.m_type), _undone(m._undone), m_refcount(0), m_wire(nullptr), m_contextid(m.m_contextid) {}
+	virtual ~Message() { delete m_wire.loadAcquire(); }
 	
 	/**
 	 * @brief Get the type of this message.
@@ -177,7 +181,7 @@ public:
 	 *
 	 * @param userid the new user id
 	 */
-	void setContextId(uint8_t userid) { m_contextid = userid; }
+	void setContextId(uint8_t userid) { m_contextid = userid; invalidateSerialized(); }
 
 	/**
 	 * @brief Get the ID of the layer this command affects
@@ -230,6 +234,26 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message
+	 *
+	 * The message is serialized on the first call and the result is
+	 * cached, so a message sent to many recipients is encoded only once.
+	 * The returned buffer is implicitly shared.
+	 *
+	 * This is safe to call from multiple threads at once.
+	 */
+	QByteArray serialized() const;
+
+	/**
+	 * @brief Discard the cached serialized form to save memory
+	 *
+	 * Buffers already returned by serialized() remain valid.
+	 * Unlike serialized(), this must not be called while another thread
+	 * may be using this message.
+	 */
+	void releaseSerialized() const { delete m_wire.fetchAndStoreOrdered(nullptr); }
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -314,10 +338,18 @@ protected:
 	 */
 	virtual Kwargs kwargs() const = 0;
 
+	/**
+	 * @brief Discard the cached serialized form
+	 *
+	 * Subclasses must call this when they modify the payload.
+	 */
+	void invalidateSerialized() { delete m_wire.fetchAndStoreOrdered(nullptr); }
+
 private:
 	const MessageType m_type;
 	MessageUndoState _undone;
-	int m_refcount;
+	QAtomicInt m_refcount;
+	mutable QAtomicPointer<QByteArray> m_wire;
 	uint8_t m_contextid;
 };
 
@@ -354,7 +386,9 @@ protected:
 * This object is the length of a normal pointer so it can be used
 * efficiently with QList.
 *
-* @todo use QAtomicInt if thread safety is needed
+* The reference count is atomic, so messages can be passed
+* between threads (e.g. to the paint thread.) The messages themselves
+* are not synchronized.
 */
 class MessagePtr {
 public:
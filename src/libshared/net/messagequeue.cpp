@@ -55,6 +55,7 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	m_recvbytes = 0;
 	m_sentbytes = 0;
 	m_sendbuflen = 0;
+	m_outboxOffset = 0;
 
 	m_idleTimer = new QTimer(this);
 	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
@@ -120,7 +121,14 @@ MessagePtr MessageQueue::getPending()
 void MessageQueue::send(const MessagePtr &message)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
+		// The serialized form is cached in the message, so messages sent
+		// to many clients need to be serialized only once.
+		m_outbox.enqueue(message->serialized());
+
+		// Automatically disconnect after Disconnect notification is sent
+		if(message->type() == MSG_DISCONNECT)
+			m_closeWhenReady = true;
+
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -128,8 +136,23 @@ void MessageQueue::send(const MessagePtr &message)
 
 void MessageQueue::send(const MessageList &messages)
 {
-	if(!m_closeWhenReady) {
-		m_outbox << messages;
+	for(const MessagePtr &msg : messages) {
+		if(m_closeWhenReady)
+			break;
+
+		m_outbox.enqueue(msg->serialized());
+		if(msg->type() == MSG_DISCONNECT)
+			m_closeWhenReady = true;
+	}
+
+	if(m_sendbuflen==0)
+		writeData();
+}
+
+void MessageQueue::sendRaw(const QByteArray &messages)
+{
+	if(!m_closeWhenReady && !messages.isEmpty()) {
+		m_outbox.enqueue(messages);
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -138,7 +161,13 @@ void MessageQueue::send(const MessageList &messages)
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
+		// If the first entry has already been partially copied to the
+		// upload buffer, the message must go after it.
+		if(m_outboxOffset > 0)
+			m_outbox.insert(1, msg->serialized());
+		else
+			m_outbox.prepend(msg->serialized());
+
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -166,9 +195,9 @@ void MessageQueue::sendPing()
 int MessageQueue::uploadQueueBytes() const
 {
 	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr &msg : m_outbox)
-		total += msg->length();
-	return total;
+	for(const QByteArray &wire : m_outbox)
+		total += wire.length();
+	return total - m_outboxOffset;
 }
 
 bool MessageQueue::isUploading() const
@@ -203,13 +232,17 @@ void MessageQueue::readData() {
 
 		m_recvbytes += read;
 
-		// Extract all complete messages
+		// Extract all complete messages. The messages are deserialized directly
+		// from the buffer and the remaining partial message (if any) is moved
+		// to the start of the buffer only once all the complete ones are done.
 		int len;
-		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
+		int offset = 0;
+		while(m_recvbytes-offset >= Message::HEADER_LEN && m_recvbytes-offset >= (len=Message::sniffLength(m_recvbuffer+offset))) {
 			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
+			const char *msgbuf = m_recvbuffer + offset;
+			NullableMessageRef msg = Message::deserialize((const uchar*)msgbuf, m_recvbytes-offset, m_decodeOpaque);
 			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
+				emit badData(len, (unsigned char)msgbuf[2], (unsigned char)msgbuf[3]);
 
 			} else {
 				 if(msg->type() == MSG_PING) {
@@ -235,11 +268,19 @@ void MessageQueue::readData() {
 				}
 			}
 
-			if(len < m_recvbytes) {
-				// Buffer contains more than one message
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvbytes-len);
+			offset += len;
+		}
+
+		if(m_ignoreIncoming) {
+			// A signal handler just closed the connection
+			m_recvbytes = 0;
+
+		} else if(offset > 0) {
+			if(offset < m_recvbytes) {
+				// Buffer contains the start of the next message
+				memmove(m_recvbuffer, m_recvbuffer+offset, m_recvbytes-offset);
 			}
-			m_recvbytes -= len;
+			m_recvbytes -= offset;
 		}
 
 		// All messages extracted from buffer (if there were any):
@@ -276,19 +317,26 @@ void MessageQueue::writeData() {
 	while(sendMore && sentBatch < 1024*64) {
 		sendMore = false;
 		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
-			// Upload buffer is empty, but there are messages in the outbox
+			// Upload buffer is empty, but there are messages in the outbox.
+			// Fill the buffer with as much as will fit, so it can be written
+			// to the socket in one go. Entries that don't fit entirely
+			// are continued in the next round.
 			Q_ASSERT(m_sentbytes == 0);
 
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
-			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
+			while(!m_outbox.isEmpty() && m_sendbuflen < MAX_BUF_LEN) {
+				const QByteArray &wire = m_outbox.head();
+				const int len = qMin(wire.length() - m_outboxOffset, MAX_BUF_LEN - m_sendbuflen);
+
+				memcpy(m_sendbuffer+m_sendbuflen, wire.constData()+m_outboxOffset, len);
+				m_sendbuflen += len;
+				m_outboxOffset += len;
 
-			if(msg->type() == protocol::MSG_DISCONNECT) {
-				// Automatically disconnect after Disconnect notification is sent
-				m_closeWhenReady = true;
-				m_outbox.clear();
+				if(m_outboxOffset == wire.length()) {
+					m_outbox.dequeue();
+					m_outboxOffset = 0;
+				}
 			}
+			Q_ASSERT(m_sendbuflen>0);
 		}
 
 		if(m_sentbytes < m_sendbuflen) {
@@ -313,7 +361,7 @@ void MessageQueue::writeData() {
 				// Complete message sent
 				m_sendbuflen=0;
 				m_sentbytes=0;
-				if(m_closeWhenReady) {
+				if(m_closeWhenReady && m_outbox.isEmpty()) {
 					m_socket->disconnectFromHost();
 
 				} else {
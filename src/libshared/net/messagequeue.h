@@ -71,6 +71,14 @@ public:
 	void send(const MessagePtr &message);
 	void send(const MessageList &messages);
 
+	/**
+	 * @brief Enqueue already serialized messages for sending
+	 *
+	 * The buffer must contain zero or more complete messages in wire format.
+	 * It is written to the socket as is.
+	 */
+	void sendRaw(const QByteArray &messages);
+
 	/**
 	 * @brief Gracefully disconnect
 	 *
@@ -194,7 +202,8 @@ private:
 	int m_sendbuflen;   // length of the data in the upload buffer
 
 	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	QQueue<QByteArray> m_outbox; // serialized messages to be sent
+	int m_outboxOffset;          // number of bytes of the first outbox entry already in the upload buffer
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
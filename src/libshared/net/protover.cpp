@@ -78,6 +78,18 @@ bool ProtocolVersion::isFuture() const
 		asInteger() > current().asInteger();
 }
 
+bool ProtocolVersion::supportsTileReferences() const
+{
+	return m_namespace == QStringLiteral("dp") &&
+		asInteger() >= ProtocolVersion(QStringLiteral("dp"), 4, 21, 3).asInteger();
+}
+
+bool ProtocolVersion::supportsZstd() const
+{
+	return m_namespace == QStringLiteral("dp") &&
+		asInteger() >= ProtocolVersion(QStringLiteral("dp"), 4, 21, 3).asInteger();
+}
+
 QString ProtocolVersion::versionName() const
 {
 	if(m_namespace != QStringLiteral("dp"))
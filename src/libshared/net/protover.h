@@ -115,6 +115,20 @@ public:
 	 */
 	int minorVersion() const { return m_minor; }
 
+	/**
+	 * @brief Does this protocol version support PutTile references?
+	 *
+	 * Tile references were added in dp:4.21.3
+	 */
+	bool supportsTileReferences() const;
+
+	/**
+	 * @brief Does this protocol version support Zstandard compressed bitmaps?
+	 *
+	 * Zstd was added as an alternative to zlib in dp:4.21.3
+	 */
+	bool supportsZstd() const;
+
 	bool operator==(const ProtocolVersion &other) const {
 			return m_namespace==other.m_namespace && m_server==other.m_server &&
 					m_major==other.m_major && m_minor==other.m_minor;
@@ -0,0 +1,401 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "chunkeddevice.h"
+
+#include <QFileDevice>
+#include <QtEndian>
+
+#include <cstring>
+
+namespace recording {
+
+static const char MAGIC[] = "DPCHUNKS";
+static const char DIRECTORY_MAGIC[] = "DPCHDIR";
+static const char END_MAGIC[] = "DPCHEND";
+static const quint16 FORMAT_VERSION = 1;
+
+static const int HEADER_LEN = 8 + 2;
+static const int CHUNK_HEADER_LEN = 4 + 4;
+static const int DIRECTORY_ENTRY_LEN = 8 + 4 + 4;
+static const int TRAILER_LEN = 8 + 8;
+
+ChunkedDevice::ChunkedDevice(QIODevice *inner, bool autoclose, QObject *parent)
+	: QIODevice(parent), m_inner(inner), m_autoclose(autoclose), m_size(0), m_cachedChunk(-1)
+{
+	Q_ASSERT(inner);
+}
+
+ChunkedDevice::~ChunkedDevice()
+{
+	if(isOpen())
+		close();
+	if(m_autoclose)
+		delete m_inner;
+}
+
+bool ChunkedDevice::isChunkedExtension(const QString &filename)
+{
+	return filename.endsWith(".dprecc", Qt::CaseInsensitive) || filename.endsWith(".dptxtc", Qt::CaseInsensitive);
+}
+
+bool ChunkedDevice::open(OpenMode mode)
+{
+	const bool reading = mode & ReadOnly;
+	const bool writing = mode & WriteOnly;
+	if(reading == writing) {
+		setErrorString(QStringLiteral("Chunked recordings can be opened either for reading or writing"));
+		return false;
+	}
+
+	if(!m_inner->isOpen() && !m_inner->open(reading ? ReadOnly : WriteOnly)) {
+		setErrorString(m_inner->errorString());
+		return false;
+	}
+
+	m_chunks.clear();
+	m_size = 0;
+	m_writeBuffer.clear();
+	m_cache.clear();
+	m_cachedChunk = -1;
+
+	if(!(reading ? openForReading() : openForWriting()))
+		return false;
+
+	// Unbuffered, so pos() in readData is always the logical position
+	return QIODevice::open((mode & ~Text) | Unbuffered);
+}
+
+bool ChunkedDevice::openForReading()
+{
+	m_inner->seek(0);
+	char header[HEADER_LEN];
+	if(m_inner->read(header, HEADER_LEN) != HEADER_LEN || memcmp(header, MAGIC, 8) != 0) {
+		setErrorString(QStringLiteral("Not a chunked recording"));
+		return false;
+	}
+
+	if(qFromBigEndian<quint16>(header+8) > FORMAT_VERSION) {
+		setErrorString(QStringLiteral("Unsupported chunked recording version"));
+		return false;
+	}
+
+	if(!readDirectory() && !scanChunks())
+		return false;
+
+	for(const Chunk &c : m_chunks)
+		m_size += c.length;
+
+	return true;
+}
+
+bool ChunkedDevice::readDirectory()
+{
+	const qint64 filesize = m_inner->size();
+	if(filesize < HEADER_LEN + TRAILER_LEN)
+		return false;
+
+	char trailer[TRAILER_LEN];
+	if(!m_inner->seek(filesize - TRAILER_LEN) || m_inner->read(trailer, TRAILER_LEN) != TRAILER_LEN)
+		return false;
+
+	if(memcmp(trailer+8, END_MAGIC, 8) != 0)
+		return false;
+
+	const qint64 dirOffset = qint64(qFromBigEndian<quint64>(trailer));
+	if(dirOffset < HEADER_LEN || dirOffset > filesize - TRAILER_LEN - 12)
+		return false;
+
+	char dirHeader[12];
+	if(!m_inner->seek(dirOffset) || m_inner->read(dirHeader, 12) != 12 || memcmp(dirHeader, DIRECTORY_MAGIC, 8) != 0)
+		return false;
+
+	const quint32 count = qFromBigEndian<quint32>(dirHeader+8);
+	if(qint64(count) * DIRECTORY_ENTRY_LEN != filesize - TRAILER_LEN - dirOffset - 12)
+		return false;
+
+	const QByteArray entries = m_inner->read(qint64(count) * DIRECTORY_ENTRY_LEN);
+	if(entries.length() != int(count) * DIRECTORY_ENTRY_LEN)
+		return false;
+
+	QVector<Chunk> chunks;
+	chunks.reserve(int(count));
+	qint64 offset = 0;
+	for(quint32 i=0;i<count;++i) {
+		const char *e = entries.constData() + i * DIRECTORY_ENTRY_LEN;
+		const Chunk c {
+			qint64(qFromBigEndian<quint64>(e)),
+			offset,
+			qFromBigEndian<quint32>(e+8),
+			qFromBigEndian<quint32>(e+12)
+		};
+		if(c.fileOffset < HEADER_LEN || c.fileOffset + CHUNK_HEADER_LEN + c.compressedLength > dirOffset)
+			return false;
+
+		chunks << c;
+		offset += c.length;
+	}
+
+	m_chunks = chunks;
+	return true;
+}
+
+bool ChunkedDevice::scanChunks()
+{
+	qWarning("Chunk directory missing or damaged: scanning chunks");
+
+	const qint64 filesize = m_inner->size();
+	qint64 pos = HEADER_LEN;
+	qint64 offset = 0;
+
+	while(pos + CHUNK_HEADER_LEN <= filesize) {
+		char header[CHUNK_HEADER_LEN];
+		if(!m_inner->seek(pos) || m_inner->read(header, CHUNK_HEADER_LEN) != CHUNK_HEADER_LEN)
+			break;
+
+		if(memcmp(header, DIRECTORY_MAGIC, 8) == 0)
+			break;
+
+		const Chunk c {
+			pos,
+			offset,
+			qFromBigEndian<quint32>(header),
+			qFromBigEndian<quint32>(header+4)
+		};
+
+		// Last chunk may be incomplete if the writer crashed
+		if(pos + CHUNK_HEADER_LEN + c.compressedLength > filesize)
+			break;
+
+		m_chunks << c;
+		pos += CHUNK_HEADER_LEN + c.compressedLength;
+		offset += c.length;
+	}
+
+	return true;
+}
+
+bool ChunkedDevice::openForWriting()
+{
+	char header[HEADER_LEN];
+	memcpy(header, MAGIC, 8);
+	qToBigEndian(FORMAT_VERSION, header+8);
+
+	if(m_inner->write(header, HEADER_LEN) != HEADER_LEN) {
+		setErrorString(m_inner->errorString());
+		return false;
+	}
+
+	return true;
+}
+
+void ChunkedDevice::close()
+{
+	if(!isOpen())
+		return;
+
+	if(openMode() & WriteOnly) {
+		if(!m_writeBuffer.isEmpty())
+			writeChunk(m_writeBuffer.constData(), m_writeBuffer.length());
+		m_writeBuffer.clear();
+		writeDirectory();
+	}
+
+	m_inner->close();
+	m_cache.clear();
+	m_cachedChunk = -1;
+
+	QIODevice::close();
+}
+
+bool ChunkedDevice::seek(qint64 pos)
+{
+	if(pos < 0 || pos > m_size)
+		return false;
+
+	// Writing is append only
+	if((openMode() & WriteOnly) && pos != m_size)
+		return false;
+
+	return QIODevice::seek(pos);
+}
+
+bool ChunkedDevice::flush()
+{
+	if(!(openMode() & WriteOnly))
+		return false;
+
+	if(!m_writeBuffer.isEmpty()) {
+		if(!writeChunk(m_writeBuffer.constData(), m_writeBuffer.length()))
+			return false;
+		m_writeBuffer.clear();
+	}
+
+	auto *fd = qobject_cast<QFileDevice*>(m_inner);
+	if(fd)
+		return fd->flush();
+
+	return true;
+}
+
+bool ChunkedDevice::autoflush()
+{
+	if(!(openMode() & WriteOnly))
+		return false;
+
+	if(m_writeBuffer.length() >= MIN_AUTOFLUSH_SIZE)
+		return flush();
+
+	auto *fd = qobject_cast<QFileDevice*>(m_inner);
+	if(fd)
+		return fd->flush();
+
+	return true;
+}
+
+qint64 ChunkedDevice::writeData(const char *data, qint64 len)
+{
+	m_writeBuffer.append(data, int(len));
+	m_size += len;
+
+	if(m_writeBuffer.length() >= CHUNK_SIZE) {
+		int written = 0;
+		while(m_writeBuffer.length() - written >= CHUNK_SIZE) {
+			if(!writeChunk(m_writeBuffer.constData() + written, CHUNK_SIZE))
+				return -1;
+			written += CHUNK_SIZE;
+		}
+		m_writeBuffer.remove(0, written);
+	}
+
+	return len;
+}
+
+bool ChunkedDevice::writeChunk(const char *data, int len)
+{
+	const QByteArray compressed = qCompress(reinterpret_cast<const uchar*>(data), len);
+
+	const Chunk c {
+		m_inner->pos(),
+		m_chunks.isEmpty() ? 0 : m_chunks.last().offset + m_chunks.last().length,
+		quint32(compressed.length()),
+		quint32(len)
+	};
+
+	char header[CHUNK_HEADER_LEN];
+	qToBigEndian(c.compressedLength, header);
+	qToBigEndian(c.length, header+4);
+
+	if(m_inner->write(header, CHUNK_HEADER_LEN) != CHUNK_HEADER_LEN || m_inner->write(compressed) != compressed.length()) {
+		setErrorString(m_inner->errorString());
+		return false;
+	}
+
+	m_chunks << c;
+	return true;
+}
+
+bool ChunkedDevice::writeDirectory()
+{
+	const qint64 dirOffset = m_inner->pos();
+
+	QByteArray dir(12 + m_chunks.size() * DIRECTORY_ENTRY_LEN + TRAILER_LEN, 0);
+	char *ptr = dir.data();
+	memcpy(ptr, DIRECTORY_MAGIC, 8); ptr += 8;
+	qToBigEndian(quint32(m_chunks.size()), ptr); ptr += 4;
+
+	for(const Chunk &c : m_chunks) {
+		qToBigEndian(quint64(c.fileOffset), ptr); ptr += 8;
+		qToBigEndian(c.compressedLength, ptr); ptr += 4;
+		qToBigEndian(c.length, ptr); ptr += 4;
+	}
+
+	qToBigEndian(quint64(dirOffset), ptr); ptr += 8;
+	memcpy(ptr, END_MAGIC, 8);
+
+	if(m_inner->write(dir) != dir.length()) {
+		setErrorString(m_inner->errorString());
+		return false;
+	}
+	return true;
+}
+
+int ChunkedDevice::chunkAt(qint64 pos) const
+{
+	// Binary search for the last chunk starting at or before pos
+	int lo = 0, hi = m_chunks.size() - 1;
+	while(lo < hi) {
+		const int mid = (lo + hi + 1) / 2;
+		if(m_chunks.at(mid).offset <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+bool ChunkedDevice::loadChunk(int chunk)
+{
+	if(chunk == m_cachedChunk)
+		return true;
+
+	const Chunk &c = m_chunks.at(chunk);
+	if(!m_inner->seek(c.fileOffset + CHUNK_HEADER_LEN)) {
+		setErrorString(m_inner->errorString());
+		return false;
+	}
+
+	const QByteArray compressed = m_inner->read(c.compressedLength);
+	if(compressed.length() != int(c.compressedLength)) {
+		setErrorString(QStringLiteral("Unexpected end of file"));
+		return false;
+	}
+
+	m_cache = qUncompress(compressed);
+	if(m_cache.length() != int(c.length)) {
+		m_cachedChunk = -1;
+		setErrorString(QStringLiteral("Corrupted chunk #%1").arg(chunk));
+		return false;
+	}
+
+	m_cachedChunk = chunk;
+	return true;
+}
+
+qint64 ChunkedDevice::readData(char *data, qint64 maxlen)
+{
+	qint64 pos = this->pos();
+	qint64 done = 0;
+
+	while(done < maxlen && pos < m_size) {
+		const int chunk = chunkAt(pos);
+		if(!loadChunk(chunk))
+			return done > 0 ? done : -1;
+
+		const qint64 inChunk = pos - m_chunks.at(chunk).offset;
+		const qint64 n = qMin(maxlen - done, qint64(m_cache.length()) - inChunk);
+		memcpy(data + done, m_cache.constData() + inChunk, size_t(n));
+		done += n;
+		pos += n;
+	}
+
+	return done;
+}
+
+}
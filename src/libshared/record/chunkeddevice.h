@@ -0,0 +1,133 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2021 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REC_CHUNKEDDEVICE_H
+#define REC_CHUNKEDDEVICE_H
+
+#include <QIODevice>
+#include <QVector>
+
+namespace recording {
+
+/**
+ * @brief A seekable compressed container for recordings
+ *
+ * The content is split into independently compressed chunks, followed by
+ * a chunk directory. Reading is random access: seeking to any position only
+ * requires decompressing the chunk containing it. This makes compressed
+ * recordings indexable.
+ *
+ * Layout (integers are big endian):
+ *
+ *     "DPCHUNKS" u16(version)
+ *     chunk*: u32(compressed length) u32(uncompressed length) data (qCompress format)
+ *     "DPCHDIR\0" u32(chunk count) (u64(file offset) u32(compressed length) u32(uncompressed length))*
+ *     u64(directory offset) "DPCHEND\0"
+ *
+ * If the directory is missing (e.g. the writer crashed), it is rebuilt
+ * by scanning the chunk headers when the file is opened.
+ *
+ * Only sequential writing is supported. Reading and writing at the same
+ * time is not supported.
+ */
+class ChunkedDevice : public QIODevice
+{
+	Q_OBJECT
+public:
+	//! Uncompressed size of a chunk
+	static const int CHUNK_SIZE = 256 * 1024;
+
+	//! Minimum amount of buffered data autoflush() writes out as a chunk
+	static const int MIN_AUTOFLUSH_SIZE = 32 * 1024;
+
+	/**
+	 * @brief Construct a device that reads or writes through the given device
+	 * @param inner the underlying device (the actual file)
+	 * @param autoclose if true, this device takes ownership of the inner device
+	 */
+	ChunkedDevice(QIODevice *inner, bool autoclose, QObject *parent=nullptr);
+	~ChunkedDevice();
+
+	//! Check if the given filename has the chunked recording extension
+	static bool isChunkedExtension(const QString &filename);
+
+	bool open(OpenMode mode) override;
+	void close() override;
+
+	bool isSequential() const override { return false; }
+	qint64 size() const override { return m_size; }
+	bool seek(qint64 pos) override;
+
+	//! Number of chunks in the container
+	int chunkCount() const { return m_chunks.size(); }
+
+public slots:
+	/**
+	 * @brief Write out the current chunk, even if it is not full yet
+	 *
+	 * Everything written so far can be read back (except for the directory)
+	 * if the program crashes after this.
+	 */
+	bool flush();
+
+	/**
+	 * @brief Periodic flush
+	 *
+	 * Like flush(), but the buffered data is written out as a chunk only if
+	 * there is at least MIN_AUTOFLUSH_SIZE bytes of it. Otherwise, only
+	 * the inner device is flushed. This keeps a slow trickle of messages
+	 * from being split into many tiny, poorly compressed chunks.
+	 */
+	bool autoflush();
+
+protected:
+	qint64 readData(char *data, qint64 maxlen) override;
+	qint64 writeData(const char *data, qint64 len) override;
+
+private:
+	struct Chunk {
+		qint64 fileOffset;  // position of the chunk header in the inner device
+		qint64 offset;      // uncompressed position of the chunk's first byte
+		quint32 compressedLength;
+		quint32 length;
+	};
+
+	bool openForReading();
+	bool openForWriting();
+	bool readDirectory();
+	bool scanChunks();
+	bool writeChunk(const char *data, int len);
+	bool writeDirectory();
+	int chunkAt(qint64 pos) const;
+	bool loadChunk(int chunk);
+
+	QIODevice *m_inner;
+	bool m_autoclose;
+
+	QVector<Chunk> m_chunks;
+	qint64 m_size;
+
+	QByteArray m_writeBuffer;
+
+	QByteArray m_cache;
+	int m_cachedChunk;
+};
+
+}
+
+#endif
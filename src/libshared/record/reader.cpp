@@ -19,6 +19,7 @@
 
 #include "reader.h"
 #include "header.h"
+#include "chunkeddevice.h"
 #include "../net/recording.h"
 #include "../net/textmode.h"
 
@@ -41,6 +42,11 @@ struct Reader::Private {
 
 	QByteArray msgbuf;
 
+	// Uncompressed binary recordings are read straight from a memory mapping
+	const uchar *mapped = nullptr;
+	qint64 mappedSize = 0;
+	qint64 mappedPos = 0;
+
 	QJsonObject metadata;
 
 	int current;
@@ -50,12 +56,36 @@ struct Reader::Private {
 	bool autoclose;
 	bool eof;
 	bool isCompressed;
+	bool isSeekable;
 	bool opaque;
+
+	//! Get the next message from the mapping and advance the position, or return null at the end
+	const uchar *nextMappedMessage(int &len)
+	{
+		if(mappedPos + protocol::Message::HEADER_LEN > mappedSize)
+			return nullptr;
+
+		const uchar *msg = mapped + mappedPos;
+		len = protocol::Message::sniffLength(reinterpret_cast<const char*>(msg));
+		if(mappedPos + len > mappedSize)
+			return nullptr;
+
+		mappedPos += len;
+		return msg;
+	}
+
+	void unmap()
+	{
+		if(mapped) {
+			static_cast<QFile*>(file)->unmap(const_cast<uchar*>(mapped));
+			mapped = nullptr;
+		}
+	}
 };
 
 bool Reader::isRecordingExtension(const QString &filename)
 {
-	QRegularExpression re("\\.dp(?:rec|txt)(?:z|\\.(?:gz|bz2|xz))?$");
+	QRegularExpression re("\\.dp(?:rec|txt)(?:z|c|\\.(?:gz|bz2|xz))?$");
 	return re.match(filename).hasMatch();
 }
 
@@ -78,12 +108,18 @@ Reader::Reader(const QString &filename, Encoding encoding, QObject *parent)
 	else if(filename.endsWith(".xz", Qt::CaseInsensitive))
 		ct = KCompressionDevice::Xz;
 
-	if(ct == KCompressionDevice::None) {
+	if(ChunkedDevice::isChunkedExtension(filename)) {
+		d->file = new ChunkedDevice(new QFile(filename), true);
+		d->isCompressed = true;
+		d->isSeekable = true;
+	} else if(ct == KCompressionDevice::None) {
 		d->file = new QFile(filename);
 		d->isCompressed = false;
+		d->isSeekable = true;
 	} else {
 		d->file = new KCompressionDevice(filename, ct);
 		d->isCompressed = true;
+		d->isSeekable = false;
 	}
 }
 
@@ -97,11 +133,13 @@ Reader::Reader(const QString &filename, QIODevice *file, bool autoclose, Encodin
 	d->current = -1;
 	d->autoclose = autoclose;
 	d->eof = false;
-	d->isCompressed = false;
+	d->isCompressed = qobject_cast<ChunkedDevice*>(file) != nullptr;
+	d->isSeekable = !file->isSequential();
 }
 
 Reader::~Reader()
 {
+	d->unmap();
 	if(d->autoclose)
 		delete d->file;
 	delete d;
@@ -117,6 +155,11 @@ bool Reader::isCompressed() const
 	return d->isCompressed;
 }
 
+bool Reader::isSeekable() const
+{
+	return d->isSeekable;
+}
+
 protocol::ProtocolVersion Reader::formatVersion() const
 {
 	return protocol::ProtocolVersion::fromString(d->metadata["version"].toString());
@@ -237,6 +280,16 @@ Compatibility Reader::readBinaryHeader() {
 	// Header completed!
 	d->beginning = d->file->pos();
 
+	// Map uncompressed files so messages can be deserialized without copying them first
+	QFile *f = d->isCompressed ? nullptr : qobject_cast<QFile*>(d->file);
+	if(f && !d->mapped) {
+		d->mapped = f->map(0, f->size());
+		if(d->mapped) {
+			d->mappedSize = f->size();
+			d->mappedPos = d->beginning;
+		}
+	}
+
 	// Check version numbers
 	const auto version = formatVersion();
 
@@ -388,17 +441,21 @@ qint64 Reader::filesize() const
 
 qint64 Reader::filePosition() const
 {
+	if(d->mapped)
+		return d->mappedPos;
 	return d->file->pos();
 }
 
 void Reader::close()
 {
 	Q_ASSERT(d->file->isOpen());
+	d->unmap();
 	d->file->close();
 }
 
 void Reader::rewind()
 {
+	d->mappedPos = d->beginning;
 	d->file->seek(d->beginning);
 	d->current = -1;
 	d->currentPos = -1;
@@ -409,6 +466,7 @@ void Reader::seekTo(int pos, qint64 position)
 {
 	d->current = pos;
 	d->currentPos = position;
+	d->mappedPos = position;
 	d->file->seek(position);
 	d->eof = false;
 }
@@ -443,7 +501,18 @@ bool Reader::readNextToBuffer(QByteArray &buffer)
 
 	d->currentPos = filePosition();
 
-	if(d->encoding == Encoding::Binary) {
+	if(d->mapped) {
+		int len;
+		const uchar *msg = d->nextMappedMessage(len);
+		if(!msg) {
+			d->eof = true;
+			return false;
+		}
+		if(buffer.length() < len)
+			buffer.resize(len);
+		memcpy(buffer.data(), msg, len);
+
+	} else if(d->encoding == Encoding::Binary) {
 		if(!readRecordingMessage(d->file, buffer)) {
 			d->eof = true;
 			return false;
@@ -468,16 +537,32 @@ MessageRecord Reader::readNext()
 	Q_ASSERT(d->encoding != Encoding::Autodetect);
 
 	if(d->encoding == Encoding::Binary) {
-		if(!readNextToBuffer(d->msgbuf))
-			return MessageRecord::Eor();
+		const uchar *data;
+		int len;
+		if(d->mapped) {
+			// Deserialize directly from the mapped file
+			d->currentPos = d->mappedPos;
+			data = d->nextMappedMessage(len);
+			if(!data) {
+				d->eof = true;
+				return MessageRecord::Eor();
+			}
+			++d->current;
+
+		} else {
+			if(!readNextToBuffer(d->msgbuf))
+				return MessageRecord::Eor();
+			data = reinterpret_cast<const uchar*>(d->msgbuf.constData());
+			len = d->msgbuf.length();
+		}
 
 		protocol::NullableMessageRef message;
-		message = protocol::Message::deserialize((const uchar*)d->msgbuf.constData(), d->msgbuf.length(), !d->opaque);
+		message = protocol::Message::deserialize(data, len, !d->opaque);
 
 		if(message.isNull())
 			return MessageRecord::Invalid(
-				protocol::Message::sniffLength(d->msgbuf.constData()),
-				protocol::MessageType(d->msgbuf.at(2))
+				protocol::Message::sniffLength(reinterpret_cast<const char*>(data)),
+				protocol::MessageType(data[2])
 			);
 		else
 			return MessageRecord::Ok(message);
@@ -125,6 +125,14 @@ public:
 	//! Is this recording compressed?
 	bool isCompressed() const;
 
+	/**
+	 * @brief Can this recording be seeked efficiently?
+	 *
+	 * Uncompressed and chunked compressed (.dprecc) recordings are seekable
+	 * and can thus be indexed.
+	 */
+	bool isSeekable() const;
+
 	//! Get the last error message
 	QString errorString() const;
 
@@ -182,6 +190,9 @@ public:
 
 	/**
 	 * @brief Read the next message
+	 *
+	 * Uncompressed binary recordings are memory mapped and messages
+	 * are deserialized directly from the mapping.
 	 * @return
 	 */
 	MessageRecord readNext();
@@ -19,6 +19,7 @@
 
 #include "writer.h"
 #include "header.h"
+#include "chunkeddevice.h"
 #include "../net/recording.h"
 
 #include <QVarLengthArray>
@@ -43,7 +44,9 @@ Writer::Writer(const QString &filename, QObject *parent)
 	else if(filename.endsWith(".xz", Qt::CaseInsensitive))
 		ct = KCompressionDevice::Xz;
 
-	if(ct != KCompressionDevice::None)
+	if(ChunkedDevice::isChunkedExtension(filename))
+		m_file = new ChunkedDevice(m_file, true);
+	else if(ct != KCompressionDevice::None)
 		m_file = new KCompressionDevice(m_file, true, ct);
 
 	if(filename.contains(".dptxt", Qt::CaseInsensitive) && !filename.contains(".dprec", Qt::CaseInsensitive))
@@ -81,14 +84,18 @@ void Writer::setAutoflush()
 		return;
 
 	auto *fd = qobject_cast<QFileDevice*>(m_file);
-	if(!fd) {
+	auto *cd = qobject_cast<ChunkedDevice*>(m_file);
+	if(!fd && !cd) {
 		qWarning("Cannot enable recording autoflush: output device not a QFileDevice");
 		return;
 	}
 
 	m_autoflush = new QTimer(this);
 	m_autoflush->setSingleShot(false);
-	connect(m_autoflush, &QTimer::timeout, fd, &QFileDevice::flush);
+	if(fd)
+		connect(m_autoflush, &QTimer::timeout, fd, &QFileDevice::flush);
+	else
+		connect(m_autoflush, &QTimer::timeout, cd, &ChunkedDevice::autoflush);
 	m_autoflush->start(5000);
 }
 
@@ -171,6 +171,77 @@ private slots:
 		loopUntil(allReceived);
 	}
 
+	void testSendRaw()
+	{
+		auto mq = getMsgQueue();
+
+		// Large enough to not fit in the upload buffer in one go
+		const int rawCount = 200;
+		const int sendCount = rawCount + 1;
+
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QVERIFY(got.cast<Chat>().message().startsWith(QString::number(countReceived) + ":"));
+				if(++countReceived == sendCount)
+					allReceived = true;
+				QVERIFY(countReceived <= sendCount);
+			}
+		});
+
+		QByteArray raw;
+		for(int i=0;i<rawCount;++i) {
+			MessagePtr msg(new Chat(0, 0, 0, QByteArray::number(i) + ":" + QByteArray(1000, 'x')));
+			raw += msg->serialized();
+		}
+
+		mq->sendRaw(raw);
+
+		// Messages and raw data are sent in order
+		MessagePtr last(new Chat(0, 0, 0, QByteArray::number(rawCount) + ":"));
+		mq->send(last);
+		QCOMPARE(mq->uploadQueueBytes(), raw.length() + last->length());
+
+		loopUntil(allReceived);
+	}
+
+	// Many small messages arriving at once are all extracted from the receive
+	// buffer, including the ones split across reads.
+	void testReceiveBurst()
+	{
+		auto mq = getMsgQueue();
+
+		const int sendCount = 3000;
+
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&mq, sendCount, &countReceived, &allReceived]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived) + ":" + QString(countReceived % 97, 'x'));
+				if(++countReceived == sendCount)
+					allReceived = true;
+				QVERIFY(countReceived <= sendCount);
+			}
+		});
+
+		QByteArray raw;
+		for(int i=0;i<sendCount;++i) {
+			MessagePtr msg(new Chat(0, 0, 0, QByteArray::number(i) + ":" + QByteArray(i % 97, 'x')));
+			raw += msg->serialized();
+		}
+
+		mq->sendRaw(raw);
+
+		loopUntil(allReceived);
+	}
+
 	void testSendDisconnect()
 	{
 		auto s = getConnection();
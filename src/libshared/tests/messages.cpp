@@ -55,6 +55,7 @@ private slots:
 		QTest::newRow("layervisibility") << (Message*)new LayerVisibility(21, 0x1122, 1);
 		QTest::newRow("putimage") << (Message*)new PutImage(22, 0x1122, 0x10, 100, 200, 300, 400, QByteArray("Test"));
 		QTest::newRow("puttile") << (Message*)new PutTile(22, 0x1122, 0x10, 1, 2, 3, 0xaabbccdd);
+		QTest::newRow("puttile(ref)") << (Message*)new PutTile(22, 0x1122, 0x10, 1, 2, 3, QByteArray("\x33\x44\x05\x00\x06\x00\x07", PutTile::REFERENCE_LEN));
 		QTest::newRow("fillrect") << (Message*)new FillRect(23, 0x1122, 0x10, 3, 200, 300, 400, 0x11223344);
 		QTest::newRow("penup") << (Message*)new PenUp(26);
 		QTest::newRow("annotationcreate") << (Message*)new AnnotationCreate(27, 0x1122, -100, -100, 200, 200);
@@ -128,6 +129,34 @@ private slots:
 		QVERIFY(unwrapped->equals(*original));
 	}
 
+	// Modifying a message must not leave a stale cached serialization behind
+	void testModifiedDabsSerialization()
+	{
+		MessagePtr classic(new DrawDabsClassic(1, 2, 100, 100, 0xff000000, 1, { ClassicBrushDab { 0, 0, 256, 255, 128 } }));
+		classic->serialized();
+		QVERIFY(classic.cast<DrawDabsClassic>().extend(DrawDabsClassic(1, 2, 110, 90, 0xff000000, 1, { ClassicBrushDab { 0, 0, 512, 255, 128 } })));
+		QCOMPARE(classic->serialized(), MessagePtr(new DrawDabsClassic(1, 2, 100, 100, 0xff000000, 1, {
+			ClassicBrushDab { 0, 0, 256, 255, 128 },
+			ClassicBrushDab { 10, -10, 512, 255, 128 }
+		}))->serialized());
+
+		classic.cast<DrawDabsClassic>().appendDab(ClassicBrushDab { 1, 1, 256, 255, 64 });
+		QCOMPARE(classic.cast<DrawDabsClassic>().dabs().size(), 3);
+		QCOMPARE(classic->serialized(), MessagePtr(new DrawDabsClassic(1, 2, 100, 100, 0xff000000, 1, {
+			ClassicBrushDab { 0, 0, 256, 255, 128 },
+			ClassicBrushDab { 10, -10, 512, 255, 128 },
+			ClassicBrushDab { 1, 1, 256, 255, 64 }
+		}))->serialized());
+
+		MessagePtr pixel(new DrawDabsPixel(DabShape::Round, 1, 2, 100, 100, 0xff000000, 1, { PixelBrushDab { 0, 0, 4, 128 } }));
+		pixel->serialized();
+		pixel.cast<DrawDabsPixel>().appendDab(PixelBrushDab { 2, 3, 5, 255 });
+		QCOMPARE(pixel->serialized(), MessagePtr(new DrawDabsPixel(DabShape::Round, 1, 2, 100, 100, 0xff000000, 1, {
+			PixelBrushDab { 0, 0, 4, 128 },
+			PixelBrushDab { 2, 3, 5, 255 }
+		}))->serialized());
+	}
+
 	void testLayerOrderSanitation_data()
 	{
 		QTest::addColumn<IdList>("reorder");
@@ -1,6 +1,7 @@
 #include "../record/reader.h"
 #include "../record/writer.h"
 #include "../record/header.h"
+#include "../record/chunkeddevice.h"
 
 #include "../net/control.h"
 #include "../net/meta.h"
@@ -171,6 +172,138 @@ private slots:
 		QVERIFY(skipRecordingMessage(&buffer)<0);
 	}
 
+	void testChunked()
+	{
+		QBuffer buffer;
+		buffer.open(QBuffer::ReadWrite);
+
+		// Write enough messages to fill several chunks
+		const int count = 40000;
+		{
+			ChunkedDevice chunked(&buffer, false);
+			QVERIFY(chunked.open(QIODevice::WriteOnly));
+
+			Writer writer(&chunked, false);
+			writer.writeHeader(QJsonObject());
+			for(int i=0;i<count;++i)
+				writer.writeMessage(UserJoin(1, 0, QString("user%1").arg(i).toUtf8(), QByteArray("avatar")));
+
+			QVERIFY(chunked.chunkCount() > 1);
+		}
+
+		const QByteArray data = buffer.data();
+		QVERIFY(data.startsWith("DPCHUNKS"));
+		QVERIFY(data.endsWith(QByteArray("DPCHEND", 8)));
+
+		// Read back: everything should be there
+		QBuffer inbuf;
+		inbuf.setData(data);
+		inbuf.open(QBuffer::ReadOnly);
+		ChunkedDevice chunked(&inbuf, false);
+		QVERIFY(chunked.open(QIODevice::ReadOnly));
+		QVERIFY(chunked.chunkCount() > 1);
+
+		Reader reader("test", &chunked, false);
+		QVERIFY(reader.isCompressed());
+		QVERIFY(reader.isSeekable());
+		QCOMPARE(reader.open(), COMPATIBLE);
+
+		qint64 seekPos = 0;
+		for(int i=0;i<count;++i) {
+			if(i == count/2)
+				seekPos = reader.filePosition();
+
+			const MessageRecord mr = reader.readNext();
+			QCOMPARE(mr.status, MessageRecord::OK);
+			QCOMPARE(mr.message.cast<UserJoin>().name(), QString("user%1").arg(i));
+		}
+		QCOMPARE(reader.readNext().status, MessageRecord::END_OF_RECORDING);
+
+		// Seeking backwards into an earlier chunk
+		reader.seekTo(count/2, seekPos);
+		const MessageRecord mr = reader.readNext();
+		QCOMPARE(mr.status, MessageRecord::OK);
+		QCOMPARE(mr.message.cast<UserJoin>().name(), QString("user%1").arg(count/2));
+
+		// If the directory is lost, the chunks can still be read
+		QByteArray truncated = data;
+		truncated.chop(16);
+		QBuffer truncbuf(&truncated);
+		truncbuf.open(QBuffer::ReadOnly);
+		ChunkedDevice recovered(&truncbuf, false);
+		QVERIFY(recovered.open(QIODevice::ReadOnly));
+		QCOMPARE(recovered.size(), chunked.size());
+	}
+
+	void testChunkedAutoflush()
+	{
+		QBuffer buffer;
+		buffer.open(QBuffer::ReadWrite);
+
+		ChunkedDevice chunked(&buffer, false);
+		QVERIFY(chunked.open(QIODevice::WriteOnly));
+
+		// A small amount of data is not cut into a chunk of its own
+		const QByteArray small(100, 'x');
+		chunked.write(small);
+		QVERIFY(chunked.autoflush());
+		QCOMPARE(chunked.chunkCount(), 0);
+
+		// But once there is enough of it, it is
+		chunked.write(QByteArray(ChunkedDevice::MIN_AUTOFLUSH_SIZE, 'y'));
+		QVERIFY(chunked.autoflush());
+		QCOMPARE(chunked.chunkCount(), 1);
+
+		// An explicit flush always writes out the buffer
+		chunked.write(small);
+		QVERIFY(chunked.flush());
+		QCOMPARE(chunked.chunkCount(), 2);
+	}
+
+	void testMappedReader()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const QString filename = dir.filePath("test.dprec");
+
+		{
+			Writer writer(filename);
+			QVERIFY(writer.open());
+			writer.writeHeader();
+			for(int i=0;i<10;++i)
+				writer.writeMessage(UserJoin(1, 0, QString("user%1").arg(i).toUtf8(), QByteArray()));
+			writer.close();
+		}
+
+		Reader reader(filename);
+		QCOMPARE(reader.open(), COMPATIBLE);
+
+		qint64 seekPos = 0;
+		for(int i=0;i<10;++i) {
+			if(i == 5)
+				seekPos = reader.filePosition();
+
+			const MessageRecord mr = reader.readNext();
+			QCOMPARE(mr.status, MessageRecord::OK);
+			QCOMPARE(mr.message.cast<UserJoin>().name(), QString("user%1").arg(i));
+		}
+		QCOMPARE(reader.readNext().status, MessageRecord::END_OF_RECORDING);
+		QVERIFY(reader.isEof());
+		QCOMPARE(reader.filePosition(), reader.filesize());
+
+		reader.seekTo(5, seekPos);
+		const MessageRecord mr = reader.readNext();
+		QCOMPARE(mr.status, MessageRecord::OK);
+		QCOMPARE(mr.message.cast<UserJoin>().name(), QString("user5"));
+		QCOMPARE(reader.currentIndex(), 5);
+		QCOMPARE(reader.currentPosition(), seekPos);
+
+		// The buffer API reads from the mapping too
+		QByteArray buf;
+		QVERIFY(reader.readNextToBuffer(buf));
+		QCOMPARE(protocol::Message::sniffLength(buf.constData()), UserJoin(1, 0, QByteArray("user6"), QByteArray()).length());
+	}
+
 	void testVersionMismatch()
 	{
 		QByteArray testRecording = QByteArray::fromHex(TEST_RECORDING_OLD);
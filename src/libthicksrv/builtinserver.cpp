@@ -228,10 +228,10 @@ void BuiltinServer::stop() {
 	m_session = nullptr;
 }
 
-void BuiltinServer::doInternalReset()
+void BuiltinServer::doInternalReset(const canvas::StateSavepoint &savepoint)
 {
 	if(m_session)
-		m_session->doInternalResetNow();
+		m_session->doInternalResetNow(savepoint);
 }
 
 }
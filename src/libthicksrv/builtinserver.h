@@ -38,6 +38,7 @@ namespace sessionlisting {
 
 namespace canvas {
     class StateTracker;
+	class StateSavepoint;
 	class AclFilter;
 }
 
@@ -84,7 +85,8 @@ public slots:
 	 //! Stop the server. All clients are disconnected.
 	void stop();
 
-	void doInternalReset();
+	//! Generate a new join snapshot from the canvas as it was at the soft reset point
+	void doInternalReset(const canvas::StateSavepoint &savepoint);
 
 private slots:
 	void newClient();
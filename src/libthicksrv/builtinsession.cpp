@@ -22,6 +22,7 @@
 #include "../libshared/net/meta.h"
 #include "../libshared/net/control.h"
 #include "../libclient/canvas/statetracker.h"
+#include "../libclient/core/layerstack.h"
 
 namespace server {
 
@@ -37,52 +38,51 @@ void BuiltinSession::onClientJoin(Client *client, bool host)
 		return;
 	}
 
+	if(!isResetImageStale()) {
+		sendResetImage(client);
+		return;
+	}
+
 	// New client must wait until soft reset is processed.
 	// We can't do it right away, since the client's statetracker processes messages asynchronously.
 	client->setAwaitingReset(true);
 
 	// Just send the softresetpoint. The StateTracker will emit softResetPoint, which should be connected
-	// to our doInternalResetNow slot.
+	// to our doInternalResetNow slot. Messages sent in the mean time are collected in the
+	// snapshot tail.
 	if(!m_softResetRequested) {
-		directToAll(protocol::MessagePtr(new protocol::SoftResetPoint(stateTracker()->localId())));
+		softReset(client);
 		m_softResetRequested = true;
 	}
 }
 
-void BuiltinSession::doInternalResetNow()
+void BuiltinSession::doInternalResetNow(const canvas::StateSavepoint &savepoint)
 {
+	if(!m_softResetRequested) {
+		qWarning("doInternalResetNow(): soft reset was not requested, not doing it...");
+		return;
+	}
+
 	m_softResetRequested = false;
 
+	// The snapshot is generated even if the clients waiting for it have already left,
+	// since it will be reused for the next user to join.
+	// The canvas may have moved on since the reset point (the signal is queued
+	// and the paint thread keeps drawing), but those messages are already in the
+	// reset tail, so the snapshot must be made from the savepoint instead.
+	paintcore::LayerStack image;
+	image.editor(0).restoreSavepoint(savepoint.canvas());
+	internalReset(&image);
+
 	QList<Client*> awaitingClients;
 	for(Client *c : clients()) {
 		if(c->isAwaitingReset())
 			awaitingClients << c;
 	}
 
-	if(awaitingClients.isEmpty()) {
-		qWarning("doInternalResetNow(): no clients awaiting reset, not doing it...");
-		return;
-	}
-
-	internalReset();
-
-	protocol::MessageList msgs;
-	int lastBatchIndex=0;
-	std::tie(msgs, lastBatchIndex) = history()->getBatch(-1);
-
-	Q_ASSERT(lastBatchIndex == history()->lastIndex()); // InMemoryHistory always returns the whole history
-
-	history()->reset(protocol::MessageList());
-
-	protocol::ServerReply catchup;
-	catchup.type = protocol::ServerReply::CATCHUP;
-	catchup.reply["count"] = msgs.size();
-	const auto catchupMsg = protocol::MessagePtr(new protocol::Command(0, catchup));
-
 	for(Client *c : awaitingClients) {
 		c->setAwaitingReset(false);
-		c->sendDirectMessage(catchupMsg);
-		c->sendDirectMessage(msgs);
+		sendResetImage(c);
 	}
 }
 
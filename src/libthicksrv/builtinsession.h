@@ -22,6 +22,10 @@
 
 #include "thicksession.h"
 
+namespace canvas {
+	class StateSavepoint;
+}
+
 namespace server {
 
 /**
@@ -34,7 +38,12 @@ public:
 	BuiltinSession(ServerConfig *config, sessionlisting::Announcements *announcements, canvas::StateTracker *statetracker, const canvas::AclFilter *aclFilter, const QString &id, const QString &idAlias, const QString &founder, QObject *parent=nullptr);
 
 public slots:
-	void doInternalResetNow();
+	/**
+	 * @brief Generate the join snapshot and send it to the waiting clients
+	 *
+	 * @param savepoint the canvas as it was at the soft reset point
+	 */
+	void doInternalResetNow(const canvas::StateSavepoint &savepoint);
 
 protected:
 	void onClientJoin(Client *client, bool host) override;
@@ -0,0 +1,69 @@
+#include "../thicksession.h"
+#include "../../libserver/inmemoryconfig.h"
+#include "../../libserver/announcements.h"
+#include "../../libshared/net/meta.h"
+
+#include <QtTest/QtTest>
+
+using namespace server;
+
+// Exposes the join snapshot internals for testing
+class TestableSession : public ThickSession
+{
+public:
+	TestableSession(ServerConfig *config, sessionlisting::Announcements *announcements)
+		: ThickSession(config, announcements, "test", QString(), "founder")
+	{ }
+
+	using ThickSession::addToHistory;
+	using ThickSession::internalReset;
+	using ThickSession::isResetImageStale;
+	using ThickSession::resetTailSize;
+};
+
+class TestThickSession : public QObject
+{
+	Q_OBJECT
+private slots:
+	// The message tail is kept only as long as the cached snapshot is worth sending
+	void testResetTailLimit()
+	{
+		InMemoryConfig config;
+		sessionlisting::Announcements announcements(&config);
+		TestableSession session(&config, &announcements);
+
+		session.internalReset();
+		QVERIFY(!session.isResetImageStale());
+		QCOMPARE(session.resetTailSize(), 0u);
+
+		const QByteArray text(1000, 'x');
+
+		// A small tail is recorded after the snapshot
+		uint sent = 0;
+		while(sent < 512 * 1024) {
+			const protocol::MessagePtr msg(new protocol::Chat(1, 0, 0, text));
+			session.addToHistory(msg);
+			sent += msg->length();
+		}
+		QCOMPARE(session.resetTailSize(), sent);
+		QVERIFY(!session.isResetImageStale());
+
+		// Past the limit, the snapshot is stale and both it and the tail are dropped
+		for(int i=0;i<2000;++i)
+			session.addToHistory(protocol::MessagePtr(new protocol::Chat(1, 0, 0, text)));
+
+		QVERIFY(session.isResetImageStale());
+		QCOMPARE(session.resetTailSize(), 0u);
+
+		// Nothing is recorded until a new snapshot is made
+		session.addToHistory(protocol::MessagePtr(new protocol::Chat(1, 0, 0, text)));
+		QCOMPARE(session.resetTailSize(), 0u);
+
+		session.internalReset();
+		QVERIFY(!session.isResetImageStale());
+	}
+};
+
+
+QTEST_MAIN(TestThickSession)
+#include "thicksession.moc"
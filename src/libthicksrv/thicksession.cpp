@@ -97,6 +97,16 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 
 	addedToHistory(msg);
 
+	if(m_recordResetTail) {
+		m_resetTail << msg;
+		m_resetTailSize += msg->length();
+
+		// Once the tail has outgrown the snapshot, the next join will make a new
+		// one anyway, so there is no point in holding on to either of them.
+		if(m_resetImageReady && isResetImageStale())
+			discardResetImage();
+	}
+
 	if(state() == State::Initialization) {
 		// Send to everyone except the initializing user
 		for(Client *client : clients()) {
@@ -108,6 +118,10 @@ void ThickSession::addToHistory(protocol::MessagePtr msg)
 		for(Client *client : clients())
 			client->sendDirectMessage(msg);
 	}
+
+	// The clients' upload queues hold on to the wire format as long as they need it.
+	// The history keeps only the message itself.
+	msg->releaseSerialized();
 }
 
 void ThickSession::onSessionReset()
@@ -120,6 +134,9 @@ void ThickSession::onSessionReset()
 
 	history()->reset(protocol::MessageList());
 
+	// The canvas was replaced, so the cached join snapshot is no longer valid
+	discardResetImage();
+
 	// Reset ACL filter state
 	m_aclfilter->reset(m_statetracker->localId(), false);
 	for(const auto &msg : msgs)
@@ -141,45 +158,101 @@ void ThickSession::onClientJoin(Client *client, bool host)
 	if(host)
 		return;
 
-	directToAll(protocol::MessagePtr(new protocol::SoftResetPoint(m_statetracker->localId())));
-	internalReset();
-
-	protocol::MessageList msgs;
-	int lastBatchIndex=0;
-	std::tie(msgs, lastBatchIndex) = history()->getBatch(-1);
+	// Regenerating the snapshot is expensive and truncates everyone's
+	// undo history, so it's only done when the cached one has gone stale.
+	if(isResetImageStale()) {
+		softReset(client);
+		internalReset();
+	}
 
-	Q_ASSERT(lastBatchIndex == history()->lastIndex()); // InMemoryHistory always returns the whole history
+	sendResetImage(client);
+}
 
-	history()->reset(protocol::MessageList());
+void ThickSession::softReset(const Client *newClient)
+{
+	directToAll(protocol::MessagePtr(new protocol::SoftResetPoint(m_statetracker->localId())));
 
-	protocol::ServerReply catchup;
-	catchup.type = protocol::ServerReply::CATCHUP;
-	catchup.reply["count"] = msgs.size();
+	// The user list as of the reset point. The new user's own join
+	// message will be added to the tail.
+	m_resetImage.clear();
+	for(const protocol::MessagePtr &msg : serverSideStateMessages()) {
+		if(newClient && msg->type() == protocol::MSG_USER_JOIN && msg->contextId() == newClient->id())
+			continue;
+		m_resetImage << msg;
+	}
 
-	client->sendDirectMessage(protocol::MessagePtr(new protocol::Command(0, catchup)));
-	client->sendDirectMessage(msgs);
+	m_resetImageReady = false;
+	m_resetTail.clear();
+	m_resetTailSize = 0;
+	m_recordResetTail = true;
 }
 
 void ThickSession::internalReset()
 {
+	internalReset(m_statetracker->image());
+}
+
+void ThickSession::internalReset(const paintcore::LayerStack *image)
+{
+	if(!m_recordResetTail) {
+		// Snapshot was discarded after the soft reset point: start from the current state
+		m_resetImage = serverSideStateMessages();
+		m_resetTail.clear();
+		m_resetTailSize = 0;
+		m_recordResetTail = true;
+	}
+
 	auto loader =  canvas::SnapshotLoader(
 			m_statetracker->localId(),
-			m_statetracker->image(),
+			image,
 			m_aclfilter
 	);
 
 	loader.setDefaultLayer(m_defaultLayer);
 	loader.setPinnedMessage(m_pinnedMessage);
+	loader.setProtocolVersion(history()->protocolVersion());
 
-	auto messages = serverSideStateMessages() + loader.loadInitCommands();
-
-	history()->reset(messages);
+	m_resetImage += loader.loadInitCommands();
+	m_resetImageSize = 0;
+	for(const protocol::MessagePtr &msg : m_resetImage)
+		m_resetImageSize += msg->length();
+	m_resetImageReady = true;
 
 	log(Log()
 		.about(Log::Level::Info, Log::Topic::Status)
-		.message(QStringLiteral("Performed internal reset. Image size is %1 MB").arg(history()->sizeInBytes() / 1024.0 / 1024.0, 0, 'f', 2))
+		.message(QStringLiteral("Performed internal reset. Image size is %1 MB").arg(m_resetImageSize / 1024.0 / 1024.0, 0, 'f', 2))
 	   );
 }
 
+bool ThickSession::isResetImageStale() const
+{
+	// Small tails are always cheaper to send than a new snapshot
+	static const uint MIN_TAIL_SIZE = 1024 * 1024;
+
+	return !m_resetImageReady || m_resetTailSize > qMax(m_resetImageSize, MIN_TAIL_SIZE);
+}
+
+void ThickSession::sendResetImage(Client *client)
+{
+	Q_ASSERT(m_resetImageReady);
+
+	protocol::ServerReply catchup;
+	catchup.type = protocol::ServerReply::CATCHUP;
+	catchup.reply["count"] = m_resetImage.size() + m_resetTail.size();
+
+	client->sendDirectMessage(protocol::MessagePtr(new protocol::Command(0, catchup)));
+	client->sendDirectMessage(m_resetImage);
+	client->sendDirectMessage(m_resetTail);
 }
 
+void ThickSession::discardResetImage()
+{
+	m_resetImage.clear();
+	m_resetTail.clear();
+	m_resetImageSize = 0;
+	m_resetTailSize = 0;
+	m_resetImageReady = false;
+	m_recordResetTail = false;
+}
+
+}
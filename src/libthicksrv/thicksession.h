@@ -27,6 +27,10 @@ namespace canvas {
 	class StateTracker;
 }
 
+namespace paintcore {
+	class LayerStack;
+}
+
 namespace server {
 
 /**
@@ -51,16 +55,59 @@ protected:
     void onSessionReset() override;
 	void onClientJoin(Client *client, bool host) override;
 
+	/**
+	 * @brief Start a new join snapshot
+	 *
+	 * This sends a soft reset point to all users and starts recording
+	 * a new message tail. The snapshot itself is generated by internalReset()
+	 * once the canvas has caught up with the reset point.
+	 *
+	 * @param newClient the user whose join triggered the reset (or nullptr)
+	 */
+	void softReset(const Client *newClient);
+
+	/**
+	 * @brief Generate the join snapshot from the current canvas state
+	 */
 	void internalReset();
 
+	/**
+	 * @brief Generate the join snapshot from the given canvas
+	 *
+	 * The canvas must be in the state it was at the soft reset point,
+	 * since everything after that is already in the message tail.
+	 */
+	void internalReset(const paintcore::LayerStack *image);
+
+	/**
+	 * @brief Is a new join snapshot needed?
+	 *
+	 * The cached snapshot is reused until the tail recorded after it grows
+	 * bigger than the snapshot itself.
+	 */
+	bool isResetImageStale() const;
+
+	//! Send the cached join snapshot and the tail to a new user
+	void sendResetImage(Client *client);
+
 	canvas::StateTracker *stateTracker() { return m_statetracker; }
 
+	//! Get the size of the message tail recorded after the join snapshot
+	uint resetTailSize() const { return m_resetTailSize; }
+
 private:
+	void discardResetImage();
+
 	canvas::StateTracker *m_statetracker;
 	canvas::AclFilter *m_aclfilter;
 
+	// The cached join snapshot and the messages added to the history after it
 	protocol::MessageList m_resetImage;
+	protocol::MessageList m_resetTail;
 	uint m_resetImageSize = 0;
+	uint m_resetTailSize = 0;
+	bool m_resetImageReady = false;
+	bool m_recordResetTail = false;
 
 	QString m_pinnedMessage;
 	int m_defaultLayer = 0;
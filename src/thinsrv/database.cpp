@@ -113,7 +113,7 @@ bool Database::openFile(const QString &path)
 		return false;
 	}
 
-	DbLog *dblog = new DbLog(d->db);
+	DbLog *dblog = new DbLog(d->db, storageMutex());
 	if(!dblog->initDb()) {
 		qWarning("Couldn't initialize database log!");
 		delete dblog;
@@ -165,6 +165,7 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 
 	const QString urlStr = url.toString();
 
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("SELECT url FROM listingservers");
 	while(q.next()) {
@@ -184,6 +185,7 @@ bool Database::isAllowedAnnouncementUrl(const QUrl &url) const
 QStringList Database::listServerWhitelist() const
 {
 	QStringList list;
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("SELECT url FROM listingservers");
 	while(q.next()) {
@@ -194,6 +196,7 @@ QStringList Database::listServerWhitelist() const
 
 void Database::updateListServerWhitelist(const QStringList &whitelist)
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("BEGIN TRANSACTION");
 	q.exec("DELETE FROM listingservers");
@@ -211,6 +214,7 @@ void Database::updateListServerWhitelist(const QStringList &whitelist)
 
 bool Database::isAddressBanned(const QHostAddress &addr) const
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("SELECT ip, subnet FROM ipbans WHERE expires > datetime('now')");
 
@@ -247,6 +251,7 @@ static QJsonObject banResultToJson(const QSqlQuery &q)
 QJsonArray Database::getBanlist() const
 {
 	QJsonArray result;
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans");
 
@@ -258,6 +263,7 @@ QJsonArray Database::getBanlist() const
 
 QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime &expiration, const QString &comment)
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.prepare("SELECT rowid, ip, subnet, expires, comment, added FROM ipbans WHERE ip=? AND subnet=?");
 	q.bindValue(0, ip.toString());
@@ -292,6 +298,7 @@ QJsonObject Database::addBan(const QHostAddress &ip, int subnet, const QDateTime
 
 bool Database::deleteBan(int entryId)
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.prepare("DELETE FROM ipbans WHERE rowid=?");
 	q.bindValue(0, entryId);
@@ -306,6 +313,7 @@ ServerLog *Database::logger() const
 
 RegisteredUser Database::getUserAccount(const QString &username, const QString &password) const
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.prepare("SELECT rowid, password, locked, flags FROM users WHERE username=?");
 	q.bindValue(0, username);
@@ -367,6 +375,7 @@ static QJsonObject userQueryToJson(const QSqlQuery &q)
 QJsonArray Database::getAccountList() const
 {
 	QJsonArray list;
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.exec("SELECT rowid, username, locked, flags FROM users");
 	while(q.next()) {
@@ -380,6 +389,7 @@ QJsonObject Database::addAccount(const QString &username, const QString &passwor
 	if(!validateUsername(username))
 		return QJsonObject();
 
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.prepare("INSERT INTO users (username, password, locked, flags) VALUES (?, ?, ?, ?)");
 	q.bindValue(0, username);
@@ -420,6 +430,7 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 		params << update["flags"].toString();
 	}
 
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 
 	if(!updates.isEmpty()) {
@@ -443,6 +454,7 @@ QJsonObject Database::updateAccount(int id, const QJsonObject &update)
 
 bool Database::deleteAccount(int userId)
 {
+	QMutexLocker lock(storageMutex());
 	QSqlQuery q(d->db);
 	q.prepare("DELETE FROM users WHERE rowid=?");
 	q.bindValue(0, userId);
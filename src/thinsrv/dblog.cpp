@@ -25,13 +25,14 @@
 
 namespace server {
 
-DbLog::DbLog(const QSqlDatabase &db)
-	: m_db(db)
+DbLog::DbLog(const QSqlDatabase &db, QMutex *dbMutex)
+	: m_db(db), m_dbMutex(dbMutex)
 {
 }
 
 bool DbLog::initDb()
 {
+	QMutexLocker lock(m_dbMutex);
 	QSqlQuery q(m_db);
 	return q.exec(
 		"CREATE TABLE IF NOT EXISTS serverlog ("
@@ -69,6 +70,7 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 		params << offset;
 	}
 
+	QMutexLocker lock(m_dbMutex);
 	QSqlQuery q(m_db);
 	q.prepare(sql);
 	for(int i=0;i<params.size();++i)
@@ -95,6 +97,7 @@ QList<Log> DbLog::getLogEntries(const QString &session, const QDateTime &after,
 
 void DbLog::storeMessage(const Log &entry)
 {
+	QMutexLocker lock(m_dbMutex);
 	QSqlQuery q(m_db);
 	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
 	q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
@@ -111,6 +114,7 @@ int DbLog::purgeLogs(int olderThanDays)
 	if(olderThanDays<=0)
 		return 0;
 
+	QMutexLocker lock(m_dbMutex);
 	QSqlQuery q(m_db);
 	q.prepare("DELETE FROM serverlog WHERE timestamp < DATE('now', ?)");
 	q.bindValue(0, QStringLiteral("-%1 days").arg(olderThanDays));
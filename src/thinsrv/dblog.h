@@ -23,13 +23,20 @@
 #include "../libserver/serverlog.h"
 
 #include <QSqlDatabase>
+#include <QMutex>
 
 namespace server {
 
 class DbLog : public ServerLog
 {
 public:
-	explicit DbLog(const QSqlDatabase &db);
+	/**
+	 * @brief Construct a logger that stores entries in the given database
+	 *
+	 * The mutex must be held by anyone else using the same database
+	 * connection, since log entries may be written from session threads.
+	 */
+	DbLog(const QSqlDatabase &db, QMutex *dbMutex);
 
 	bool initDb();
 
@@ -47,6 +54,7 @@ protected:
 
 private:
 	QSqlDatabase m_db;
+	QMutex *m_dbMutex;
 };
 
 }
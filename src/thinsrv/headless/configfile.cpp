@@ -164,6 +164,7 @@ QString ConfigFile::getConfigValue(const ConfigKey key, bool &found) const
 
 bool ConfigFile::isAddressBanned(const QHostAddress &addr) const
 {
+	QMutexLocker lock(storageMutex());
 	if(isModified())
 		reloadFile();
 
@@ -191,11 +192,13 @@ bool ConfigFile::isAllowedAnnouncementUrl(const QUrl &url) const
 	if(!getConfigBool(config::AnnounceWhiteList))
 		return true;
 
+	QMutexLocker lock(storageMutex());
 	return m_announcewhitelist.contains(url);
 }
 
 RegisteredUser ConfigFile::getUserAccount(const QString &username, const QString &password) const
 {
+	QMutexLocker lock(storageMutex());
 	if(m_users.contains(username)) {
 		const User &u = m_users[username];
 		if(u.password.startsWith("*")) {
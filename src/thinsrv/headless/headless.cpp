@@ -146,6 +146,18 @@ bool start() {
 	QCommandLineOption reportUrlOption(QStringList() << "report-url", "Abuse report handler URL", "url");
 	parser.addOption(reportUrlOption);
 
+	// --session-threads <count>
+	QCommandLineOption sessionThreadsOption(QStringList() << "session-threads", "Run sessions in this many worker threads", "count", "0");
+	parser.addOption(sessionThreadsOption);
+
+	// --commit-interval <milliseconds>
+	QCommandLineOption commitIntervalOption(QStringList() << "commit-interval", "Write file backed session changes to disk at this interval", "milliseconds", "1000");
+	parser.addOption(commitIntervalOption);
+
+	// --sync-writes
+	QCommandLineOption syncWritesOption(QStringList() << "sync-writes", "Wait for file backed session changes to reach the disk");
+	parser.addOption(syncWritesOption);
+
 	// Parse
 	parser.process(*QCoreApplication::instance());
 
@@ -195,6 +207,25 @@ bool start() {
 		}
 	}
 
+	{
+		bool ok;
+		icfg.sessionThreads = parser.value(sessionThreadsOption).toInt(&ok);
+		if(!ok || icfg.sessionThreads<0) {
+			qCritical("Invalid thread count %s", qPrintable(parser.value(sessionThreadsOption)));
+			return false;
+		}
+	}
+
+	{
+		bool ok;
+		icfg.commitInterval = parser.value(commitIntervalOption).toInt(&ok);
+		if(!ok || icfg.commitInterval<0) {
+			qCritical("Invalid commit interval %s", qPrintable(parser.value(commitIntervalOption)));
+			return false;
+		}
+	}
+	icfg.syncWrites = parser.isSet(syncWritesOption);
+
 	serverconfig->setInternalConfig(icfg);
 
 	// Initialize the server
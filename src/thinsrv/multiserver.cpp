@@ -329,8 +329,6 @@ JsonApiResult MultiServer::callJsonApi(JsonApiMethod method, const QStringList &
 		return serverJsonApi(method, tail, request);
 	else if(head == "status")
 		return statusJsonApi(method, tail, request);
-	else if(head == "sessions")
-		return m_sessions->callSessionJsonApi(method, tail, request);
 	else if(head == "users")
 		return m_sessions->callUserJsonApi(method, tail, request);
 	else if(head == "banlist")
@@ -347,6 +345,17 @@ JsonApiResult MultiServer::callJsonApi(JsonApiMethod method, const QStringList &
 
 void MultiServer::callJsonApiAsync(const QString &requestId, JsonApiMethod method, const QStringList &path, const QJsonObject &request)
 {
+	QString head;
+	QStringList tail;
+	std::tie(head, tail) = popApiPath(path);
+
+	if(head == "sessions") {
+		m_sessions->callSessionJsonApi(method, tail, request, [this, requestId](const JsonApiResult &result) {
+			emit jsonApiResult(requestId, result);
+		});
+		return;
+	}
+
 	JsonApiResult result = callJsonApi(method, path, request);
 	emit jsonApiResult(requestId, result);
 }
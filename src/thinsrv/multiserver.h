@@ -79,17 +79,15 @@ public slots:
 	/**
 	 * @brief Call the server's JSON administration API
 	 *
-	 * This is used by the HTTP admin API.
+	 * This is used by the HTTP admin API and the GUI.
 	 *
+	 * The response is delivered via the jsonApiResult signal. Requests about a session
+	 * running in a worker thread are answered after control returns to the event loop.
+	 *
+	 * @param requestId ID that is passed on to jsonApiResult
 	 * @param method query method
 	 * @param path path components
 	 * @param request request body content
-	 * @return JSON API response content
-	 */
-	JsonApiResult callJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
-
-	/**
-	 * @brief Like callJsonApi(), but the jsonApiResponse signal will be emitted instead of the return value
 	 */
 	void callJsonApiAsync(const QString &requestId, JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
@@ -109,6 +107,7 @@ signals:
 private:
 	bool createServer();
 
+	JsonApiResult callJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 	JsonApiResult serverJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 	JsonApiResult statusJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 	JsonApiResult banlistJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
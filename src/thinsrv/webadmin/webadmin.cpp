@@ -26,6 +26,9 @@
 #include <QJsonObject>
 #include <QMetaObject>
 #include <QDir>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QUuid>
 
 namespace server {
 
@@ -94,19 +97,37 @@ void Webadmin::setSessions(MultiServer *server)
 				return HttpResponse::JsonErrorResponse(parseError.errorString(), 400);
 		}
 
-		JsonApiResult result;
-
 		// The HTTP server runs in another thread, so we can't
-		// call the main server directly
+		// call the main server directly. The response may be produced
+		// in a session thread later, so we wait for it here rather than
+		// have the main thread wait for the session.
+		struct PendingResponse {
+			QString id;
+			JsonApiResult result;
+			QSemaphore done;
+		};
+		auto response = QSharedPointer<PendingResponse>::create();
+		response->id = QUuid::createUuid().toString();
+
+		const auto connection = QObject::connect(server, &MultiServer::jsonApiResult, [response](const QString &id, const JsonApiResult &result) {
+			if(id == response->id) {
+				response->result = result;
+				response->done.release();
+			}
+		});
+
 		QMetaObject::invokeMethod(
-			server, "callJsonApi", Qt::BlockingQueuedConnection,
-			Q_RETURN_ARG(JsonApiResult, result),
+			server, "callJsonApiAsync", Qt::QueuedConnection,
+			Q_ARG(QString, response->id),
 			Q_ARG(JsonApiMethod, m),
 			Q_ARG(QStringList, path),
 			Q_ARG(QJsonObject, reqBodyDoc.object())
 			);
 
-		return HttpResponse::JsonResponse(result.body, result.status);
+		response->done.acquire();
+		QObject::disconnect(connection);
+
+		return HttpResponse::JsonResponse(response->result.body, response->result.status);
 	});
 }
 